@@ -62,6 +62,9 @@
 #ifdef EVENT__HAVE_SYS_STAT_H
 #include <sys/stat.h>
 #endif
+#ifdef EVENT__HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
 
 
 #include <errno.h>
@@ -111,6 +114,24 @@
 #define SENDFILE_IS_SOLARIS	1
 #endif
 
+/* page cache residency support, for EVBUF_FS_READAHEAD */
+#if defined(EVENT__HAVE_MMAP) && defined(EVENT__HAVE_MINCORE)
+#define USE_FS_MINCORE
+#endif
+
+/* chain pool support */
+#if defined(EVENT__HAVE_MMAP) && defined(MAP_ANONYMOUS)
+#define USE_CHAIN_POOL
+#endif
+#if defined(USE_CHAIN_POOL) && defined(__linux__)
+#include <sys/syscall.h>
+#if defined(SYS_mbind) && defined(SYS_getcpu)
+#define USE_CHAIN_POOL_NUMA
+/* From <linux/mempolicy.h> */
+#define EVBUFFER_MPOL_PREFERRED 1
+#endif
+#endif
+
 /* Mask of user-selectable callback flags. */
 #define EVBUFFER_CB_USER_FLAGS	    0xffff
 /* Mask of all internal-use-only flags. */
@@ -148,6 +169,9 @@ static int evbuffer_ptr_subtract(struct evbuffer *buf, struct evbuffer_ptr *pos,
     size_t howfar);
 static int evbuffer_file_segment_materialize(struct evbuffer_file_segment *seg);
 static inline void evbuffer_chain_incref(struct evbuffer_chain *chain);
+static struct evbuffer_chain *evbuffer_pool_chain_new(
+    struct evbuffer_chain_pool *pool, size_t size);
+static void evbuffer_pool_chain_free(struct evbuffer_chain *chain);
 
 static struct evbuffer_chain *
 evbuffer_chain_new(size_t size)
@@ -178,14 +202,12 @@ evbuffer_chain_new(size_t size)
 	return (chain);
 }
 
-static struct evbuffer_chain *
-evbuffer_chain_new_membuf(size_t size)
+/* Return how much memory evbuffer_chain_new_membuf(buf, size) allocates. */
+static size_t
+evbuffer_chain_membuf_alloc_size(size_t size)
 {
 	size_t to_alloc;
 
-	if (size > EVBUFFER_CHAIN_MAX - EVBUFFER_CHAIN_SIZE)
-		return (NULL);
-
 	size += EVBUFFER_CHAIN_SIZE;
 
 	/* get the next largest memory that can hold the buffer */
@@ -198,7 +220,23 @@ evbuffer_chain_new_membuf(size_t size)
 		to_alloc = size;
 	}
 
-	return evbuffer_chain_new(to_alloc - EVBUFFER_CHAIN_SIZE);
+	return to_alloc;
+}
+
+/* Allocate a chain with room for size bytes of data, to go in buf. */
+static struct evbuffer_chain *
+evbuffer_chain_new_membuf(struct evbuffer *buf, size_t size)
+{
+	struct evbuffer_chain *chain;
+
+	if (size > EVBUFFER_CHAIN_MAX - EVBUFFER_CHAIN_SIZE)
+		return (NULL);
+
+	if (buf->pool && (chain = evbuffer_pool_chain_new(buf->pool, size)))
+		return chain;
+
+	return evbuffer_chain_new(
+	    evbuffer_chain_membuf_alloc_size(size) - EVBUFFER_CHAIN_SIZE);
 }
 
 static inline void
@@ -242,6 +280,13 @@ evbuffer_chain_free(struct evbuffer_chain *chain)
 			evbuffer_file_segment_free(info->segment);
 		}
 	}
+	if (chain->flags & EVBUFFER_SHARED) {
+		struct evbuffer_chain_shared *info =
+		    EVBUFFER_CHAIN_EXTRA(
+			    struct evbuffer_chain_shared,
+			    chain);
+		evbuffer_shared_free(info->shared);
+	}
 	if (chain->flags & EVBUFFER_MULTICAST) {
 		struct evbuffer_multicast_parent *info =
 		    EVBUFFER_CHAIN_EXTRA(
@@ -258,7 +303,10 @@ evbuffer_chain_free(struct evbuffer_chain *chain)
 		evbuffer_decref_and_unlock_(info->source);
 	}
 
-	mm_free(chain);
+	if (chain->flags & EVBUFFER_POOLED)
+		evbuffer_pool_chain_free(chain);
+	else
+		mm_free(chain);
 }
 
 static void
@@ -339,7 +387,7 @@ static inline struct evbuffer_chain *
 evbuffer_chain_insert_new(struct evbuffer *buf, size_t datlen)
 {
 	struct evbuffer_chain *chain;
-	if ((chain = evbuffer_chain_new_membuf(datlen)) == NULL)
+	if ((chain = evbuffer_chain_new_membuf(buf, datlen)) == NULL)
 		return NULL;
 	evbuffer_chain_insert(buf, chain);
 	return chain;
@@ -380,6 +428,7 @@ evbuffer_new(void)
 	buffer->refcnt = 1;
 	buffer->last_with_datap = &buffer->first;
 	buffer->max_read = EVBUFFER_MAX_READ_DEFAULT;
+	buffer->read_stats.read_size = EVBUFFER_MAX_READ_DEFAULT;
 
 	return (buffer);
 }
@@ -520,9 +569,18 @@ evbuffer_run_callbacks(struct evbuffer *buffer, int running_deferred)
 	}
 }
 
+static void evbuffer_compactor_touch(struct evbuffer *buf);
+static void evbuffer_compactor_stop(struct evbuffer *buf);
+
 void
 evbuffer_invoke_callbacks_(struct evbuffer *buffer)
 {
+	if (buffer->compactor)
+		evbuffer_compactor_touch(buffer);
+	if (buffer->parent && BEV_UPCAST(buffer->parent)->mem &&
+	    buffer->total_len != buffer->accounted_len)
+		bufferevent_mem_changed_(buffer->parent, buffer);
+
 	if (LIST_EMPTY(&buffer->callbacks)) {
 		buffer->n_add_for_cb = buffer->n_del_for_cb = 0;
 		return;
@@ -584,6 +642,18 @@ evbuffer_decref_and_unlock_(struct evbuffer *buffer)
 		next = chain->next;
 		evbuffer_chain_free(chain);
 	}
+	if (buffer->index) {
+		mm_free(buffer->index->entries);
+		mm_free(buffer->index);
+	}
+	if (buffer->compactor) {
+		/* A pending compaction would hold a reference. */
+		EVUTIL_ASSERT(!buffer->compactor->armed);
+		event_debug_unassign(&buffer->compactor->idle_ev);
+		mm_free(buffer->compactor);
+	}
+	if (buffer->pool)
+		evbuffer_chain_pool_decref_(buffer->pool);
 	evbuffer_remove_all_callbacks(buffer);
 	if (buffer->deferred_cbs)
 		event_deferred_cb_cancel_(buffer->cb_queue, &buffer->deferred);
@@ -598,6 +668,8 @@ void
 evbuffer_free(struct evbuffer *buffer)
 {
 	EVBUFFER_LOCK(buffer);
+	if (buffer->compactor)
+		evbuffer_compactor_stop(buffer);
 	evbuffer_decref_and_unlock_(buffer);
 }
 
@@ -621,6 +693,17 @@ size_t evbuffer_get_max_read(struct evbuffer *buf)
 	return result;
 }
 
+void
+evbuffer_get_read_stats(struct evbuffer *buf,
+    struct evbuffer_read_stats *stats)
+{
+	EVBUFFER_LOCK(buf);
+	*stats = buf->read_stats;
+	if (stats->read_size > buf->max_read)
+		stats->read_size = buf->max_read;
+	EVBUFFER_UNLOCK(buf);
+}
+
 void
 evbuffer_lock(struct evbuffer *buf)
 {
@@ -816,6 +899,30 @@ done:
 	return result;
 }
 
+/* Forget everything in buf's index, if it has one, because chains have
+ * been moved around at the front of the buffer.  Requires lock. */
+static inline void
+evbuffer_index_clear(struct evbuffer *buf)
+{
+	if (buf->index) {
+		buf->index->first = buf->index->n = 0;
+		buf->index->base = 0;
+	}
+}
+
+/* Note that len bytes have been drained from the front of buf, without
+ * anything else changing there.  Requires lock. */
+static inline void
+evbuffer_index_drained(struct evbuffer *buf, size_t len)
+{
+	if (buf->index) {
+		if (buf->index->base > EV_SIZE_MAX / 4)
+			evbuffer_index_clear(buf);
+		else
+			buf->index->base += len;
+	}
+}
+
 static inline int
 HAS_PINNED_R(struct evbuffer *buf)
 {
@@ -830,6 +937,8 @@ ZERO_CHAIN(struct evbuffer *dst)
 	dst->last = NULL;
 	dst->last_with_datap = &(dst)->first;
 	dst->total_len = 0;
+	dst->has_readahead = 0;
+	evbuffer_index_clear(dst);
 }
 
 /* Prepares the contents of src to be moved to another buffer by removing
@@ -862,7 +971,7 @@ PRESERVE_PINNED(struct evbuffer *src, struct evbuffer_chain **first,
 		struct evbuffer_chain *tmp;
 
 		EVUTIL_ASSERT(pinned == src->last_with_datap);
-		tmp = evbuffer_chain_new_membuf(chain->off);
+		tmp = evbuffer_chain_new_membuf(src, chain->off);
 		if (!tmp)
 			return -1;
 		memcpy(tmp->buffer, chain->buffer + chain->misalign,
@@ -895,6 +1004,7 @@ RESTORE_PINNED(struct evbuffer *src, struct evbuffer_chain *pinned,
 	src->last = last;
 	src->last_with_datap = &src->first;
 	src->total_len = 0;
+	evbuffer_index_clear(src);
 }
 
 static inline void
@@ -902,6 +1012,7 @@ COPY_CHAIN(struct evbuffer *dst, struct evbuffer *src)
 {
 	ASSERT_EVBUFFER_LOCKED(dst);
 	ASSERT_EVBUFFER_LOCKED(src);
+	evbuffer_index_clear(dst);
 	dst->first = src->first;
 	if (src->last_with_datap == &src->first)
 		dst->last_with_datap = &dst->first;
@@ -975,6 +1086,7 @@ PREPEND_CHAIN(struct evbuffer *dst, struct evbuffer *src)
 {
 	ASSERT_EVBUFFER_LOCKED(dst);
 	ASSERT_EVBUFFER_LOCKED(src);
+	evbuffer_index_clear(dst);
 	src->last->next = dst->first;
 	dst->first = src->first;
 	dst->total_len += src->total_len;
@@ -1180,6 +1292,7 @@ evbuffer_drain(struct evbuffer *buf, size_t len)
 		EVUTIL_ASSERT(remaining <= chain->off);
 		chain->misalign += remaining;
 		chain->off -= remaining;
+		evbuffer_index_drained(buf, len);
 	}
 
 	buf->n_del_for_cb += len;
@@ -1360,6 +1473,7 @@ evbuffer_remove_buffer(struct evbuffer *src, struct evbuffer *dst,
 	 */
 	src->total_len -= nread;
 	src->n_del_for_cb += nread;
+	evbuffer_index_drained(src, nread);
 
 	if (nread) {
 		evbuffer_invoke_callbacks_(dst);
@@ -1411,6 +1525,8 @@ evbuffer_pullup(struct evbuffer *buf, ev_ssize_t size)
 		remaining -= tmp->off;
 	}
 
+	evbuffer_index_clear(buf);
+
 	if (CHAIN_PINNED(chain)) {
 		size_t old_off = chain->off;
 		if (CHAIN_SPACE_LEN(chain) < size - chain->off) {
@@ -1431,7 +1547,7 @@ evbuffer_pullup(struct evbuffer *buf, ev_ssize_t size)
 		size -= old_off;
 		chain = chain->next;
 	} else {
-		if ((tmp = evbuffer_chain_new_membuf(size)) == NULL) {
+		if ((tmp = evbuffer_chain_new_membuf(buf, size)) == NULL) {
 			event_warn("%s: out of memory", __func__);
 			goto done;
 		}
@@ -1486,186 +1602,819 @@ done:
 	return result;
 }
 
-/*
- * Reads a line terminated by either '\r\n', '\n\r' or '\r' or '\n'.
- * The returned buffer needs to be freed by the called.
- */
-char *
-evbuffer_readline(struct evbuffer *buffer)
+size_t
+evbuffer_get_mem_usage(struct evbuffer *buf)
 {
-	return evbuffer_readln(buffer, NULL, EVBUFFER_EOL_ANY);
-}
+	struct evbuffer_chain *chain;
+	size_t total = 0;
 
-static inline ev_ssize_t
-evbuffer_strchr(struct evbuffer_ptr *it, const char chr)
-{
-	struct evbuffer_chain *chain = it->internal_.chain;
-	size_t i = it->internal_.pos_in_chain;
-	while (chain != NULL) {
-		char *buffer = (char *)chain->buffer + chain->misalign;
-		char *cp = memchr(buffer+i, chr, chain->off-i);
-		if (cp) {
-			it->internal_.chain = chain;
-			it->internal_.pos_in_chain = cp - buffer;
-			it->pos += (cp - buffer - i);
-			return it->pos;
-		}
-		it->pos += chain->off - i;
-		i = 0;
-		chain = chain->next;
+	EVBUFFER_LOCK(buf);
+	for (chain = buf->first; chain; chain = chain->next) {
+		total += EVBUFFER_CHAIN_SIZE;
+		if (!(chain->flags & (EVBUFFER_REFERENCE|EVBUFFER_FILESEGMENT|
+			    EVBUFFER_MULTICAST|EVBUFFER_SHARED)))
+			total += chain->buffer_len;
 	}
+	EVBUFFER_UNLOCK(buf);
+	return total;
+}
 
-	return (-1);
+/* Return true iff chain is plain memory that only this buffer uses, so that
+ * compaction can move its data and free it. */
+static inline int
+evbuffer_chain_is_movable(const struct evbuffer_chain *chain)
+{
+	return (chain->flags & ~EVBUFFER_POOLED) == 0 && chain->refcnt == 1;
 }
 
-static inline char *
-find_eol_char(char *s, size_t len)
+/* Do the work of evbuffer_compact(), copying at most budget bytes.  Set
+ * *morep if the budget ran out before we were done.  Requires lock. */
+static size_t
+evbuffer_compact_(struct evbuffer *buf, size_t budget, int *morep)
 {
-#define CHUNK_SZ 128
-	/* Lots of benchmarking found this approach to be faster in practice
-	 * than doing two memchrs over the whole buffer, doin a memchr on each
-	 * char of the buffer, or trying to emulate memchr by hand. */
-	char *s_end, *cr, *lf;
-	s_end = s+len;
-	while (s < s_end) {
-		size_t chunk = (s + CHUNK_SZ < s_end) ? CHUNK_SZ : (s_end - s);
-		cr = memchr(s, '\r', chunk);
-		lf = memchr(s, '\n', chunk);
-		if (cr) {
-			if (lf && lf < cr)
-				return lf;
-			return cr;
-		} else if (lf) {
-			return lf;
+	struct evbuffer_chain **chp, *chain, *run_end, *tmp, *next, *last;
+	struct evbuffer_chain *stop;
+	size_t reclaimed = 0, copied = 0, len, old_size, new_size;
+	int changed = 0, before_last;
+
+	*morep = 0;
+	if (!buf->first)
+		return 0;
+
+	/* Everything after the last chain with data is empty space kept
+	 * around for the next read or add; let it go.  If the start is
+	 * frozen, the first chain stays where it is. */
+	if (buf->total_len == 0 && buf->freeze_start) {
+		last = buf->first;
+		chp = &last->next;
+	} else if (buf->total_len == 0) {
+		chp = &buf->first;
+		last = NULL;
+	} else {
+		last = *buf->last_with_datap;
+		chp = &last->next;
+	}
+	while ((chain = *chp)) {
+		if (!chain->off && evbuffer_chain_is_movable(chain)) {
+			*chp = chain->next;
+			reclaimed += chain->buffer_len + EVBUFFER_CHAIN_SIZE;
+			evbuffer_chain_free(chain);
+			changed = 1;
+		} else {
+			last = chain;
+			chp = &chain->next;
 		}
-		s += CHUNK_SZ;
 	}
+	buf->last = last;
+	if (!buf->first)
+		buf->last_with_datap = &buf->first;
 
-	return NULL;
-#undef CHUNK_SZ
-}
+	/* Replace each run of small chains, up to and including the last
+	 * one with data, with one chain that just fits its data, if that
+	 * saves enough memory.  A frozen end of the buffer stays in the chain
+	 * it's in: the first chain if the start is frozen, and the last one
+	 * with data if the end is. */
+	chp = &buf->first;
+	if (buf->total_len && buf->freeze_start) {
+		if (buf->first == *buf->last_with_datap)
+			goto done;
+		chp = &buf->first->next;
+	}
+	stop = buf->freeze_end ? *buf->last_with_datap : NULL;
+	while (buf->total_len && (chain = *chp)) {
+		len = old_size = 0;
+		run_end = NULL;
+		for (tmp = chain; tmp && tmp != stop &&
+			 evbuffer_chain_is_movable(tmp) &&
+			 len + tmp->off <= EVBUFFER_COMPACT_MAX_MERGE;
+		     tmp = tmp->next) {
+			len += tmp->off;
+			old_size += tmp->buffer_len + EVBUFFER_CHAIN_SIZE;
+			run_end = tmp;
+			if (tmp == *buf->last_with_datap)
+				break;
+		}
+		if (!run_end) {
+			if (chain == *buf->last_with_datap)
+				break;
+			chp = &chain->next;
+			continue;
+		}
+		new_size = len ? evbuffer_chain_membuf_alloc_size(len) : 0;
+		if (old_size < new_size + MIN_BUFFER_SIZE) {
+			if (run_end == *buf->last_with_datap)
+				break;
+			chp = &run_end->next;
+			continue;
+		}
+		if (len > budget - copied) {
+			*morep = 1;
+			break;
+		}
 
-static ev_ssize_t
-evbuffer_find_eol_char(struct evbuffer_ptr *it)
-{
-	struct evbuffer_chain *chain = it->internal_.chain;
-	size_t i = it->internal_.pos_in_chain;
-	while (chain != NULL) {
-		char *buffer = (char *)chain->buffer + chain->misalign;
-		char *cp = find_eol_char(buffer+i, chain->off-i);
-		if (cp) {
-			it->internal_.chain = chain;
-			it->internal_.pos_in_chain = cp - buffer;
-			it->pos += (cp - buffer) - i;
-			return it->pos;
+		tmp = NULL;
+		if (len && !(tmp = evbuffer_chain_new_membuf(buf, len)))
+			break;
+		next = run_end->next;
+		before_last = next && next == *buf->last_with_datap;
+		for (chain = *chp; chain != next; chain = *chp) {
+			if (tmp) {
+				memcpy(tmp->buffer + tmp->off,
+				    chain->buffer + chain->misalign, chain->off);
+				tmp->off += chain->off;
+			}
+			if (buf->last_with_datap == &chain->next)
+				buf->last_with_datap = chp;
+			*chp = chain->next;
+			evbuffer_chain_free(chain);
+		}
+		copied += len;
+		reclaimed += old_size - new_size;
+		changed = 1;
+		if (tmp) {
+			/* If the last chain with data was in the run, its
+			 * data is in tmp now; last_with_datap == chp.  If it
+			 * comes right after the run, it's after tmp. */
+			tmp->next = next;
+			*chp = tmp;
+			if (!next)
+				buf->last = tmp;
+			if (before_last)
+				buf->last_with_datap = &tmp->next;
+			if (*buf->last_with_datap == tmp)
+				break;
+			chp = &tmp->next;
 		}
-		it->pos += chain->off - i;
-		i = 0;
-		chain = chain->next;
 	}
 
-	return (-1);
+done:
+	if (changed) {
+		evbuffer_index_clear(buf);
+		++buf->compact_stats.n_compactions;
+		buf->compact_stats.n_bytes_copied += copied;
+		buf->compact_stats.n_bytes_reclaimed += reclaimed;
+	}
+	return reclaimed;
 }
 
-static inline size_t
-evbuffer_strspn(
-	struct evbuffer_ptr *ptr, const char *chrset)
+size_t
+evbuffer_compact(struct evbuffer *buf, size_t max_copy)
 {
-	size_t count = 0;
-	struct evbuffer_chain *chain = ptr->internal_.chain;
-	size_t i = ptr->internal_.pos_in_chain;
-
-	if (!chain)
-		return 0;
-
-	while (1) {
-		char *buffer = (char *)chain->buffer + chain->misalign;
-		for (; i < chain->off; ++i) {
-			const char *p = chrset;
-			while (*p) {
-				if (buffer[i] == *p++)
-					goto next;
-			}
-			ptr->internal_.chain = chain;
-			ptr->internal_.pos_in_chain = i;
-			ptr->pos += count;
-			return count;
-		next:
-			++count;
-		}
-		i = 0;
+	size_t reclaimed;
+	int more;
 
-		if (! chain->next) {
-			ptr->internal_.chain = chain;
-			ptr->internal_.pos_in_chain = i;
-			ptr->pos += count;
-			return count;
-		}
+	EVBUFFER_LOCK(buf);
+	reclaimed = evbuffer_compact_(buf, max_copy, &more);
+	EVBUFFER_UNLOCK(buf);
+	return reclaimed;
+}
 
-		chain = chain->next;
+/* Note that buf has changed, and start watching for it to go idle if we
+ * weren't already.  Like a deferred callback, a pending compaction holds
+ * references to the buffer and to its bufferevent.  Requires lock. */
+static void
+evbuffer_compactor_touch(struct evbuffer *buf)
+{
+	struct evbuffer_compactor *c = buf->compactor;
+
+	c->changed = 1;
+	if (c->enabled && !c->armed) {
+		c->armed = 1;
+		c->changed = 0;
+		evbuffer_incref_and_lock_(buf);
+		c->parent = buf->parent;
+		if (c->parent)
+			bufferevent_incref_(c->parent);
+		EVBUFFER_UNLOCK(buf);
+		event_add(&c->idle_ev, &c->idle);
 	}
 }
 
-
-static inline int
-evbuffer_getchr(struct evbuffer_ptr *it)
+/* Stop compacting buf.  If idle_ev is waiting, make it fire now, so that
+ * it lets go of the buffer and its bufferevent.  Requires lock. */
+static void
+evbuffer_compactor_stop(struct evbuffer *buf)
 {
-	struct evbuffer_chain *chain = it->internal_.chain;
-	size_t off = it->internal_.pos_in_chain;
+	struct evbuffer_compactor *c = buf->compactor;
 
-	if (chain == NULL)
-		return -1;
+	c->enabled = 0;
+	if (c->armed && !c->compacting)
+		event_active(&c->idle_ev, EV_TIMEOUT, 1);
+}
 
-	return (unsigned char)chain->buffer[chain->misalign + off];
+/* Drop the references that idle_ev or compact_cb held, and unlock. */
+static void
+evbuffer_compactor_disarm(struct evbuffer *buf)
+{
+	struct bufferevent *parent = buf->compactor->parent;
+
+	buf->compactor->armed = 0;
+	buf->compactor->compacting = 0;
+	buf->compactor->parent = NULL;
+	evbuffer_decref_and_unlock_(buf);
+	if (parent)
+		bufferevent_decref_(parent);
 }
 
-struct evbuffer_ptr
-evbuffer_search_eol(struct evbuffer *buffer,
-    struct evbuffer_ptr *start, size_t *eol_len_out,
-    enum evbuffer_eol_style eol_style)
+static void
+evbuffer_compactor_idle_cb(evutil_socket_t fd, short what, void *arg)
 {
-	struct evbuffer_ptr it, it2;
-	size_t extra_drain = 0;
-	int ok = 0;
+	struct evbuffer *buf = arg;
+	struct evbuffer_compactor *c;
 
-	/* Avoid locking in trivial edge cases */
-	if (start && start->internal_.chain == NULL) {
-		PTR_NOT_FOUND(&it);
-		if (eol_len_out)
-			*eol_len_out = extra_drain;
-		return it;
+	EVBUFFER_LOCK(buf);
+	c = buf->compactor;
+	if (!c->enabled) {
+		evbuffer_compactor_disarm(buf);
+	} else if (c->changed) {
+		/* Still busy; look again in a while. */
+		c->changed = 0;
+		event_add(&c->idle_ev, &c->idle);
+		EVBUFFER_UNLOCK(buf);
+	} else {
+		c->compacting = 1;
+		event_deferred_cb_schedule_(c->base, &c->compact_cb);
+		EVBUFFER_UNLOCK(buf);
 	}
+}
 
-	EVBUFFER_LOCK(buffer);
+static void
+evbuffer_compactor_cb(struct event_callback *cb, void *arg)
+{
+	struct evbuffer *buf = arg;
+	struct evbuffer_compactor *c;
+	int more = 0;
 
-	if (start) {
-		memcpy(&it, start, sizeof(it));
+	EVBUFFER_LOCK(buf);
+	c = buf->compactor;
+	if (c->enabled && !c->changed)
+		evbuffer_compact_(buf, EVBUFFER_COMPACT_BUDGET, &more);
+
+	if (!c->enabled) {
+		evbuffer_compactor_disarm(buf);
+	} else if (more && !c->changed) {
+		/* Leave the rest for a later loop iteration. */
+		event_deferred_cb_schedule_(c->base, &c->compact_cb);
+		EVBUFFER_UNLOCK(buf);
+	} else if (c->changed) {
+		/* It got used while we were waiting; start over. */
+		c->compacting = 0;
+		c->changed = 0;
+		event_add(&c->idle_ev, &c->idle);
+		EVBUFFER_UNLOCK(buf);
 	} else {
-		it.pos = 0;
-		it.internal_.chain = buffer->first;
-		it.internal_.pos_in_chain = 0;
+		evbuffer_compactor_disarm(buf);
 	}
+}
 
-	/* the eol_style determines our first stop character and how many
-	 * characters we are going to drain afterwards. */
-	switch (eol_style) {
-	case EVBUFFER_EOL_ANY:
-		if (evbuffer_find_eol_char(&it) < 0)
-			goto done;
-		memcpy(&it2, &it, sizeof(it));
-		extra_drain = evbuffer_strspn(&it2, "\r\n");
-		break;
-	case EVBUFFER_EOL_CRLF_STRICT: {
-		it = evbuffer_search(buffer, "\r\n", 2, &it);
-		if (it.pos < 0)
-			goto done;
-		extra_drain = 2;
-		break;
+int
+evbuffer_set_compaction(struct evbuffer *buf, struct event_base *base,
+    const struct timeval *idle)
+{
+	struct evbuffer_compactor *c;
+	int result = 0;
+
+	EVBUFFER_LOCK(buf);
+	c = buf->compactor;
+	if (!base) {
+		if (c)
+			evbuffer_compactor_stop(buf);
+		goto done;
 	}
-	case EVBUFFER_EOL_CRLF: {
-		ev_ssize_t start_pos = it.pos;
-		/* Look for a LF ... */
-		if (evbuffer_strchr(&it, '\n') < 0)
+	if (c && c->base != base) {
+		result = -1;
+		goto done;
+	}
+	if (!c) {
+		c = mm_calloc(1, sizeof(struct evbuffer_compactor));
+		if (!c) {
+			result = -1;
+			goto done;
+		}
+		c->base = base;
+		evtimer_assign(&c->idle_ev, base, evbuffer_compactor_idle_cb,
+		    buf);
+		/* Compaction can wait for everything else. */
+		event_priority_set(&c->idle_ev,
+		    event_base_get_npriorities(base) - 1);
+		event_deferred_cb_init_(&c->compact_cb,
+		    event_base_get_npriorities(base) - 1,
+		    evbuffer_compactor_cb, buf);
+		buf->compactor = c;
+	}
+	if (idle) {
+		c->idle = *idle;
+	} else {
+		c->idle.tv_sec = 1;
+		c->idle.tv_usec = 0;
+	}
+	c->enabled = 1;
+	evbuffer_compactor_touch(buf);
+
+done:
+	EVBUFFER_UNLOCK(buf);
+	return result;
+}
+
+void
+evbuffer_get_compact_stats(struct evbuffer *buf,
+    struct evbuffer_compact_stats *stats)
+{
+	EVBUFFER_LOCK(buf);
+	*stats = buf->compact_stats;
+	EVBUFFER_UNLOCK(buf);
+}
+
+/* Return which of a pool's free lists a block of 'block' bytes goes on. */
+static int
+evbuffer_pool_class(size_t block)
+{
+	size_t size = EVBUFFER_POOL_MIN_BLOCK;
+	int c = 0;
+
+	while (size < block) {
+		size <<= 1;
+		++c;
+	}
+	return c;
+}
+
+#ifdef USE_CHAIN_POOL_NUMA
+/* Return the NUMA node we're running on, or -1. */
+static int
+evbuffer_pool_current_node(void)
+{
+	unsigned cpu, node;
+
+	if (syscall(SYS_getcpu, &cpu, &node, NULL) < 0 ||
+	    node >= sizeof(unsigned long) * 8)
+		return -1;
+	return (int)node;
+}
+#endif
+
+#ifdef USE_CHAIN_POOL
+/* Map a region for pool, set *hugetlb if it's made of explicit huge pages,
+ * and return it, or NULL. */
+static void *
+evbuffer_pool_map(struct evbuffer_chain_pool *pool, int *hugetlb)
+{
+	unsigned char *mem, *aligned;
+	size_t head;
+
+	*hugetlb = 0;
+#ifdef MAP_HUGETLB
+	if (pool->flags & EVBUFFER_POOL_HUGEPAGES) {
+		mem = mmap(NULL, EVBUFFER_POOL_REGION_SIZE,
+		    PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB,
+		    -1, 0);
+		if (mem != MAP_FAILED) {
+			*hugetlb = 1;
+			goto mapped;
+		}
+	}
+#endif
+	/* Map twice what we need, and trim it down to an aligned region,
+	 * which the kernel can back with a transparent huge page. */
+	mem = mmap(NULL, EVBUFFER_POOL_REGION_SIZE * 2, PROT_READ|PROT_WRITE,
+	    MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED)
+		return NULL;
+	aligned = (unsigned char *)(((ev_uintptr_t)mem +
+		EVBUFFER_POOL_REGION_SIZE - 1) &
+	    ~(ev_uintptr_t)(EVBUFFER_POOL_REGION_SIZE - 1));
+	head = aligned - mem;
+	if (head)
+		munmap(mem, head);
+	munmap(aligned + EVBUFFER_POOL_REGION_SIZE,
+	    EVBUFFER_POOL_REGION_SIZE - head);
+	mem = aligned;
+#ifdef MADV_HUGEPAGE
+	if (pool->flags & EVBUFFER_POOL_HUGEPAGES)
+		madvise(mem, EVBUFFER_POOL_REGION_SIZE, MADV_HUGEPAGE);
+#endif
+
+#ifdef MAP_HUGETLB
+mapped:
+#endif
+#ifdef USE_CHAIN_POOL_NUMA
+	if (pool->stats.node >= 0) {
+		unsigned long mask = 1UL << pool->stats.node;
+		/* Nothing has touched the region yet, so all of its pages
+		 * will come from the node.  If we can't ask for that, we
+		 * stop claiming to. */
+		if (syscall(SYS_mbind, mem, EVBUFFER_POOL_REGION_SIZE,
+			EVBUFFER_MPOL_PREFERRED, &mask, sizeof(mask) * 8 + 1,
+			0) < 0)
+			pool->stats.node = -1;
+	}
+#endif
+	return mem;
+}
+
+/* Map another region for pool.  Requires pool's lock. */
+static int
+evbuffer_pool_grow(struct evbuffer_chain_pool *pool)
+{
+	struct evbuffer_pool_region *region;
+	int hugetlb;
+
+	if (pool->max_bytes && pool->stats.bytes_mapped +
+	    EVBUFFER_POOL_REGION_SIZE > pool->max_bytes)
+		return -1;
+	if (!(region = mm_malloc(sizeof(*region))))
+		return -1;
+	if (!(region->mem = evbuffer_pool_map(pool, &hugetlb))) {
+		mm_free(region);
+		return -1;
+	}
+	region->len = EVBUFFER_POOL_REGION_SIZE;
+	region->next = pool->regions;
+	pool->regions = region;
+	pool->next_free = region->mem;
+	pool->left = region->len;
+	pool->stats.bytes_mapped += region->len;
+	if (hugetlb)
+		pool->stats.bytes_hugetlb += region->len;
+	return 0;
+}
+
+/* Put the rest of the newest region onto the free lists, biggest blocks
+ * first.  Requires pool's lock. */
+static void
+evbuffer_pool_retire_region(struct evbuffer_chain_pool *pool)
+{
+	struct evbuffer_pool_block *b;
+	size_t block = EVBUFFER_POOL_REGION_SIZE / 2;
+
+	while (pool->left >= EVBUFFER_POOL_MIN_BLOCK) {
+		while (block > pool->left)
+			block >>= 1;
+		b = (struct evbuffer_pool_block *)pool->next_free;
+		b->next = pool->free_blocks[evbuffer_pool_class(block)];
+		pool->free_blocks[evbuffer_pool_class(block)] = b;
+		pool->next_free += block;
+		pool->left -= block;
+	}
+}
+#endif
+
+static struct evbuffer_chain *
+evbuffer_pool_chain_new(struct evbuffer_chain_pool *pool, size_t size)
+{
+	struct evbuffer_chain *chain;
+	struct evbuffer_chain_pooled *info;
+	struct evbuffer_pool_block *b = NULL;
+	size_t block;
+	int c;
+
+	block = evbuffer_chain_membuf_alloc_size(
+	    size + sizeof(struct evbuffer_chain_pooled));
+	if (block < pool->min_block || block > EVBUFFER_POOL_REGION_SIZE / 2)
+		return NULL;
+	c = evbuffer_pool_class(block);
+
+	EVLOCK_LOCK(pool->lock, 0);
+	if ((b = pool->free_blocks[c])) {
+		pool->free_blocks[c] = b->next;
+	}
+#ifdef USE_CHAIN_POOL
+	else {
+		if (pool->left < block) {
+			evbuffer_pool_retire_region(pool);
+			if (evbuffer_pool_grow(pool) < 0)
+				goto done;
+		}
+		b = (struct evbuffer_pool_block *)pool->next_free;
+		pool->next_free += block;
+		pool->left -= block;
+	}
+done:
+#endif
+	if (b) {
+		++pool->refcnt;
+		++pool->stats.n_allocs;
+		pool->stats.bytes_in_use += block;
+	} else {
+		++pool->stats.n_fallbacks;
+	}
+	EVLOCK_UNLOCK(pool->lock, 0);
+	if (!b)
+		return NULL;
+
+	chain = (struct evbuffer_chain *)b;
+	memset(chain, 0, EVBUFFER_CHAIN_SIZE);
+	chain->flags = EVBUFFER_POOLED;
+	chain->refcnt = 1;
+	info = EVBUFFER_CHAIN_EXTRA(struct evbuffer_chain_pooled, chain);
+	info->pool = pool;
+	chain->buffer = (unsigned char *)(info + 1);
+	chain->buffer_len = block - EVBUFFER_CHAIN_SIZE - sizeof(*info);
+	return chain;
+}
+
+static void
+evbuffer_pool_chain_free(struct evbuffer_chain *chain)
+{
+	struct evbuffer_chain_pooled *info =
+	    EVBUFFER_CHAIN_EXTRA(struct evbuffer_chain_pooled, chain);
+	struct evbuffer_chain_pool *pool = info->pool;
+	struct evbuffer_pool_block *b = (struct evbuffer_pool_block *)chain;
+	size_t block = chain->buffer_len + EVBUFFER_CHAIN_SIZE + sizeof(*info);
+	int c = evbuffer_pool_class(block);
+
+	EVLOCK_LOCK(pool->lock, 0);
+	b->next = pool->free_blocks[c];
+	pool->free_blocks[c] = b;
+	pool->stats.bytes_in_use -= block;
+	EVLOCK_UNLOCK(pool->lock, 0);
+	evbuffer_chain_pool_decref_(pool);
+}
+
+void
+evbuffer_chain_pool_decref_(struct evbuffer_chain_pool *pool)
+{
+	struct evbuffer_pool_region *region;
+
+	EVLOCK_LOCK(pool->lock, 0);
+	if (--pool->refcnt) {
+		EVLOCK_UNLOCK(pool->lock, 0);
+		return;
+	}
+	EVLOCK_UNLOCK(pool->lock, 0);
+
+	while ((region = pool->regions)) {
+		pool->regions = region->next;
+#ifdef USE_CHAIN_POOL
+		munmap(region->mem, region->len);
+#endif
+		mm_free(region);
+	}
+	EVTHREAD_FREE_LOCK(pool->lock, 0);
+	mm_free(pool);
+}
+
+int
+evbuffer_base_set_chain_pool(struct event_base *base, size_t min_size,
+    size_t max_bytes, unsigned flags)
+{
+#ifdef USE_CHAIN_POOL
+	struct evbuffer_chain_pool *pool;
+	int r = -1;
+
+	if (!(pool = mm_calloc(1, sizeof(*pool))))
+		return -1;
+	EVTHREAD_ALLOC_LOCK(pool->lock, 0);
+	pool->refcnt = 1;
+	pool->flags = flags;
+	pool->max_bytes = max_bytes;
+	if (!min_size)
+		min_size = EVBUFFER_POOL_DEFAULT_MIN;
+	pool->min_block = EVBUFFER_POOL_MIN_BLOCK;
+	while (pool->min_block < min_size &&
+	    pool->min_block < EVBUFFER_POOL_REGION_SIZE / 2)
+		pool->min_block <<= 1;
+	pool->stats.node = -1;
+#ifdef USE_CHAIN_POOL_NUMA
+	if (flags & EVBUFFER_POOL_LOCAL_NODE)
+		pool->stats.node = evbuffer_pool_current_node();
+#endif
+
+	EVBASE_ACQUIRE_LOCK(base, th_base_lock);
+	if (!base->chain_pool) {
+		base->chain_pool = pool;
+		r = 0;
+	}
+	EVBASE_RELEASE_LOCK(base, th_base_lock);
+	if (r < 0)
+		evbuffer_chain_pool_decref_(pool);
+	return r;
+#else
+	(void)base;
+	(void)min_size;
+	(void)max_bytes;
+	(void)flags;
+	return -1;
+#endif
+}
+
+int
+evbuffer_set_chain_pool(struct evbuffer *buf, struct event_base *base)
+{
+	struct evbuffer_chain_pool *pool = NULL, *old;
+
+	if (base) {
+		if (!(pool = base->chain_pool))
+			return -1;
+		EVLOCK_LOCK(pool->lock, 0);
+		++pool->refcnt;
+		EVLOCK_UNLOCK(pool->lock, 0);
+	}
+
+	EVBUFFER_LOCK(buf);
+	old = buf->pool;
+	buf->pool = pool;
+	EVBUFFER_UNLOCK(buf);
+
+	if (old)
+		evbuffer_chain_pool_decref_(old);
+	return 0;
+}
+
+int
+evbuffer_base_get_chain_pool_stats(struct event_base *base,
+    struct evbuffer_chain_pool_stats *stats)
+{
+	struct evbuffer_chain_pool *pool = base->chain_pool;
+
+	if (!pool)
+		return -1;
+	EVLOCK_LOCK(pool->lock, 0);
+	*stats = pool->stats;
+	EVLOCK_UNLOCK(pool->lock, 0);
+	return 0;
+}
+
+/*
+ * Reads a line terminated by either '\r\n', '\n\r' or '\r' or '\n'.
+ * The returned buffer needs to be freed by the called.
+ */
+char *
+evbuffer_readline(struct evbuffer *buffer)
+{
+	return evbuffer_readln(buffer, NULL, EVBUFFER_EOL_ANY);
+}
+
+static inline ev_ssize_t
+evbuffer_strchr(struct evbuffer_ptr *it, const char chr)
+{
+	struct evbuffer_chain *chain = it->internal_.chain;
+	size_t i = it->internal_.pos_in_chain;
+	while (chain != NULL) {
+		char *buffer = (char *)chain->buffer + chain->misalign;
+		char *cp = memchr(buffer+i, chr, chain->off-i);
+		if (cp) {
+			it->internal_.chain = chain;
+			it->internal_.pos_in_chain = cp - buffer;
+			it->pos += (cp - buffer - i);
+			return it->pos;
+		}
+		it->pos += chain->off - i;
+		i = 0;
+		chain = chain->next;
+	}
+
+	return (-1);
+}
+
+static inline char *
+find_eol_char(char *s, size_t len)
+{
+#define CHUNK_SZ 128
+	/* Lots of benchmarking found this approach to be faster in practice
+	 * than doing two memchrs over the whole buffer, doin a memchr on each
+	 * char of the buffer, or trying to emulate memchr by hand. */
+	char *s_end, *cr, *lf;
+	s_end = s+len;
+	while (s < s_end) {
+		size_t chunk = (s + CHUNK_SZ < s_end) ? CHUNK_SZ : (s_end - s);
+		cr = memchr(s, '\r', chunk);
+		lf = memchr(s, '\n', chunk);
+		if (cr) {
+			if (lf && lf < cr)
+				return lf;
+			return cr;
+		} else if (lf) {
+			return lf;
+		}
+		s += CHUNK_SZ;
+	}
+
+	return NULL;
+#undef CHUNK_SZ
+}
+
+static ev_ssize_t
+evbuffer_find_eol_char(struct evbuffer_ptr *it)
+{
+	struct evbuffer_chain *chain = it->internal_.chain;
+	size_t i = it->internal_.pos_in_chain;
+	while (chain != NULL) {
+		char *buffer = (char *)chain->buffer + chain->misalign;
+		char *cp = find_eol_char(buffer+i, chain->off-i);
+		if (cp) {
+			it->internal_.chain = chain;
+			it->internal_.pos_in_chain = cp - buffer;
+			it->pos += (cp - buffer) - i;
+			return it->pos;
+		}
+		it->pos += chain->off - i;
+		i = 0;
+		chain = chain->next;
+	}
+
+	return (-1);
+}
+
+static inline size_t
+evbuffer_strspn(
+	struct evbuffer_ptr *ptr, const char *chrset)
+{
+	size_t count = 0;
+	struct evbuffer_chain *chain = ptr->internal_.chain;
+	size_t i = ptr->internal_.pos_in_chain;
+
+	if (!chain)
+		return 0;
+
+	while (1) {
+		char *buffer = (char *)chain->buffer + chain->misalign;
+		for (; i < chain->off; ++i) {
+			const char *p = chrset;
+			while (*p) {
+				if (buffer[i] == *p++)
+					goto next;
+			}
+			ptr->internal_.chain = chain;
+			ptr->internal_.pos_in_chain = i;
+			ptr->pos += count;
+			return count;
+		next:
+			++count;
+		}
+		i = 0;
+
+		if (! chain->next) {
+			ptr->internal_.chain = chain;
+			ptr->internal_.pos_in_chain = i;
+			ptr->pos += count;
+			return count;
+		}
+
+		chain = chain->next;
+	}
+}
+
+
+static inline int
+evbuffer_getchr(struct evbuffer_ptr *it)
+{
+	struct evbuffer_chain *chain = it->internal_.chain;
+	size_t off = it->internal_.pos_in_chain;
+
+	if (chain == NULL)
+		return -1;
+
+	return (unsigned char)chain->buffer[chain->misalign + off];
+}
+
+struct evbuffer_ptr
+evbuffer_search_eol(struct evbuffer *buffer,
+    struct evbuffer_ptr *start, size_t *eol_len_out,
+    enum evbuffer_eol_style eol_style)
+{
+	struct evbuffer_ptr it, it2;
+	size_t extra_drain = 0;
+	int ok = 0;
+
+	/* Avoid locking in trivial edge cases */
+	if (start && start->internal_.chain == NULL) {
+		PTR_NOT_FOUND(&it);
+		if (eol_len_out)
+			*eol_len_out = extra_drain;
+		return it;
+	}
+
+	EVBUFFER_LOCK(buffer);
+
+	if (start) {
+		memcpy(&it, start, sizeof(it));
+	} else {
+		it.pos = 0;
+		it.internal_.chain = buffer->first;
+		it.internal_.pos_in_chain = 0;
+	}
+
+	/* the eol_style determines our first stop character and how many
+	 * characters we are going to drain afterwards. */
+	switch (eol_style) {
+	case EVBUFFER_EOL_ANY:
+		if (evbuffer_find_eol_char(&it) < 0)
+			goto done;
+		memcpy(&it2, &it, sizeof(it));
+		extra_drain = evbuffer_strspn(&it2, "\r\n");
+		break;
+	case EVBUFFER_EOL_CRLF_STRICT: {
+		it = evbuffer_search(buffer, "\r\n", 2, &it);
+		if (it.pos < 0)
+			goto done;
+		extra_drain = 2;
+		break;
+	}
+	case EVBUFFER_EOL_CRLF: {
+		ev_ssize_t start_pos = it.pos;
+		/* Look for a LF ... */
+		if (evbuffer_strchr(&it, '\n') < 0)
 			goto done;
 		extra_drain = 1;
 		/* ... optionally preceded by a CR. */
@@ -1820,7 +2569,7 @@ evbuffer_add(struct evbuffer *buf, const void *data_in, size_t datlen)
 		to_alloc <<= 1;
 	if (datlen > to_alloc)
 		to_alloc = datlen;
-	tmp = evbuffer_chain_new_membuf(to_alloc);
+	tmp = evbuffer_chain_new_membuf(buf, to_alloc);
 	if (tmp == NULL)
 		goto done;
 
@@ -1867,6 +2616,7 @@ evbuffer_prepend(struct evbuffer *buf, const void *data, size_t datlen)
 		goto done;
 	}
 
+	evbuffer_index_clear(buf);
 	chain = buf->first;
 
 	if (chain == NULL) {
@@ -1909,7 +2659,7 @@ evbuffer_prepend(struct evbuffer *buf, const void *data, size_t datlen)
 	}
 
 	/* we need to add another chain */
-	if ((tmp = evbuffer_chain_new_membuf(datlen)) == NULL)
+	if ((tmp = evbuffer_chain_new_membuf(buf, datlen)) == NULL)
 		goto done;
 	buf->first = tmp;
 	if (buf->last_with_datap == &buf->first && chain->off)
@@ -2038,7 +2788,7 @@ evbuffer_expand_singlechain(struct evbuffer *buf, size_t datlen)
 		 * MAX_TO_COPY_IN_EXPAND bytes. */
 		/* figure out how much space we need */
 		size_t length = chain->off + datlen;
-		struct evbuffer_chain *tmp = evbuffer_chain_new_membuf(length);
+		struct evbuffer_chain *tmp = evbuffer_chain_new_membuf(buf, length);
 		if (tmp == NULL)
 			goto err;
 
@@ -2126,7 +2876,7 @@ evbuffer_expand_fast_(struct evbuffer *buf, size_t datlen, int n)
 		 * chains; we can add another. */
 		EVUTIL_ASSERT(chain == NULL);
 
-		tmp = evbuffer_chain_new_membuf(datlen - avail);
+		tmp = evbuffer_chain_new_membuf(buf, datlen - avail);
 		if (tmp == NULL)
 			return (-1);
 
@@ -2158,7 +2908,7 @@ evbuffer_expand_fast_(struct evbuffer *buf, size_t datlen, int n)
 			evbuffer_chain_free(chain);
 		}
 		EVUTIL_ASSERT(datlen >= avail);
-		tmp = evbuffer_chain_new_membuf(datlen - avail);
+		tmp = evbuffer_chain_new_membuf(buf, datlen - avail);
 		if (tmp == NULL) {
 			if (rmv_all) {
 				ZERO_CHAIN(buf);
@@ -2299,6 +3049,35 @@ get_n_bytes_readable_on_socket(evutil_socket_t fd)
 #endif
 }
 
+/* With EVBUFFER_FLAG_ADAPTIVE_READ: adjust how much the next read asks for,
+ * after one that got 'got' bytes.  'capped' is true if the caller let us
+ * ask for less than we wanted.  A read that fills our guess means there's
+ * probably more waiting, so we guess twice as much next time; reads that
+ * keep coming back with much less mean we should guess smaller. */
+static void
+evbuffer_adapt_read_size(struct evbuffer *buf, int capped, int got)
+{
+	struct evbuffer_read_stats *st = &buf->read_stats;
+
+	if ((size_t)got >= st->read_size) {
+		st->read_size *= 2;
+		if (st->read_size > buf->max_read)
+			st->read_size = buf->max_read;
+		buf->read_misses = 0;
+	} else if (!capped && (size_t)got < st->read_size / 4 &&
+	    st->read_size > MIN_BUFFER_SIZE) {
+		if (++buf->read_misses >= 2) {
+			st->read_size /= 2;
+			if (st->read_size < MIN_BUFFER_SIZE)
+				st->read_size = MIN_BUFFER_SIZE;
+			/* Keep asking the kernel until we guess right. */
+			buf->read_misses = 1;
+		}
+	} else {
+		buf->read_misses = 0;
+	}
+}
+
 /* TODO(niels): should this function return ev_ssize_t and take ev_ssize_t
  * as howmuch? */
 int
@@ -2307,6 +3086,7 @@ evbuffer_read(struct evbuffer *buf, evutil_socket_t fd, int howmuch)
 	struct evbuffer_chain **chainp;
 	int n;
 	int result;
+	int capped = 0;
 
 #ifdef USE_IOVEC_IMPL
 	int nvecs, i, remaining;
@@ -2322,11 +3102,19 @@ evbuffer_read(struct evbuffer *buf, evutil_socket_t fd, int howmuch)
 		goto done;
 	}
 
-	n = get_n_bytes_readable_on_socket(fd);
+	if ((buf->flags & EVBUFFER_FLAG_ADAPTIVE_READ) && !buf->read_misses) {
+		/* Our guesses have been good; don't bother the kernel. */
+		n = (int)buf->read_stats.read_size;
+	} else {
+		n = get_n_bytes_readable_on_socket(fd);
+		++buf->read_stats.n_fionread;
+	}
 	if (n <= 0 || n > (int)buf->max_read)
 		n = (int)buf->max_read;
 	if (howmuch < 0 || howmuch > n)
 		howmuch = n;
+	else
+		capped = 1;
 
 #ifdef USE_IOVEC_IMPL
 	/* Since we can use iovecs, we're willing to use the last
@@ -2424,6 +3212,13 @@ evbuffer_read(struct evbuffer *buf, evutil_socket_t fd, int howmuch)
 	buf->total_len += n;
 	buf->n_add_for_cb += n;
 
+	++buf->read_stats.n_reads;
+	buf->read_stats.n_bytes += n;
+	if (n == howmuch)
+		++buf->read_stats.n_full;
+	if (buf->flags & EVBUFFER_FLAG_ADAPTIVE_READ)
+		evbuffer_adapt_read_size(buf, capped, n);
+
 	/* Tell someone about changes in this buffer */
 	evbuffer_invoke_callbacks_(buf);
 	result = n;
@@ -2594,6 +3389,100 @@ evbuffer_write(struct evbuffer *buffer, evutil_socket_t fd)
 	return evbuffer_write_atmost(buffer, fd, -1);
 }
 
+#if defined(MSG_ZEROCOPY) && defined(EVENT__HAVE_SYS_UIO_H)
+int
+evbuffer_write_zerocopy_(struct evbuffer *buffer, evutil_socket_t fd,
+    ev_ssize_t howmuch, struct evbuffer_zerocopy_send **sendp)
+{
+	struct iovec iov[NUM_WRITE_IOVEC];
+	struct evbuffer_zerocopy_send *send;
+	struct evbuffer_chain *chain;
+	struct msghdr msg;
+	ev_ssize_t atmost = howmuch;
+	size_t left;
+	int n = -1, i = 0;
+
+	*sendp = NULL;
+	EVBUFFER_LOCK(buffer);
+
+	if (buffer->freeze_start)
+		goto done;
+
+	if (howmuch < 0 || (size_t)howmuch > buffer->total_len)
+		howmuch = buffer->total_len;
+
+	for (chain = buffer->first; chain && i < NUM_WRITE_IOVEC && howmuch;
+	     chain = chain->next) {
+#ifdef USE_SENDFILE
+		if (chain->flags & EVBUFFER_SENDFILE)
+			break;
+#endif
+		if (!chain->off)
+			continue;
+		iov[i].iov_base = chain->buffer + chain->misalign;
+		iov[i].iov_len = (size_t)howmuch < chain->off ?
+		    (size_t)howmuch : chain->off;
+		howmuch -= iov[i++].iov_len;
+	}
+
+	/* The kernel may hang on to every chain we point it at, so we need
+	 * room to remember them all before we send anything. */
+	if (!i || !(send = mm_malloc(sizeof(*send) + i * sizeof(chain)))) {
+		n = evbuffer_write_atmost(buffer, fd, atmost);
+		goto done;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = i;
+	n = (int)sendmsg(fd, &msg, MSG_ZEROCOPY);
+	if (n <= 0) {
+		if (n < 0 && errno == ENOBUFS)
+			n = -2;
+		mm_free(send);
+		goto done;
+	}
+
+	/* Hold every chain that the kernel took some of, and keep anyone from
+	 * writing into the rest of it (or moving what's there) until the
+	 * kernel says it's done. */
+	send->next = NULL;
+	send->id = 0;
+	send->n_chains = 0;
+	send->chains = (struct evbuffer_chain **)(send + 1);
+	for (chain = buffer->first, left = n; left; chain = chain->next) {
+		if (!chain->off)
+			continue;
+		chain->flags |= EVBUFFER_IMMUTABLE;
+		evbuffer_chain_incref(chain);
+		send->chains[send->n_chains++] = chain;
+		left -= left < chain->off ? left : chain->off;
+	}
+	*sendp = send;
+
+	evbuffer_drain(buffer, n);
+
+done:
+	EVBUFFER_UNLOCK(buffer);
+	return (n);
+}
+
+void
+evbuffer_zerocopy_send_free_(struct evbuffer *buffer,
+    struct evbuffer_zerocopy_send *send)
+{
+	int i;
+
+	if (buffer)
+		EVBUFFER_LOCK(buffer);
+	for (i = 0; i < send->n_chains; ++i)
+		evbuffer_chain_free(send->chains[i]);
+	if (buffer)
+		EVBUFFER_UNLOCK(buffer);
+	mm_free(send);
+}
+#endif
+
 unsigned char *
 evbuffer_find(struct evbuffer *buffer, const unsigned char *what, size_t len)
 {
@@ -2639,13 +3528,97 @@ evbuffer_ptr_subtract(struct evbuffer *buf, struct evbuffer_ptr *pos,
 	}
 }
 
+/* Use buf's index to find a chain that starts at or not long before
+ * 'position', extending the index as far as needed.  Return that chain, and
+ * set *offp to the offset of 'position' from its start.  Return NULL if the
+ * index can't help, because 'position' is in the first chain.
+ * Requires lock. */
+static struct evbuffer_chain *
+evbuffer_index_find(struct evbuffer *buf, size_t position, size_t *offp)
+{
+	struct evbuffer_index *idx = buf->index;
+	struct evbuffer_index_entry *e;
+	struct evbuffer_chain *chain;
+	size_t target, start, lo, hi;
+
+	if (!buf->first || position < buf->first->off)
+		return NULL;
+
+	if (idx->n == idx->first || idx->entries[idx->n - 1].start <= idx->base) {
+		/* Everything we had indexed has been drained; start over. */
+		idx->first = idx->n = 0;
+		idx->base = 0;
+		chain = buf->first;
+		start = 0;
+	} else {
+		e = &idx->entries[idx->n - 1];
+		chain = e->chain->next;
+		start = e->start + e->chain->off;
+	}
+	target = idx->base + position;
+
+	/* Index more chains, up to the one that holds target.  The last
+	 * chain with data can still grow, so it never gets an entry. */
+	while (chain && start <= target && chain != *buf->last_with_datap) {
+		if (idx->n == idx->n_alloc) {
+			if (idx->first) {
+				memmove(idx->entries, idx->entries + idx->first,
+				    (idx->n - idx->first) * sizeof(*e));
+				idx->n -= idx->first;
+				idx->first = 0;
+			} else {
+				size_t n_alloc = idx->n_alloc ?
+				    idx->n_alloc * 2 : EVBUFFER_INDEX_MIN_CHAINS;
+				e = mm_realloc(idx->entries,
+				    n_alloc * sizeof(*e));
+				if (!e)
+					break;
+				idx->entries = e;
+				idx->n_alloc = n_alloc;
+			}
+		}
+		e = &idx->entries[idx->n++];
+		e->chain = chain;
+		e->start = start;
+		start += chain->off;
+		chain = chain->next;
+	}
+
+	if (idx->n == idx->first)
+		return NULL;
+
+	/* Find the last entry that starts at or before target. */
+	lo = idx->first;
+	hi = idx->n;
+	while (hi - lo > 1) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (idx->entries[mid].start <= target)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	e = &idx->entries[lo];
+	if (e->start <= idx->base) {
+		/* This chain and everything before it may be gone. */
+		idx->first = lo;
+		return NULL;
+	}
+	if (e->start > target)
+		return NULL;
+
+	*offp = target - e->start;
+	return e->chain;
+}
+
 int
 evbuffer_ptr_set(struct evbuffer *buf, struct evbuffer_ptr *pos,
     size_t position, enum evbuffer_ptr_how how)
 {
 	size_t left = position;
-	struct evbuffer_chain *chain = NULL;
+	struct evbuffer_chain *chain = NULL, *found;
+	size_t found_off;
 	int result = 0;
+	int n_walked = 0;
 
 	EVBUFFER_LOCK(buf);
 
@@ -2669,10 +3642,24 @@ evbuffer_ptr_set(struct evbuffer *buf, struct evbuffer_ptr *pos,
 	}
 
 	EVUTIL_ASSERT(EV_SIZE_MAX - left >= position);
+	if (buf->index && chain && position + left >= chain->off &&
+	    (found = evbuffer_index_find(buf, pos->pos, &found_off)) &&
+	    found_off < position + left) {
+		/* The index found a chain past the one we were at. */
+		chain = found;
+		position = 0;
+		left = found_off;
+	}
 	while (chain && position + left >= chain->off) {
 		left -= chain->off - position;
 		chain = chain->next;
 		position = 0;
+		++n_walked;
+	}
+	if (n_walked >= EVBUFFER_INDEX_MIN_CHAINS && !buf->index) {
+		/* Seeks in this buffer are getting slow; index it from
+		 * now on. */
+		buf->index = mm_calloc(1, sizeof(struct evbuffer_index));
 	}
 	if (chain) {
 		pos->internal_.chain = chain;
@@ -2937,6 +3924,171 @@ evbuffer_add_printf(struct evbuffer *buf, const char *fmt, ...)
 	return (res);
 }
 
+/* Pairs of decimal digits, so that we can write two at a time. */
+static const char evbuffer_digit_pairs[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+/* Helper: append value to buf in base 10 or 16, at least width digits long,
+ * after a '-' if negative is set.  Requires lock. */
+static int
+evbuffer_add_digits_(struct evbuffer *buf, ev_uint64_t value, int negative,
+    unsigned flags, int width)
+{
+	const char *hex = (flags & EVBUFFER_INT_UPPER) ?
+	    "0123456789ABCDEF" : "0123456789abcdef";
+	struct evbuffer_chain *chain;
+	unsigned char *p;
+	ev_uint64_t v;
+	int n_digits = 1, len;
+
+	ASSERT_EVBUFFER_LOCKED(buf);
+	if (buf->freeze_end || width < 0 || width > 64)
+		return -1;
+
+	/* Count the digits first, so we can write them from the end. */
+	if (flags & EVBUFFER_INT_HEX) {
+		for (v = value >> 4; v; v >>= 4)
+			++n_digits;
+	} else {
+		for (v = value / 10; v; v /= 10)
+			++n_digits;
+	}
+	if (n_digits < width)
+		n_digits = width;
+	len = n_digits + !!negative;
+
+	if ((chain = evbuffer_expand_singlechain(buf, len)) == NULL)
+		return -1;
+	p = CHAIN_SPACE_PTR(chain) + len;
+	if (flags & EVBUFFER_INT_HEX) {
+		do {
+			*--p = hex[value & 15];
+			value >>= 4;
+		} while (value);
+	} else {
+		while (value >= 100) {
+			unsigned i = (unsigned)(value % 100) * 2;
+			value /= 100;
+			*--p = evbuffer_digit_pairs[i + 1];
+			*--p = evbuffer_digit_pairs[i];
+		}
+		if (value >= 10) {
+			unsigned i = (unsigned)value * 2;
+			*--p = evbuffer_digit_pairs[i + 1];
+			*--p = evbuffer_digit_pairs[i];
+		} else {
+			*--p = '0' + (unsigned)value;
+		}
+	}
+	while (p > CHAIN_SPACE_PTR(chain) + !!negative)
+		*--p = '0';
+	if (negative)
+		*--p = '-';
+
+	chain->off += len;
+	buf->total_len += len;
+	buf->n_add_for_cb += len;
+	advance_last_with_data(buf);
+	evbuffer_invoke_callbacks_(buf);
+	return len;
+}
+
+int
+evbuffer_add_int(struct evbuffer *buf, ev_int64_t value)
+{
+	int result;
+	/* Negate as unsigned, so that EV_INT64_MIN works. */
+	ev_uint64_t magnitude = value < 0 ?
+	    0 - (ev_uint64_t)value : (ev_uint64_t)value;
+
+	EVBUFFER_LOCK(buf);
+	result = evbuffer_add_digits_(buf, magnitude, value < 0, 0, 0);
+	EVBUFFER_UNLOCK(buf);
+	return result;
+}
+
+int
+evbuffer_add_uint(struct evbuffer *buf, ev_uint64_t value)
+{
+	int result;
+
+	EVBUFFER_LOCK(buf);
+	result = evbuffer_add_digits_(buf, value, 0, 0, 0);
+	EVBUFFER_UNLOCK(buf);
+	return result;
+}
+
+int
+evbuffer_add_uint_fixed(struct evbuffer *buf, ev_uint64_t value,
+    unsigned flags, int width)
+{
+	int result;
+
+	EVBUFFER_LOCK(buf);
+	result = evbuffer_add_digits_(buf, value, 0, flags, width);
+	EVBUFFER_UNLOCK(buf);
+	return result;
+}
+
+int
+evbuffer_add_strings(struct evbuffer *buf, ...)
+{
+	struct evbuffer_chain *chain;
+	unsigned char *p;
+	const char *str;
+	size_t len = 0, n;
+	int result = -1;
+	va_list ap;
+
+	va_start(ap, buf);
+	while ((str = va_arg(ap, const char *)) != NULL) {
+		n = strlen(str);
+		if (n > EVBUFFER_CHAIN_MAX - len) {
+			va_end(ap);
+			return -1;
+		}
+		len += n;
+	}
+	va_end(ap);
+	if (len == 0)
+		return 0;
+	if (len > INT_MAX)
+		return -1;
+
+	EVBUFFER_LOCK(buf);
+	if (buf->freeze_end)
+		goto done;
+	if ((chain = evbuffer_expand_singlechain(buf, len)) == NULL)
+		goto done;
+	p = CHAIN_SPACE_PTR(chain);
+	va_start(ap, buf);
+	while ((str = va_arg(ap, const char *)) != NULL) {
+		n = strlen(str);
+		memcpy(p, str, n);
+		p += n;
+	}
+	va_end(ap);
+
+	chain->off += len;
+	buf->total_len += len;
+	buf->n_add_for_cb += len;
+	advance_last_with_data(buf);
+	evbuffer_invoke_callbacks_(buf);
+	result = (int)len;
+done:
+	EVBUFFER_UNLOCK(buf);
+	return result;
+}
+
 int
 evbuffer_add_reference(struct evbuffer *outbuf,
     const void *data, size_t datlen,
@@ -3018,6 +4170,11 @@ evbuffer_file_segment_new(
 	    (ev_uint64_t)offset > (ev_uint64_t)(EVBUFFER_CHAIN_MAX - length))
 		goto err;
 
+#ifdef EVENT__HAVE_POSIX_FADVISE
+	if (flags & EVBUF_FS_READAHEAD)
+		posix_fadvise(fd, offset, length, POSIX_FADV_SEQUENTIAL);
+#endif
+
 #if defined(USE_SENDFILE)
 	if (!(flags & EVBUF_FS_DISABLE_SENDFILE)) {
 		seg->can_sendfile = 1;
@@ -3215,6 +4372,13 @@ evbuffer_file_segment_free(struct evbuffer_file_segment *seg)
 	} else if (seg->contents) {
 		mm_free(seg->contents);
 	}
+#ifdef USE_FS_MINCORE
+	if (seg->probe) {
+		off_t offset_leftover;
+		offset_leftover = seg->file_offset % get_page_size();
+		munmap(seg->probe, seg->length + offset_leftover);
+	}
+#endif
 
 	if ((seg->flags & EVBUF_FS_CLOSE_ON_FREE) && seg->fd >= 0) {
 		close(seg->fd);
@@ -3317,6 +4481,8 @@ evbuffer_add_file_segment(struct evbuffer *buf,
 	++seg->refcnt;
 	EVLOCK_UNLOCK(seg->lock, 0);
 	extra->segment = seg;
+	if (seg->flags & EVBUF_FS_READAHEAD)
+		buf->has_readahead = 1;
 	buf->n_add_for_cb += length;
 	evbuffer_chain_insert(buf, chain);
 
@@ -3347,6 +4513,719 @@ evbuffer_add_file(struct evbuffer *buf, int fd, ev_off_t offset, ev_off_t length
 	return r;
 }
 
+static struct evbuffer_shared *
+evbuffer_shared_new_(size_t extra)
+{
+	struct evbuffer_shared *shared;
+
+	if (extra > EVBUFFER_CHAIN_MAX - sizeof(struct evbuffer_shared))
+		return NULL;
+	shared = mm_calloc(1, sizeof(struct evbuffer_shared) + extra);
+	if (!shared)
+		return NULL;
+	shared->refcnt = 1;
+	EVTHREAD_ALLOC_LOCK(shared->lock, 0);
+	return shared;
+}
+
+struct evbuffer_shared *
+evbuffer_shared_new(const void *data, size_t datlen)
+{
+	struct evbuffer_shared *shared = evbuffer_shared_new_(datlen);
+	unsigned char *contents;
+
+	if (!shared)
+		return NULL;
+	/* The copy lives just after the struct, and goes with it. */
+	contents = (unsigned char *)(shared + 1);
+	if (datlen)
+		memcpy(contents, data, datlen);
+	shared->data = contents;
+	shared->length = datlen;
+	return shared;
+}
+
+struct evbuffer_shared *
+evbuffer_shared_new_reference(const void *data, size_t datlen,
+    evbuffer_ref_cleanup_cb cleanupfn, void *cleanupfn_arg)
+{
+	struct evbuffer_shared *shared;
+
+	if (datlen > EVBUFFER_CHAIN_MAX)
+		return NULL;
+	shared = evbuffer_shared_new_(0);
+	if (!shared)
+		return NULL;
+	shared->data = data;
+	shared->length = datlen;
+	shared->cleanupfn = cleanupfn;
+	shared->cleanupfn_arg = cleanupfn_arg;
+	return shared;
+}
+
+void
+evbuffer_shared_free(struct evbuffer_shared *shared)
+{
+	int refcnt;
+
+	EVLOCK_LOCK(shared->lock, 0);
+	refcnt = --shared->refcnt;
+	EVLOCK_UNLOCK(shared->lock, 0);
+	if (refcnt > 0)
+		return;
+	EVUTIL_ASSERT(refcnt == 0);
+
+	if (shared->cleanupfn)
+		(*shared->cleanupfn)(shared->data, shared->length,
+		    shared->cleanupfn_arg);
+	EVTHREAD_FREE_LOCK(shared->lock, 0);
+	mm_free(shared);
+}
+
+size_t
+evbuffer_shared_get_length(const struct evbuffer_shared *shared)
+{
+	return shared->length;
+}
+
+int
+evbuffer_add_shared(struct evbuffer *buf, struct evbuffer_shared *shared,
+    size_t offset, ev_ssize_t length)
+{
+	struct evbuffer_chain *chain;
+	struct evbuffer_chain_shared *extra;
+
+	if (offset > shared->length)
+		return -1;
+	if (length < 0)
+		length = shared->length - offset;
+	else if ((size_t)length > shared->length - offset)
+		return -1;
+	if (!length)
+		return 0;
+
+	chain = evbuffer_chain_new(sizeof(struct evbuffer_chain_shared));
+	if (!chain)
+		return -1;
+	extra = EVBUFFER_CHAIN_EXTRA(struct evbuffer_chain_shared, chain);
+	chain->flags |= EVBUFFER_IMMUTABLE|EVBUFFER_SHARED;
+	chain->buffer = (unsigned char *)shared->data + offset;
+	chain->buffer_len = length;
+	chain->off = length;
+	extra->shared = shared;
+
+	EVBUFFER_LOCK(buf);
+	if (buf->freeze_end) {
+		EVBUFFER_UNLOCK(buf);
+		mm_free(chain);
+		return -1;
+	}
+	EVLOCK_LOCK(shared->lock, 0);
+	++shared->refcnt;
+	EVLOCK_UNLOCK(shared->lock, 0);
+	evbuffer_chain_insert(buf, chain);
+	buf->n_add_for_cb += length;
+
+	evbuffer_invoke_callbacks_(buf);
+
+	EVBUFFER_UNLOCK(buf);
+	return 0;
+}
+
+/* How far ahead of where we're writing a file segment from we keep the
+ * kernel reading it, and how much of it we check the page cache for, or
+ * read in off the loop thread, at a time. */
+#define EVBUFFER_FS_WINDOW ((ev_off_t)4 << 20)
+
+static inline struct evbuffer_file_segment *
+evbuffer_chain_segment(struct evbuffer_chain *chain)
+{
+	struct evbuffer_chain_file_segment *info =
+	    EVBUFFER_CHAIN_EXTRA(struct evbuffer_chain_file_segment, chain);
+	return info->segment;
+}
+
+/* Return true iff chain is part of a file segment that we have to watch
+ * the page cache for. */
+static int
+evbuffer_chain_is_readahead(struct evbuffer_chain *chain)
+{
+	struct evbuffer_file_segment *seg;
+
+	if (!(chain->flags & EVBUFFER_FILESEGMENT))
+		return 0;
+	seg = evbuffer_chain_segment(chain);
+	/* Segments that we read into memory are no concern of ours. */
+	return (seg->flags & EVBUF_FS_READAHEAD) &&
+	    ((chain->flags & EVBUFFER_SENDFILE) || seg->is_mapping);
+}
+
+#ifdef USE_FS_MINCORE
+/* Return the address of the data at 'pos' in seg's file, in its mapping or
+ * in its probe, mapping the probe if need be; or NULL.  Requires seg's
+ * lock. */
+static char *
+evbuffer_file_segment_addr(struct evbuffer_file_segment *seg, ev_off_t pos)
+{
+	off_t offset_leftover;
+
+	if (seg->is_mapping)
+		return seg->contents + (pos - seg->file_offset);
+	offset_leftover = seg->file_offset % get_page_size();
+	if (!seg->probe) {
+		void *mapped = mmap(NULL, seg->length + offset_leftover,
+		    PROT_READ, MAP_PRIVATE, seg->fd,
+		    seg->file_offset - offset_leftover);
+		if (mapped == MAP_FAILED)
+			return NULL;
+		seg->probe = mapped;
+	}
+	return (char *)seg->probe + offset_leftover +
+	    (pos - seg->file_offset);
+}
+#endif
+
+/* Return how many of the 'len' bytes at 'pos' in seg's file are in the page
+ * cache, counting from the start.  Requires seg's lock. */
+static ev_off_t
+evbuffer_file_segment_resident(struct evbuffer_file_segment *seg,
+    ev_off_t pos, ev_off_t len)
+{
+#ifdef USE_FS_MINCORE
+	unsigned char vec[EVBUFFER_FS_WINDOW / 4096];
+	long page_size = get_page_size();
+	char *addr, *start;
+	size_t n_pages, i;
+
+	if (page_size <= 0 ||
+	    !(addr = evbuffer_file_segment_addr(seg, pos)))
+		return len;
+	start = addr - ((ev_uintptr_t)addr % page_size);
+	n_pages = (addr + len - start + page_size - 1) / page_size;
+	if (n_pages > sizeof(vec))
+		n_pages = sizeof(vec);
+	/* (Some systems want a char *, some an unsigned char *.) */
+	if (mincore(start, n_pages * page_size, (void *)vec) < 0)
+		return len;
+	for (i = 0; i < n_pages; ++i) {
+		if (!(vec[i] & 1))
+			break;
+	}
+	if (start + i * page_size - addr >= len)
+		return len;
+	return i ? start + i * page_size - addr : 0;
+#else
+	return len;
+#endif
+}
+
+/* Keep the kernel reading seg's file a window ahead of 'pos'.  Requires
+ * seg's lock. */
+static void
+evbuffer_file_segment_readahead(struct evbuffer_file_segment *seg,
+    ev_off_t pos)
+{
+	ev_off_t end = seg->file_offset + seg->length;
+	ev_off_t to = pos + EVBUFFER_FS_WINDOW;
+
+	if (to > end)
+		to = end;
+	/* Ask in big steps, rather than once per write. */
+	if (seg->readahead_to >= to ||
+	    seg->readahead_to - pos >= EVBUFFER_FS_WINDOW / 2)
+		return;
+	if (seg->readahead_to > pos)
+		pos = seg->readahead_to;
+#ifdef EVENT__HAVE_POSIX_FADVISE
+	posix_fadvise(seg->fd, pos, to - pos, POSIX_FADV_WILLNEED);
+#elif defined(EVENT__HAVE_MMAP) && defined(MADV_WILLNEED)
+	if (seg->is_mapping) {
+		char *addr = seg->contents + (pos - seg->file_offset);
+		char *start = addr - ((ev_uintptr_t)addr % get_page_size());
+		madvise(start, to - pos + (addr - start), MADV_WILLNEED);
+	}
+#endif
+	seg->readahead_to = to;
+}
+
+/* Return where in its file the data of chain, a file segment chain,
+ * starts. */
+static ev_off_t
+evbuffer_file_chain_pos(struct evbuffer_chain *chain,
+    struct evbuffer_file_segment *seg)
+{
+	if (chain->flags & EVBUFFER_SENDFILE)
+		return chain->misalign;
+	return seg->file_offset +
+	    ((char *)chain->buffer + chain->misalign - seg->contents);
+}
+
+ev_ssize_t
+evbuffer_file_write_ready_(struct evbuffer *buf, ev_ssize_t howmuch)
+{
+	struct evbuffer_chain *chain;
+	struct evbuffer_file_segment *seg;
+	ev_ssize_t ready = 0;
+	ev_off_t pos, n, resident;
+	int found = 0;
+
+	ASSERT_EVBUFFER_LOCKED(buf);
+	if (!buf->has_readahead)
+		return -1;
+	if (howmuch < 0 || (size_t)howmuch > buf->total_len)
+		howmuch = buf->total_len;
+
+	for (chain = buf->first; chain && ready < howmuch;
+	     chain = chain->next) {
+		n = chain->off;
+		if (n > howmuch - ready)
+			n = howmuch - ready;
+		if (n && evbuffer_chain_is_readahead(chain)) {
+			found = 1;
+			seg = evbuffer_chain_segment(chain);
+			pos = evbuffer_file_chain_pos(chain, seg);
+			EVLOCK_LOCK(seg->lock, 0);
+			evbuffer_file_segment_readahead(seg, pos);
+			resident = evbuffer_file_segment_resident(seg, pos, n);
+			EVLOCK_UNLOCK(seg->lock, 0);
+			if (resident < n)
+				return ready + (ev_ssize_t)resident;
+		}
+		ready += (ev_ssize_t)n;
+	}
+	if (found)
+		return ready;
+	/* If none of the buffer was from such a segment, none of it will be
+	 * until another one is added. */
+	if ((size_t)ready == buf->total_len)
+		buf->has_readahead = 0;
+	return -1;
+}
+
+/* A part of a file that we're reading in off the loop thread. */
+struct evbuffer_file_fetch {
+	/** Run from the loop once we're done. */
+	struct event_callback cb;
+	struct event_base *base;
+	/** Our place in base's file_fetches list, and whether the offload
+	 * thread is still reading.  Both protected by base's lock. */
+	LIST_ENTRY(evbuffer_file_fetch) next;
+	unsigned reading : 1;
+	/** The segment we're reading; we hold a reference to it. */
+	struct evbuffer_file_segment *seg;
+	/** Where the data is mapped, and how long it is. */
+	const char *addr;
+	ev_off_t len;
+	long page_size;
+	void (*done)(void *);
+	void *arg;
+};
+
+/* Runs on the offload thread: fault in every page of the data, so that
+ * it's in the page cache when we write it. */
+static void
+evbuffer_file_fetch_work(void *arg)
+{
+	struct evbuffer_file_fetch *fetch = arg;
+	volatile const char *p = fetch->addr;
+	ev_off_t i;
+	char c = 0;
+
+	for (i = 0; i < fetch->len; i += fetch->page_size)
+		c ^= p[i];
+	if (fetch->len)
+		c ^= p[fetch->len - 1];
+	(void)c;
+
+	/* Once we let go of the lock, the base may free fetch. */
+	EVBASE_ACQUIRE_LOCK(fetch->base, th_base_lock);
+	fetch->reading = 0;
+	event_callback_activate_nolock_(fetch->base, &fetch->cb);
+	EVTHREAD_COND_BROADCAST(fetch->base->current_event_cond);
+	EVBASE_RELEASE_LOCK(fetch->base, th_base_lock);
+}
+
+static void
+evbuffer_file_fetch_free(struct evbuffer_file_fetch *fetch)
+{
+	fetch->done(fetch->arg);
+	evbuffer_file_segment_free(fetch->seg);
+	mm_free(fetch);
+}
+
+static void
+evbuffer_file_fetch_done(struct event_callback *cb, void *arg)
+{
+	struct evbuffer_file_fetch *fetch = arg;
+
+	EVBASE_ACQUIRE_LOCK(fetch->base, th_base_lock);
+	LIST_REMOVE(fetch, next);
+	EVBASE_RELEASE_LOCK(fetch->base, th_base_lock);
+	evbuffer_file_fetch_free(fetch);
+}
+
+int
+evbuffer_file_fetch_(struct evbuffer *buf, struct event_base *base,
+    void (*done)(void *), void *arg)
+{
+#ifdef USE_FS_MINCORE
+	struct evbuffer_chain *chain;
+	struct evbuffer_file_segment *seg;
+	struct evbuffer_file_fetch *fetch;
+	const char *addr;
+	ev_off_t pos;
+	int priority;
+
+	ASSERT_EVBUFFER_LOCKED(buf);
+	if (!base->file_offload)
+		return -1;
+	for (chain = buf->first; chain && !chain->off; chain = chain->next)
+		;
+	if (!chain || !evbuffer_chain_is_readahead(chain))
+		return -1;
+	seg = evbuffer_chain_segment(chain);
+	pos = evbuffer_file_chain_pos(chain, seg);
+	priority = event_base_get_npriorities(base) / 2;
+	if (!(fetch = mm_calloc(1, sizeof(*fetch))))
+		return -1;
+
+	EVLOCK_LOCK(seg->lock, 0);
+	if (!(addr = evbuffer_file_segment_addr(seg, pos))) {
+		EVLOCK_UNLOCK(seg->lock, 0);
+		mm_free(fetch);
+		return -1;
+	}
+	++seg->refcnt;
+	EVLOCK_UNLOCK(seg->lock, 0);
+
+	fetch->base = base;
+	fetch->seg = seg;
+	fetch->addr = addr;
+	fetch->len = chain->off < (size_t)EVBUFFER_FS_WINDOW ?
+	    (ev_off_t)chain->off : EVBUFFER_FS_WINDOW;
+	fetch->page_size = get_page_size();
+	fetch->done = done;
+	fetch->arg = arg;
+	event_deferred_cb_init_(&fetch->cb, priority, evbuffer_file_fetch_done,
+	    fetch);
+	fetch->reading = 1;
+	EVBASE_ACQUIRE_LOCK(base, th_base_lock);
+	LIST_INSERT_HEAD(&base->file_fetches, fetch, next);
+	EVBASE_RELEASE_LOCK(base, th_base_lock);
+	base->file_offload(evbuffer_file_fetch_work, fetch,
+	    base->file_offload_arg);
+	return 0;
+#else
+	(void)buf;
+	(void)base;
+	(void)done;
+	(void)arg;
+	return -1;
+#endif
+}
+
+void
+evbuffer_file_fetch_cancel_all_(struct event_base *base)
+{
+#ifdef USE_FS_MINCORE
+	struct evbuffer_file_fetch *fetch;
+
+	EVBASE_ACQUIRE_LOCK(base, th_base_lock);
+	while ((fetch = LIST_FIRST(&base->file_fetches)) != NULL) {
+		if (fetch->reading) {
+			/* The offload thread still has it, and will use the
+			 * base once it's done. */
+			EVTHREAD_COND_WAIT(base->current_event_cond,
+			    base->th_base_lock);
+			continue;
+		}
+		LIST_REMOVE(fetch, next);
+		event_callback_cancel_nolock_(base, &fetch->cb, 0);
+		EVBASE_RELEASE_LOCK(base, th_base_lock);
+		evbuffer_file_fetch_free(fetch);
+		EVBASE_ACQUIRE_LOCK(base, th_base_lock);
+	}
+	EVBASE_RELEASE_LOCK(base, th_base_lock);
+#else
+	(void)base;
+#endif
+}
+
+int
+evbuffer_base_set_file_offload(struct event_base *base,
+    evbuffer_file_offload_cb cb, void *arg)
+{
+#ifdef USE_FS_MINCORE
+	if (cb && !EVTHREAD_LOCKING_ENABLED())
+		return -1;
+	EVBASE_ACQUIRE_LOCK(base, th_base_lock);
+	base->file_offload = cb;
+	base->file_offload_arg = arg;
+	EVBASE_RELEASE_LOCK(base, th_base_lock);
+	return 0;
+#else
+	(void)base;
+	(void)cb;
+	(void)arg;
+	return -1;
+#endif
+}
+
+/* The least room a chain on an evbuffer_spsc has. */
+#define EVBUFFER_SPSC_CHAIN_SIZE 4096
+
+#ifdef EVUTIL_HAVE_ATOMICS
+#define SPSC_LOCK(q) ((void)0)
+#define SPSC_UNLOCK(q) ((void)0)
+#define SPSC_LOAD(p) EVUTIL_ATOMIC_LOAD(p)
+#define SPSC_STORE(p, v) EVUTIL_ATOMIC_STORE(p, v)
+#define SPSC_EXCHANGE(p, v) EVUTIL_ATOMIC_EXCHANGE(p, v)
+#else
+#define SPSC_LOCK(q) EVLOCK_LOCK((q)->lock, 0)
+#define SPSC_UNLOCK(q) EVLOCK_UNLOCK((q)->lock, 0)
+#define SPSC_LOAD(p) (*(p))
+#define SPSC_STORE(p, v) (*(p) = (v))
+#define SPSC_EXCHANGE(p, v) evbuffer_spsc_exchange_((p), (v))
+static inline int
+evbuffer_spsc_exchange_(int *p, int v)
+{
+	int old = *p;
+	*p = v;
+	return old;
+}
+#endif
+
+static struct evbuffer_chain *
+evbuffer_spsc_chain_new_(size_t size)
+{
+	if (size < EVBUFFER_SPSC_CHAIN_SIZE)
+		size = EVBUFFER_SPSC_CHAIN_SIZE;
+	if (size > EVBUFFER_CHAIN_MAX - EVBUFFER_CHAIN_SIZE)
+		return NULL;
+	return evbuffer_chain_new(
+	    evbuffer_chain_membuf_alloc_size(size) - EVBUFFER_CHAIN_SIZE);
+}
+
+/* Move everything the writer has published into spsc->input, and return
+ * how much that was.  Loop thread only. */
+static size_t
+evbuffer_spsc_drain_(struct evbuffer_spsc *spsc)
+{
+	struct evbuffer *input = spsc->input;
+	struct evbuffer_chain *chain, *next;
+	size_t end, added = 0;
+
+	EVBUFFER_LOCK(input);
+	SPSC_LOCK(spsc);
+	for (;;) {
+		chain = spsc->head;
+		/* Once next is set, the writer is done with chain, so look
+		 * at next first. */
+		next = SPSC_LOAD(&chain->next);
+		end = SPSC_LOAD(&chain->off);
+		if (!next) {
+			/* The writer is still adding to this one: copy. */
+			if (end > spsc->head_pos) {
+				evbuffer_add(input,
+				    chain->buffer + spsc->head_pos,
+				    end - spsc->head_pos);
+				added += end - spsc->head_pos;
+				spsc->head_pos = end;
+			}
+			break;
+		}
+		if (end > spsc->head_pos) {
+			chain->misalign = spsc->head_pos;
+			chain->off = end - spsc->head_pos;
+			chain->next = NULL;
+			evbuffer_chain_insert(input, chain);
+			input->n_add_for_cb += chain->off;
+			added += chain->off;
+		} else {
+			evbuffer_chain_free(chain);
+		}
+		spsc->head = next;
+		spsc->head_pos = 0;
+	}
+	SPSC_UNLOCK(spsc);
+	evbuffer_invoke_callbacks_(input);
+	EVBUFFER_UNLOCK(input);
+	return added;
+}
+
+static void
+evbuffer_spsc_deferred_cb_(struct event_callback *cb, void *arg)
+{
+	struct evbuffer_spsc *spsc = arg;
+
+	/* Anything the writer adds after this wakes us again. */
+	SPSC_LOCK(spsc);
+	SPSC_EXCHANGE(&spsc->wake_pending, 0);
+	SPSC_UNLOCK(spsc);
+	if (evbuffer_spsc_drain_(spsc) && spsc->cb)
+		spsc->cb(spsc, spsc->input, spsc->cbarg);
+}
+
+struct evbuffer_spsc *
+evbuffer_spsc_new(struct event_base *base, evbuffer_spsc_cb cb, void *arg)
+{
+	struct evbuffer_spsc *spsc;
+
+	if (!EVTHREAD_LOCKING_ENABLED())
+		return NULL;
+	if (!(spsc = mm_calloc(1, sizeof(struct evbuffer_spsc))))
+		return NULL;
+	spsc->input = evbuffer_new();
+	spsc->head = spsc->tail = evbuffer_spsc_chain_new_(0);
+	if (!spsc->input || !spsc->head) {
+		if (spsc->input)
+			evbuffer_free(spsc->input);
+		if (spsc->head)
+			evbuffer_chain_free(spsc->head);
+		mm_free(spsc);
+		return NULL;
+	}
+#ifndef EVUTIL_HAVE_ATOMICS
+	EVTHREAD_ALLOC_LOCK(spsc->lock, 0);
+#endif
+	spsc->base = base;
+	spsc->cb = cb;
+	spsc->cbarg = arg;
+	event_deferred_cb_init_(&spsc->deferred,
+	    event_base_get_npriorities(base) / 2,
+	    evbuffer_spsc_deferred_cb_, spsc);
+	return spsc;
+}
+
+void
+evbuffer_spsc_free(struct evbuffer_spsc *spsc)
+{
+	struct evbuffer_chain *chain, *next;
+
+	event_deferred_cb_cancel_(spsc->base, &spsc->deferred);
+	for (chain = spsc->head; chain; chain = next) {
+		next = chain->next;
+		evbuffer_chain_free(chain);
+	}
+	evbuffer_free(spsc->input);
+	EVTHREAD_FREE_LOCK(spsc->lock, 0);
+	mm_free(spsc);
+}
+
+struct evbuffer *
+evbuffer_spsc_get_input(struct evbuffer_spsc *spsc)
+{
+	evbuffer_spsc_drain_(spsc);
+	return spsc->input;
+}
+
+/* Publish what the writer just added to chain, which now holds off bytes,
+ * and next, if it's starting a new chain.  Wake the reader if it isn't
+ * already awake.  Requires the writer's lock, and releases it. */
+static void
+evbuffer_spsc_publish_(struct evbuffer_spsc *spsc,
+    struct evbuffer_chain *chain, size_t off, struct evbuffer_chain *next)
+{
+	int wake;
+
+	SPSC_STORE(&chain->off, off);
+	if (next) {
+		SPSC_STORE(&chain->next, next);
+		spsc->tail = next;
+	}
+	wake = SPSC_EXCHANGE(&spsc->wake_pending, 1) == 0;
+	SPSC_UNLOCK(spsc);
+	if (wake)
+		event_callback_activate_(spsc->base, &spsc->deferred);
+}
+
+int
+evbuffer_spsc_add(struct evbuffer_spsc *spsc, const void *data_in,
+    size_t datlen)
+{
+	const unsigned char *data = data_in;
+	struct evbuffer_chain *chain, *next = NULL;
+	size_t off, space;
+
+	if (!datlen)
+		return 0;
+
+	SPSC_LOCK(spsc);
+	chain = spsc->tail;
+	off = chain->off;
+	space = chain->buffer_len - off;
+	if (datlen > space) {
+		/* Fill this chain, and start another with the rest. */
+		if (!(next = evbuffer_spsc_chain_new_(datlen - space))) {
+			SPSC_UNLOCK(spsc);
+			return -1;
+		}
+		memcpy(next->buffer, data + space, datlen - space);
+		next->off = datlen - space;
+		datlen = space;
+	}
+	memcpy(chain->buffer + off, data, datlen);
+	evbuffer_spsc_publish_(spsc, chain, off + datlen, next);
+	return 0;
+}
+
+int
+evbuffer_spsc_add_vprintf(struct evbuffer_spsc *spsc, const char *fmt,
+    va_list ap)
+{
+	struct evbuffer_chain *chain, *next = NULL;
+	size_t off, space;
+	va_list aq;
+	char scratch[1];
+	int sz;
+
+	SPSC_LOCK(spsc);
+	chain = spsc->tail;
+	off = chain->off;
+	space = chain->buffer_len - off;
+
+	/* Format straight into the chain: the reader doesn't look past what
+	 * we've published, so it's fine if this doesn't fit.  With no room at
+	 * all, evutil_vsnprintf() wouldn't tell us how much we need. */
+	va_copy(aq, ap);
+	if (space)
+		sz = evutil_vsnprintf((char *)chain->buffer + off, space,
+		    fmt, aq);
+	else
+		sz = evutil_vsnprintf(scratch, sizeof(scratch), fmt, aq);
+	va_end(aq);
+	if (sz < 0)
+		goto err;
+	if ((size_t)sz >= space) {
+		if (!(next = evbuffer_spsc_chain_new_((size_t)sz + 1)))
+			goto err;
+		va_copy(aq, ap);
+		evutil_vsnprintf((char *)next->buffer, (size_t)sz + 1, fmt, aq);
+		va_end(aq);
+		next->off = sz;
+	} else {
+		off += sz;
+	}
+	evbuffer_spsc_publish_(spsc, chain, off, next);
+	return sz;
+err:
+	SPSC_UNLOCK(spsc);
+	return -1;
+}
+
+int
+evbuffer_spsc_add_printf(struct evbuffer_spsc *spsc, const char *fmt, ...)
+{
+	int res;
+	va_list ap;
+
+	va_start(ap, fmt);
+	res = evbuffer_spsc_add_vprintf(spsc, fmt, ap);
+	va_end(ap);
+
+	return (res);
+}
+
 int
 evbuffer_setcb(struct evbuffer *buffer, evbuffer_cb cb, void *cbarg)
 {
@@ -73,6 +73,16 @@ extern "C" {
 /* On a base bufferevent, for reading: used when a filter has choked this
  * (underlying) bufferevent because it has stopped reading from it. */
 #define BEV_SUSPEND_FILT_READ 0x10
+/* On a bufferevent that forwards to another: used when the other one has
+ * as much data waiting to be written as we let it have. */
+#define BEV_SUSPEND_FORWARD 0x20
+/* On a base bufferevent, for reading: used when the bufferevents on our
+ * event_base hold more than their hard memory limit, and we are one of the
+ * biggest. */
+#define BEV_SUSPEND_MEM 0x40
+/* On a socket bufferevent, for writing: used while the next part of a file
+ * segment that we're writing is being read in off the loop thread. */
+#define BEV_SUSPEND_FILE 0x80
 
 typedef ev_uint16_t bufferevent_suspend_flags;
 
@@ -172,6 +182,9 @@ struct bufferevent_private {
 	/** Flag: set if a connect failed prematurely; this is a hack for
 	 * getting around the bufferevent abstraction. */
 	unsigned connection_refused : 1;
+	/** Flag: set if bufferevent_socket_set_batch_writes() asked us to
+	 * write once per loop iteration. */
+	unsigned batch_writes : 1;
 	/** Set to the events pending if we have deferred callbacks and
 	 * an events callback is pending. */
 	short eventcb_pending;
@@ -230,6 +243,136 @@ struct bufferevent_private {
 	} conn_address;
 
 	struct evdns_getaddrinfo_request *dns_request;
+
+	/** Hash of the name given to bufferevent_socket_connect_hostname,
+	 * used to remember which address worked for it last time. */
+	ev_uint32_t connect_host_hash;
+
+	/** Connection attempts racing to become our socket, if a name
+	 * resolved to more than one address. */
+	struct bufferevent_connect_race *connect_race;
+
+	/** Where bufferevent_forward() sends what we read, if anywhere. */
+	struct bufferevent_forward *forward_out;
+	/** What bufferevent_forward() sends us, if anything. */
+	struct bufferevent_forward *forward_in;
+
+	/** State for bufferevent_socket_set_zerocopy(), if it was ever
+	 * called. */
+	struct bufferevent_zerocopy *zerocopy;
+
+	/** The memory accounting of our event_base, if it has any. */
+	struct bufferevent_mem_accounting *mem;
+	/** Our place in mem->members. */
+	LIST_ENTRY(bufferevent_private) mem_next;
+	/** Bytes in our input and output buffers, as last accounted. */
+	size_t mem_bytes;
+	/** The part of mem_bytes that's in our input buffer. */
+	size_t mem_in_bytes;
+	/** True iff mem wants our reading suspended with BEV_SUSPEND_MEM. */
+	unsigned mem_suspend : 1;
+};
+
+/** Memory accounting for the bufferevents on an event_base; see
+ * bufferevent_base_set_mem_limits().
+ *
+ * Each bufferevent's buffers report changes in their length as they
+ * happen, under the bufferevent's lock and then ours.  When the total
+ * crosses a limit, check_cb runs from the event loop to suspend or resume
+ * reading, and to tell the user.  Since our lock nests inside the
+ * bufferevent locks, check_cb only ever tries to lock a bufferevent; one
+ * that it can't lock catches up the next time its buffers change, or when
+ * check_cb tries again.
+ */
+struct bufferevent_mem_accounting {
+	struct event_base *base;
+	/** The bufferevents being accounted. */
+	LIST_HEAD(bufferevent_mem_members, bufferevent_private) members;
+	/** Bytes in all their input and output buffers. */
+	size_t total;
+	size_t soft_limit;
+	size_t hard_limit;
+	bufferevent_mem_cb cb;
+	void *cbarg;
+	/** The BEV_MEM_* level that check_cb last acted on. */
+	int level;
+	/** True iff check_cb is scheduled. */
+	unsigned check_pending : 1;
+	/** True iff check_cb couldn't lock some bufferevent last time. */
+	unsigned retry : 1;
+	struct event_callback check_cb;
+	void *lock;
+};
+
+/** How often a socket bufferevent with nothing left to write looks for the
+ * kernel to finish with its zero-copy sends. */
+#define BEV_ZEROCOPY_REAP_MSEC 10
+/** How long we keep the socket and memory of a freed bufferevent around for
+ * the kernel to finish with its zero-copy sends. */
+#define BEV_ZEROCOPY_LINGER_MSEC 30000
+
+/** State for a socket bufferevent that sends big writes with MSG_ZEROCOPY.
+ * Protected by the bufferevent's lock. */
+struct bufferevent_zerocopy {
+	/** Writes at least this big go out without copying; 0 if none do. */
+	size_t min_bytes;
+	/** True iff we have set SO_ZEROCOPY on the current fd. */
+	unsigned enabled : 1;
+	/** True iff setting SO_ZEROCOPY on the current fd didn't work. */
+	unsigned failed : 1;
+	/** The number that the kernel will give our next send. */
+	ev_uint32_t next_id;
+	/** Sends that the kernel isn't done with yet, oldest first. */
+	struct evbuffer_zerocopy_send *pending;
+	/** Where to link the next send in pending. */
+	struct evbuffer_zerocopy_send **pending_tail;
+	/** How many sends are in pending. */
+	int n_pending;
+	/** Timer to look for the kernel's notifications when neither of the
+	 * bufferevent's own events would wake us for them. */
+	struct event reap_ev;
+	/** Once the bufferevent is freed: the socket we're still waiting on,
+	 * and how many more times reap_ev will look at it. */
+	evutil_socket_t linger_fd;
+	int linger_ticks;
+	/** Once the bufferevent is freed: the base whose zerocopy_lingering
+	 * list we're on, and our place in it.  Protected by the base's
+	 * lock. */
+	struct event_base *linger_base;
+	LIST_ENTRY(bufferevent_zerocopy) linger_next;
+};
+
+/** Most data we let a forwarded-to bufferevent have waiting to be written,
+ * unless its write high-watermark says otherwise.  Also the most we put in
+ * a pipe at once, which is the default pipe capacity on Linux. */
+#define BEV_FORWARD_MAX 65536
+
+/** State for bufferevent_forward(): data that src reads goes to dst.
+ *
+ * Everything but src and dst is protected by dst's lock.  dst's side only
+ * ever gets src going again through resume_ev.  Since two bufferevents can
+ * forward to each other, callbacks that hold one end's lock only try to
+ * take the other's, and leave the work to resume_ev if they can't; the
+ * functions that set up and tear down a forward take both locks in address
+ * order. */
+struct bufferevent_forward {
+	struct bufferevent *src;
+	struct bufferevent *dst;
+	/** Callback on src's input, to copy it to dst's output; NULL when we
+	 * splice. */
+	struct evbuffer_cb_entry *input_cb;
+	/** Callback on dst's output, to notice it draining. */
+	struct evbuffer_cb_entry *output_cb;
+	/** Lets src read again once dst has caught up. */
+	struct event resume_ev;
+	/** Pipe that data moves through with splice(), or -1s if we copy. */
+	evutil_socket_t pipe[2];
+	/** Number of bytes in the pipe. */
+	size_t pipe_bytes;
+	/** Most bytes the pipe can hold. */
+	size_t pipe_size;
+	/** True if we've suspended reading on src until dst catches up. */
+	unsigned src_waiting : 1;
 };
 
 /** Possible operations for a control callback. */
@@ -367,6 +510,14 @@ void bufferevent_unsuspend_write_(struct bufferevent *bufev, bufferevent_suspend
 EVENT2_EXPORT_SYMBOL
 int bufferevent_disable_hard_(struct bufferevent *bufev, short event);
 
+/** Internal: Update the memory accounting of bev, which has it, for a
+ * change in the length of buf, which is one of its buffers.  Requires
+ * lock. */
+void bufferevent_mem_changed_(struct bufferevent *bev, struct evbuffer *buf);
+/** Internal: Move bev's memory accounting over to 'base'.  Requires
+ * lock. */
+void bufferevent_mem_rebase_(struct bufferevent *bev, struct event_base *base);
+
 /** Internal: Set up locking on a bufferevent.  If lock is set, use it.
  * Otherwise, use a new lock. */
 EVENT2_EXPORT_SYMBOL
@@ -421,6 +572,28 @@ bufferevent_trigger_nolock_(struct bufferevent *bufev, short iotype, int options
 		bufferevent_run_writecb_(bufev, options);
 }
 
+/** Internal: Return how many more bytes a forward may send to its dst before
+ * src has to wait.  Must hold dst's lock. */
+size_t bufferevent_forward_room_(struct bufferevent_forward *f);
+/** Internal: Suspend reading on a forward's src until its dst has caught
+ * up.  Must hold both locks. */
+void bufferevent_forward_pause_(struct bufferevent_forward *f);
+/** Internal: Suspend reading on a forward's src if its dst has no room.
+ * Must hold both locks. */
+void bufferevent_forward_pause_if_full_(struct bufferevent_forward *f);
+/** Internal: Let a forward's src read again if its dst has room.  Must hold
+ * dst's lock. */
+void bufferevent_forward_wake_(struct bufferevent_forward *f);
+/** Internal: Set up a pipe so that a forward can splice() data from one
+ * socket to the other.  Returns -1 if we can't, and the forward should
+ * copy instead.  Must hold both locks. */
+int bufferevent_forward_splice_setup_(struct bufferevent_forward *f);
+/** Internal: Move whatever is in a forward's pipe to its dst's output
+ * buffer, and close the pipe.  Must hold dst's lock. */
+void bufferevent_forward_splice_free_(struct bufferevent_forward *f);
+/** Internal: Stop a forward and free it.  Must hold both locks. */
+void bufferevent_forward_detach_(struct bufferevent_forward *f);
+
 /** Internal: Add the event 'ev' with timeout tv, unless tv is set to 0, in
  * which case add ev with no timeout. */
 EVENT2_EXPORT_SYMBOL
@@ -487,6 +660,7 @@ bufferevent_socket_set_conn_address_(struct bufferevent *bev, struct sockaddr *a
 #ifdef EVENT__DISABLE_THREAD_SUPPORT
 #define BEV_LOCK(b) (void)(b)
 #define BEV_UNLOCK(b) (void)(b)
+#define BEV_TRYLOCK(b) ((void)(b), 1)
 #else
 /** Internal: Grab the lock (if any) on a bufferevent */
 #define BEV_LOCK(b) do {						\
@@ -499,6 +673,10 @@ bufferevent_socket_set_conn_address_(struct bufferevent *bev, struct sockaddr *a
 		struct bufferevent_private *locking =  BEV_UPCAST(b);	\
 		EVLOCK_UNLOCK(locking->lock, 0);			\
 	} while (0)
+
+/** Internal: Grab the lock (if any) on a bufferevent if nobody else has it.
+ * Return true if we got it. */
+#define BEV_TRYLOCK(b) EVLOCK_TRY_LOCK_(BEV_UPCAST(b)->lock)
 #endif
 
 
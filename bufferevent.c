@@ -62,6 +62,9 @@
 
 static void bufferevent_cancel_all_(struct bufferevent *bev);
 static void bufferevent_finalize_cb_(struct event_callback *evcb, void *arg_);
+static void bufferevent_mem_join_(struct bufferevent_private *bevp,
+    struct bufferevent_mem_accounting *m);
+static void bufferevent_mem_leave_(struct bufferevent_private *bevp);
 
 void
 bufferevent_suspend_read_(struct bufferevent *bufev, bufferevent_suspend_flags what)
@@ -242,7 +245,7 @@ bufferevent_run_readcb_(struct bufferevent *bufev, int options)
 {
 	/* Requires that we hold the lock and a reference */
 	struct bufferevent_private *p = BEV_UPCAST(bufev);
-	if (bufev->readcb == NULL)
+	if (bufev->readcb == NULL || p->forward_out)
 		return;
 	if ((p->options|options) & BEV_OPT_DEFER_CALLBACKS) {
 		p->readcb_pending = 1;
@@ -305,6 +308,201 @@ bufferevent_trigger_event(struct bufferevent *bufev, short what, int options)
 	bufferevent_decref_and_unlock_(bufev);
 }
 
+size_t
+bufferevent_forward_room_(struct bufferevent_forward *f)
+{
+	struct bufferevent *dst = f->dst;
+	size_t limit = dst->wm_write.high ? dst->wm_write.high : BEV_FORWARD_MAX;
+	size_t used = f->pipe_bytes + evbuffer_get_length(dst->output);
+
+	/* Whatever we splice has to fit in the pipe. */
+	if (f->pipe[0] >= 0 && limit > f->pipe_size)
+		limit = f->pipe_size;
+	return used < limit ? limit - used : 0;
+}
+
+void
+bufferevent_forward_pause_(struct bufferevent_forward *f)
+{
+	if (!f->src_waiting) {
+		f->src_waiting = 1;
+		bufferevent_suspend_read_(f->src, BEV_SUSPEND_FORWARD);
+	}
+}
+
+void
+bufferevent_forward_pause_if_full_(struct bufferevent_forward *f)
+{
+	if (!bufferevent_forward_room_(f))
+		bufferevent_forward_pause_(f);
+}
+
+void
+bufferevent_forward_wake_(struct bufferevent_forward *f)
+{
+	if (f->src_waiting && bufferevent_forward_room_(f)) {
+		f->src_waiting = 0;
+		event_active(&f->resume_ev, EV_TIMEOUT, 1);
+	}
+}
+
+static void
+bufferevent_forward_resume_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct bufferevent_forward *f = arg;
+	struct bufferevent *src = f->src;
+	int waiting;
+
+	bufferevent_incref_and_lock_(src);
+	if (!BEV_TRYLOCK(f->dst)) {
+		/* dst's side has the lock, and may want src's: let it. */
+		event_active(&f->resume_ev, EV_TIMEOUT, 1);
+		goto done;
+	}
+	/* Pass on whatever bufferevent_forward_input_cb had to leave. */
+	if (f->input_cb && evbuffer_get_length(src->input)) {
+		evbuffer_add_buffer(f->dst->output, src->input);
+		bufferevent_forward_pause_if_full_(f);
+	}
+	/* src may have filled dst up again since we were activated. */
+	waiting = f->src_waiting;
+	BEV_UNLOCK(f->dst);
+	if (!waiting)
+		bufferevent_unsuspend_read_(src, BEV_SUSPEND_FORWARD);
+done:
+	bufferevent_decref_and_unlock_(src);
+}
+
+static void
+bufferevent_forward_input_cb(struct evbuffer *buf,
+    const struct evbuffer_cb_info *info, void *arg)
+{
+	struct bufferevent_forward *f = arg;
+
+	if (!info->n_added)
+		return;
+	if (!BEV_TRYLOCK(f->dst)) {
+		event_active(&f->resume_ev, EV_TIMEOUT, 1);
+		return;
+	}
+	evbuffer_add_buffer(f->dst->output, buf);
+	bufferevent_forward_pause_if_full_(f);
+	BEV_UNLOCK(f->dst);
+}
+
+static void
+bufferevent_forward_output_cb(struct evbuffer *buf,
+    const struct evbuffer_cb_info *info, void *arg)
+{
+	if (info->n_deleted)
+		bufferevent_forward_wake_(arg);
+}
+
+/* Take the locks on both ends of a forward, lower address first. */
+static void
+bufferevent_forward_lock_both_(struct bufferevent *a, struct bufferevent *b)
+{
+	if ((ev_uintptr_t)a > (ev_uintptr_t)b) {
+		struct bufferevent *t = a;
+		a = b;
+		b = t;
+	}
+	BEV_LOCK(a);
+	BEV_LOCK(b);
+}
+
+void
+bufferevent_forward_detach_(struct bufferevent_forward *f)
+{
+	struct bufferevent *src = f->src, *dst = f->dst;
+
+	bufferevent_forward_splice_free_(f);
+	if (f->input_cb)
+		evbuffer_remove_cb_entry(src->input, f->input_cb);
+	evbuffer_remove_cb_entry(dst->output, f->output_cb);
+	BEV_UPCAST(dst)->forward_in = NULL;
+	BEV_UPCAST(src)->forward_out = NULL;
+	event_del(&f->resume_ev);
+	event_debug_unassign(&f->resume_ev);
+	bufferevent_unsuspend_read_(src, BEV_SUSPEND_FORWARD);
+	mm_free(f);
+}
+
+/* Stop forwarding what src reads, if we were. */
+static void
+bufferevent_forward_stop_(struct bufferevent *src)
+{
+	struct bufferevent_private *src_p = BEV_UPCAST(src);
+	struct bufferevent *dst;
+
+	BEV_LOCK(src);
+	while (src_p->forward_out) {
+		dst = src_p->forward_out->dst;
+		BEV_UNLOCK(src);
+		bufferevent_forward_lock_both_(src, dst);
+		/* It may have changed while we didn't hold src's lock. */
+		if (src_p->forward_out && src_p->forward_out->dst == dst)
+			bufferevent_forward_detach_(src_p->forward_out);
+		BEV_UNLOCK(dst);
+	}
+	BEV_UNLOCK(src);
+}
+
+int
+bufferevent_forward(struct bufferevent *src, struct bufferevent *dst)
+{
+	struct bufferevent_private *src_p = BEV_UPCAST(src);
+	struct bufferevent_forward *f;
+	int r = -1;
+
+	bufferevent_forward_stop_(src);
+	if (!dst)
+		return 0;
+	if (dst == src)
+		return -1;
+
+	if (!(f = mm_calloc(1, sizeof(*f))))
+		return -1;
+	f->src = src;
+	f->dst = dst;
+	f->pipe[0] = f->pipe[1] = -1;
+	event_assign(&f->resume_ev, src->ev_base, -1, 0,
+	    bufferevent_forward_resume_cb, f);
+
+	bufferevent_forward_lock_both_(src, dst);
+	if (BEV_UPCAST(dst)->forward_in)
+		goto done;
+	if (bufferevent_forward_splice_setup_(f) < 0) {
+		f->input_cb = evbuffer_add_cb(src->input,
+		    bufferevent_forward_input_cb, f);
+		if (!f->input_cb)
+			goto done;
+	}
+	f->output_cb = evbuffer_add_cb(dst->output,
+	    bufferevent_forward_output_cb, f);
+	if (!f->output_cb)
+		goto done;
+
+	src_p->forward_out = f;
+	BEV_UPCAST(dst)->forward_in = f;
+	/* Whatever src has read already goes first. */
+	evbuffer_add_buffer(dst->output, src->input);
+	bufferevent_forward_pause_if_full_(f);
+	r = 0;
+
+done:
+	if (r < 0) {
+		bufferevent_forward_splice_free_(f);
+		if (f->input_cb)
+			evbuffer_remove_cb_entry(src->input, f->input_cb);
+		event_debug_unassign(&f->resume_ev);
+		mm_free(f);
+	}
+	BEV_UNLOCK(dst);
+	BEV_UNLOCK(src);
+	return r;
+}
+
 int
 bufferevent_init_common_(struct bufferevent_private *bufev_private,
     struct event_base *base,
@@ -371,6 +569,13 @@ bufferevent_init_common_(struct bufferevent_private *bufev_private,
 	evbuffer_set_parent_(bufev->input, bufev);
 	evbuffer_set_parent_(bufev->output, bufev);
 
+	if (base && base->chain_pool) {
+		evbuffer_set_chain_pool(bufev->input, base);
+		evbuffer_set_chain_pool(bufev->output, base);
+	}
+	if (base && base->bev_mem)
+		bufferevent_mem_join_(bufev_private, base->bev_mem);
+
 	return 0;
 
 err:
@@ -725,6 +930,8 @@ bufferevent_decref_and_unlock_(struct bufferevent *bufev)
 	if (bufev->be_ops->unlink)
 		bufev->be_ops->unlink(bufev);
 
+	bufferevent_mem_leave_(bufev_private);
+
 	/* Okay, we're out of references. Let's finalize this once all the
 	 * callbacks are done running. */
 	cbs[0] = &bufev->ev_read.ev_evcallback;
@@ -736,6 +943,8 @@ bufferevent_decref_and_unlock_(struct bufferevent *bufev)
 		if (event_initialized(e))
 			cbs[n_cbs++] = &e->ev_evcallback;
 	}
+	if (bufev_private->zerocopy)
+		cbs[n_cbs++] = &bufev_private->zerocopy->reap_ev.ev_evcallback;
 	n_cbs += evbuffer_get_callbacks_(bufev->input, cbs+n_cbs, MAX_CBS-n_cbs);
 	n_cbs += evbuffer_get_callbacks_(bufev->output, cbs+n_cbs, MAX_CBS-n_cbs);
 
@@ -810,9 +1019,18 @@ bufferevent_decref(struct bufferevent *bufev)
 void
 bufferevent_free(struct bufferevent *bufev)
 {
+	struct bufferevent_forward *f = BEV_UPCAST(bufev)->forward_in;
+
+	bufferevent_forward_stop_(bufev);
+	if (f)
+		bufferevent_forward_stop_(f->src);
+
 	BEV_LOCK(bufev);
 	bufferevent_setcb(bufev, NULL, NULL, NULL, NULL);
 	bufferevent_cancel_all_(bufev);
+	/* A pending compaction would keep us around. */
+	evbuffer_set_compaction(bufev->input, NULL, NULL);
+	evbuffer_set_compaction(bufev->output, NULL, NULL);
 	bufferevent_decref_and_unlock_(bufev);
 }
 
@@ -1067,3 +1285,347 @@ bufferevent_unlock(struct bufferevent *bev)
 {
 	bufferevent_decref_and_unlock_(bev);
 }
+
+#define LOCK_MEM(m) EVLOCK_LOCK((m)->lock, 0)
+#define UNLOCK_MEM(m) EVLOCK_UNLOCK((m)->lock, 0)
+
+/** Return the BEV_MEM_* level that m's total puts it at.  Once over the
+ * hard limit, we stay at BEV_MEM_HARD until we're back within the soft
+ * one.  Requires m's lock. */
+static int
+bufferevent_mem_level_(const struct bufferevent_mem_accounting *m)
+{
+	if (m->hard_limit && m->total > m->hard_limit)
+		return BEV_MEM_HARD;
+	if (m->soft_limit && m->total > m->soft_limit)
+		return m->level == BEV_MEM_HARD ? BEV_MEM_HARD : BEV_MEM_SOFT;
+	return BEV_MEM_OK;
+}
+
+/** Make sure that m's check_cb will run.  Requires m's lock. */
+static void
+bufferevent_mem_schedule_check_(struct bufferevent_mem_accounting *m)
+{
+	if (!m->check_pending) {
+		m->check_pending = 1;
+		event_deferred_cb_schedule_(m->base, &m->check_cb);
+	}
+}
+
+/** Suspend or resume reading on bevp, as its accounting wants.  Requires
+ * bevp's lock and its accounting's lock. */
+static void
+bufferevent_mem_apply_(struct bufferevent_private *bevp)
+{
+	if (bevp->mem_suspend) {
+		if (!(bevp->read_suspended & BEV_SUSPEND_MEM))
+			bufferevent_suspend_read_(&bevp->bev, BEV_SUSPEND_MEM);
+	} else {
+		if (bevp->read_suspended & BEV_SUSPEND_MEM)
+			bufferevent_unsuspend_read_(&bevp->bev,
+			    BEV_SUSPEND_MEM);
+	}
+}
+
+static int
+bufferevent_mem_cmp_(const void *a_, const void *b_)
+{
+	const struct bufferevent_private *a =
+	    *(struct bufferevent_private * const *)a_;
+	const struct bufferevent_private *b =
+	    *(struct bufferevent_private * const *)b_;
+
+	if (a->mem_in_bytes > b->mem_in_bytes)
+		return -1;
+	if (a->mem_in_bytes < b->mem_in_bytes)
+		return 1;
+	return 0;
+}
+
+/** Over the hard limit: suspend reading on the bufferevents that are still
+ * reading and have the most input, until the total less their input is no
+ * more than the soft limit.  Output doesn't count: suspending a
+ * bufferevent's reading doesn't keep its output from growing.  Return how
+ * many we picked, or -1 if we couldn't pick them.  Requires m's lock. */
+static int
+bufferevent_mem_pick_suspended_(struct bufferevent_mem_accounting *m)
+{
+	struct bufferevent_private *bevp, **sorted;
+	size_t remaining = m->total;
+	int i, n = 0, picked = 0;
+
+	LIST_FOREACH(bevp, &m->members, mem_next) {
+		if (bevp->mem_suspend)
+			remaining -= bevp->mem_in_bytes < remaining ?
+			    bevp->mem_in_bytes : remaining;
+		else if (bevp->mem_in_bytes)
+			++n;
+	}
+	if (remaining <= m->soft_limit || !n)
+		return 0;
+
+	sorted = mm_calloc(n, sizeof(*sorted));
+	if (!sorted)
+		return -1;
+	i = 0;
+	LIST_FOREACH(bevp, &m->members, mem_next) {
+		if (!bevp->mem_suspend && bevp->mem_in_bytes)
+			sorted[i++] = bevp;
+	}
+	qsort(sorted, n, sizeof(*sorted), bufferevent_mem_cmp_);
+	for (i = 0; i < n && remaining > m->soft_limit; ++i) {
+		sorted[i]->mem_suspend = 1;
+		remaining -= sorted[i]->mem_in_bytes < remaining ?
+		    sorted[i]->mem_in_bytes : remaining;
+		++picked;
+	}
+	mm_free(sorted);
+	return picked;
+}
+
+static void
+bufferevent_mem_check_cb_(struct event_callback *cb, void *arg)
+{
+	struct bufferevent_mem_accounting *m = arg;
+	struct bufferevent_private *bevp;
+	bufferevent_mem_cb user_cb = NULL;
+	void *cbarg = NULL;
+	size_t total;
+	int level, old_level, picked = 0;
+
+	LOCK_MEM(m);
+	m->check_pending = 0;
+	old_level = m->level;
+	level = bufferevent_mem_level_(m);
+	total = m->total;
+
+	if (level == BEV_MEM_HARD) {
+		if (m->total > m->hard_limit &&
+		    (picked = bufferevent_mem_pick_suspended_(m)) < 0)
+			m->retry = 1;
+	} else if (old_level == BEV_MEM_HARD) {
+		LIST_FOREACH(bevp, &m->members, mem_next)
+			bevp->mem_suspend = 0;
+	}
+
+	if (level != old_level || m->retry || picked > 0) {
+		/* As with rate-limit groups, we only try to lock each
+		 * bufferevent, to avoid a deadlock.  One that we miss catches
+		 * up the next time its buffers change, or when we retry. */
+		m->retry = 0;
+		LIST_FOREACH(bevp, &m->members, mem_next) {
+			if (EVLOCK_TRY_LOCK_(bevp->lock)) {
+				bufferevent_mem_apply_(bevp);
+				EVLOCK_UNLOCK(bevp->lock, 0);
+			} else {
+				m->retry = 1;
+			}
+		}
+		if (m->retry)
+			bufferevent_mem_schedule_check_(m);
+	}
+
+	if (level != old_level) {
+		m->level = level;
+		user_cb = m->cb;
+		cbarg = m->cbarg;
+	}
+	UNLOCK_MEM(m);
+
+	if (user_cb)
+		user_cb(m->base, level, total, cbarg);
+}
+
+void
+bufferevent_mem_changed_(struct bufferevent *bev, struct evbuffer *buf)
+{
+	struct bufferevent_private *bevp = BEV_UPCAST(bev);
+	struct bufferevent_mem_accounting *m = bevp->mem;
+	size_t len = buf->total_len;
+	int grew = len > buf->accounted_len;
+
+	LOCK_MEM(m);
+	m->total += len - buf->accounted_len;
+	bevp->mem_bytes += len - buf->accounted_len;
+	if (buf == bev->input)
+		bevp->mem_in_bytes = len;
+	buf->accounted_len = len;
+
+	if (bufferevent_mem_level_(m) != m->level ||
+	    (grew && m->hard_limit && m->total > m->hard_limit))
+		bufferevent_mem_schedule_check_(m);
+	bufferevent_mem_apply_(bevp);
+	UNLOCK_MEM(m);
+}
+
+/** Start accounting for bevp on m.  Requires bevp's lock. */
+static void
+bufferevent_mem_join_(struct bufferevent_private *bevp,
+    struct bufferevent_mem_accounting *m)
+{
+	struct bufferevent *bev = &bevp->bev;
+
+	LOCK_MEM(m);
+	bevp->mem = m;
+	LIST_INSERT_HEAD(&m->members, bevp, mem_next);
+	bev->input->accounted_len = bev->input->total_len;
+	bev->output->accounted_len = bev->output->total_len;
+	bevp->mem_bytes = bev->input->total_len + bev->output->total_len;
+	bevp->mem_in_bytes = bev->input->total_len;
+	bevp->mem_suspend = 0;
+	m->total += bevp->mem_bytes;
+	if (bufferevent_mem_level_(m) != m->level)
+		bufferevent_mem_schedule_check_(m);
+	UNLOCK_MEM(m);
+}
+
+/** Stop accounting for bevp, if we were.  Requires bevp's lock. */
+static void
+bufferevent_mem_leave_(struct bufferevent_private *bevp)
+{
+	struct bufferevent_mem_accounting *m = bevp->mem;
+	struct bufferevent *bev = &bevp->bev;
+
+	if (!m)
+		return;
+	LOCK_MEM(m);
+	LIST_REMOVE(bevp, mem_next);
+	m->total -= bevp->mem_bytes;
+	bevp->mem_bytes = 0;
+	bevp->mem_in_bytes = 0;
+	bevp->mem_suspend = 0;
+	bev->input->accounted_len = 0;
+	bev->output->accounted_len = 0;
+	bevp->mem = NULL;
+	if (bufferevent_mem_level_(m) != m->level)
+		bufferevent_mem_schedule_check_(m);
+	UNLOCK_MEM(m);
+}
+
+void
+bufferevent_mem_rebase_(struct bufferevent *bev, struct event_base *base)
+{
+	struct bufferevent_private *bevp = BEV_UPCAST(bev);
+
+	if (bevp->mem && bevp->mem->base == base)
+		return;
+	bufferevent_mem_leave_(bevp);
+	if (bevp->read_suspended & BEV_SUSPEND_MEM)
+		bufferevent_unsuspend_read_(bev, BEV_SUSPEND_MEM);
+	if (base && base->bev_mem)
+		bufferevent_mem_join_(bevp, base->bev_mem);
+}
+
+int
+bufferevent_base_set_mem_limits(struct event_base *base,
+    size_t soft_limit, size_t hard_limit, bufferevent_mem_cb cb, void *ctx)
+{
+	struct bufferevent_mem_accounting *m;
+	int priority = event_base_get_npriorities(base) / 2;
+
+	if (hard_limit && soft_limit > hard_limit)
+		return -1;
+	if (!soft_limit)
+		soft_limit = hard_limit;
+
+	EVBASE_ACQUIRE_LOCK(base, th_base_lock);
+	m = base->bev_mem;
+	if (!m) {
+		m = mm_calloc(1, sizeof(*m));
+		if (!m) {
+			EVBASE_RELEASE_LOCK(base, th_base_lock);
+			return -1;
+		}
+		m->base = base;
+		LIST_INIT(&m->members);
+		EVTHREAD_ALLOC_LOCK(m->lock, EVTHREAD_LOCKTYPE_RECURSIVE);
+		event_deferred_cb_init_(&m->check_cb, priority,
+		    bufferevent_mem_check_cb_, m);
+		base->bev_mem = m;
+	}
+	EVBASE_RELEASE_LOCK(base, th_base_lock);
+
+	LOCK_MEM(m);
+	m->soft_limit = soft_limit;
+	m->hard_limit = hard_limit;
+	m->cb = cb;
+	m->cbarg = ctx;
+	/* Let check_cb re-pick which bufferevents to suspend. */
+	bufferevent_mem_schedule_check_(m);
+	UNLOCK_MEM(m);
+	return 0;
+}
+
+void
+bufferevent_mem_accounting_free_(struct bufferevent_mem_accounting *m)
+{
+	struct bufferevent_private *bevp;
+
+	/* The base is going away, so check_cb won't run again; whatever
+	 * bufferevents are left just stop being accounted. */
+	while ((bevp = LIST_FIRST(&m->members)) != NULL) {
+		LIST_REMOVE(bevp, mem_next);
+		bevp->mem = NULL;
+	}
+	EVTHREAD_FREE_LOCK(m->lock, EVTHREAD_LOCKTYPE_RECURSIVE);
+	mm_free(m);
+}
+
+size_t
+bufferevent_base_get_mem(struct event_base *base)
+{
+	struct bufferevent_mem_accounting *m = base->bev_mem;
+	size_t total;
+
+	if (!m)
+		return 0;
+	LOCK_MEM(m);
+	total = m->total;
+	UNLOCK_MEM(m);
+	return total;
+}
+
+size_t
+bufferevent_get_mem(struct bufferevent *bufev)
+{
+	size_t total;
+
+	BEV_LOCK(bufev);
+	total = evbuffer_get_length(bufev->input) +
+	    evbuffer_get_length(bufev->output);
+	BEV_UNLOCK(bufev);
+	return total;
+}
+
+int
+bufferevent_base_get_top_mem(struct event_base *base,
+    struct bufferevent **bevs, size_t *bytes, int n)
+{
+	struct bufferevent_mem_accounting *m = base->bev_mem;
+	struct bufferevent_private *bevp;
+	int i, found = 0;
+
+	if (!m || n <= 0)
+		return 0;
+	LOCK_MEM(m);
+	LIST_FOREACH(bevp, &m->members, mem_next) {
+		/* Insertion sort into the n biggest so far. */
+		for (i = found; i > 0; --i) {
+			if (BEV_UPCAST(bevs[i-1])->mem_bytes >= bevp->mem_bytes)
+				break;
+			if (i < n)
+				bevs[i] = bevs[i-1];
+		}
+		if (i < n) {
+			bevs[i] = &bevp->bev;
+			if (found < n)
+				++found;
+		}
+	}
+	if (bytes) {
+		for (i = 0; i < found; ++i)
+			bytes[i] = BEV_UPCAST(bevs[i])->mem_bytes;
+	}
+	UNLOCK_MEM(m);
+	return found;
+}
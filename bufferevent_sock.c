@@ -45,6 +45,9 @@
 #ifdef EVENT__HAVE_UNISTD_H
 #include <unistd.h>
 #endif
+#ifdef EVENT__HAVE_SPLICE
+#include <fcntl.h>
+#endif
 
 #ifdef _WIN32
 #include <winsock2.h>
@@ -60,21 +63,34 @@
 #ifdef EVENT__HAVE_NETINET_IN6_H
 #include <netinet/in6.h>
 #endif
+#if defined(EVENT__HAVE_LINUX_ERRQUEUE_H) && defined(MSG_ZEROCOPY) && \
+    defined(SO_ZEROCOPY) && defined(EVENT__HAVE_SYS_UIO_H)
+#include <linux/errqueue.h>
+#define USE_ZEROCOPY
+#endif
 
 #include "event2/util.h"
 #include "event2/bufferevent.h"
 #include "event2/buffer.h"
+#include "event2/buffer_compat.h"
 #include "event2/bufferevent_struct.h"
 #include "event2/bufferevent_compat.h"
 #include "event2/event.h"
+#include "event-internal.h"
 #include "log-internal.h"
 #include "mm-internal.h"
 #include "bufferevent-internal.h"
+#include "evbuffer-internal.h"
 #include "util-internal.h"
 #ifdef _WIN32
 #include "iocp-internal.h"
 #endif
 
+/* Number of bytes that a forward to this bufferevent has waiting for it in
+ * a pipe. */
+#define BEV_FORWARD_PIPE_BYTES(bevp)					\
+	((bevp)->forward_in ? (bevp)->forward_in->pipe_bytes : 0)
+
 /* prototypes */
 static int be_socket_enable(struct bufferevent *, short);
 static int be_socket_disable(struct bufferevent *, short);
@@ -125,6 +141,36 @@ bufferevent_socket_set_conn_address_(struct bufferevent *bev,
 	memcpy(&bev_p->conn_address, addr, addrlen);
 }
 
+/* Start writing on bufev.  With batched writes, we run the write callback
+ * in the next loop iteration, once everything that this one wants to write
+ * is in the output buffer; otherwise, or if we're already waiting for the
+ * socket, we wait for it to be writable. */
+static int
+bufferevent_socket_schedule_write(struct bufferevent *bufev)
+{
+	struct bufferevent_private *bufev_p = BEV_UPCAST(bufev);
+
+	if (bufev_p->batch_writes && !bufev_p->connecting &&
+	    !event_pending(&bufev->ev_write, EV_WRITE, NULL)) {
+		event_active_later_(&bufev->ev_write, EV_WRITE);
+		return 0;
+	}
+	return bufferevent_add_event_(&bufev->ev_write, &bufev->timeout_write);
+}
+
+/* Return true if a batched write left output behind, and nothing (like the
+ * rate limiter suspending us, or the user disabling writes) has stopped us
+ * from waiting for the socket to take it. */
+static int
+bufferevent_socket_batch_pending_(struct bufferevent *bufev)
+{
+	struct bufferevent_private *bufev_p = BEV_UPCAST(bufev);
+
+	return bufev_p->batch_writes && !bufev_p->write_suspended &&
+	    (bufev->enabled & EV_WRITE) &&
+	    !event_pending(&bufev->ev_write, EV_WRITE, NULL);
+}
+
 static void
 bufferevent_socket_outbuf_cb(struct evbuffer *buf,
     const struct evbuffer_cb_info *cbinfo,
@@ -139,12 +185,447 @@ bufferevent_socket_outbuf_cb(struct evbuffer *buf,
 	    !bufev_p->write_suspended) {
 		/* Somebody added data to the buffer, and we would like to
 		 * write, and we were not writing.  So, start writing. */
-		if (bufferevent_add_event_(&bufev->ev_write, &bufev->timeout_write) == -1) {
+		if (bufferevent_socket_schedule_write(bufev) == -1) {
 		    /* Should we log this? */
 		}
 	}
 }
 
+#ifdef EVENT__HAVE_SPLICE
+/* Add dst's write event if it should be waiting to move data out of the
+ * pipe, as bufferevent_socket_outbuf_cb does for its output buffer. */
+static void
+bufferevent_forward_want_write(struct bufferevent_forward *f)
+{
+	struct bufferevent *dst = f->dst;
+
+	if (f->pipe_bytes && (dst->enabled & EV_WRITE) &&
+	    !BEV_UPCAST(dst)->write_suspended &&
+	    !event_pending(&dst->ev_write, EV_WRITE, NULL))
+		bufferevent_add_event_(&dst->ev_write, &dst->timeout_write);
+}
+
+/* Move as much data as we can from the pipe to dst's socket.  Anything in
+ * dst's output buffer has to go first.  Returns the number of bytes moved,
+ * or -1 with the socket error set.  Must hold dst's lock. */
+static ev_ssize_t
+bufferevent_forward_splice_out(struct bufferevent_forward *f)
+{
+	struct bufferevent *dst = f->dst;
+	struct bufferevent_private *dst_p = BEV_UPCAST(dst);
+	evutil_socket_t fd = event_get_fd(&dst->ev_write);
+	ev_ssize_t howmuch, n;
+
+	if (!f->pipe_bytes || evbuffer_get_length(dst->output) || fd < 0 ||
+	    dst_p->connecting || dst_p->write_suspended)
+		return 0;
+
+	howmuch = bufferevent_get_write_max_(dst_p);
+	if (howmuch < 0 || (size_t)howmuch > f->pipe_bytes)
+		howmuch = f->pipe_bytes;
+	n = splice(f->pipe[0], NULL, fd, NULL, howmuch,
+	    SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+	if (n > 0) {
+		f->pipe_bytes -= n;
+		bufferevent_decrement_write_buckets_(dst_p, n);
+		bufferevent_forward_wake_(f);
+	}
+	return n;
+}
+
+/* Read up to howmuch bytes from src's socket into the pipe, and pass them
+ * on to dst if it can take them.  Returns what read() would; at EOF or on
+ * an error, the forward is gone.  Must hold src's lock. */
+static ev_ssize_t
+bufferevent_forward_splice_in(struct bufferevent_forward *f,
+    evutil_socket_t fd, ev_ssize_t howmuch)
+{
+	struct bufferevent *dst = f->dst;
+	ev_ssize_t n;
+	size_t room;
+	int err;
+
+	if (!BEV_TRYLOCK(dst)) {
+		/* dst's side has the lock, and may want ours: our read event
+		 * will bring us back. */
+		EVUTIL_SET_SOCKET_ERROR(EAGAIN);
+		return -1;
+	}
+	room = bufferevent_forward_room_(f);
+	if (howmuch < 0 || (size_t)howmuch > room)
+		howmuch = room;
+	if (!howmuch) {
+		bufferevent_forward_pause_if_full_(f);
+		EVUTIL_SET_SOCKET_ERROR(EAGAIN);
+		n = -1;
+		goto done;
+	}
+
+	n = splice(fd, NULL, f->pipe[1], NULL, howmuch,
+	    SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+	if (n > 0) {
+		f->pipe_bytes += n;
+		/* Errors writing show up when dst's write event runs. */
+		bufferevent_forward_splice_out(f);
+		bufferevent_forward_want_write(f);
+		bufferevent_forward_pause_if_full_(f);
+	} else if (n == 0 || !EVUTIL_ERR_RW_RETRIABLE(errno)) {
+		/* src is done.  Put what's left where whoever handles
+		 * that will expect to find it, and let src's callbacks run
+		 * as usual again. */
+		err = errno;
+		bufferevent_forward_detach_(f);
+		errno = err;
+	} else if (f->pipe_bytes) {
+		/* Either src had nothing after all, or the pipe is full: it
+		 * holds fewer than pipe_size bytes when they came in small
+		 * pieces.  Don't spin on src's read event until dst has taken
+		 * some. */
+		err = errno;
+		bufferevent_forward_pause_(f);
+		errno = err;
+	}
+
+done:
+	BEV_UNLOCK(dst);
+	return n;
+}
+#endif
+
+int
+bufferevent_forward_splice_setup_(struct bufferevent_forward *f)
+{
+#ifdef EVENT__HAVE_SPLICE
+	int fds[2];
+
+	if (!BEV_IS_SOCKET(f->src) || !BEV_IS_SOCKET(f->dst))
+		return -1;
+	if (pipe2(fds, O_NONBLOCK|O_CLOEXEC) < 0)
+		return -1;
+	f->pipe[0] = fds[0];
+	f->pipe[1] = fds[1];
+	f->pipe_size = BEV_FORWARD_MAX;
+#ifdef F_GETPIPE_SZ
+	{
+		/* Pipes are smaller once a user has used up their share. */
+		int size = fcntl(fds[0], F_GETPIPE_SZ);
+		if (size > 0 && size < BEV_FORWARD_MAX)
+			f->pipe_size = size;
+	}
+#endif
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+void
+bufferevent_forward_splice_free_(struct bufferevent_forward *f)
+{
+#ifdef EVENT__HAVE_SPLICE
+	struct evbuffer *output = f->dst->output;
+
+	if (f->pipe[0] < 0)
+		return;
+	while (f->pipe_bytes) {
+		int n = evbuffer_read(output, f->pipe[0], (int)f->pipe_bytes);
+		if (n <= 0)
+			break;
+		f->pipe_bytes -= n;
+	}
+	close(f->pipe[0]);
+	close(f->pipe[1]);
+	f->pipe[0] = f->pipe[1] = -1;
+	f->pipe_bytes = 0;
+#endif
+}
+
+#ifdef USE_ZEROCOPY
+/* Release every zero-copy send in zc with a number from lo to hi. */
+static void
+bufferevent_zerocopy_done(struct bufferevent_zerocopy *zc,
+    struct evbuffer *output, ev_uint32_t lo, ev_uint32_t hi)
+{
+	struct evbuffer_zerocopy_send **sendp = &zc->pending, *send;
+
+	while ((send = *sendp) != NULL) {
+		/* The kernel's numbers wrap around, so compare them as
+		 * offsets from lo. */
+		if ((ev_uint32_t)(send->id - lo) <= (ev_uint32_t)(hi - lo)) {
+			*sendp = send->next;
+			--zc->n_pending;
+			evbuffer_zerocopy_send_free_(output, send);
+		} else {
+			sendp = &send->next;
+		}
+	}
+	zc->pending_tail = sendp;
+}
+
+/* Read the kernel's notifications about our zero-copy sends from fd's error
+ * queue, and release whatever it is done with. */
+static void
+bufferevent_zerocopy_read_errqueue(struct bufferevent_zerocopy *zc,
+    struct evbuffer *output, evutil_socket_t fd)
+{
+	struct sock_extended_err *serr;
+	struct cmsghdr *cm;
+	struct msghdr msg;
+	char control[128];
+
+	while (zc->pending) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(fd, &msg, MSG_ERRQUEUE) < 0)
+			break;
+		for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+			if (!(cm->cmsg_level == IPPROTO_IP &&
+				cm->cmsg_type == IP_RECVERR) &&
+			    !(cm->cmsg_level == IPPROTO_IPV6 &&
+				cm->cmsg_type == IPV6_RECVERR))
+				continue;
+			serr = (struct sock_extended_err *)CMSG_DATA(cm);
+			if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY ||
+			    serr->ee_errno != 0)
+				continue;
+			bufferevent_zerocopy_done(zc, output,
+			    serr->ee_info, serr->ee_data);
+		}
+	}
+}
+
+/* Release whatever zero-copy sends the kernel is done with.  A notification
+ * wakes our read and write events, but only if they're added; if there are
+ * sends left over and we aren't waiting to write, check back on a timer. */
+static void
+bufferevent_zerocopy_reap(struct bufferevent *bufev, evutil_socket_t fd)
+{
+	struct bufferevent_zerocopy *zc = BEV_UPCAST(bufev)->zerocopy;
+
+	if (!zc)
+		return;
+	if (fd >= 0)
+		bufferevent_zerocopy_read_errqueue(zc, bufev->output, fd);
+
+	if (zc->pending && !event_pending(&bufev->ev_write, EV_WRITE, NULL)) {
+		if (!evtimer_pending(&zc->reap_ev, NULL)) {
+			struct timeval tv = {
+				0, BEV_ZEROCOPY_REAP_MSEC * 1000 };
+			event_add(&zc->reap_ev, &tv);
+		}
+	} else {
+		event_del(&zc->reap_ev);
+	}
+}
+
+static void
+bufferevent_zerocopy_reap_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct bufferevent *bufev = arg;
+
+	bufferevent_incref_and_lock_(bufev);
+	bufferevent_zerocopy_reap(bufev, event_get_fd(&bufev->ev_write));
+	bufferevent_decref_and_unlock_(bufev);
+}
+
+/* Write from bufev's output to fd like evbuffer_write_atmost(), but without
+ * copying if there is enough to write. */
+static int
+bufferevent_zerocopy_write(struct bufferevent *bufev, evutil_socket_t fd,
+    ev_ssize_t atmost)
+{
+	struct bufferevent_zerocopy *zc = BEV_UPCAST(bufev)->zerocopy;
+	struct evbuffer_zerocopy_send *send;
+	size_t len = evbuffer_get_length(bufev->output);
+	int on = 1, res;
+
+	if (atmost >= 0 && (size_t)atmost < len)
+		len = atmost;
+	if (!zc->min_bytes || len < zc->min_bytes || zc->failed)
+		return evbuffer_write_atmost(bufev->output, fd, atmost);
+
+	if (!zc->enabled) {
+		if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &on,
+			sizeof(on)) < 0) {
+			zc->failed = 1;
+			return evbuffer_write_atmost(bufev->output, fd, atmost);
+		}
+		zc->enabled = 1;
+	}
+
+	res = evbuffer_write_zerocopy_(bufev->output, fd, atmost, &send);
+	if (res == -2) {
+		/* The kernel has too many of our sends to tell us about
+		 * already; copy this one. */
+		return evbuffer_write_atmost(bufev->output, fd, atmost);
+	}
+	if (send) {
+		send->id = zc->next_id++;
+		*zc->pending_tail = send;
+		zc->pending_tail = &send->next;
+		++zc->n_pending;
+	}
+	return res;
+}
+
+/* Forget about the zero-copy sends on bufev's old socket, and start over on
+ * a new one. */
+static void
+bufferevent_zerocopy_reset(struct bufferevent *bufev)
+{
+	struct bufferevent_zerocopy *zc = BEV_UPCAST(bufev)->zerocopy;
+	struct evbuffer_zerocopy_send *send;
+
+	while ((send = zc->pending) != NULL) {
+		zc->pending = send->next;
+		evbuffer_zerocopy_send_free_(bufev->output, send);
+	}
+	zc->pending_tail = &zc->pending;
+	zc->n_pending = 0;
+	zc->next_id = 0;
+	zc->enabled = zc->failed = 0;
+	event_del(&zc->reap_ev);
+}
+
+static void
+bufferevent_zerocopy_free(struct bufferevent_zerocopy *zc)
+{
+	struct evbuffer_zerocopy_send *send;
+
+	while ((send = zc->pending) != NULL) {
+		zc->pending = send->next;
+		evbuffer_zerocopy_send_free_(NULL, send);
+	}
+	if (zc->linger_fd != EVUTIL_INVALID_SOCKET)
+		evutil_closesocket(zc->linger_fd);
+	event_debug_unassign(&zc->reap_ev);
+	mm_free(zc);
+}
+
+static void
+bufferevent_zerocopy_linger_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct bufferevent_zerocopy *zc = arg;
+	struct event_base *base = zc->linger_base;
+	struct timeval tv = { 0, BEV_ZEROCOPY_REAP_MSEC * 1000 };
+
+	bufferevent_zerocopy_read_errqueue(zc, NULL, zc->linger_fd);
+	if (zc->pending && --zc->linger_ticks > 0) {
+		event_add(&zc->reap_ev, &tv);
+		return;
+	}
+	EVBASE_ACQUIRE_LOCK(base, th_base_lock);
+	LIST_REMOVE(zc, linger_next);
+	EVBASE_RELEASE_LOCK(base, th_base_lock);
+	bufferevent_zerocopy_free(zc);
+}
+
+/* Called when bufev is being freed.  If the kernel may still be sending from
+ * memory that would go away with bufev's output buffer, hold on to that and
+ * the socket until the kernel is done (or we give up on it), and return 1 if
+ * we took over closing fd.  Otherwise, free the zero-copy state and return
+ * 0. */
+static int
+bufferevent_zerocopy_linger(struct bufferevent *bufev, evutil_socket_t fd,
+    int close_fd)
+{
+	struct bufferevent_zerocopy *zc = BEV_UPCAST(bufev)->zerocopy;
+	struct timeval tv = { 0, BEV_ZEROCOPY_REAP_MSEC * 1000 };
+
+	BEV_UPCAST(bufev)->zerocopy = NULL;
+	event_del(&zc->reap_ev);
+	if (zc->pending && fd >= 0) {
+		/* Our chains stop being shared with the output buffer once
+		 * it's freed, so after this we touch them without a lock. */
+		bufferevent_zerocopy_read_errqueue(zc, bufev->output, fd);
+	}
+	if (!zc->pending || fd < 0 ||
+	    (zc->linger_fd = close_fd ? fd : dup(fd)) < 0) {
+		zc->linger_fd = EVUTIL_INVALID_SOCKET;
+		bufferevent_zerocopy_free(zc);
+		return 0;
+	}
+
+	zc->linger_ticks = BEV_ZEROCOPY_LINGER_MSEC / BEV_ZEROCOPY_REAP_MSEC;
+	zc->linger_base = bufev->ev_base;
+	/* If the base goes first, it frees us. */
+	EVBASE_ACQUIRE_LOCK(zc->linger_base, th_base_lock);
+	LIST_INSERT_HEAD(&zc->linger_base->zerocopy_lingering, zc,
+	    linger_next);
+	EVBASE_RELEASE_LOCK(zc->linger_base, th_base_lock);
+	event_assign(&zc->reap_ev, bufev->ev_base, -1, 0,
+	    bufferevent_zerocopy_linger_cb, zc);
+	event_add(&zc->reap_ev, &tv);
+	return close_fd;
+}
+#endif
+
+void
+bufferevent_zerocopy_linger_free_all_(struct event_base *base)
+{
+#ifdef USE_ZEROCOPY
+	struct bufferevent_zerocopy *zc;
+
+	/* The memory goes away while the kernel may still be sending from
+	 * it; at least nothing else can write to the socket. */
+	while ((zc = LIST_FIRST(&base->zerocopy_lingering)) != NULL) {
+		LIST_REMOVE(zc, linger_next);
+		event_del(&zc->reap_ev);
+		bufferevent_zerocopy_free(zc);
+	}
+#else
+	(void)base;
+#endif
+}
+
+int
+bufferevent_socket_set_zerocopy(struct bufferevent *bev, size_t min_bytes)
+{
+#ifdef USE_ZEROCOPY
+	struct bufferevent_private *bev_p = BEV_UPCAST(bev);
+	struct bufferevent_zerocopy *zc;
+	int r = -1;
+
+	BEV_LOCK(bev);
+	if (!BEV_IS_SOCKET(bev))
+		goto done;
+	if (!bev_p->zerocopy && min_bytes) {
+		if (!(zc = mm_calloc(1, sizeof(*zc))))
+			goto done;
+		zc->pending_tail = &zc->pending;
+		zc->linger_fd = EVUTIL_INVALID_SOCKET;
+		event_assign(&zc->reap_ev, bev->ev_base, -1, EV_FINALIZE,
+		    bufferevent_zerocopy_reap_cb, bev);
+		bev_p->zerocopy = zc;
+	}
+	if (bev_p->zerocopy)
+		bev_p->zerocopy->min_bytes = min_bytes;
+	r = 0;
+done:
+	BEV_UNLOCK(bev);
+	return r;
+#else
+	(void)bev;
+	(void)min_bytes;
+	return -1;
+#endif
+}
+
+int
+bufferevent_socket_set_batch_writes(struct bufferevent *bev, int enable)
+{
+	int r = -1;
+
+	BEV_LOCK(bev);
+	if (BEV_IS_SOCKET(bev)) {
+		BEV_UPCAST(bev)->batch_writes = !!enable;
+		r = 0;
+	}
+	BEV_UNLOCK(bev);
+	return r;
+}
+
 static void
 bufferevent_readcb(evutil_socket_t fd, short event, void *arg)
 {
@@ -157,6 +638,10 @@ bufferevent_readcb(evutil_socket_t fd, short event, void *arg)
 
 	bufferevent_incref_and_lock_(bufev);
 
+#ifdef USE_ZEROCOPY
+	bufferevent_zerocopy_reap(bufev, fd);
+#endif
+
 	if (event == EV_TIMEOUT) {
 		/* Note that we only check for event==EV_TIMEOUT. If
 		 * event==EV_TIMEOUT|EV_READ, we can safely ignore the
@@ -187,6 +672,12 @@ bufferevent_readcb(evutil_socket_t fd, short event, void *arg)
 		goto done;
 
 	evbuffer_unfreeze(input, 0);
+#ifdef EVENT__HAVE_SPLICE
+	if (bufev_p->forward_out && bufev_p->forward_out->pipe[1] >= 0)
+		res = (int)bufferevent_forward_splice_in(bufev_p->forward_out,
+		    fd, howmuch);
+	else
+#endif
 	res = evbuffer_read(input, fd, (int)howmuch); /* XXXX evbuffer_read would do better to take and return ev_ssize_t */
 	evbuffer_freeze(input, 0);
 
@@ -226,6 +717,32 @@ bufferevent_readcb(evutil_socket_t fd, short event, void *arg)
 	bufferevent_decref_and_unlock_(bufev);
 }
 
+static void
+bufferevent_socket_file_fetched(void *arg)
+{
+	struct bufferevent *bufev = arg;
+
+	BEV_LOCK(bufev);
+	bufferevent_unsuspend_write_(bufev, BEV_SUSPEND_FILE);
+	bufferevent_decref_and_unlock_(bufev);
+}
+
+/* Stop writing while the next part of the file segment at the front of our
+ * output gets read in off the loop thread, if our base can do that.  Returns
+ * 0 if we stopped, -1 if we should just go ahead and write. */
+static int
+bufferevent_socket_fetch_file(struct bufferevent *bufev)
+{
+	bufferevent_incref_(bufev);
+	if (evbuffer_file_fetch_(bufev->output, bufev->ev_base,
+		bufferevent_socket_file_fetched, bufev) < 0) {
+		bufferevent_decref_(bufev);
+		return -1;
+	}
+	bufferevent_suspend_write_(bufev, BEV_SUSPEND_FILE);
+	return 0;
+}
+
 static void
 bufferevent_writecb(evutil_socket_t fd, short event, void *arg)
 {
@@ -291,7 +808,19 @@ bufferevent_writecb(evutil_socket_t fd, short event, void *arg)
 		goto done;
 
 	if (evbuffer_get_length(bufev->output)) {
+		ev_ssize_t ready =
+		    evbuffer_file_write_ready_(bufev->output, atmost);
+		if (ready == 0 && bufferevent_socket_fetch_file(bufev) == 0)
+			goto done;
+		if (ready > 0 && ready < atmost)
+			atmost = ready;
+
 		evbuffer_unfreeze(bufev->output, 1);
+#ifdef USE_ZEROCOPY
+		if (bufev_p->zerocopy)
+			res = bufferevent_zerocopy_write(bufev, fd, atmost);
+		else
+#endif
 		res = evbuffer_write_atmost(bufev->output, fd, atmost);
 		evbuffer_freeze(bufev->output, 1);
 		if (res == -1) {
@@ -312,8 +841,27 @@ bufferevent_writecb(evutil_socket_t fd, short event, void *arg)
 		bufferevent_decrement_write_buckets_(bufev_p, res);
 	}
 
-	if (evbuffer_get_length(bufev->output) == 0) {
+#ifdef EVENT__HAVE_SPLICE
+	if (bufev_p->forward_in && bufev_p->forward_in->pipe[0] >= 0) {
+		ev_ssize_t n = bufferevent_forward_splice_out(bufev_p->forward_in);
+		if (n < 0) {
+			int err = evutil_socket_geterror(fd);
+			if (EVUTIL_ERR_RW_RETRIABLE(err))
+				goto reschedule;
+			what |= BEV_EVENT_ERROR;
+			goto error;
+		}
+		res += (int)n;
+	}
+#endif
+
+	if (evbuffer_get_length(bufev->output) == 0 &&
+	    !BEV_FORWARD_PIPE_BYTES(bufev_p)) {
 		event_del(&bufev->ev_write);
+	} else if (bufferevent_socket_batch_pending_(bufev)) {
+		/* A batched write didn't get everything out; wait for the
+		 * socket to take the rest. */
+		bufferevent_add_event_(&bufev->ev_write, &bufev->timeout_write);
 	}
 
 	/*
@@ -327,8 +875,11 @@ bufferevent_writecb(evutil_socket_t fd, short event, void *arg)
 	goto done;
 
  reschedule:
-	if (evbuffer_get_length(bufev->output) == 0) {
+	if (evbuffer_get_length(bufev->output) == 0 &&
+	    !BEV_FORWARD_PIPE_BYTES(bufev_p)) {
 		event_del(&bufev->ev_write);
+	} else if (bufferevent_socket_batch_pending_(bufev)) {
+		bufferevent_add_event_(&bufev->ev_write, &bufev->timeout_write);
 	}
 	goto done;
 
@@ -337,6 +888,9 @@ bufferevent_writecb(evutil_socket_t fd, short event, void *arg)
 	bufferevent_run_eventcb_(bufev, what, 0);
 
  done:
+#ifdef USE_ZEROCOPY
+	bufferevent_zerocopy_reap(bufev, fd);
+#endif
 	bufferevent_decref_and_unlock_(bufev);
 }
 
@@ -448,6 +1002,370 @@ done:
 	return result;
 }
 
+/* When a name resolves to more than one address, we race connections to
+ * them as RFC 8305 ("Happy Eyeballs") describes: start with one address,
+ * and start another each BEV_CONNECT_ATTEMPT_DELAY_MSEC (or as soon as an
+ * attempt fails) without giving up on the earlier ones.  The first socket
+ * to connect becomes the bufferevent's fd; the others are closed. */
+#define BEV_CONNECT_ATTEMPT_DELAY_MSEC 250
+
+struct bufferevent_connect_race;
+
+struct bufferevent_connect_attempt {
+	struct bufferevent_connect_race *race;
+	struct evutil_addrinfo *ai;
+	evutil_socket_t fd;
+	struct event ev;
+};
+
+struct bufferevent_connect_race {
+	struct bufferevent *bev;
+	/* The result of the lookup; we own it until the race is over. */
+	struct evutil_addrinfo *ai;
+	/* One entry per address, in the order we try them. */
+	struct bufferevent_connect_attempt *attempts;
+	int n_attempts;
+	/* Index of the next address to try. */
+	int next_attempt;
+	/* Number of attempts still waiting to connect. */
+	int n_pending;
+	/* Socket error from the last attempt that failed. */
+	int error;
+	/* Starts the next attempt. */
+	struct event next_ev;
+	/* Gives up on the whole race after the bufferevent's write timeout. */
+	struct event timeout_ev;
+};
+
+/* For each of a handful of destinations, the address that won the last race
+ * to it.  We try that address first next time, and the addresses of its
+ * family before the others. */
+#define BEV_CONNECT_PREF_SLOTS 64
+
+struct bufferevent_connect_pref {
+	ev_uint32_t host_hash;
+	ev_socklen_t addrlen;
+	union {
+		struct sockaddr_in6 in6;
+		struct sockaddr_in in;
+	} addr;
+};
+
+static struct bufferevent_connect_pref connect_prefs[BEV_CONNECT_PREF_SLOTS];
+#ifndef EVENT__DISABLE_THREAD_SUPPORT
+static void *connect_prefs_lock_ = NULL;
+
+int
+bufferevent_socket_global_setup_locks_(const int enable_locks)
+{
+	EVTHREAD_SETUP_GLOBAL_LOCK(connect_prefs_lock_, 0);
+	return 0;
+}
+#endif
+
+void
+bufferevent_socket_free_globals_(void)
+{
+	memset(connect_prefs, 0, sizeof(connect_prefs));
+#ifndef EVENT__DISABLE_THREAD_SUPPORT
+	if (connect_prefs_lock_ != NULL) {
+		EVTHREAD_FREE_LOCK(connect_prefs_lock_, 0);
+		connect_prefs_lock_ = NULL;
+	}
+#endif
+}
+
+static ev_uint32_t
+bufferevent_connect_host_hash(const char *hostname)
+{
+	/* FNV-1a, ignoring case.  Zero means "no destination". */
+	ev_uint32_t h = 2166136261u;
+	for (; *hostname; ++hostname) {
+		h ^= (ev_uint8_t)EVUTIL_TOLOWER_(*hostname);
+		h *= 16777619u;
+	}
+	return h ? h : 1;
+}
+
+static void
+bufferevent_connect_pref_set(ev_uint32_t host_hash,
+    const struct evutil_addrinfo *ai)
+{
+	struct bufferevent_connect_pref *pref =
+	    &connect_prefs[host_hash % BEV_CONNECT_PREF_SLOTS];
+
+	if (!host_hash)
+		return;
+	EVLOCK_LOCK(connect_prefs_lock_, 0);
+	if (ai && ai->ai_addrlen <= sizeof(pref->addr)) {
+		pref->host_hash = host_hash;
+		pref->addrlen = (ev_socklen_t)ai->ai_addrlen;
+		memcpy(&pref->addr, ai->ai_addr, ai->ai_addrlen);
+	} else if (pref->host_hash == host_hash) {
+		pref->host_hash = 0;
+	}
+	EVLOCK_UNLOCK(connect_prefs_lock_, 0);
+}
+
+/* Return the member of the list that won the last race to host_hash. */
+static struct evutil_addrinfo *
+bufferevent_connect_pref_find(ev_uint32_t host_hash,
+    struct evutil_addrinfo *ai)
+{
+	struct bufferevent_connect_pref pref;
+
+	if (!host_hash)
+		return NULL;
+	EVLOCK_LOCK(connect_prefs_lock_, 0);
+	pref = connect_prefs[host_hash % BEV_CONNECT_PREF_SLOTS];
+	EVLOCK_UNLOCK(connect_prefs_lock_, 0);
+
+	if (pref.host_hash != host_hash)
+		return NULL;
+	for (; ai; ai = ai->ai_next) {
+		if (ai->ai_addrlen == pref.addrlen &&
+		    !memcmp(ai->ai_addr, &pref.addr, pref.addrlen))
+			return ai;
+	}
+	return NULL;
+}
+
+/* Close the sockets that lost, forget about the race, and drop the
+ * reference it held.  Requires that we hold the lock, and another
+ * reference. */
+static void
+bufferevent_connect_race_free(struct bufferevent_connect_race *race)
+{
+	struct bufferevent *bev = race->bev;
+	struct bufferevent_private *bev_p = BEV_UPCAST(bev);
+	int i;
+
+	for (i = 0; i < race->next_attempt; ++i) {
+		struct bufferevent_connect_attempt *att = &race->attempts[i];
+		if (att->fd < 0)
+			continue;
+		event_del(&att->ev);
+		event_debug_unassign(&att->ev);
+		evutil_closesocket(att->fd);
+	}
+	event_del(&race->next_ev);
+	event_debug_unassign(&race->next_ev);
+	event_del(&race->timeout_ev);
+	event_debug_unassign(&race->timeout_ev);
+	evutil_freeaddrinfo(race->ai);
+	mm_free(race->attempts);
+	mm_free(race);
+	bev_p->connect_race = NULL;
+	bufferevent_decref_(bev);
+}
+
+static void
+bufferevent_connect_race_lost(struct bufferevent_connect_race *race,
+    short what)
+{
+	struct bufferevent *bev = race->bev;
+	int err = race->error;
+
+	bufferevent_connect_pref_set(BEV_UPCAST(bev)->connect_host_hash, NULL);
+	bufferevent_connect_race_free(race);
+	bufferevent_unsuspend_write_(bev, BEV_SUSPEND_LOOKUP);
+	bufferevent_unsuspend_read_(bev, BEV_SUSPEND_LOOKUP);
+	if (what & BEV_EVENT_TIMEOUT)
+		bufferevent_disable(bev, EV_WRITE);
+	EVUTIL_SET_SOCKET_ERROR(err);
+	bufferevent_run_eventcb_(bev, what, 0);
+}
+
+static void
+bufferevent_connect_race_won(struct bufferevent_connect_race *race,
+    struct bufferevent_connect_attempt *att)
+{
+	struct bufferevent *bev = race->bev;
+	evutil_socket_t fd = att->fd;
+
+	bufferevent_connect_pref_set(BEV_UPCAST(bev)->connect_host_hash,
+	    att->ai);
+	bufferevent_socket_set_conn_address_(bev, att->ai->ai_addr,
+	    (int)att->ai->ai_addrlen);
+	event_del(&att->ev);
+	event_debug_unassign(&att->ev);
+	att->fd = -1;
+	bufferevent_connect_race_free(race);
+
+	bufferevent_setfd(bev, fd);
+	bufferevent_unsuspend_write_(bev, BEV_SUSPEND_LOOKUP);
+	bufferevent_unsuspend_read_(bev, BEV_SUSPEND_LOOKUP);
+	bufferevent_run_eventcb_(bev, BEV_EVENT_CONNECTED, 0);
+}
+
+static void bufferevent_connect_attempt_cb(evutil_socket_t, short, void *);
+
+/* Start connecting to the next address that we can, and schedule the one
+ * after it.  If there is nothing left to wait for, report the failure. */
+static void
+bufferevent_connect_race_next(struct bufferevent_connect_race *race)
+{
+	struct timeval tv = { 0, BEV_CONNECT_ATTEMPT_DELAY_MSEC * 1000 };
+	struct bufferevent *bev = race->bev;
+
+	event_del(&race->next_ev);
+	while (race->next_attempt < race->n_attempts) {
+		struct bufferevent_connect_attempt *att =
+		    &race->attempts[race->next_attempt++];
+		int r;
+
+		att->fd = evutil_socket_(att->ai->ai_family,
+		    SOCK_STREAM|EVUTIL_SOCK_NONBLOCK, 0);
+		if (att->fd < 0) {
+			race->error = EVUTIL_SOCKET_ERROR();
+			continue;
+		}
+		r = evutil_socket_connect_(&att->fd, att->ai->ai_addr,
+		    (int)att->ai->ai_addrlen);
+		if (r == 0 || r == 1) {
+			/* If the connect finished already, the socket is
+			 * writable and the callback will notice. */
+			event_assign(&att->ev, bev->ev_base, att->fd,
+			    EV_WRITE|EV_PERSIST, bufferevent_connect_attempt_cb,
+			    att);
+			if (event_add(&att->ev, NULL) == 0) {
+				++race->n_pending;
+				if (race->next_attempt < race->n_attempts)
+					event_add(&race->next_ev, &tv);
+				return;
+			}
+			event_debug_unassign(&att->ev);
+		}
+		race->error = EVUTIL_SOCKET_ERROR();
+		evutil_closesocket(att->fd);
+		att->fd = -1;
+	}
+	if (!race->n_pending)
+		bufferevent_connect_race_lost(race, BEV_EVENT_ERROR);
+}
+
+static void
+bufferevent_connect_attempt_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct bufferevent_connect_attempt *att = arg;
+	struct bufferevent_connect_race *race = att->race;
+	struct bufferevent *bev = race->bev;
+	int c;
+
+	bufferevent_incref_and_lock_(bev);
+
+	c = evutil_socket_finished_connecting_(fd);
+	if (c == 0)
+		goto done;
+
+	--race->n_pending;
+	if (c > 0) {
+		bufferevent_connect_race_won(race, att);
+		goto done;
+	}
+
+	race->error = EVUTIL_SOCKET_ERROR();
+	event_del(&att->ev);
+	event_debug_unassign(&att->ev);
+	evutil_closesocket(fd);
+	att->fd = -1;
+	/* Don't wait for the timer to try the next address. */
+	bufferevent_connect_race_next(race);
+
+ done:
+	bufferevent_decref_and_unlock_(bev);
+}
+
+static void
+bufferevent_connect_race_next_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct bufferevent_connect_race *race = arg;
+	struct bufferevent *bev = race->bev;
+
+	bufferevent_incref_and_lock_(bev);
+	bufferevent_connect_race_next(race);
+	bufferevent_decref_and_unlock_(bev);
+}
+
+static void
+bufferevent_connect_race_timeout_cb(evutil_socket_t fd, short what,
+    void *arg)
+{
+	struct bufferevent_connect_race *race = arg;
+	struct bufferevent *bev = race->bev;
+
+	bufferevent_incref_and_lock_(bev);
+	bufferevent_connect_race_lost(race,
+	    BEV_EVENT_WRITING|BEV_EVENT_TIMEOUT);
+	bufferevent_decref_and_unlock_(bev);
+}
+
+/* Start racing connections to the addresses in ai, taking ownership of it.
+ * Return -1 (leaving ai to the caller) if we couldn't.  Requires that we
+ * hold the lock. */
+static int
+bufferevent_connect_race_start(struct bufferevent *bev,
+    struct evutil_addrinfo *ai)
+{
+	struct bufferevent_private *bev_p = BEV_UPCAST(bev);
+	struct bufferevent_connect_race *race;
+	struct evutil_addrinfo *first, *a, *b;
+	int family, i, n = 0;
+
+	for (a = ai; a; a = a->ai_next)
+		++n;
+	if (!(race = mm_calloc(1, sizeof(*race))))
+		return -1;
+	if (!(race->attempts = mm_calloc(n, sizeof(*race->attempts)))) {
+		mm_free(race);
+		return -1;
+	}
+	race->bev = bev;
+	race->ai = ai;
+	race->n_attempts = n;
+
+	/* Start with the address that worked last time, if there is one, and
+	 * then alternate between address families, beginning with its
+	 * family or else the resolver's favorite. */
+	first = bufferevent_connect_pref_find(bev_p->connect_host_hash, ai);
+	family = first ? first->ai_family : ai->ai_family;
+	i = 0;
+	if (first)
+		race->attempts[i++].ai = first;
+	a = b = ai;
+	while (i < n) {
+		while (a && (a->ai_family != family || a == first))
+			a = a->ai_next;
+		if (a) {
+			race->attempts[i++].ai = a;
+			a = a->ai_next;
+		}
+		while (b && b->ai_family == family)
+			b = b->ai_next;
+		if (b) {
+			race->attempts[i++].ai = b;
+			b = b->ai_next;
+		}
+	}
+	for (i = 0; i < n; ++i) {
+		race->attempts[i].race = race;
+		race->attempts[i].fd = -1;
+	}
+
+	evtimer_assign(&race->next_ev, bev->ev_base,
+	    bufferevent_connect_race_next_cb, race);
+	evtimer_assign(&race->timeout_ev, bev->ev_base,
+	    bufferevent_connect_race_timeout_cb, race);
+	if (evutil_timerisset(&bev->timeout_write))
+		event_add(&race->timeout_ev, &bev->timeout_write);
+
+	/* Our events refer to bev until the race is over. */
+	bufferevent_incref_(bev);
+	bev_p->connect_race = race;
+	bufferevent_connect_race_next(race);
+	return 0;
+}
+
 static void
 bufferevent_connect_getaddrinfo_cb(int result, struct evutil_addrinfo *ai,
     void *arg)
@@ -457,11 +1375,20 @@ bufferevent_connect_getaddrinfo_cb(int result, struct evutil_addrinfo *ai,
 	int r;
 	BEV_LOCK(bev);
 
+	bev_p->dns_request = NULL;
+
+	/* Race the addresses if there's more than one and the socket isn't
+	 * ours already; the lookup stays suspended until the race ends. */
+	if (result == 0 && ai->ai_next && bufferevent_getfd(bev) < 0 &&
+	    !BEV_IS_ASYNC(bev) &&
+	    bufferevent_connect_race_start(bev, ai) == 0) {
+		bufferevent_decref_and_unlock_(bev);
+		return;
+	}
+
 	bufferevent_unsuspend_write_(bev, BEV_SUSPEND_LOOKUP);
 	bufferevent_unsuspend_read_(bev, BEV_SUSPEND_LOOKUP);
 
-	bev_p->dns_request = NULL;
-
 	if (result == EVUTIL_EAI_CANCEL) {
 		bev_p->dns_error = result;
 		bufferevent_decref_and_unlock_(bev);
@@ -476,7 +1403,6 @@ bufferevent_connect_getaddrinfo_cb(int result, struct evutil_addrinfo *ai,
 		return;
 	}
 
-	/* XXX use the other addrinfos? */
 	bufferevent_socket_set_conn_address_(bev, ai->ai_addr, (int)ai->ai_addrlen);
 	r = bufferevent_socket_connect(bev, ai->ai_addr, (int)ai->ai_addrlen);
 	if (r < 0)
@@ -515,6 +1441,7 @@ bufferevent_socket_connect_hostname_hints(struct bufferevent *bev,
 
 	BEV_LOCK(bev);
 	bev_p->dns_error = 0;
+	bev_p->connect_host_hash = bufferevent_connect_host_hash(hostname);
 
 	evutil_snprintf(portbuf, sizeof(portbuf), "%d", port);
 
@@ -577,7 +1504,7 @@ be_socket_enable(struct bufferevent *bufev, short event)
 	    bufferevent_add_event_(&bufev->ev_read, &bufev->timeout_read) == -1)
 			return -1;
 	if (event & EV_WRITE &&
-	    bufferevent_add_event_(&bufev->ev_write, &bufev->timeout_write) == -1)
+	    bufferevent_socket_schedule_write(bufev) == -1)
 			return -1;
 	return 0;
 }
@@ -603,11 +1530,19 @@ be_socket_destruct(struct bufferevent *bufev)
 {
 	struct bufferevent_private *bufev_p = BEV_UPCAST(bufev);
 	evutil_socket_t fd;
+	int close_fd;
 	EVUTIL_ASSERT(BEV_IS_SOCKET(bufev));
 
 	fd = event_get_fd(&bufev->ev_read);
+	close_fd = (bufev_p->options & BEV_OPT_CLOSE_ON_FREE) && fd >= 0;
+
+#ifdef USE_ZEROCOPY
+	if (bufev_p->zerocopy &&
+	    bufferevent_zerocopy_linger(bufev, fd, close_fd))
+		close_fd = 0;
+#endif
 
-	if ((bufev_p->options & BEV_OPT_CLOSE_ON_FREE) && fd >= 0)
+	if (close_fd)
 		EVUTIL_CLOSESOCKET(fd);
 
 	evutil_getaddrinfo_cancel_async_(bufev_p->dns_request);
@@ -635,6 +1570,13 @@ be_socket_setfd(struct bufferevent *bufev, evutil_socket_t fd)
 	evbuffer_unfreeze(bufev->input, 0);
 	evbuffer_unfreeze(bufev->output, 1);
 
+#ifdef USE_ZEROCOPY
+	/* Whatever the old socket still has to send is between it and
+	 * whoever owns it now. */
+	if (bufev_p->zerocopy)
+		bufferevent_zerocopy_reset(bufev);
+#endif
+
 	event_assign(&bufev->ev_read, bufev->ev_base, fd,
 	    EV_READ|EV_PERSIST|EV_FINALIZE, bufferevent_readcb, bufev);
 	event_assign(&bufev->ev_write, bufev->ev_base, fd,
@@ -644,6 +1586,11 @@ be_socket_setfd(struct bufferevent *bufev, evutil_socket_t fd)
 		bufferevent_enable(bufev, bufev->enabled);
 
 	evutil_getaddrinfo_cancel_async_(bufev_p->dns_request);
+	if (bufev_p->connect_race) {
+		bufferevent_connect_race_free(bufev_p->connect_race);
+		bufferevent_unsuspend_write_(bufev, BEV_SUSPEND_LOOKUP);
+		bufferevent_unsuspend_read_(bufev, BEV_SUSPEND_LOOKUP);
+	}
 
 	BEV_UNLOCK(bufev);
 }
@@ -683,12 +1630,19 @@ bufferevent_base_set(struct event_base *base, struct bufferevent *bufev)
 		goto done;
 
 	bufev->ev_base = base;
+	bufferevent_mem_rebase_(bufev, base);
+	evbuffer_set_chain_pool(bufev->input, base->chain_pool ? base : NULL);
+	evbuffer_set_chain_pool(bufev->output, base->chain_pool ? base : NULL);
 
 	res = event_base_set(base, &bufev->ev_read);
 	if (res == -1)
 		goto done;
 
 	res = event_base_set(base, &bufev->ev_write);
+#ifdef USE_ZEROCOPY
+	if (res == 0 && BEV_UPCAST(bufev)->zerocopy)
+		res = event_base_set(base, &BEV_UPCAST(bufev)->zerocopy->reap_ev);
+#endif
 done:
 	BEV_UNLOCK(bufev);
 	return res;
@@ -705,8 +1659,14 @@ be_socket_ctrl(struct bufferevent *bev, enum bufferevent_ctrl_op op,
 	case BEV_CTRL_GET_FD:
 		data->fd = event_get_fd(&bev->ev_read);
 		return 0;
-	case BEV_CTRL_GET_UNDERLYING:
 	case BEV_CTRL_CANCEL_ALL:
+		/* The race holds a reference; it must not outlive the
+		 * user's. */
+		if (BEV_UPCAST(bev)->connect_race)
+			bufferevent_connect_race_free(
+			    BEV_UPCAST(bev)->connect_race);
+		return 0;
+	case BEV_CTRL_GET_UNDERLYING:
 	default:
 		return -1;
 	}
@@ -0,0 +1,466 @@
+/*
+ * Copyright (c) 2007-2012 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "event2/event-config.h"
+#include "evconfig-private.h"
+
+#include <sys/types.h>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#endif
+#include <errno.h>
+#include <string.h>
+#ifdef EVENT__HAVE_SYS_SOCKET_H
+#include <sys/socket.h>
+#endif
+#ifdef EVENT__HAVE_NETINET_IN_H
+#include <netinet/in.h>
+#endif
+#ifdef __linux__
+#include <netinet/udp.h>
+#endif
+#ifdef EVENT__HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "event2/dgram.h"
+#include "event2/util.h"
+#include "event2/event.h"
+#include "event2/event_struct.h"
+#include "mm-internal.h"
+#include "util-internal.h"
+#include "log-internal.h"
+
+#if defined(EVENT__HAVE_RECVMMSG) && defined(EVENT__HAVE_SENDMMSG)
+#define USE_MMSG
+#endif
+#if defined(USE_MMSG) && defined(UDP_GRO)
+#define USE_GRO
+#endif
+#if defined(USE_MMSG) && defined(UDP_SEGMENT)
+#define USE_GSO
+#endif
+
+/* How many datagrams to read at once, unless we're told otherwise. */
+#define EVDGRAM_DEFAULT_BATCH 64
+/* The longest UDP datagram, and the most that GRO coalesces. */
+#define EVDGRAM_MAX_SIZE 65535
+/* How many messages we hand sendmmsg() at once. */
+#define EVDGRAM_SEND_BATCH 32
+
+struct evdgram {
+	struct event_base *base;
+	struct event ev;
+	evutil_socket_t fd;
+	unsigned flags;
+	evdgram_read_cb readcb;
+	evdgram_error_cb errorcb;
+	void *arg;
+
+	/** How many datagrams we read at once, and how much room each one
+	 * gets. */
+	int batch;
+	size_t slot_size;
+	/** batch slots of slot_size bytes each. */
+	unsigned char *bufs;
+	/** Where the datagram in each slot came from. */
+	struct sockaddr_storage *addrs;
+	/** What we hand the read callback. */
+	struct evdgram_msg *msgs;
+#ifdef USE_MMSG
+	struct mmsghdr *hdrs;
+	struct iovec *iovs;
+	/** Room for the ancillary data that says how big coalesced datagrams
+	 * are, if we use GRO. */
+	unsigned char *cmsgs;
+	size_t cmsg_space;
+#endif
+
+	struct evdgram_stats stats;
+
+	unsigned enabled : 1;
+	/** True iff the kernel coalesces datagrams for us. */
+	unsigned gro : 1;
+	/** True iff the kernel can split up datagrams for us. */
+	unsigned gso : 1;
+};
+
+static void evdgram_read_cb_(evutil_socket_t fd, short what, void *arg);
+
+/* Free dg and everything it allocated, but leave its event and its socket
+ * alone. */
+static void
+evdgram_free_mem_(struct evdgram *dg)
+{
+#ifdef USE_MMSG
+	mm_free(dg->hdrs);
+	mm_free(dg->iovs);
+	mm_free(dg->cmsgs);
+#endif
+	mm_free(dg->bufs);
+	mm_free(dg->addrs);
+	mm_free(dg->msgs);
+	mm_free(dg);
+}
+
+struct evdgram *
+evdgram_new(struct event_base *base, evutil_socket_t fd, unsigned flags,
+    int batch, size_t max_size)
+{
+	struct evdgram *dg;
+	int i;
+
+	if (batch < 0)
+		batch = EVDGRAM_DEFAULT_BATCH;
+	if (batch < 1 || max_size > EVDGRAM_MAX_SIZE)
+		return NULL;
+	if (!max_size)
+		max_size = EVDGRAM_MAX_SIZE;
+
+	if (!(dg = mm_calloc(1, sizeof(*dg))))
+		return NULL;
+	dg->base = base;
+	dg->fd = fd;
+	dg->flags = flags;
+	dg->batch = batch;
+	dg->slot_size = max_size;
+
+#ifdef USE_GRO
+	if (flags & EVDGRAM_OPT_GRO) {
+		int one = 1;
+		if (setsockopt(fd, IPPROTO_UDP, UDP_GRO, &one,
+			sizeof(one)) == 0) {
+			dg->gro = 1;
+			dg->slot_size = EVDGRAM_MAX_SIZE;
+		}
+	}
+#endif
+#ifdef USE_GSO
+	{
+		int size;
+		ev_socklen_t len = sizeof(size);
+		if (getsockopt(fd, IPPROTO_UDP, UDP_SEGMENT, &size, &len) == 0)
+			dg->gso = 1;
+	}
+#endif
+
+	dg->bufs = mm_malloc(batch * dg->slot_size);
+	dg->addrs = mm_calloc(batch, sizeof(*dg->addrs));
+	dg->msgs = mm_calloc(batch, sizeof(*dg->msgs));
+	if (!dg->bufs || !dg->addrs || !dg->msgs)
+		goto err;
+#ifdef USE_MMSG
+	dg->hdrs = mm_calloc(batch, sizeof(*dg->hdrs));
+	dg->iovs = mm_calloc(batch, sizeof(*dg->iovs));
+	if (!dg->hdrs || !dg->iovs)
+		goto err;
+#ifdef USE_GRO
+	if (dg->gro) {
+		dg->cmsg_space = CMSG_SPACE(sizeof(int));
+		if (!(dg->cmsgs = mm_calloc(batch, dg->cmsg_space)))
+			goto err;
+	}
+#endif
+	for (i = 0; i < batch; ++i) {
+		struct msghdr *hdr = &dg->hdrs[i].msg_hdr;
+		dg->iovs[i].iov_base = dg->bufs + i * dg->slot_size;
+		hdr->msg_iov = &dg->iovs[i];
+		hdr->msg_iovlen = 1;
+		hdr->msg_name = &dg->addrs[i];
+		if (dg->cmsgs)
+			hdr->msg_control = dg->cmsgs + i * dg->cmsg_space;
+	}
+#endif
+	for (i = 0; i < batch; ++i) {
+		dg->msgs[i].addr = (struct sockaddr *)&dg->addrs[i];
+		dg->msgs[i].iov_base = dg->bufs + i * dg->slot_size;
+	}
+
+	event_assign(&dg->ev, base, fd, EV_READ|EV_PERSIST,
+	    evdgram_read_cb_, dg);
+	if (!(flags & EVDGRAM_OPT_DISABLED))
+		evdgram_enable(dg);
+	return dg;
+err:
+	/* The event was never assigned, and the socket is still the
+	 * caller's. */
+	evdgram_free_mem_(dg);
+	return NULL;
+}
+
+void
+evdgram_free(struct evdgram *dg)
+{
+	event_del(&dg->ev);
+	if (dg->flags & EVDGRAM_OPT_CLOSE_ON_FREE)
+		evutil_closesocket(dg->fd);
+	evdgram_free_mem_(dg);
+}
+
+void
+evdgram_setcb(struct evdgram *dg, evdgram_read_cb readcb,
+    evdgram_error_cb errorcb, void *arg)
+{
+	dg->readcb = readcb;
+	dg->errorcb = errorcb;
+	dg->arg = arg;
+}
+
+int
+evdgram_enable(struct evdgram *dg)
+{
+	dg->enabled = 1;
+	return event_add(&dg->ev, NULL);
+}
+
+int
+evdgram_disable(struct evdgram *dg)
+{
+	dg->enabled = 0;
+	return event_del(&dg->ev);
+}
+
+struct event_base *
+evdgram_get_base(struct evdgram *dg)
+{
+	return dg->base;
+}
+
+evutil_socket_t
+evdgram_get_fd(struct evdgram *dg)
+{
+	return dg->fd;
+}
+
+void
+evdgram_get_stats(struct evdgram *dg, struct evdgram_stats *stats)
+{
+	*stats = dg->stats;
+}
+
+/* Return how many datagrams msg stands for. */
+static ev_uint64_t
+evdgram_msg_count(const struct evdgram_msg *msg)
+{
+	if (msg->segment_size && msg->iov_len > msg->segment_size)
+		return (msg->iov_len + msg->segment_size - 1) /
+		    msg->segment_size;
+	return 1;
+}
+
+/* Read up to a batch of datagrams into dg->msgs.  Returns how many we read,
+ * or -1 on error. */
+static int
+evdgram_recv(struct evdgram *dg)
+{
+	int i, n;
+
+#ifdef USE_MMSG
+	for (i = 0; i < dg->batch; ++i) {
+		struct msghdr *hdr = &dg->hdrs[i].msg_hdr;
+		dg->iovs[i].iov_len = dg->slot_size;
+		hdr->msg_namelen = sizeof(dg->addrs[i]);
+		hdr->msg_controllen = dg->cmsg_space;
+		hdr->msg_flags = 0;
+	}
+	n = recvmmsg(dg->fd, dg->hdrs, dg->batch, 0, NULL);
+	if (n < 0)
+		return -1;
+	for (i = 0; i < n; ++i) {
+		struct msghdr *hdr = &dg->hdrs[i].msg_hdr;
+		struct evdgram_msg *msg = &dg->msgs[i];
+		msg->addrlen = hdr->msg_namelen;
+		msg->iov_len = dg->hdrs[i].msg_len;
+		msg->segment_size = 0;
+		msg->flags = (hdr->msg_flags & MSG_TRUNC) ?
+		    EVDGRAM_MSG_TRUNCATED : 0;
+#ifdef USE_GRO
+		if (dg->gro) {
+			struct cmsghdr *cm;
+			for (cm = CMSG_FIRSTHDR(hdr); cm;
+			     cm = CMSG_NXTHDR(hdr, cm)) {
+				int size;
+				if (cm->cmsg_level != IPPROTO_UDP ||
+				    cm->cmsg_type != UDP_GRO)
+					continue;
+				memcpy(&size, CMSG_DATA(cm), sizeof(size));
+				if (size > 0 && (size_t)size < msg->iov_len)
+					msg->segment_size = size;
+			}
+		}
+#endif
+	}
+#else
+	for (n = 0; n < dg->batch; ++n) {
+		struct evdgram_msg *msg = &dg->msgs[n];
+		ev_ssize_t r;
+		msg->addrlen = sizeof(dg->addrs[n]);
+		r = recvfrom(dg->fd, (char *)msg->iov_base, (int)dg->slot_size,
+		    0, msg->addr, &msg->addrlen);
+		if (r < 0) {
+			if (n)
+				break;
+			return -1;
+		}
+		msg->iov_len = r;
+		msg->segment_size = 0;
+		msg->flags = 0;
+	}
+#endif
+
+	++dg->stats.n_reads;
+	for (i = 0; i < n; ++i) {
+		dg->stats.n_datagrams_read += evdgram_msg_count(&dg->msgs[i]);
+		dg->stats.n_bytes_read += dg->msgs[i].iov_len;
+		if (dg->msgs[i].flags & EVDGRAM_MSG_TRUNCATED)
+			++dg->stats.n_truncated;
+	}
+	return n;
+}
+
+static void
+evdgram_read_cb_(evutil_socket_t fd, short what, void *arg)
+{
+	struct evdgram *dg = arg;
+	int n = evdgram_recv(dg);
+
+	if (n < 0) {
+		int err = evutil_socket_geterror(fd);
+		if (EVUTIL_ERR_RW_RETRIABLE(err))
+			return;
+		if (dg->errorcb)
+			dg->errorcb(dg, err, dg->arg);
+		return;
+	}
+	/* This must come last: the callback may free us. */
+	if (n && dg->readcb)
+		dg->readcb(dg, dg->msgs, n, dg->arg);
+}
+
+/* Send msg's datagrams one at a time.  Returns 0 if they all went, or -1. */
+static int
+evdgram_send_split(struct evdgram *dg, const struct evdgram_msg *msg)
+{
+	const char *p = msg->iov_base;
+	size_t left = msg->iov_len, len;
+
+	while (left) {
+		len = left < msg->segment_size ? left : msg->segment_size;
+		if (sendto(dg->fd, p, (int)len, 0, msg->addr,
+			msg->addrlen) < 0)
+			return -1;
+		++dg->stats.n_sends;
+		++dg->stats.n_datagrams_sent;
+		p += len;
+		left -= len;
+	}
+	return 0;
+}
+
+int
+evdgram_send(struct evdgram *dg, const struct evdgram_msg *msgs, int n_msgs)
+{
+	int done = 0;
+#ifdef USE_MMSG
+	struct mmsghdr hdrs[EVDGRAM_SEND_BATCH];
+	struct iovec iovs[EVDGRAM_SEND_BATCH];
+#ifdef USE_GSO
+	union {
+		unsigned char buf[CMSG_SPACE(sizeof(ev_uint16_t))];
+		struct cmsghdr align;
+	} cmsgs[EVDGRAM_SEND_BATCH];
+#endif
+	int i, n, r;
+
+	while (done < n_msgs) {
+		n = 0;
+		for (i = done; i < n_msgs && n < EVDGRAM_SEND_BATCH; ++i) {
+			const struct evdgram_msg *msg = &msgs[i];
+			struct msghdr *hdr = &hdrs[n].msg_hdr;
+			int split = msg->segment_size &&
+			    msg->iov_len > msg->segment_size;
+
+			if (split && !dg->gso)
+				break;
+			memset(&hdrs[n], 0, sizeof(hdrs[n]));
+			iovs[n].iov_base = msg->iov_base;
+			iovs[n].iov_len = msg->iov_len;
+			hdr->msg_iov = &iovs[n];
+			hdr->msg_iovlen = 1;
+			hdr->msg_name = msg->addr;
+			hdr->msg_namelen = msg->addr ? msg->addrlen : 0;
+#ifdef USE_GSO
+			if (split) {
+				ev_uint16_t size = (ev_uint16_t)msg->segment_size;
+				struct cmsghdr *cm;
+				hdr->msg_control = cmsgs[n].buf;
+				hdr->msg_controllen = sizeof(cmsgs[n].buf);
+				cm = CMSG_FIRSTHDR(hdr);
+				cm->cmsg_level = IPPROTO_UDP;
+				cm->cmsg_type = UDP_SEGMENT;
+				cm->cmsg_len = CMSG_LEN(sizeof(size));
+				memcpy(CMSG_DATA(cm), &size, sizeof(size));
+			}
+#endif
+			++n;
+		}
+		if (!n) {
+			/* The next message needs splitting by hand. */
+			if (evdgram_send_split(dg, &msgs[done]) < 0)
+				break;
+			++done;
+			continue;
+		}
+		r = sendmmsg(dg->fd, hdrs, n, 0);
+		if (r < 0)
+			break;
+		++dg->stats.n_sends;
+		for (i = 0; i < r; ++i)
+			dg->stats.n_datagrams_sent +=
+			    evdgram_msg_count(&msgs[done + i]);
+		done += r;
+		if (r < n)
+			break;
+	}
+#else
+	for (; done < n_msgs; ++done) {
+		const struct evdgram_msg *msg = &msgs[done];
+		if (msg->segment_size && msg->iov_len > msg->segment_size) {
+			if (evdgram_send_split(dg, msg) < 0)
+				break;
+			continue;
+		}
+		if (sendto(dg->fd, msg->iov_base, (int)msg->iov_len, 0,
+			msg->addr, msg->addr ? msg->addrlen : 0) < 0)
+			break;
+		++dg->stats.n_sends;
+		++dg->stats.n_datagrams_sent;
+	}
+#endif
+	return done ? done : (n_msgs ? -1 : 0);
+}
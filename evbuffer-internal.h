@@ -75,6 +75,114 @@ struct evbuffer_cb_entry {
 	ev_uint32_t flags;
 };
 
+/** An entry in an evbuffer_index: one chain, and where it starts. */
+struct evbuffer_index_entry {
+	struct evbuffer_chain *chain;
+	/** The offset of the chain's first byte, counting from wherever the
+	 * front of the buffer was when the index was last started. */
+	size_t start;
+};
+
+/** A sorted array of the chains in a long evbuffer, so that
+ * evbuffer_ptr_set() can binary-search for a position instead of walking
+ * the chain list from the start.
+ *
+ * The index only covers chains before the last one with data, whose
+ * lengths and offsets never change while appends go on at the end.
+ * Draining just advances 'base'; an entry that starts at or before 'base'
+ * may name a chain that was freed, and is never used.  Anything that moves
+ * data around at the front of the buffer clears the index instead.  It is
+ * filled in lazily, as far as the positions that are asked for.
+ */
+struct evbuffer_index {
+	/** How many bytes have been drained since the index was started. */
+	size_t base;
+	/** The entries; the live ones are entries[first] .. entries[n-1]. */
+	struct evbuffer_index_entry *entries;
+	size_t first;
+	size_t n;
+	size_t n_alloc;
+};
+
+/** Seeks that walk over at least this many chains get an index. */
+#define EVBUFFER_INDEX_MIN_CHAINS 64
+
+/** State for evbuffer_set_compaction().
+ *
+ * While the buffer is in use, idle_ev fires every 'idle'.  When it fires
+ * and the buffer hasn't changed since the last time, compact_cb gets
+ * scheduled, which compacts a little at a time from the deferred callback
+ * queue.  Until then, the buffer and its bufferevent stay referenced.
+ */
+struct evbuffer_compactor {
+	struct event_base *base;
+	struct event idle_ev;
+	struct event_callback compact_cb;
+	struct timeval idle;
+	/** The bufferevent we hold a reference to while armed, if any. */
+	struct bufferevent *parent;
+	/** False once the buffer is freed, or compaction is turned off. */
+	unsigned enabled : 1;
+	/** True iff the buffer has changed since idle_ev was last added. */
+	unsigned changed : 1;
+	/** True iff idle_ev is added or compact_cb is scheduled. */
+	unsigned armed : 1;
+	/** True iff compact_cb, rather than idle_ev, is pending. */
+	unsigned compacting : 1;
+};
+
+/** Bytes compact_cb copies each time it runs. */
+#define EVBUFFER_COMPACT_BUDGET 65536
+/** Compaction won't merge chains into one bigger than this. */
+#define EVBUFFER_COMPACT_MAX_MERGE 16384
+
+/** A free block in an evbuffer_chain_pool. */
+struct evbuffer_pool_block {
+	struct evbuffer_pool_block *next;
+};
+
+/** A region of memory mapped for an evbuffer_chain_pool. */
+struct evbuffer_pool_region {
+	struct evbuffer_pool_region *next;
+	void *mem;
+	size_t len;
+};
+
+/** Regions are mapped this much at a time, aligned to it, so that each
+ * can be a single huge page. */
+#define EVBUFFER_POOL_REGION_SIZE ((size_t)2 << 20)
+/** The smallest block a pool hands out. */
+#define EVBUFFER_POOL_MIN_BLOCK 4096
+/** How many block sizes a pool has: powers of two from
+ * EVBUFFER_POOL_MIN_BLOCK through half a region. */
+#define EVBUFFER_POOL_N_CLASSES 9
+/** The default smallest chain to allocate from a pool. */
+#define EVBUFFER_POOL_DEFAULT_MIN 16384
+
+/** State for evbuffer_base_set_chain_pool().
+ *
+ * Blocks get carved off the newest region as needed, and go onto the free
+ * list for their size when their chain is freed.  The pool is freed, and
+ * its regions unmapped, once the event_base, the evbuffers using it, and
+ * the chains allocated from it are all gone.
+ */
+struct evbuffer_chain_pool {
+	void *lock;
+	/** One for the event_base, one for each evbuffer using us, and one
+	 * for each chain we've handed out. */
+	int refcnt;
+	unsigned flags;
+	/** Smallest block, in bytes, that chains from us come in. */
+	size_t min_block;
+	size_t max_bytes;
+	struct evbuffer_pool_region *regions;
+	/** Where the unused part of the newest region starts. */
+	unsigned char *next_free;
+	size_t left;
+	struct evbuffer_pool_block *free_blocks[EVBUFFER_POOL_N_CLASSES];
+	struct evbuffer_chain_pool_stats stats;
+};
+
 struct bufferevent;
 struct evbuffer_chain;
 struct evbuffer {
@@ -102,6 +210,23 @@ struct evbuffer {
 	size_t total_len;
 	/** Maximum bytes per one read */
 	size_t max_read;
+	/** With EVBUFFER_FLAG_ADAPTIVE_READ: how many reads in a row have come
+	 * back with much less than read_stats.read_size. */
+	unsigned read_misses;
+	/** What evbuffer_read has been up to. */
+	struct evbuffer_read_stats read_stats;
+	/** An index of the chains, if seeks in this buffer have been walking
+	 * over many of them; otherwise NULL. */
+	struct evbuffer_index *index;
+	/** How much of total_len the memory accounting of our parent
+	 * bufferevent knows about. */
+	size_t accounted_len;
+	/** Set up by evbuffer_set_compaction(); otherwise NULL. */
+	struct evbuffer_compactor *compactor;
+	/** What compaction has done to this buffer. */
+	struct evbuffer_compact_stats compact_stats;
+	/** Set up by evbuffer_set_chain_pool(); otherwise NULL. */
+	struct evbuffer_chain_pool *pool;
 
 	/** Number of bytes we have added to the buffer since we last tried to
 	 * invoke callbacks. */
@@ -133,6 +258,10 @@ struct evbuffer {
 	/** True iff this buffer is set up for overlapped IO. */
 	unsigned is_overlapped : 1;
 #endif
+	/** True iff a file segment with EVBUF_FS_READAHEAD may be in this
+	 * buffer: one has been added since it was last emptied, or since
+	 * evbuffer_file_write_ready_() last found none. */
+	unsigned has_readahead : 1;
 	/** Zero or more EVBUFFER_FLAG_* bits */
 	ev_uint32_t flags;
 
@@ -202,6 +331,11 @@ struct evbuffer_chain {
 #define EVBUFFER_DANGLING	0x0040
 	/** a chain that is a referenced copy of another chain */
 #define EVBUFFER_MULTICAST	0x0080
+	/** a chain allocated from an evbuffer_chain_pool, which
+	 * evbuffer_chain_pooled points to */
+#define EVBUFFER_POOLED		0x0100
+	/** a chain that holds part of an evbuffer_shared */
+#define EVBUFFER_SHARED		0x0200
 
 	/** number of references to this chain */
 	int refcnt;
@@ -265,6 +399,64 @@ struct evbuffer_file_segment {
 	evbuffer_file_segment_cleanup_cb cleanup_cb;
 	/** Argument to be pass to cleanup callback function */
 	void *cleanup_cb_arg;
+	/** With EVBUF_FS_READAHEAD: how far into the file we've asked the
+	 * kernel to read. */
+	ev_off_t readahead_to;
+	/** With EVBUF_FS_READAHEAD, on a segment we send with sendfile: a
+	 * mapping of the segment that we never touch, except to ask mincore()
+	 * what's in the page cache, and to read it in off the loop thread. */
+	void *probe;
+};
+
+/* Declared in event2/buffer.h; defined here. */
+struct evbuffer_shared {
+	void *lock; /**< lock prevent concurrent access to refcnt */
+	int refcnt; /**< Reference count for this evbuffer_shared */
+	/** The data, and how long it is. */
+	const unsigned char *data;
+	size_t length;
+	/** Called when we're done with data, if we didn't copy it. */
+	evbuffer_ref_cleanup_cb cleanupfn;
+	void *cleanupfn_arg;
+};
+
+/** The evbuffer_shared for a chain.  Lives at the end of an evbuffer_chain
+ * with the EVBUFFER_SHARED flag set.  */
+struct evbuffer_chain_shared {
+	struct evbuffer_shared *shared;
+};
+
+/* Declared in event2/buffer.h; defined here.
+ *
+ * The writer appends to the chain at 'tail', and publishes each byte it
+ * adds by storing the chain's new 'off'; it publishes a new chain by
+ * storing it in the old one's 'next', after which it never touches the old
+ * one again.  The reader takes chains from 'head' once they have a 'next',
+ * and copies what has been published of the last one.  Without
+ * EVUTIL_HAVE_ATOMICS, both sides take 'lock' instead.
+ */
+struct evbuffer_spsc {
+	struct event_base *base;
+	/** Run on the loop thread when the writer adds to an idle queue. */
+	struct event_callback deferred;
+	evbuffer_spsc_cb cb;
+	void *cbarg;
+	void *lock;
+
+	/** The reader's side: the oldest chain we haven't taken, how much of
+	 * it we've copied, and where it all goes. */
+	struct evbuffer_chain *head;
+	size_t head_pos;
+	struct evbuffer *input;
+
+	/** Keep the writer's fields off the reader's cache line. */
+	char pad_[64];
+
+	/** The writer's side: the chain it's adding to. */
+	struct evbuffer_chain *tail;
+	/** Set by the writer when it has woken the reader; cleared by the
+	 * reader before it looks for data. */
+	int wake_pending;
 };
 
 /** Information about the multicast parent of a chain.  Lives at the
@@ -276,6 +468,14 @@ struct evbuffer_multicast_parent {
 	struct evbuffer_chain *parent;
 };
 
+/** The pool a chain came from.  Lives at the end of an evbuffer_chain with
+ * the EVBUFFER_POOLED flag set, just before its data. */
+struct evbuffer_chain_pooled {
+	struct evbuffer_chain_pool *pool;
+	/** Keeps the data aligned */
+	void *unused;
+};
+
 #define EVBUFFER_CHAIN_SIZE sizeof(struct evbuffer_chain)
 /** Return a pointer to extra data allocated along with an evbuffer. */
 #define EVBUFFER_CHAIN_EXTRA(t, c) (t *)((struct evbuffer_chain *)(c) + 1)
@@ -336,6 +536,48 @@ int evbuffer_read_setup_vecs_(struct evbuffer *buf, ev_ssize_t howmuch,
 /* XXXX the cast above is safe for now, but not if we allow mmaps on win64.
  * See note in buffer_iocp's launch_write function */
 
+/** The chains that one MSG_ZEROCOPY send pointed into.  The kernel may still
+ * read from them until it tells us it's done, so we hold a reference to each
+ * of them and mark them immutable so that nobody writes into them. */
+struct evbuffer_zerocopy_send {
+	/** Next send on the same socket, in the order they were made. */
+	struct evbuffer_zerocopy_send *next;
+	/** The number that the kernel uses for this send in its
+	 * notifications. */
+	ev_uint32_t id;
+	/** How many chains we hold. */
+	int n_chains;
+	/** The chains we hold.  Allocated along with this structure. */
+	struct evbuffer_chain **chains;
+};
+
+/** Like evbuffer_write_atmost(), but send with MSG_ZEROCOPY.  The caller must
+ * already have set SO_ZEROCOPY on fd.  If the kernel took some data without
+ * copying it, sets *sendp to a newly allocated evbuffer_zerocopy_send that
+ * holds on to it; otherwise sets *sendp to NULL.  Returns -2 if the kernel
+ * refused to take any more zero-copy sends, so the caller can copy instead. */
+int evbuffer_write_zerocopy_(struct evbuffer *buffer, evutil_socket_t fd,
+    ev_ssize_t howmuch, struct evbuffer_zerocopy_send **sendp);
+/** Release the chains held by send, once the kernel is done with them, and
+ * free send.  buffer is the evbuffer that send was made from, or NULL if that
+ * has been freed already. */
+void evbuffer_zerocopy_send_free_(struct evbuffer *buffer,
+    struct evbuffer_zerocopy_send *send);
+
+/** Return how many bytes from the front of buf, up to howmuch, we can write
+ * without waiting for the disk, or -1 if they include no part of a file
+ * segment with EVBUF_FS_READAHEAD.  Asks the kernel to read ahead for any
+ * such segment that we reach.  Requires buf's lock. */
+ev_ssize_t evbuffer_file_write_ready_(struct evbuffer *buf,
+    ev_ssize_t howmuch);
+/** Have base's file offload function read in the next part of the file
+ * segment at the front of buf, and call done(arg) from the event loop once
+ * it's in.  Returns 0 on success, or -1 if base has no offload function, or
+ * buf doesn't start with a segment that needs reading.  Requires buf's
+ * lock. */
+int evbuffer_file_fetch_(struct evbuffer *buf, struct event_base *base,
+    void (*done)(void *), void *arg);
+
 /** Set the parent bufferevent object for buf to bev */
 void evbuffer_set_parent_(struct evbuffer *buf, struct bufferevent *bev);
 
@@ -102,6 +102,8 @@
 #include "ipv6-internal.h"
 #include "util-internal.h"
 #include "evthread-internal.h"
+#include "time-internal.h"
+#include "ht-internal.h"
 #ifdef _WIN32
 #include <ctype.h>
 #include <winsock2.h>
@@ -117,6 +119,9 @@
 #ifdef EVENT__HAVE_NETINET_IN6_H
 #include <netinet/in6.h>
 #endif
+#ifdef EVENT__HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
 
 #define EVDNS_LOG_DEBUG EVENT_LOG_DEBUG
 #define EVDNS_LOG_WARN EVENT_LOG_WARN
@@ -126,6 +131,21 @@
 #define EVDNS_NAME_MAX 255
 #endif
 
+/* Maximum number of datagrams read or written with one system call. */
+#define EVDNS_UDP_BATCH 16
+/* Number of recent round-trip times kept per nameserver. */
+#define EVDNS_RTT_RING 32
+/* Lower bound for adaptive request timeouts, in usec. */
+#define EVDNS_RTO_MIN 200000
+/* Number of random transaction ids we get from the RNG at once. */
+#define EVDNS_TRANS_ID_POOL 64
+/* Upper bound for the TCP reconnection backoff, in seconds. */
+#define EVDNS_TCP_MAX_BACKOFF 60
+/* Number of hosts file lines parsed per loop iteration during a reload. */
+#define EVDNS_HOSTS_RELOAD_LINES 1024
+/* TTL of stale answers served when all nameservers fail (RFC 8767). */
+#define EVDNS_STALE_TTL 30
+
 #include <stdio.h>
 
 #undef MIN
@@ -211,6 +231,25 @@ struct evdns_request {
 	char *search_origname;	/* needs to be free()ed */
 	int search_flags;
 	u16 tcp_flags;
+
+	/* lowercased name the caller asked for, or NULL if neither the cache
+	 * nor coalescing is enabled.  Together with lookup_type,
+	 * lookup_searched and lookup_flags it identifies the question for
+	 * the response cache and for coalescing.  Needs to be free()ed */
+	char *lookup_name;
+	u16 lookup_type;
+	u16 lookup_flags;
+	unsigned lookup_searched : 1;
+	unsigned lookup_indexed : 1; /* in base->inflight */
+
+	/* Identical lookups share one request: the handle that owns the
+	 * request is indexed in base->inflight and keeps the others on its
+	 * waiters list until the answer arrives. */
+	HT_ENTRY(evdns_request) inflight_node;
+	struct evdns_request *leader;
+	TAILQ_HEAD(evdns_waiter_list, evdns_request) waiters;
+	TAILQ_ENTRY(evdns_request) waiter_next;
+	char **put_cname_in_ptr; /* for waiters, as in struct request */
 };
 
 struct request {
@@ -232,6 +271,17 @@ struct request {
 	unsigned request_appended :1;	/* true if the request pointer is data which follows this struct */
 	unsigned transmit_me :1;  /* needs to be transmitted */
 	unsigned need_cname :1;   /* make a separate callback for CNAME */
+	unsigned send_queued :1;  /* on ns->send_queue */
+	unsigned hedge_pending :1;  /* timeout_event is the hedge timer */
+	unsigned hedged :1;  /* a copy was sent to a second nameserver */
+
+	/* when we last transmitted this request, for RTT sampling */
+	struct timeval sent_at;
+	/* time left before the real timeout once the hedge timer fires */
+	struct timeval hedge_rest;
+
+	/* link in ns->send_queue, when udp-batch is set */
+	TAILQ_ENTRY(request) send_next;
 
 	/* XXXX This is a horrible hack. */
 	char **put_cname_in_ptr; /* store the cname here if we get one. */
@@ -251,6 +301,8 @@ struct tcp_connection {
 	struct bufferevent *bev;
 	enum tcp_state state;
 	u16 awaiting_packet_size;
+	/* DNS client only: true once a reply has been read from it */
+	unsigned answered : 1;
 };
 
 struct evdns_server_port;
@@ -284,6 +336,29 @@ struct nameserver {
 	/* Number of currently inflight requests: used
 	 * to track when we should add/del the event. */
 	int requests_inflight;
+
+	/* Requests waiting to be written together by evdns_flush_sends. */
+	TAILQ_HEAD(evdns_send_queue, request) send_queue;
+
+	/* Smoothed round-trip time and its variance, in usec, as in
+	 * RFC 6298.  srtt is 0 until the first answer or timeout. */
+	int srtt;
+	int rttvar;
+	/* The most recent samples, for hedge_delay; rtt_next is the slot
+	 * that the next one goes in. */
+	int rtt_ring[EVDNS_RTT_RING];
+	int rtt_samples;
+	int rtt_next;
+	/* How long to wait for this server before hedging, in usec. */
+	int hedge_delay;
+
+	/* DNS over TCP: when the last reply was read from connection, and
+	 * how long we wait before connecting again after a failed attempt
+	 * (zero after a successful one). */
+	struct timeval tcp_last_reply;
+	struct timeval tcp_backoff;
+	struct event tcp_reconnect_event;
+	unsigned tcp_reconnect_pending : 1;
 };
 
 
@@ -293,6 +368,10 @@ struct evdns_server_port {
 	int refcnt; /* reference count. */
 	char choked; /* Are we currently blocked from writing? */
 	char closing; /* Are we trying to close this port, pending writes? */
+	char write_waiting; /* Are we waiting for EV_WRITE events? */
+	char batch_replies; /* Queue UDP replies until the next flush? */
+	char flush_scheduled; /* Is flush_cb pending?  It holds a reference. */
+	struct event_callback flush_cb; /* Writes the queued UDP replies */
 	evdns_request_callback_fn_type user_callback; /* Fn to handle requests */
 	void *user_data; /* Opaque pointer passed to user_callback */
 	struct event event; /* Read/write event */
@@ -353,10 +432,48 @@ struct server_request {
 	char *response;
 	size_t response_len;
 
+	/* Wire format of the only question, as the client sent it, if it
+	 * used no compression; stored after the question's name. */
+	const u8 *question_wire;
+	u16 question_wire_len;
+	/* true if the request carried an EDNS0 OPT record */
+	unsigned edns : 1;
+
 	/* Caller-visible fields: flags, questions. */
 	struct evdns_server_request base;
 };
 
+/* A cached answer (or negative answer) for one question. */
+struct evdns_cache_entry {
+	HT_ENTRY(evdns_cache_entry) node;
+	/* most recently used entries are at the head */
+	TAILQ_ENTRY(evdns_cache_entry) lru;
+
+	/* Key: lowercased name as asked by the user, type, class, and
+	 * whether the search list was applied to the name. */
+	char *name;
+	u16 type;
+	u16 class;
+	unsigned searched : 1;
+
+	/* monotonic time when this entry stops being valid */
+	struct timeval expires;
+	/* monotonic time until which it may still be served when all
+	 * nameservers fail (RFC 8767); equal to expires unless
+	 * cache-max-stale is set */
+	struct timeval stale_until;
+	/* TTL the entry was stored with, after clamping */
+	u32 ttl;
+	/* a background refresh of this entry is in flight */
+	unsigned prefetching : 1;
+	/* DNS_ERR_NONE, DNS_ERR_NOTEXIST or DNS_ERR_NODATA */
+	int err;
+	u32 rr_count;
+	size_t datalen;
+	void *data;
+	char *cname;
+};
+
 struct evdns_base {
 	/* An array of n_req_heads circular lists for inflight requests.
 	 * Each inflight request req is in req_heads[req->trans_id % n_req_heads].
@@ -369,6 +486,16 @@ struct evdns_base {
 	struct nameserver *server_head;
 	int n_req_heads;
 
+	/* Open-addressing table of the inflight requests, keyed by */
+	/* transaction id, with trans_map_mask+1 slots (a power of two). */
+	struct request **trans_map;
+	unsigned trans_map_mask;
+	unsigned trans_map_count;
+	/* Random transaction ids, drawn EVDNS_TRANS_ID_POOL at a time; */
+	/* the first trans_id_pool_left of them haven't been used yet. */
+	u16 trans_id_pool[EVDNS_TRANS_ID_POOL];
+	int trans_id_pool_left;
+
 	struct event_base *event_base;
 
 	/* The number of good nameservers that we have */
@@ -402,6 +529,9 @@ struct evdns_base {
 	u16 global_tcp_flags;
 	/* Idle timeout for outgoing TCP connections. */
 	struct timeval global_tcp_idle_timeout;
+	/* First delay before reconnecting to a nameserver after a TCP
+	 * connection failed; zero to reconnect on the next query. */
+	struct timeval global_tcp_reconnect_backoff;
 
 	/** Port to bind to for outgoing DNS packets. */
 	struct sockaddr_storage global_outgoing_address;
@@ -420,7 +550,24 @@ struct evdns_base {
 
 	struct search_state *global_search_state;
 
-	TAILQ_HEAD(hosts_list, hosts_entry) hostsdb;
+	/* Entries from the hosts file. */
+	struct hosts_db *hostsdb;
+	/* Answer reverse lookups from hostsdb where we can. */
+	int hosts_reverse;
+	/* The last hosts file loaded, which we reload when it changes: */
+	/* hosts_check_ev compares its mtime and size every */
+	/* hosts-reload-interval, and then hosts_parse_ev parses */
+	/* hosts_text into hosts_pending a slice at a time, so that a */
+	/* big file doesn't stall the loop.  hostsdb is replaced at the */
+	/* end. */
+	char *hosts_fname;
+	time_t hosts_mtime;
+	ev_int64_t hosts_size;
+	struct event hosts_check_ev;
+	struct event hosts_parse_ev;
+	struct hosts_db *hosts_pending;
+	char *hosts_text;
+	size_t hosts_text_pos;
 
 #ifndef EVENT__DISABLE_THREAD_SUPPORT
 	void *lock;
@@ -434,19 +581,200 @@ struct evdns_base {
 	int ns_max_probe_timeout;
 	/* Backoff factor of probe timeout */
 	int ns_timeout_backoff_factor;
+
+	/* Response cache; disabled while cache_max_entries is 0. */
+	HT_HEAD(evdns_cache_map, evdns_cache_entry) cache;
+	TAILQ_HEAD(evdns_cache_lru, evdns_cache_entry) cache_lru;
+	size_t cache_max_entries;
+	u32 cache_min_ttl;
+	u32 cache_max_ttl;
+	u32 cache_max_negative_ttl;
+	/* Refresh answers queried within the last cache_prefetch percent of
+	 * their TTL; 0 to disable. */
+	int cache_prefetch;
+	/* Seconds past expiry an answer may be served if all nameservers
+	 * fail; 0 to disable. */
+	u32 cache_max_stale;
+	struct evdns_cache_stats cache_stats;
+	struct evutil_monotonic_timer monotonic_timer;
+
+	/* Handles with a request outstanding, keyed by question, so that
+	 * identical lookups can share it. */
+	HT_HEAD(evdns_inflight_map, evdns_request) inflight;
+	int coalesce_queries;
+
+	/* If set, UDP queries are queued on their nameserver and written
+	 * together by send_flush_cb once per loop iteration. */
+	int udp_batch;
+	struct event_callback send_flush_cb;
+
+	/* Latency-aware nameserver selection: prefer servers with a low
+	 * srtt, derive request timeouts from it, and resend slow queries to
+	 * a second server after the hedge_percentile'th percentile RTT. */
+	int rtt_select;
+	int adaptive_timeout;
+	int hedge_percentile;
+	struct evutil_weakrand_state weakrand_seed;
 };
 
 struct hosts_entry {
 	TAILQ_ENTRY(hosts_entry) next;
+	HT_ENTRY(hosts_entry) name_node;
+	HT_ENTRY(hosts_entry) addr_node;
+	/* Later entries with the same name, in file order.  last_by_name */
+	/* is only set in the entry that is in the name index. */
+	struct hosts_entry *next_by_name;
+	struct hosts_entry *last_by_name;
 	union {
 		struct sockaddr sa;
 		struct sockaddr_in sin;
 		struct sockaddr_in6 sin6;
 	} addr;
 	int addrlen;
-	char hostname[1];
+	char *hostname; /* stored just after the entry */
+};
+
+struct hosts_db {
+	/* every entry, in file order */
+	TAILQ_HEAD(hosts_list, hosts_entry) entries;
+	/* the first entry for each name, compared case-insensitively */
+	HT_HEAD(hosts_name_map, hosts_entry) by_name;
+	/* the first entry for each address */
+	HT_HEAD(hosts_addr_map, hosts_entry) by_addr;
 };
 
+static inline unsigned
+hosts_entry_name_hash(const struct hosts_entry *e)
+{
+	/* ht_string_hash_, over the lowercased name */
+	const unsigned char *cp = (const unsigned char *)e->hostname;
+	unsigned h = (unsigned)EVUTIL_TOLOWER_(*cp) << 7;
+	while (*cp)
+		h = (1000003*h) ^ (unsigned char)EVUTIL_TOLOWER_(*cp++);
+	h ^= (unsigned)(cp - (const unsigned char *)e->hostname);
+	return ht_improve_hash_(h);
+}
+
+static inline int
+hosts_entry_name_eq(const struct hosts_entry *a, const struct hosts_entry *b)
+{
+	return !evutil_ascii_strcasecmp(a->hostname, b->hostname);
+}
+
+static inline unsigned
+hosts_entry_addr_hash(const struct hosts_entry *e)
+{
+	const unsigned char *cp;
+	unsigned h = 0;
+	int i;
+
+	if (e->addr.sa.sa_family == AF_INET)
+		return ht_improve_hash_(e->addr.sin.sin_addr.s_addr);
+	cp = e->addr.sin6.sin6_addr.s6_addr;
+	for (i = 0; i < 16; ++i)
+		h = (1000003*h) ^ cp[i];
+	return ht_improve_hash_(h);
+}
+
+static inline int
+hosts_entry_addr_eq(const struct hosts_entry *a, const struct hosts_entry *b)
+{
+	return !evutil_sockaddr_cmp(&a->addr.sa, &b->addr.sa, 0);
+}
+
+HT_PROTOTYPE(hosts_name_map, hosts_entry, name_node, hosts_entry_name_hash,
+    hosts_entry_name_eq)
+HT_GENERATE(hosts_name_map, hosts_entry, name_node, hosts_entry_name_hash,
+    hosts_entry_name_eq, 0.5, mm_malloc, mm_realloc, mm_free)
+HT_PROTOTYPE(hosts_addr_map, hosts_entry, addr_node, hosts_entry_addr_hash,
+    hosts_entry_addr_eq)
+HT_GENERATE(hosts_addr_map, hosts_entry, addr_node, hosts_entry_addr_hash,
+    hosts_entry_addr_eq, 0.5, mm_malloc, mm_realloc, mm_free)
+
+static struct hosts_db *
+hosts_db_new(void)
+{
+	struct hosts_db *db = mm_calloc(1, sizeof(*db));
+	if (!db)
+		return NULL;
+	TAILQ_INIT(&db->entries);
+	HT_INIT(hosts_name_map, &db->by_name);
+	HT_INIT(hosts_addr_map, &db->by_addr);
+	return db;
+}
+
+static void
+hosts_db_clear(struct hosts_db *db)
+{
+	struct hosts_entry *victim;
+	HT_CLEAR(hosts_name_map, &db->by_name);
+	HT_CLEAR(hosts_addr_map, &db->by_addr);
+	while ((victim = TAILQ_FIRST(&db->entries))) {
+		TAILQ_REMOVE(&db->entries, victim, next);
+		mm_free(victim);
+	}
+}
+
+static void
+hosts_db_free(struct hosts_db *db)
+{
+	if (!db)
+		return;
+	hosts_db_clear(db);
+	mm_free(db);
+}
+
+static int
+hosts_db_add(struct hosts_db *db, const struct sockaddr *sa, int socklen,
+    const char *hostname)
+{
+	const size_t namelen = strlen(hostname);
+	struct hosts_entry *he, *first;
+
+	he = mm_calloc(1, sizeof(struct hosts_entry) + namelen + 1);
+	if (!he)
+		return -1;
+	EVUTIL_ASSERT(socklen <= (int)sizeof(he->addr));
+	memcpy(&he->addr, sa, socklen);
+	he->addrlen = socklen;
+	he->hostname = (char *)(he + 1);
+	memcpy(he->hostname, hostname, namelen + 1);
+
+	if ((first = HT_FIND(hosts_name_map, &db->by_name, he))) {
+		first->last_by_name->next_by_name = he;
+		first->last_by_name = he;
+	} else {
+		he->last_by_name = he;
+		HT_INSERT(hosts_name_map, &db->by_name, he);
+	}
+	if (!HT_FIND(hosts_addr_map, &db->by_addr, he))
+		HT_INSERT(hosts_addr_map, &db->by_addr, he);
+	TAILQ_INSERT_TAIL(&db->entries, he, next);
+	return 0;
+}
+
+/* Return the first entry for hostname; the others follow it through */
+/* next_by_name. */
+static struct hosts_entry *
+hosts_db_find_name(struct hosts_db *db, const char *hostname)
+{
+	struct hosts_entry find;
+	find.hostname = (char *)hostname;
+	return HT_FIND(hosts_name_map, &db->by_name, &find);
+}
+
+/* Return the first entry for the address in sa. */
+static struct hosts_entry *
+hosts_db_find_addr(struct hosts_db *db, const struct sockaddr *sa,
+    int socklen)
+{
+	struct hosts_entry find;
+	if (socklen > (int)sizeof(find.addr))
+		return NULL;
+	memcpy(&find.addr, sa, socklen);
+	return HT_FIND(hosts_addr_map, &db->by_addr, &find);
+}
+
 static struct evdns_base *current_base = NULL;
 
 struct evdns_base *
@@ -464,6 +792,10 @@ evdns_get_global_base(void)
 #define REQ_HEAD(base, id) ((base)->req_heads[id % (base)->n_req_heads])
 
 static struct nameserver *nameserver_pick(struct evdns_base *base);
+static void nameserver_rtt_sample(struct nameserver *ns, const struct request *req);
+static void evdns_hosts_reload_cancel_(struct evdns_base *base);
+static void evdns_hosts_check_cb(evutil_socket_t fd, short what, void *arg);
+static void evdns_hosts_parse_cb(evutil_socket_t fd, short what, void *arg);
 static void evdns_request_insert(struct request *req, struct request **head);
 static void evdns_request_remove(struct request *req, struct request **head);
 static void nameserver_ready_callback(evutil_socket_t fd, short events, void *arg);
@@ -493,6 +825,29 @@ static void incoming_conn_cb(struct evconnlistener *listener, evutil_socket_t fd
     struct sockaddr *address, int socklen, void *arg);
 
 static int strtoint(const char *const str);
+static void request_unqueue_send(struct request *req);
+static void evdns_handle_free_(struct evdns_request *handle);
+static void evdns_cache_store_(struct evdns_base *base,
+    struct evdns_request *handle, int type, u32 ttl, int err,
+    const struct reply *reply);
+static void evdns_cache_flush_(struct evdns_base *base);
+static int evdns_lookup_start_(struct evdns_base *base,
+    struct evdns_request *handle, int type, const char *name, int flags);
+static void evdns_lookup_index_(struct evdns_base *base,
+    struct evdns_request *handle);
+static void evdns_lookup_config_changed_(struct evdns_base *base);
+static void evdns_coalesce_finish_(struct evdns_base *base,
+    struct evdns_request *handle, int type, u32 ttl, int err,
+    const struct reply *reply, int priority);
+static void evdns_coalesce_cancel_(struct evdns_base *base,
+    struct evdns_request *handle);
+static char *evdns_cache_cname_dup_(struct evdns_base *base, int type,
+    const char *name, int flags);
+static int evdns_cache_stale_(struct evdns_base *base,
+    struct evdns_request *handle, int type, u32 *ttl, u32 *err,
+    struct reply *reply);
+static void evdns_cache_prefetch_done_(struct evdns_base *base,
+    struct evdns_request *handle, int type);
 
 #ifdef EVENT__DISABLE_THREAD_SUPPORT
 #define EVDNS_LOCK(base)  EVUTIL_NIL_STMT_
@@ -640,21 +995,112 @@ disconnect_and_free_connection(struct tcp_connection *conn)
 	mm_free(conn);
 }
 
-/* This walks the list of inflight requests to find the */
-/* one with a matching transaction id. Returns NULL on */
-/* failure */
+/* Transaction ids are random, so the low bits make a fine hash. */
+#define TRANS_MAP_SLOT(base, id) ((unsigned)(id) & (base)->trans_map_mask)
+
+/* Rebuild the transaction id table with n_slots slots. */
+static int
+trans_map_resize(struct evdns_base *base, unsigned n_slots)
+{
+	struct request **old_map = base->trans_map, **new_map;
+	unsigned old_n_slots = old_map ? base->trans_map_mask + 1 : 0;
+	unsigned i, j;
+
+	new_map = mm_calloc(n_slots, sizeof(struct request *));
+	if (!new_map)
+		return -1;
+	for (i = 0; i < old_n_slots; ++i) {
+		if (!old_map[i])
+			continue;
+		j = old_map[i]->trans_id & (n_slots - 1);
+		while (new_map[j])
+			j = (j + 1) & (n_slots - 1);
+		new_map[j] = old_map[i];
+	}
+	if (old_map)
+		mm_free(old_map);
+	base->trans_map = new_map;
+	base->trans_map_mask = n_slots - 1;
+	return 0;
+}
+
+/* Make the table big enough to stay at most half full with n requests. */
+static int
+trans_map_reserve(struct evdns_base *base, unsigned n)
+{
+	unsigned n_slots = 16;
+	while (n_slots < 65536 && n_slots < n * 2)
+		n_slots <<= 1;
+	if (base->trans_map && n_slots <= base->trans_map_mask + 1)
+		return 0;
+	return trans_map_resize(base, n_slots);
+}
+
+static void
+trans_map_add(struct evdns_base *base, struct request *req)
+{
+	unsigned i;
+
+	/* If we can't grow the table, keep filling it: it always has */
+	/* room for all 65535 usable ids. */
+	(void) trans_map_reserve(base, base->trans_map_count + 1);
+	EVUTIL_ASSERT(base->trans_map_count < base->trans_map_mask);
+	i = TRANS_MAP_SLOT(base, req->trans_id);
+	while (base->trans_map[i])
+		i = (i + 1) & base->trans_map_mask;
+	base->trans_map[i] = req;
+	base->trans_map_count++;
+}
+
+static void
+trans_map_remove(struct evdns_base *base, struct request *req)
+{
+	struct request **map = base->trans_map;
+	unsigned i, j, k;
+
+	i = TRANS_MAP_SLOT(base, req->trans_id);
+	while (map[i] != req) {
+		if (!map[i])
+			return;
+		i = (i + 1) & base->trans_map_mask;
+	}
+	map[i] = NULL;
+	base->trans_map_count--;
+
+	/* Shift back the requests after it in the same run that would */
+	/* no longer be found past the hole. */
+	for (j = (i + 1) & base->trans_map_mask; map[j];
+	     j = (j + 1) & base->trans_map_mask) {
+		k = TRANS_MAP_SLOT(base, map[j]->trans_id);
+		if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+			continue;
+		map[i] = map[j];
+		map[j] = NULL;
+		i = j;
+	}
+}
+
+static void
+trans_map_clear(struct evdns_base *base)
+{
+	memset(base->trans_map, 0,
+	    (base->trans_map_mask + 1) * sizeof(struct request *));
+	base->trans_map_count = 0;
+}
+
+/* Find the inflight request with a matching transaction id. */
+/* Returns NULL on failure */
 static struct request *
 request_find_from_trans_id(struct evdns_base *base, u16 trans_id) {
-	struct request *req = REQ_HEAD(base, trans_id);
-	struct request *const started_at = req;
+	unsigned i;
 
 	ASSERT_LOCKED(base);
 
-	if (req) {
-		do {
-			if (req->trans_id == trans_id) return req;
-			req = req->next;
-		} while (req != started_at);
+	i = TRANS_MAP_SLOT(base, trans_id);
+	while (base->trans_map[i]) {
+		if (base->trans_map[i]->trans_id == trans_id)
+			return base->trans_map[i];
+		i = (i + 1) & base->trans_map_mask;
 	}
 
 	return NULL;
@@ -720,6 +1166,10 @@ static void
 request_swap_ns(struct request *req, struct nameserver *ns) {
 	if (ns && req->ns != ns) {
 		EVUTIL_ASSERT(req->ns->requests_inflight > 0);
+		if (req->send_queued) {
+			request_unqueue_send(req);
+			req->transmit_me = 1;
+		}
 		req->ns->requests_inflight--;
 		ns->requests_inflight++;
 
@@ -864,6 +1314,7 @@ request_finished(struct request *const req, struct request **head, int free_hand
 		evdns_request_remove(req, head);
 
 	log(EVDNS_LOG_DEBUG, "Removing timeout for request %p", (void *)req);
+	request_unqueue_send(req);
 	if (was_inflight) {
 		evtimer_del(&req->timeout_event);
 		base->global_requests_inflight--;
@@ -898,7 +1349,7 @@ request_finished(struct request *const req, struct request **head, int free_hand
 			if (! req->handle->pending_cb) {
 				/* If we're planning to run the callback,
 				 * don't free the handle until later. */
-				mm_free(req->handle);
+				evdns_handle_free_(req->handle);
 			}
 			req->handle = NULL; /* If we have a bug, let's crash
 					     * early */
@@ -1029,16 +1480,55 @@ reply_run_callback(struct event_callback *d, void *user_pointer)
 		mm_free(handle->reply.cname);
 	}
 
-	mm_free(handle);
+	evdns_handle_free_(handle);
+}
+
+static void
+reply_schedule_handle(struct evdns_base *base, struct evdns_request *handle,
+    int priority)
+{
+	handle->pending_cb = 1;
+
+	event_deferred_cb_init_(
+	    &handle->deferred,
+	    priority,
+	    reply_run_callback,
+	    handle->user_pointer);
+	event_deferred_cb_schedule_(
+		base->event_base,
+		&handle->deferred);
 }
 
 static void
 reply_schedule_callback(struct request *const req, u32 ttl, u32 err, struct reply *reply)
 {
 	struct evdns_request* handle = req->handle;
+	struct reply stale;
 
 	ASSERT_LOCKED(req->base);
 
+	if (handle->lookup_name)
+		evdns_cache_prefetch_done_(req->base, handle,
+		    req->request_type);
+	if (handle->lookup_name && !reply &&
+	    (err == DNS_ERR_TIMEOUT || err == DNS_ERR_SERVERFAILED) &&
+	    evdns_cache_stale_(req->base, handle, req->request_type, &ttl,
+		&err, &stale)) {
+		if (err == DNS_ERR_NONE)
+			reply = &stale;
+	} else if (handle->lookup_name) {
+		evdns_cache_store_(req->base, handle, req->request_type, ttl, err,
+		    reply);
+	}
+	if (handle->lookup_name)
+		evdns_coalesce_finish_(req->base, handle, req->request_type,
+		    ttl, err, reply, event_get_priority(&req->timeout_event));
+	if (reply && reply->cname && !req->need_cname) {
+		/* we only kept it for the cache and the waiters */
+		mm_free(reply->cname);
+		reply->cname = NULL;
+	}
+
 	handle->request_type = req->request_type;
 	handle->ttl = ttl;
 	handle->err = err;
@@ -1047,18 +1537,11 @@ reply_schedule_callback(struct request *const req, u32 ttl, u32 err, struct repl
 		memcpy(&handle->reply, reply, sizeof(struct reply));
 		/* We've taken ownership of the data. */
 		reply->data.raw = NULL;
+		reply->cname = NULL;
 	}
 
-	handle->pending_cb = 1;
-
-	event_deferred_cb_init_(
-	    &handle->deferred,
-	    event_get_priority(&req->timeout_event),
-	    reply_run_callback,
-	    handle->user_pointer);
-	event_deferred_cb_schedule_(
-		req->base->event_base,
-		&handle->deferred);
+	reply_schedule_handle(req->base, handle,
+	    event_get_priority(&req->timeout_event));
 }
 
 static int
@@ -1248,9 +1731,10 @@ name_parse(u8 *packet, int length, int *idx, char *name_out, int name_out_len) {
 	return -1;
 }
 
-/* parses a raw request from a nameserver */
+/* parses a raw request from a nameserver; ns is the server that sent */
+/* it over UDP, or NULL for TCP. */
 static int
-reply_parse(struct evdns_base *base, u8 *packet, int length)
+reply_parse(struct evdns_base *base, struct nameserver *ns, u8 *packet, int length)
 {
 	int j = 0, k = 0;  /* index into packet */
 	u16 t_;	 /* used by the macros */
@@ -1284,6 +1768,10 @@ reply_parse(struct evdns_base *base, u8 *packet, int length)
 
 	/* If it's not an answer, it doesn't correspond to any request. */
 	if (!(flags & _QR_MASK)) return -1;  /* must be an answer */
+	/* Following Karn, only time answers that can't belong to an */
+	/* earlier transmission or to a hedged copy. */
+	if (ns && ns == req->ns && req->tx_count == 1 && !req->hedged)
+		nameserver_rtt_sample(ns, req);
 	if ((flags & (_RCODE_MASK|_TC_MASK)) && (flags & (_RCODE_MASK|_TC_MASK)) != DNS_ERR_NOTEXIST) {
 		/* there was an error and it's not NXDOMAIN */
 		goto err;
@@ -1381,8 +1869,11 @@ reply_parse(struct evdns_base *base, u8 *packet, int length)
 			if (name_parse(packet, length, &j, cname,
 				sizeof(cname))<0)
 				goto err;
-			if (req->need_cname)
+			if (req->need_cname || req->handle->lookup_name) {
+				if (reply.cname)
+					mm_free(reply.cname);
 				reply.cname = mm_strdup(cname);
+			}
 			if (req->put_cname_in_ptr && !*req->put_cname_in_ptr)
 				*req->put_cname_in_ptr = mm_strdup(cname);
 		} else if (type == TYPE_AAAA && class == CLASS_INET) {
@@ -1444,12 +1935,16 @@ reply_parse(struct evdns_base *base, u8 *packet, int length)
 	reply_handle(req, flags, ttl_r, &reply);
 	if (reply.data.raw)
 		mm_free(reply.data.raw);
+	if (reply.cname)
+		mm_free(reply.cname);
 	return 0;
  err:
 	if (req)
 		reply_handle(req, flags, 0, NULL);
 	if (reply.data.raw)
 		mm_free(reply.data.raw);
+	if (reply.cname)
+		mm_free(reply.cname);
 	return -1;
 }
 
@@ -1505,18 +2000,28 @@ request_parse(u8 *packet, int length, struct evdns_server_port *port,
 	for (i = 0; i < questions; ++i) {
 		u16 type, class;
 		struct evdns_server_question *q;
-		int namelen;
+		int namelen, start = j, wirelen = 0;
 		if (name_parse(packet, length, &j, tmp_name, sizeof(tmp_name))<0)
 			goto err;
 		GET16(type);
 		GET16(class);
 		namelen = (int)strlen(tmp_name);
-		q = mm_malloc(sizeof(struct evdns_server_question) + namelen);
+		/* Keep the question as sent, so that the response can repeat
+		 * it with a memcpy, unless it was compressed. */
+		if (questions == 1 && j - start == namelen + (namelen ? 2 : 1) + 4)
+			wirelen = j - start;
+		q = mm_malloc(sizeof(struct evdns_server_question) + namelen +
+		    wirelen);
 		if (!q)
 			goto err;
 		q->type = type;
 		q->dns_question_class = class;
 		memcpy(q->name, tmp_name, namelen+1);
+		if (wirelen) {
+			memcpy(q->name + namelen + 1, packet + start, wirelen);
+			server_req->question_wire = (u8 *)q->name + namelen + 1;
+			server_req->question_wire_len = wirelen;
+		}
 		server_req->base.questions[server_req->base.nquestions++] = q;
 	}
 
@@ -1549,6 +2054,7 @@ request_parse(u8 *packet, int length, struct evdns_server_port *port,
 			/* In case of OPT pseudo-RR `class` field is treated
 			 * as a requestor's UDP payload size. */
 			server_req->max_udp_reply_size = MAX(class, DNS_MAX_UDP_SIZE);
+			server_req->edns = 1;
 			evdns_server_request_add_reply(&(server_req->base),
 				EVDNS_ADDITIONAL_SECTION,
 				"", /* name */
@@ -1598,7 +2104,12 @@ transaction_id_pick(struct evdns_base *base) {
 	ASSERT_LOCKED(base);
 	for (;;) {
 		u16 trans_id;
-		evutil_secure_rng_get_bytes(&trans_id, sizeof(trans_id));
+		if (!base->trans_id_pool_left) {
+			evutil_secure_rng_get_bytes(base->trans_id_pool,
+			    sizeof(base->trans_id_pool));
+			base->trans_id_pool_left = EVDNS_TRANS_ID_POOL;
+		}
+		trans_id = base->trans_id_pool[--base->trans_id_pool_left];
 
 		if (trans_id == 0xffff) continue;
 		/* now check to see if that id is already inflight */
@@ -1607,6 +2118,204 @@ transaction_id_pick(struct evdns_base *base) {
 	}
 }
 
+static int
+rtt_compare_(const void *a, const void *b)
+{
+	const int x = *(const int *)a, y = *(const int *)b;
+	return x < y ? -1 : x > y;
+}
+
+/* Recompute how long ns may take before we hedge a query to it, as the
+ * hedge_percentile'th percentile of its recent round-trip times. */
+static void
+nameserver_hedge_delay_update(struct nameserver *ns)
+{
+	int sorted[EVDNS_RTT_RING];
+	const int n = ns->rtt_samples;
+
+	memcpy(sorted, ns->rtt_ring, n * sizeof(int));
+	qsort(sorted, n, sizeof(int), rtt_compare_);
+	ns->hedge_delay = sorted[(n - 1) * ns->base->hedge_percentile / 100];
+}
+
+/* Fold the round-trip time of req, which has just been answered by its
+ * nameserver, into that server's estimates. */
+static void
+nameserver_rtt_sample(struct nameserver *ns, const struct request *req)
+{
+	struct timeval now, elapsed;
+	int rtt, delta;
+
+	if (evutil_gettime_monotonic_(&ns->base->monotonic_timer, &now) < 0)
+		return;
+	evutil_timersub(&now, &req->sent_at, &elapsed);
+	if (elapsed.tv_sec < 0 || elapsed.tv_sec > 3600)
+		return;
+	rtt = (int)(elapsed.tv_sec * 1000000 + elapsed.tv_usec);
+	if (rtt < 1)
+		rtt = 1;
+
+	if (!ns->srtt) {
+		ns->srtt = rtt;
+		ns->rttvar = rtt / 2;
+	} else {
+		delta = ns->srtt > rtt ? ns->srtt - rtt : rtt - ns->srtt;
+		ns->rttvar += (delta - ns->rttvar) / 4;
+		ns->srtt += (rtt - ns->srtt) / 8;
+		if (ns->srtt < 1)
+			ns->srtt = 1;
+	}
+
+	ns->rtt_ring[ns->rtt_next] = rtt;
+	ns->rtt_next = (ns->rtt_next + 1) % EVDNS_RTT_RING;
+	if (ns->rtt_samples < EVDNS_RTT_RING)
+		ns->rtt_samples++;
+	/* Sorting the ring on every reply would be wasteful; the
+	 * percentile moves slowly, so refresh it every few samples. */
+	if (ns->base->hedge_percentile &&
+	    (ns->rtt_samples < 8 || ns->rtt_next % 8 == 0))
+		nameserver_hedge_delay_update(ns);
+}
+
+/* Called when a UDP request to ns timed out: back off its srtt, so that
+ * rtt-select moves queries away from it until it answers again. */
+static void
+nameserver_rtt_timeout(struct nameserver *ns)
+{
+	const struct timeval *tv = &ns->base->global_timeout;
+	const ev_int64_t cap = (ev_int64_t)tv->tv_sec * 1000000 + tv->tv_usec;
+
+	if (!ns->srtt || ns->srtt > cap / 2)
+		ns->srtt = cap < INT_MAX ? (int)cap : INT_MAX;
+	else
+		ns->srtt *= 2;
+}
+
+/* Set *tv to how long we wait for req->ns to answer req. */
+static void
+request_timeout_get(const struct request *req, struct timeval *tv)
+{
+	const struct evdns_base *base = req->base;
+	const struct nameserver *ns = req->ns;
+	const ev_int64_t cap = (ev_int64_t)base->global_timeout.tv_sec * 1000000 +
+	    base->global_timeout.tv_usec;
+	ev_int64_t usec;
+
+	*tv = base->global_timeout;
+	if (!base->adaptive_timeout || !ns->rtt_samples ||
+	    (req->handle->tcp_flags & DNS_QUERY_USEVC))
+		return;
+
+	/* RFC 6298: srtt + 4 * rttvar, doubled for each retransmission. */
+	usec = (ev_int64_t)ns->srtt + 4 * (ev_int64_t)ns->rttvar;
+	usec <<= req->tx_count < 16 ? req->tx_count : 16;
+	if (usec < EVDNS_RTO_MIN)
+		usec = EVDNS_RTO_MIN;
+	if (usec >= cap)
+		return;
+	tv->tv_sec = (long)(usec / 1000000);
+	tv->tv_usec = (long)(usec % 1000000);
+}
+
+/* If the first transmission of req should be hedged, replace *timeout by
+ * the hedge delay of its nameserver and remember the rest of it. */
+static void
+request_hedge_arm(struct request *req, struct timeval *timeout)
+{
+	struct evdns_base *base = req->base;
+	struct timeval delay;
+
+	req->hedge_pending = 0;
+	if (!base->hedge_percentile || req->tx_count || req->hedged ||
+	    base->global_good_nameservers < 2 ||
+	    base->disable_when_inactive || !req->ns->hedge_delay ||
+	    (req->handle->tcp_flags & DNS_QUERY_USEVC))
+		return;
+
+	delay.tv_sec = req->ns->hedge_delay / 1000000;
+	delay.tv_usec = req->ns->hedge_delay % 1000000;
+	if (evutil_timercmp(&delay, timeout, >=))
+		return;
+	evutil_timersub(timeout, &delay, &req->hedge_rest);
+	*timeout = delay;
+	req->hedge_pending = 1;
+}
+
+/* Send a copy of req to the fastest good nameserver other than req->ns.
+ * Whichever answer arrives first is matched by transaction id as usual;
+ * the other one is dropped since the request is gone by then. */
+static void
+request_hedge(struct request *req)
+{
+	struct evdns_base *base = req->base;
+	struct nameserver *ns = base->server_head, *best = NULL;
+	char addrbuf[128];
+
+	do {
+		if (ns->state && ns != req->ns && !ns->choked &&
+		    (!best || (ns->srtt && (!best->srtt || ns->srtt < best->srtt))))
+			best = ns;
+		ns = ns->next;
+	} while (ns != base->server_head);
+	if (!best)
+		return;
+
+	log(EVDNS_LOG_DEBUG, "Hedging request %p to nameserver %s",
+	    (void *)req, evutil_format_sockaddr_port_(
+		    (struct sockaddr *)&best->address, addrbuf, sizeof(addrbuf)));
+	if (sendto(best->socket, (void*)req->request, req->request_len, 0,
+		(struct sockaddr *)&best->address, best->addrlen) < 0)
+		return;
+	req->hedged = 1;
+}
+
+/* The weight of ns for nameserver_pick_by_rtt: inversely proportional to
+ * its srtt, or to best (the lowest known srtt) if we have not measured it
+ * yet, so that new servers get tried. */
+static ev_uint32_t
+nameserver_rtt_weight(const struct nameserver *ns, int best)
+{
+	const int srtt = ns->srtt ? ns->srtt : best;
+	if (!srtt)
+		return 1;
+	return (1u << 20) / ((ev_uint32_t)srtt / 64 + 1);
+}
+
+/* Pick a good nameserver at random, weighted by nameserver_rtt_weight. */
+static struct nameserver *
+nameserver_pick_by_rtt(struct evdns_base *base)
+{
+	struct nameserver *const head = base->server_head, *ns = head;
+	ev_uint32_t total = 0, w;
+	ev_int32_t r;
+	int best = 0;
+
+	do {
+		if (ns->state && ns->srtt && (!best || ns->srtt < best))
+			best = ns->srtt;
+		ns = ns->next;
+	} while (ns != head);
+	do {
+		if (ns->state && total < (1u << 30))
+			total += nameserver_rtt_weight(ns, best);
+		ns = ns->next;
+	} while (ns != head);
+	if (!total)
+		return NULL;
+
+	r = evutil_weakrand_range_(&base->weakrand_seed, (ev_int32_t)total);
+	do {
+		if (ns->state) {
+			w = nameserver_rtt_weight(ns, best);
+			if ((ev_uint32_t)r < w)
+				return ns;
+			r -= w;
+		}
+		ns = ns->next;
+	} while (ns != head);
+	return NULL;
+}
+
 /* choose a namesever to use. This function will try to ignore */
 /* nameservers which we think are down and load balance across the rest */
 /* by updating the server_head global each time. */
@@ -1623,6 +2332,12 @@ nameserver_pick(struct evdns_base *base) {
 		return base->server_head;
 	}
 
+	if (base->rtt_select && base->global_good_nameservers > 1) {
+		picked = nameserver_pick_by_rtt(base);
+		if (picked)
+			return picked;
+	}
+
 	/* remember that nameservers are in a circular list */
 	for (;;) {
 		if (base->server_head->state) {
@@ -1645,26 +2360,107 @@ nameserver_pick(struct evdns_base *base) {
 	}
 }
 
+/* One datagram for evdns_udp_send_many_. */
+struct evdns_udp_msg {
+	const void *buf;
+	size_t len;
+	const struct sockaddr *addr;
+	ev_socklen_t addrlen;
+};
+
+/* Write up to n datagrams to fd, using a single sendmmsg() where we have
+ * it.  Returns the number of datagrams written, or -1 if the first one
+ * could not be written. */
+static int
+evdns_udp_send_many_(evutil_socket_t fd, const struct evdns_udp_msg *msgs,
+    int n)
+{
+#ifdef EVENT__HAVE_SENDMMSG
+	struct mmsghdr hdrs[EVDNS_UDP_BATCH];
+	struct iovec iov[EVDNS_UDP_BATCH];
+	int i;
+
+	EVUTIL_ASSERT(n <= EVDNS_UDP_BATCH);
+	memset(hdrs, 0, n * sizeof(hdrs[0]));
+	for (i = 0; i < n; ++i) {
+		iov[i].iov_base = (void *)msgs[i].buf;
+		iov[i].iov_len = msgs[i].len;
+		hdrs[i].msg_hdr.msg_iov = &iov[i];
+		hdrs[i].msg_hdr.msg_iovlen = 1;
+		hdrs[i].msg_hdr.msg_name = (void *)msgs[i].addr;
+		hdrs[i].msg_hdr.msg_namelen = msgs[i].addrlen;
+	}
+	return sendmmsg(fd, hdrs, n, 0);
+#else
+	int i;
+
+	for (i = 0; i < n; ++i) {
+		if (sendto(fd, msgs[i].buf, (int)msgs[i].len, 0,
+			msgs[i].addr, msgs[i].addrlen) < 0)
+			break;
+	}
+	return i ? i : -1;
+#endif
+}
+
+/* Read up to n datagrams from fd, the i-th one into bufs + i*buflen.
+ * Stores the length and source of each one in lens, addrs and addrlens,
+ * and returns how many were read, or -1 on error. */
+static int
+evdns_udp_recv_many_(evutil_socket_t fd, u8 *bufs, size_t buflen, int n,
+    int *lens, struct sockaddr_storage *addrs, ev_socklen_t *addrlens)
+{
+#ifdef EVENT__HAVE_RECVMMSG
+	struct mmsghdr hdrs[EVDNS_UDP_BATCH];
+	struct iovec iov[EVDNS_UDP_BATCH];
+	int i, r;
+
+	EVUTIL_ASSERT(n <= EVDNS_UDP_BATCH);
+	memset(hdrs, 0, n * sizeof(hdrs[0]));
+	for (i = 0; i < n; ++i) {
+		iov[i].iov_base = bufs + i * buflen;
+		iov[i].iov_len = buflen;
+		hdrs[i].msg_hdr.msg_iov = &iov[i];
+		hdrs[i].msg_hdr.msg_iovlen = 1;
+		hdrs[i].msg_hdr.msg_name = &addrs[i];
+		hdrs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+	}
+	r = recvmmsg(fd, hdrs, n, 0, NULL);
+	for (i = 0; i < r; ++i) {
+		lens[i] = (int)hdrs[i].msg_len;
+		addrlens[i] = hdrs[i].msg_hdr.msg_namelen;
+	}
+	return r;
+#else
+	(void)n;
+	addrlens[0] = sizeof(addrs[0]);
+	lens[0] = recvfrom(fd, (void*)bufs, buflen, 0,
+	    (struct sockaddr*)&addrs[0], &addrlens[0]);
+	return lens[0] < 0 ? -1 : 1;
+#endif
+}
+
 /* this is called when a namesever socket is ready for reading */
 static void
 nameserver_read(struct nameserver *ns) {
-	struct sockaddr_storage ss;
-	ev_socklen_t addrlen = sizeof(ss);
+	struct sockaddr_storage ss[EVDNS_UDP_BATCH];
+	ev_socklen_t addrlen[EVDNS_UDP_BATCH];
+	int len[EVDNS_UDP_BATCH];
 	char addrbuf[128];
 	const size_t max_packet_size = ns->base->global_max_udp_size;
-	u8 *packet = mm_malloc(max_packet_size);
+	u8 *packets = mm_malloc(max_packet_size * EVDNS_UDP_BATCH);
 	ASSERT_LOCKED(ns->base);
 
-	if (!packet) {
+	if (!packets) {
 		nameserver_failed(ns, "not enough memory", 0);
 		return;
 	}
 
 	for (;;) {
-		const int r = recvfrom(ns->socket, (void*)packet,
-		    max_packet_size, 0,
-		    (struct sockaddr*)&ss, &addrlen);
-		if (r < 0) {
+		int i;
+		const int n = evdns_udp_recv_many_(ns->socket, packets,
+		    max_packet_size, EVDNS_UDP_BATCH, len, ss, addrlen);
+		if (n < 0) {
 			int err = evutil_socket_geterror(ns->socket);
 			if (EVUTIL_ERR_RW_RETRIABLE(err))
 				goto done;
@@ -1672,38 +2468,43 @@ nameserver_read(struct nameserver *ns) {
 			    evutil_socket_error_to_string(err), err);
 			goto done;
 		}
-		if (evutil_sockaddr_cmp((struct sockaddr*)&ss,
-			(struct sockaddr*)&ns->address, 0)) {
-			log(EVDNS_LOG_WARN, "Address mismatch on received "
-			    "DNS packet.  Apparent source was %s",
-			    evutil_format_sockaddr_port_(
-				    (struct sockaddr *)&ss,
-				    addrbuf, sizeof(addrbuf)));
-			goto done;
-		}
+		for (i = 0; i < n; ++i) {
+			if (evutil_sockaddr_cmp((struct sockaddr*)&ss[i],
+				(struct sockaddr*)&ns->address, 0)) {
+				log(EVDNS_LOG_WARN, "Address mismatch on received "
+				    "DNS packet.  Apparent source was %s",
+				    evutil_format_sockaddr_port_(
+					    (struct sockaddr *)&ss[i],
+					    addrbuf, sizeof(addrbuf)));
+				/* The rest of the batch is off the socket
+				 * already; don't lose it. */
+				continue;
+			}
 
-		ns->timedout = 0;
-		reply_parse(ns->base, packet, r);
+			ns->timedout = 0;
+			reply_parse(ns->base, ns,
+			    packets + i * max_packet_size, len[i]);
+		}
 	}
 done:
-	mm_free(packet);
+	mm_free(packets);
 }
 
 /* Read a packet from a DNS client on a server port s, parse it, and */
 /* act accordingly. */
 static void
 server_udp_port_read(struct evdns_server_port *s) {
-	u8 packet[1500];
-	struct sockaddr_storage addr;
-	ev_socklen_t addrlen;
-	int r;
+	u8 packets[EVDNS_UDP_BATCH][1500];
+	struct sockaddr_storage addr[EVDNS_UDP_BATCH];
+	ev_socklen_t addrlen[EVDNS_UDP_BATCH];
+	int len[EVDNS_UDP_BATCH];
+	int i, n;
 	ASSERT_LOCKED(s);
 
 	for (;;) {
-		addrlen = sizeof(struct sockaddr_storage);
-		r = recvfrom(s->socket, (void*)packet, sizeof(packet), 0,
-					 (struct sockaddr*) &addr, &addrlen);
-		if (r < 0) {
+		n = evdns_udp_recv_many_(s->socket, packets[0],
+		    sizeof(packets[0]), EVDNS_UDP_BATCH, len, addr, addrlen);
+		if (n < 0) {
 			int err = evutil_socket_geterror(s->socket);
 			if (EVUTIL_ERR_RW_RETRIABLE(err))
 				return;
@@ -1712,7 +2513,9 @@ server_udp_port_read(struct evdns_server_port *s) {
 			    evutil_socket_error_to_string(err), err);
 			return;
 		}
-		request_parse(packet, r, s, (struct sockaddr*) &addr, addrlen, NULL);
+		for (i = 0; i < n; ++i)
+			request_parse(packets[i], len[i], s,
+			    (struct sockaddr*) &addr[i], addrlen[i], NULL);
 	}
 }
 
@@ -1744,41 +2547,137 @@ beferevent_error:
 	return -1;
 }
 
-/* Try to write all pending replies on a given DNS server port. */
+/* set if we are waiting for the ability to write replies on this port. */
 static void
-server_port_flush(struct evdns_server_port *port)
+server_port_write_waiting(struct evdns_server_port *port, char waiting)
 {
-	struct server_request *req = port->pending_replies;
 	ASSERT_LOCKED(port);
-	while (req) {
-		int r = server_send_response(port, req);
-		if (r < 0) {
-			int err = evutil_socket_geterror(port->socket);
-			if (EVUTIL_ERR_RW_RETRIABLE(err))
-				return;
-			log(EVDNS_LOG_WARN, "Error %s (%d) while writing response to port; dropping", evutil_socket_error_to_string(err), err);
-		}
-		if (server_request_free(req)) {
-			/* we released the last reference to req->port. */
-			return;
-		} else {
-			EVUTIL_ASSERT(req != port->pending_replies);
-			req = port->pending_replies;
-		}
-	}
+	if (port->write_waiting == waiting)
+		return;
 
-	/* We have no more pending requests; stop listening for 'writeable' events. */
+	port->write_waiting = waiting;
 	(void) event_del(&port->event);
-	event_assign(&port->event, port->event_base,
-				 port->socket, EV_READ | EV_PERSIST,
-				 server_port_ready_callback, port);
-
+	event_assign(&port->event, port->event_base, port->socket,
+	    (waiting ? ((port->closing ? 0 : EV_READ) | EV_WRITE) : EV_READ) |
+	    EV_PERSIST, server_port_ready_callback, port);
 	if (event_add(&port->event, NULL) < 0) {
 		log(EVDNS_LOG_WARN, "Error from libevent when adding event for DNS server.");
 		/* ???? Do more? */
 	}
 }
 
+/* Append req to the list of replies waiting to be written on port. */
+static void
+server_port_queue_reply(struct evdns_server_port *port,
+    struct server_request *req)
+{
+	ASSERT_LOCKED(port);
+	if (port->pending_replies) {
+		req->prev_pending = port->pending_replies->prev_pending;
+		req->next_pending = port->pending_replies;
+		req->prev_pending->next_pending =
+			req->next_pending->prev_pending = req;
+	} else {
+		req->prev_pending = req->next_pending = req;
+		port->pending_replies = req;
+	}
+}
+
+/* Write a run of pending UDP replies from the front of the list with as
+ * few system calls as we can.  Returns 0 if we made progress, and -1 if
+ * we have to stop: the socket is full or we freed the port. */
+static int
+server_port_flush_udp(struct evdns_server_port *port)
+{
+	struct evdns_udp_msg msgs[EVDNS_UDP_BATCH];
+	struct server_request *reqs[EVDNS_UDP_BATCH];
+	struct server_request *req = port->pending_replies;
+	int i, n = 0, r;
+
+	do {
+		if (req->client)
+			break;
+		reqs[n] = req;
+		msgs[n].buf = req->response;
+		msgs[n].len = req->response_len;
+		msgs[n].addr = (struct sockaddr *)&req->addr;
+		msgs[n].addrlen = req->addrlen;
+		++n;
+		req = req->next_pending;
+	} while (n < EVDNS_UDP_BATCH && req != port->pending_replies);
+
+	r = evdns_udp_send_many_(port->socket, msgs, n);
+	if (r < 0) {
+		int err = evutil_socket_geterror(port->socket);
+		if (EVUTIL_ERR_RW_RETRIABLE(err)) {
+			port->choked = 1;
+			server_port_write_waiting(port, 1);
+			return -1;
+		}
+		log(EVDNS_LOG_WARN, "Error %s (%d) while writing response to port; dropping", evutil_socket_error_to_string(err), err);
+		r = 1;
+	}
+	for (i = 0; i < r; ++i) {
+		if (server_request_free(reqs[i]))
+			return -1;
+	}
+	return 0;
+}
+
+/* Try to write all pending replies on a given DNS server port. */
+static void
+server_port_flush(struct evdns_server_port *port)
+{
+	struct server_request *req = port->pending_replies;
+	ASSERT_LOCKED(port);
+	while (req) {
+		int r;
+		if (!req->client) {
+			if (server_port_flush_udp(port) < 0)
+				return;
+			req = port->pending_replies;
+			continue;
+		}
+		r = server_send_response(port, req);
+		if (r < 0) {
+			int err = evutil_socket_geterror(port->socket);
+			if (EVUTIL_ERR_RW_RETRIABLE(err))
+				return;
+			log(EVDNS_LOG_WARN, "Error %s (%d) while writing response to port; dropping", evutil_socket_error_to_string(err), err);
+		}
+		if (server_request_free(req)) {
+			/* we released the last reference to req->port. */
+			return;
+		} else {
+			EVUTIL_ASSERT(req != port->pending_replies);
+			req = port->pending_replies;
+		}
+	}
+
+	/* We have no more pending requests; stop listening for 'writeable' events. */
+	server_port_write_waiting(port, 0);
+}
+
+/* Deferred callback: write the UDP replies queued on a port since the
+ * last loop iteration. */
+static void
+server_port_flush_cb(struct event_callback *cb, void *arg)
+{
+	struct evdns_server_port *port = arg;
+	(void)cb;
+
+	EVDNS_LOCK(port);
+	port->flush_scheduled = 0;
+	if (!port->choked)
+		server_port_flush(port);
+	if (--port->refcnt == 0) {
+		EVDNS_UNLOCK(port);
+		server_port_free(port);
+		return;
+	}
+	EVDNS_UNLOCK(port);
+}
+
 /* set if we are waiting for the ability to write to this server. */
 /* if waiting is true then we ask libevent for EV_WRITE events, otherwise */
 /* we stop these events. */
@@ -1899,6 +2798,41 @@ dnslabel_table_add(struct dnslabel_table *table, const char *label, off_t pos)
 	return (0);
 }
 
+/* Return true if wire holds exactly the labels of name, uncompressed.
+ * The callback may have changed the name since wire was received. */
+static int
+dnsname_matches_labels(const char *name, const u8 *wire)
+{
+	off_t o = 0;
+	size_t len;
+
+	while ((len = wire[o])) {
+		if (memcmp(name + o, wire + o + 1, len) ||
+		    (name[o + len] != '.' && name[o + len] != '\0'))
+			return 0;
+		if (!name[o + len])
+			return !wire[o + len + 1];
+		o += len + 1;
+	}
+	return !name[0];
+}
+
+/* Remember the names in a question that has been copied from wire to
+ * offset 12 of the message, as dnsname_to_labels would have.  Only for
+ * names that pass dnsname_matches_labels. */
+static void
+dnslabel_table_add_question(struct dnslabel_table *table, const char *name,
+    const u8 *wire)
+{
+	off_t o = 0;
+	size_t len;
+
+	while ((len = wire[o])) {
+		dnslabel_table_add(table, name + o, 12 + o);
+		o += len + 1;
+	}
+}
+
 /* Converts a string to a length-prefixed set of DNS labels, starting */
 /* at buf[j]. name and buf must not overlap. name_len should be the length */
 /* of name.	 table is optional, and is used for compression. */
@@ -2075,6 +3009,9 @@ evdns_add_server_port_with_base(struct event_base *base, evutil_socket_t socket,
 	port->tcp_idle_timeout.tv_usec = 0;
 	port->client_connections_count = 0;
 	LIST_INIT(&port->client_connections);
+	event_deferred_cb_init_(&port->flush_cb,
+	    event_base_get_npriorities(base) / 2,
+	    server_port_flush_cb, port);
 	event_assign(&port->event, port->event_base,
 				 port->socket, EV_READ | EV_PERSIST,
 				 server_port_ready_callback, port);
@@ -2275,6 +3212,150 @@ evdns_close_server_port(struct evdns_server_port *port)
 	}
 }
 
+/* Server ports for one address on several event bases. */
+struct evdns_server_port_group {
+	int n_shards;
+	/* udp[i] and tcp[i] run on the i-th base; tcp[i] is NULL unless
+	 * EVDNS_SERVER_GROUP_TCP was given. */
+	struct evdns_server_port **udp;
+	struct evdns_server_port **tcp;
+};
+
+/* Make a nonblocking UDP socket bound to sa that other sockets can share
+ * the address with. */
+static evutil_socket_t
+server_port_group_socket(const struct sockaddr *sa, ev_socklen_t socklen)
+{
+	evutil_socket_t fd;
+
+	fd = evutil_socket_(sa->sa_family,
+	    SOCK_DGRAM|EVUTIL_SOCK_NONBLOCK|EVUTIL_SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+	if (evutil_make_listen_socket_reuseable_port(fd) < 0 ||
+	    bind(fd, sa, socklen) < 0) {
+		evutil_closesocket(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* exported function */
+struct evdns_server_port_group *
+evdns_add_server_port_group(struct event_base **bases, int n_bases,
+    const struct sockaddr *sa, int socklen, int flags,
+    evdns_request_callback_fn_type cb, void *user_data)
+{
+	struct evdns_server_port_group *group;
+	struct evconnlistener *listener;
+	struct sockaddr_storage bound;
+	ev_socklen_t boundlen = socklen;
+	evutil_socket_t fd;
+	int i;
+
+	if (n_bases < 1 || (flags & ~EVDNS_SERVER_GROUP_TCP) ||
+	    socklen <= 0 || socklen > (int)sizeof(bound))
+		return NULL;
+	group = mm_calloc(1, sizeof(*group) +
+	    2 * n_bases * sizeof(struct evdns_server_port *));
+	if (!group)
+		return NULL;
+	group->n_shards = n_bases;
+	group->udp = (struct evdns_server_port **)(group + 1);
+	group->tcp = group->udp + n_bases;
+	memcpy(&bound, sa, socklen);
+
+	for (i = 0; i < n_bases; ++i) {
+		fd = server_port_group_socket((struct sockaddr *)&bound, boundlen);
+		if (fd < 0)
+			goto err;
+		/* the others have to use the port we got, not port 0 */
+		if (i == 0) {
+			boundlen = sizeof(bound);
+			if (getsockname(fd, (struct sockaddr *)&bound,
+				&boundlen) < 0) {
+				evutil_closesocket(fd);
+				goto err;
+			}
+		}
+		group->udp[i] = evdns_add_server_port_with_base(bases[i], fd, 0,
+		    cb, user_data);
+		if (!group->udp[i]) {
+			evutil_closesocket(fd);
+			goto err;
+		}
+
+		if (!(flags & EVDNS_SERVER_GROUP_TCP))
+			continue;
+		listener = evconnlistener_new_bind(bases[i], NULL, NULL,
+		    LEV_OPT_CLOSE_ON_FREE|LEV_OPT_CLOSE_ON_EXEC|
+		    LEV_OPT_REUSEABLE|LEV_OPT_REUSEABLE_PORT, -1,
+		    (struct sockaddr *)&bound, boundlen);
+		if (!listener)
+			goto err;
+		group->tcp[i] = evdns_add_server_port_with_listener(bases[i],
+		    listener, 0, cb, user_data);
+		if (!group->tcp[i]) {
+			evconnlistener_free(listener);
+			goto err;
+		}
+	}
+	return group;
+err:
+	log(EVDNS_LOG_WARN, "Unable to add server port %d of %d: %s", i + 1,
+	    n_bases, evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR()));
+	evdns_close_server_port_group(group);
+	return NULL;
+}
+
+/* exported function */
+int
+evdns_server_port_group_set_callback(struct evdns_server_port_group *group,
+    int index, evdns_request_callback_fn_type cb, void *user_data)
+{
+	struct evdns_server_port *ports[2];
+	int i;
+
+	if (index < 0 || index >= group->n_shards)
+		return -1;
+	ports[0] = group->udp[index];
+	ports[1] = group->tcp[index];
+	for (i = 0; i < 2; ++i) {
+		if (!ports[i])
+			continue;
+		EVDNS_LOCK(ports[i]);
+		ports[i]->user_callback = cb;
+		ports[i]->user_data = user_data;
+		EVDNS_UNLOCK(ports[i]);
+	}
+	return 0;
+}
+
+/* exported function */
+struct evdns_server_port *
+evdns_server_port_group_get_port(struct evdns_server_port_group *group,
+    int index, int tcp)
+{
+	if (index < 0 || index >= group->n_shards)
+		return NULL;
+	return tcp ? group->tcp[index] : group->udp[index];
+}
+
+/* exported function */
+void
+evdns_close_server_port_group(struct evdns_server_port_group *group)
+{
+	int i;
+
+	for (i = 0; i < group->n_shards; ++i) {
+		if (group->udp[i])
+			evdns_close_server_port(group->udp[i]);
+		if (group->tcp[i])
+			evdns_close_server_port(group->tcp[i]);
+	}
+	mm_free(group);
+}
+
 /* exported function */
 int
 evdns_server_request_add_reply(struct evdns_server_request *req_, int section, const char *name, int type, int class, int ttl, int datalen, int is_name, const char *data)
@@ -2436,7 +3517,18 @@ evdns_server_request_format_response(struct server_request *req, int err)
 	APPEND16(req->n_additional);
 
 	/* Add questions. */
-	for (i=0; i < req->base.nquestions; ++i) {
+	if (req->question_wire &&
+	    !dnsname_matches_labels(req->base.questions[0]->name,
+		req->question_wire))
+		req->question_wire = NULL;
+	if (req->question_wire) {
+		EVUTIL_ASSERT(req->base.nquestions == 1);
+		memcpy(buf + j, req->question_wire, req->question_wire_len);
+		dnslabel_table_add_question(&table,
+		    req->base.questions[0]->name, req->question_wire);
+		j += req->question_wire_len;
+	}
+	for (i=0; i < req->base.nquestions && !req->question_wire; ++i) {
 		const char *s = req->base.questions[i]->name;
 		j = dnsname_to_labels(buf, buf_len, j, s, strlen(s), &table);
 		if (j < 0) {
@@ -2523,30 +3615,31 @@ evdns_server_request_respond(struct evdns_server_request *req_, int err)
 			goto done;
 	}
 
+	if (!req->client && port->batch_replies) {
+		/* Written by server_port_flush_cb, together with the other
+		 * replies made during this loop iteration. */
+		server_port_queue_reply(port, req);
+		if (!port->choked && !port->flush_scheduled) {
+			port->flush_scheduled = 1;
+			++port->refcnt;
+			event_deferred_cb_schedule_(port->event_base,
+			    &port->flush_cb);
+		}
+		r = 0;
+		goto done;
+	}
+
 	r = server_send_response(port, req);
 	if (r < 0 && req->client) {
 		int sock_err = evutil_socket_geterror(port->socket);
 		if (EVUTIL_ERR_RW_RETRIABLE(sock_err))
 			goto done;
 
-		if (port->pending_replies) {
-			req->prev_pending = port->pending_replies->prev_pending;
-			req->next_pending = port->pending_replies;
-			req->prev_pending->next_pending =
-				req->next_pending->prev_pending = req;
-		} else {
-			req->prev_pending = req->next_pending = req;
-			port->pending_replies = req;
+		if (!port->pending_replies) {
 			port->choked = 1;
-
-			(void) event_del(&port->event);
-			event_assign(&port->event, port->event_base, port->socket, (port->closing?0:EV_READ) | EV_WRITE | EV_PERSIST, server_port_ready_callback, port);
-
-			if (event_add(&port->event, NULL) < 0) {
-				log(EVDNS_LOG_WARN, "Error from libevent when adding event for DNS server");
-			}
-
+			server_port_write_waiting(port, 1);
 		}
+		server_port_queue_reply(port, req);
 
 		r = 1;
 		goto done;
@@ -2565,6 +3658,211 @@ done:
 	return r;
 }
 
+/* A response to one question, as it goes on the wire. */
+struct evdns_server_template {
+	char *name;
+	u16 type;
+	u16 dns_class;
+	/* Counts for the header. */
+	u16 n_answer;
+	u16 n_authority;
+	u16 n_additional;
+	/* The section of the last record added. */
+	int section;
+	/* The whole message: a header with only the counts to be filled in,
+	 * the question at offset 12, then the records. */
+	u8 *wire;
+	size_t wire_len;
+	size_t question_len;
+	/* Names already in wire, for compressing the next record. */
+	struct dnslabel_table table;
+};
+
+/* exported function */
+struct evdns_server_template *
+evdns_server_template_new(const char *name, int type, int dns_class)
+{
+	struct evdns_server_template *tmpl;
+	size_t namelen = strlen(name);
+	off_t j;
+	u16 t_;
+
+	if (!(tmpl = mm_calloc(1, sizeof(*tmpl))))
+		return NULL;
+	dnslabel_table_init(&tmpl->table);
+	tmpl->type = type;
+	tmpl->dns_class = dns_class;
+	if (!(tmpl->name = mm_strdup(name)))
+		goto err;
+	tmpl->wire_len = 12 + namelen + 2 + 4;
+	if (!(tmpl->wire = mm_calloc(1, tmpl->wire_len)))
+		goto err;
+
+	j = dnsname_to_labels(tmpl->wire, tmpl->wire_len, 12, tmpl->name,
+	    namelen, &tmpl->table);
+	if (j < 0)
+		goto err;
+	t_ = htons(type);
+	memcpy(tmpl->wire + j, &t_, 2);
+	t_ = htons(dns_class);
+	memcpy(tmpl->wire + j + 2, &t_, 2);
+	tmpl->wire_len = j + 4;
+	tmpl->question_len = j + 4 - 12;
+	return tmpl;
+err:
+	evdns_server_template_free(tmpl);
+	return NULL;
+}
+
+/* exported function */
+int
+evdns_server_template_add_reply(struct evdns_server_template *tmpl,
+    int section, const char *name, int type, int class, int ttl,
+    int datalen, int is_name, const char *data)
+{
+	size_t namelen = strlen(name), buf_len;
+	u8 *buf;
+	off_t j, r;
+	u16 t_;
+	u32 t32_;
+	u16 *countp;
+
+	switch (section) {
+	case EVDNS_ANSWER_SECTION:
+		countp = &tmpl->n_answer;
+		break;
+	case EVDNS_AUTHORITY_SECTION:
+		countp = &tmpl->n_authority;
+		break;
+	case EVDNS_ADDITIONAL_SECTION:
+		countp = &tmpl->n_additional;
+		break;
+	default:
+		return -1;
+	}
+	if (section < tmpl->section || *countp == 0xffff)
+		return -1;
+	if (is_name)
+		datalen = (int)strlen(data);
+	if (datalen < 0 || datalen > 0xffff)
+		return -1;
+
+	/* Enough room for uncompressed names. */
+	buf_len = tmpl->wire_len + namelen + 2 + 10 + datalen + 2;
+	if (buf_len > 65535)
+		return -1;
+	if (!(buf = mm_realloc(tmpl->wire, buf_len)))
+		return -1;
+	tmpl->wire = buf;
+
+	j = dnsname_to_labels(buf, buf_len, tmpl->wire_len, name, namelen,
+	    &tmpl->table);
+	if (j < 0)
+		return -1;
+	APPEND16(type);
+	APPEND16(class);
+	APPEND32(ttl);
+	if (is_name) {
+		off_t len_idx = j;
+		j += 2;
+		r = dnsname_to_labels(buf, buf_len, j, data, datalen,
+		    &tmpl->table);
+		if (r < 0)
+			return -1;
+		t_ = htons((u16)(r - j));
+		memcpy(buf + len_idx, &t_, 2);
+		j = r;
+	} else {
+		APPEND16(datalen);
+		if (datalen)
+			memcpy(buf + j, data, datalen);
+		j += datalen;
+	}
+
+	tmpl->wire_len = j;
+	tmpl->section = section;
+	++*countp;
+	return 0;
+overflow:
+	return -1;
+}
+
+/* exported function */
+void
+evdns_server_template_free(struct evdns_server_template *tmpl)
+{
+	dnslabel_clear(&tmpl->table);
+	if (tmpl->wire)
+		mm_free(tmpl->wire);
+	if (tmpl->name)
+		mm_free(tmpl->name);
+	mm_free(tmpl);
+}
+
+/* exported function */
+int
+evdns_server_request_respond_template(struct evdns_server_request *req_,
+    const struct evdns_server_template *tmpl)
+{
+	/* The OPT record we answer EDNS0 requests with. */
+	static const u8 opt_rr[] = {
+		0, 0, TYPE_OPT, DNS_MAX_UDP_SIZE >> 8, DNS_MAX_UDP_SIZE & 0xff,
+		0, 0, 0, 0, 0, 0
+	};
+	struct server_request *req = TO_SERVER_REQUEST(req_);
+	const struct evdns_server_question *q;
+	size_t len;
+	u8 *buf;
+	u16 t_;
+	int r = -1;
+
+	EVDNS_LOCK(req->port);
+	if (req->response || req->base.nquestions != 1)
+		goto done;
+	q = req->base.questions[0];
+	if (q->type != tmpl->type || q->dns_question_class != tmpl->dns_class ||
+	    evutil_ascii_strcasecmp(q->name, tmpl->name))
+		goto done;
+
+	len = tmpl->wire_len + (req->edns ? sizeof(opt_rr) : 0);
+	if (!(buf = mm_malloc(len)))
+		goto done;
+	memcpy(buf, tmpl->wire, tmpl->wire_len);
+	if (req->edns)
+		memcpy(buf + tmpl->wire_len, opt_rr, sizeof(opt_rr));
+
+	t_ = htons(req->trans_id);
+	memcpy(buf, &t_, 2);
+	t_ = htons(req->base.flags | _QR_MASK);
+	memcpy(buf + 2, &t_, 2);
+	t_ = htons(1);
+	memcpy(buf + 4, &t_, 2);
+	t_ = htons(tmpl->n_answer);
+	memcpy(buf + 6, &t_, 2);
+	t_ = htons(tmpl->n_authority);
+	memcpy(buf + 8, &t_, 2);
+	t_ = htons(tmpl->n_additional + req->edns);
+	memcpy(buf + 10, &t_, 2);
+	/* Echo the case the client used (see draft-vixie-dnsext-dns0x20). */
+	if (req->question_wire && req->question_wire_len == tmpl->question_len &&
+	    dnsname_matches_labels(q->name, req->question_wire))
+		memcpy(buf + 12, req->question_wire, req->question_wire_len);
+
+	if (len > req->max_udp_reply_size && !req->client) {
+		len = req->max_udp_reply_size;
+		buf[2] |= 0x02; /* set the truncated bit. */
+	}
+	server_request_free_answers(req);
+	req->response = (char *)buf;
+	req->response_len = len;
+	r = 0;
+done:
+	EVDNS_UNLOCK(req->port);
+	if (r < 0)
+		return r;
+	return evdns_server_request_respond(req_, 0);
+}
+
 /* Free all storage held by RRs in req. */
 static void
 server_request_free_answers(struct server_request *req)
@@ -2695,12 +3993,18 @@ retransmit_all_tcp_requests_for(struct nameserver *server)
 {
 	int i = 0;
 	for (i = 0; i < server->base->n_req_heads; ++i) {
-		struct request *started_at = server->base->req_heads[i];
-		struct request *req = started_at;
+		struct request *req = server->base->req_heads[i];
+		struct request *last, *next;
+		int done = 0;
 		if (!req)
 			continue;
 
-		do {
+		/* req may be finished (and unlinked) below, so remember
+		 * where to go next before looking at it. */
+		last = req->prev;
+		while (!done) {
+			next = req->next;
+			done = req == last;
 			if (req->ns == server && (req->handle->tcp_flags & DNS_QUERY_USEVC)) {
 				if (req->tx_count >= req->base->global_max_retransmits) {
 					log(EVDNS_LOG_DEBUG, "Giving up on request %p; tx_count==%d",
@@ -2712,8 +4016,8 @@ retransmit_all_tcp_requests_for(struct nameserver *server)
 					evdns_request_transmit(req);
 				}
 			}
-			req = req->next;
-		} while (req != started_at);
+			req = next;
+		}
 	}
 }
 
@@ -2730,6 +4034,26 @@ evdns_request_timeout_callback(evutil_socket_t fd, short events, void *arg) {
 	log(EVDNS_LOG_DEBUG, "Request %p timed out", arg);
 	EVDNS_LOCK(base);
 
+	if (req->hedge_pending) {
+		/* Not a timeout yet: ask a second server, then keep */
+		/* waiting for either of them. */
+		req->hedge_pending = 0;
+		request_hedge(req);
+		if (evtimer_add(&req->timeout_event, &req->hedge_rest) < 0) {
+			log(EVDNS_LOG_WARN,
+			    "Error from libevent when adding timer for request %p",
+			    arg);
+		}
+		EVDNS_UNLOCK(base);
+		return;
+	}
+
+	if (!(req->handle->tcp_flags & DNS_QUERY_USEVC))
+		nameserver_rtt_timeout(req->ns);
+	else if (req->transmit_me && req->ns->tcp_reconnect_pending)
+		/* It never went out, but it waited as long as an attempt. */
+		req->tx_count++;
+
 	if (req->tx_count >= req->base->global_max_retransmits) {
 		struct nameserver *ns = req->ns;
 		/* this request has failed */
@@ -2740,8 +4064,21 @@ evdns_request_timeout_callback(evutil_socket_t fd, short events, void *arg) {
 		request_finished(req, &REQ_HEAD(req->base, req->trans_id), 1);
 		nameserver_failed(ns, "request timed out.", 0);
 	} else {
-		/* if request is using tcp connection, so tear connection */
-		if (req->handle->tcp_flags & DNS_QUERY_USEVC) {
+		struct tcp_connection *conn = req->ns->connection;
+		if ((req->handle->tcp_flags & DNS_QUERY_USEVC) &&
+		    (req->ns->tcp_reconnect_pending ||
+		     (conn && conn->state == TS_CONNECTED &&
+		      evutil_timercmp(&req->ns->tcp_last_reply,
+			  &req->sent_at, >)))) {
+			/* Other answers arrived on the connection since we
+			 * sent this one: only this query got lost.  Or
+			 * there is no connection until the backoff ends: only
+			 * this query waits for its next attempt. */
+			log(EVDNS_LOG_DEBUG, "Retransmitting request %p; tx_count==%d by tcp", arg, req->tx_count);
+			(void) evtimer_del(&req->timeout_event);
+			evdns_request_transmit(req);
+		} else if (req->handle->tcp_flags & DNS_QUERY_USEVC) {
+			/* if request is using tcp connection, so tear connection */
 			disconnect_and_free_connection(req->ns->connection);
 			req->ns->connection = NULL;
 
@@ -2765,13 +4102,91 @@ evdns_request_timeout_callback(evutil_socket_t fd, short events, void *arg) {
 	EVDNS_UNLOCK(base);
 }
 
-/* try to send a request to a given server. */
-/* */
-/* return: */
-/*   0 ok */
-/*   1 temporary failure */
-/*   2 other failure */
-static int
+/* Take req off the send queue of its nameserver, if it is on it. */
+static void
+request_unqueue_send(struct request *req)
+{
+	if (req->send_queued) {
+		TAILQ_REMOVE(&req->ns->send_queue, req, send_next);
+		req->send_queued = 0;
+	}
+}
+
+/* Write the requests queued on ns, EVDNS_UDP_BATCH at a time. */
+static void
+nameserver_flush_sends(struct nameserver *ns)
+{
+	struct evdns_udp_msg msgs[EVDNS_UDP_BATCH];
+	struct request *reqs[EVDNS_UDP_BATCH];
+	struct request *req;
+	int i, n, r;
+
+	ASSERT_LOCKED(ns->base);
+	while (!TAILQ_EMPTY(&ns->send_queue)) {
+		n = 0;
+		TAILQ_FOREACH(req, &ns->send_queue, send_next) {
+			if (n == EVDNS_UDP_BATCH)
+				break;
+			reqs[n] = req;
+			msgs[n].buf = req->request;
+			msgs[n].len = req->request_len;
+			msgs[n].addr = (struct sockaddr *)&ns->address;
+			msgs[n].addrlen = ns->addrlen;
+			++n;
+		}
+
+		r = evdns_udp_send_many_(ns->socket, msgs, n);
+		if (r < 0) {
+			int err = evutil_socket_geterror(ns->socket);
+			/* Nothing else gets out now: whatever is left is
+			 * retransmitted, either once the socket is writable
+			 * or when its timeout fires. */
+			while ((req = TAILQ_FIRST(&ns->send_queue))) {
+				request_unqueue_send(req);
+				req->transmit_me = 1;
+				req->tx_count--;
+			}
+			if (EVUTIL_ERR_RW_RETRIABLE(err)) {
+				ns->choked = 1;
+				nameserver_write_waiting(ns, 1);
+			} else {
+				nameserver_failed(ns,
+				    evutil_socket_error_to_string(err), err);
+			}
+			return;
+		}
+		for (i = 0; i < r; ++i)
+			request_unqueue_send(reqs[i]);
+	}
+}
+
+/* Deferred callback: write the UDP requests queued since the last loop
+ * iteration. */
+static void
+evdns_flush_sends(struct event_callback *cb, void *arg)
+{
+	struct evdns_base *base = arg;
+	struct nameserver *ns;
+	(void)cb;
+
+	EVDNS_LOCK(base);
+	ns = base->server_head;
+	if (ns) {
+		do {
+			nameserver_flush_sends(ns);
+			ns = ns->next;
+		} while (ns != base->server_head);
+	}
+	EVDNS_UNLOCK(base);
+}
+
+/* try to send a request to a given server. */
+/* */
+/* return: */
+/*   0 ok */
+/*   1 temporary failure */
+/*   2 other failure */
+static int
 evdns_request_transmit_to(struct request *req, struct nameserver *server) {
 	int r;
 	ASSERT_LOCKED(req->base);
@@ -2783,6 +4198,18 @@ evdns_request_transmit_to(struct request *req, struct nameserver *server) {
 		return 1;
 	}
 
+	if (req->base->udp_batch) {
+		/* evdns_flush_sends will write it, together with the other
+		 * requests transmitted during this loop iteration. */
+		if (!req->send_queued) {
+			TAILQ_INSERT_TAIL(&server->send_queue, req, send_next);
+			req->send_queued = 1;
+			event_deferred_cb_schedule_(req->base->event_base,
+			    &req->base->send_flush_cb);
+		}
+		return 0;
+	}
+
 	r = sendto(server->socket, (void*)req->request, req->request_len, 0,
 	    (struct sockaddr *)&server->address, server->addrlen);
 	if (r < 0) {
@@ -2811,6 +4238,9 @@ evdns_tcp_connect_if_disconnected(struct nameserver *server)
 	struct timeval *timeout = &server->base->global_tcp_idle_timeout;
 	if (conn && conn->state != TS_DISCONNECTED && conn->bev != NULL)
 		return 0;
+	/* Queries wait for tcp_reconnect_callback after a failure. */
+	if (server->tcp_reconnect_pending)
+		return 1;
 
 	disconnect_and_free_connection(conn);
 	conn = new_tcp_connecton(bufferevent_socket_new(server->base->event_base, -1, BEV_OPT_CLOSE_ON_FREE));
@@ -2833,6 +4263,80 @@ evdns_tcp_connect_if_disconnected(struct nameserver *server)
 static void
 client_tcp_event_cb(struct bufferevent *bev, short events, void *ctx);
 
+/* Return true if some request is waiting for an answer from server over
+ * TCP. */
+static int
+nameserver_tcp_requests_pending(struct nameserver *server)
+{
+	int i;
+	for (i = 0; i < server->base->n_req_heads; ++i) {
+		struct request *started_at = server->base->req_heads[i];
+		struct request *req = started_at;
+		if (!req)
+			continue;
+		do {
+			if (req->ns == server &&
+			    (req->handle->tcp_flags & DNS_QUERY_USEVC))
+				return 1;
+			req = req->next;
+		} while (req != started_at);
+	}
+	return 0;
+}
+
+static void
+tcp_reconnect_callback(evutil_socket_t fd, short events, void *arg)
+{
+	struct nameserver *server = arg;
+	(void) fd;
+	(void) events;
+
+	EVDNS_LOCK(server->base);
+	server->tcp_reconnect_pending = 0;
+	retransmit_all_tcp_requests_for(server);
+	EVDNS_UNLOCK(server->base);
+}
+
+/* The TCP connection to server went away.  If it never answered
+ * anything, wait (twice as long as last time) before trying again;
+ * otherwise resend the queries that were on it right away. */
+static void
+nameserver_tcp_lost(struct nameserver *server, int answered)
+{
+	struct evdns_base *base = server->base;
+
+	if (answered) {
+		if (nameserver_tcp_requests_pending(server))
+			retransmit_all_tcp_requests_for(server);
+		return;
+	}
+	if (!evutil_timerisset(&base->global_tcp_reconnect_backoff) ||
+	    server->tcp_reconnect_pending ||
+	    !nameserver_tcp_requests_pending(server))
+		return;
+
+	if (!evutil_timerisset(&server->tcp_backoff)) {
+		server->tcp_backoff = base->global_tcp_reconnect_backoff;
+	} else if (server->tcp_backoff.tv_sec < EVDNS_TCP_MAX_BACKOFF) {
+		evutil_timeradd(&server->tcp_backoff, &server->tcp_backoff,
+		    &server->tcp_backoff);
+		if (server->tcp_backoff.tv_sec >= EVDNS_TCP_MAX_BACKOFF) {
+			server->tcp_backoff.tv_sec = EVDNS_TCP_MAX_BACKOFF;
+			server->tcp_backoff.tv_usec = 0;
+		}
+	}
+	log(EVDNS_LOG_DEBUG, "Reconnecting to nameserver %p in %d.%06d sec",
+	    (void *)server, (int)server->tcp_backoff.tv_sec,
+	    (int)server->tcp_backoff.tv_usec);
+	if (evtimer_add(&server->tcp_reconnect_event, &server->tcp_backoff) < 0) {
+		log(EVDNS_LOG_WARN,
+		    "Error from libevent when adding timer for nameserver %p",
+		    (void *)server);
+		return;
+	}
+	server->tcp_reconnect_pending = 1;
+}
+
 
 static void
 client_tcp_read_packet_cb(struct bufferevent *bev, void *ctx)
@@ -2856,7 +4360,11 @@ client_tcp_read_packet_cb(struct bufferevent *bev, void *ctx)
 		if (!msg)
 			break;
 
-		reply_parse(server->base, msg, msg_len);
+		conn->answered = 1;
+		evutil_timerclear(&server->tcp_backoff);
+		evutil_gettime_monotonic_(&server->base->monotonic_timer,
+		    &server->tcp_last_reply);
+		reply_parse(server->base, NULL, msg, msg_len);
 		mm_free(msg);
 		msg = NULL;
 		conn->awaiting_packet_size = 0;
@@ -2878,12 +4386,16 @@ client_tcp_event_cb(struct bufferevent *bev, short events, void *ctx) {
 
 	log(EVDNS_LOG_DEBUG, "Event %d on connection %p", events, (void *)conn);
 
-	if (events & (BEV_EVENT_TIMEOUT)) {
-		disconnect_and_free_connection(server->connection);
-		server->connection = NULL;
-	} else if (events & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) {
+	if ((events & BEV_EVENT_TIMEOUT) && (events & BEV_EVENT_READING) &&
+	    conn->state == TS_CONNECTED &&
+	    nameserver_tcp_requests_pending(server)) {
+		/* Not idle, just slow: the request timeouts deal with that. */
+		bufferevent_enable(bev, EV_READ);
+	} else if (events & (BEV_EVENT_TIMEOUT | BEV_EVENT_EOF | BEV_EVENT_ERROR)) {
+		const int answered = conn->answered;
 		disconnect_and_free_connection(server->connection);
 		server->connection = NULL;
+		nameserver_tcp_lost(server, answered);
 	} else if (events & BEV_EVENT_CONNECTED) {
 		EVUTIL_ASSERT (conn->state == TS_CONNECTING);
 		conn->state = TS_CONNECTED;
@@ -2942,6 +4454,7 @@ fail:
 static int
 evdns_request_transmit(struct request *req) {
 	int retcode = 0, r;
+	struct timeval timeout;
 
 	ASSERT_LOCKED(req->base);
 	ASSERT_VALID_REQUEST(req);
@@ -2969,6 +4482,16 @@ evdns_request_transmit(struct request *req) {
 		We don't mark name server as chocked so udp packets possibly have no
 		problems during transmit. Simply we will retry attempt later */
 		if (r == 1) {
+			/* While it waits for the backoff to end, the request
+			 * still has to time out eventually. */
+			if (req->ns->tcp_reconnect_pending &&
+			    !evtimer_pending(&req->timeout_event, NULL) &&
+			    evtimer_add(&req->timeout_event,
+				&req->base->global_timeout) < 0) {
+				log(EVDNS_LOG_WARN,
+				    "Error from libevent when adding timer for request %p",
+				    (void *)req);
+			}
 			return r;
 		}
 	} else {
@@ -2990,7 +4513,10 @@ evdns_request_transmit(struct request *req) {
 		/* all ok */
 		log(EVDNS_LOG_DEBUG,
 		    "Setting timeout for request %p, sent to nameserver %p", (void *)req, (void *)req->ns);
-		if (evtimer_add(&req->timeout_event, &req->base->global_timeout) < 0) {
+		evutil_gettime_monotonic_(&req->base->monotonic_timer, &req->sent_at);
+		request_timeout_get(req, &timeout);
+		request_hedge_arm(req, &timeout);
+		if (evtimer_add(&req->timeout_event, &timeout) < 0) {
 			log(EVDNS_LOG_WARN,
 		      "Error from libevent when adding timer for request %p",
 			    (void *)req);
@@ -3131,10 +4657,13 @@ evdns_base_clear_nameservers_and_suspend(struct evdns_base *base)
 		(void) event_del(&server->event);
 		if (evtimer_initialized(&server->timeout_event))
 			(void) evtimer_del(&server->timeout_event);
+		(void) evtimer_del(&server->tcp_reconnect_event);
 		if (server->probe_request) {
 			evdns_cancel_request(server->base, server->probe_request);
 			server->probe_request = NULL;
 		}
+		while (!TAILQ_EMPTY(&server->send_queue))
+			request_unqueue_send(TAILQ_FIRST(&server->send_queue));
 		if (server->socket >= 0)
 			evutil_closesocket(server->socket);
 		mm_free(server);
@@ -3171,6 +4700,7 @@ evdns_base_clear_nameservers_and_suspend(struct evdns_base *base)
 		}
 		base->req_heads[i] = NULL;
 	}
+	trans_map_clear(base);
 
 	base->global_requests_inflight = 0;
 
@@ -3228,8 +4758,11 @@ evdns_nameserver_add_impl_(struct evdns_base *base, const struct sockaddr *addre
 
 	memset(ns, 0, sizeof(struct nameserver));
 	ns->base = base;
+	TAILQ_INIT(&ns->send_queue);
 
 	evtimer_assign(&ns->timeout_event, ns->base->event_base, nameserver_prod_callback, ns);
+	evtimer_assign(&ns->tcp_reconnect_event, ns->base->event_base,
+	    tcp_reconnect_callback, ns);
 
 	ns->socket = evutil_socket_(address->sa_family,
 	    SOCK_DGRAM|EVUTIL_SOCK_NONBLOCK|EVUTIL_SOCK_CLOEXEC, 0);
@@ -3296,6 +4829,7 @@ out2:
 	evutil_closesocket(ns->socket);
 out1:
 	event_debug_unassign(&ns->event);
+	event_debug_unassign(&ns->tcp_reconnect_event);
 	mm_free(ns);
 	log(EVDNS_LOG_WARN, "Unable to add nameserver %s: error %d",
 	    evutil_format_sockaddr_port_(address, addrbuf, sizeof(addrbuf)), err);
@@ -3477,6 +5011,9 @@ evdns_request_remove(struct request *req, struct request **head)
 		if (*head == req) *head = req->next;
 	}
 	req->next = req->prev = NULL;
+
+	if (head != &req->base->req_waiting_head)
+		trans_map_remove(req->base, req);
 }
 
 /* insert into the tail of the queue */
@@ -3484,6 +5021,8 @@ static void
 evdns_request_insert(struct request *req, struct request **head) {
 	ASSERT_LOCKED(req->base);
 	ASSERT_VALID_REQUEST(req);
+	if (head != &req->base->req_waiting_head)
+		trans_map_add(req->base, req);
 	if (!*head) {
 		*head = req;
 		req->next = req->prev = req;
@@ -3607,6 +5146,8 @@ request_clone(struct evdns_base *base, struct request* current)
 	request_trans_id_set(req, trans_id);
 
 	req->tx_count = 0;
+	req->send_queued = 0;
+	req->hedge_pending = req->hedged = 0;
 	req->ns = issuing_now ? nameserver_pick(base) : NULL;
 	req->next = req->prev = NULL;
 	req->handle = NULL;
@@ -3641,7 +5182,7 @@ evdns_cancel_request(struct evdns_base *base, struct evdns_request *handle)
 {
 	struct request *req;
 
-	if (!handle->current_req)
+	if (!handle->current_req && !handle->leader)
 		return;
 
 	if (!base) {
@@ -3657,6 +5198,13 @@ evdns_cancel_request(struct evdns_base *base, struct evdns_request *handle)
 		return;
 	}
 
+	if (handle->leader || !TAILQ_EMPTY(&handle->waiters)) {
+		/* Other lookups share this request; leave it running. */
+		evdns_coalesce_cancel_(base, handle);
+		EVDNS_UNLOCK(base);
+		return;
+	}
+
 	req = handle->current_req;
 	ASSERT_VALID_REQUEST(req);
 
@@ -3686,6 +5234,10 @@ evdns_base_resolve_ipv4(struct evdns_base *base, const char *name, int flags,
 	EVDNS_LOCK(base);
 	handle->tcp_flags = base->global_tcp_flags;
 	handle->tcp_flags |= flags & (DNS_QUERY_USEVC | DNS_QUERY_IGNTC);
+	if (evdns_lookup_start_(base, handle, TYPE_A, name, flags)) {
+		EVDNS_UNLOCK(base);
+		return handle;
+	}
 	if (flags & DNS_QUERY_NO_SEARCH) {
 		req =
 			request_new(base, handle, TYPE_A, name, flags);
@@ -3695,8 +5247,10 @@ evdns_base_resolve_ipv4(struct evdns_base *base, const char *name, int flags,
 		search_request_new(base, handle, TYPE_A, name, flags);
 	}
 	if (handle->current_req == NULL) {
-		mm_free(handle);
+		evdns_handle_free_(handle);
 		handle = NULL;
+	} else {
+		evdns_lookup_index_(base, handle);
 	}
 	EVDNS_UNLOCK(base);
 	return handle;
@@ -3727,6 +5281,10 @@ evdns_base_resolve_ipv6(struct evdns_base *base,
 	EVDNS_LOCK(base);
 	handle->tcp_flags = base->global_tcp_flags;
 	handle->tcp_flags |= flags & (DNS_QUERY_USEVC | DNS_QUERY_IGNTC);
+	if (evdns_lookup_start_(base, handle, TYPE_AAAA, name, flags)) {
+		EVDNS_UNLOCK(base);
+		return handle;
+	}
 	if (flags & DNS_QUERY_NO_SEARCH) {
 		req = request_new(base, handle, TYPE_AAAA, name, flags);
 		if (req)
@@ -3735,8 +5293,10 @@ evdns_base_resolve_ipv6(struct evdns_base *base,
 		search_request_new(base, handle, TYPE_AAAA, name, flags);
 	}
 	if (handle->current_req == NULL) {
-		mm_free(handle);
+		evdns_handle_free_(handle);
 		handle = NULL;
+	} else {
+		evdns_lookup_index_(base, handle);
 	}
 	EVDNS_UNLOCK(base);
 	return handle;
@@ -3748,13 +5308,46 @@ int evdns_resolve_ipv6(const char *name, int flags,
 		? 0 : -1;
 }
 
+/* If hosts-reverse is set and the hosts file has a name for sa, answer */
+/* handle with it and return 1. */
+static int
+evdns_hosts_answer_reverse_(struct evdns_base *base,
+    struct evdns_request *handle, const struct sockaddr *sa, int socklen)
+{
+	struct hosts_entry *e;
+
+	ASSERT_LOCKED(base);
+	if (!base->hosts_reverse ||
+	    !(e = hosts_db_find_addr(base->hostsdb, sa, socklen)))
+		return 0;
+	if (!(handle->reply.data.ptr_name = mm_strdup(e->hostname)))
+		return 0;
+	log(EVDNS_LOG_DEBUG, "Answering reverse lookup from hosts file: %s",
+	    e->hostname);
+	handle->base = base;
+	handle->reply.type = TYPE_PTR;
+	handle->reply.rr_count = 1;
+	handle->reply.have_answer = 1;
+	handle->have_reply = 1;
+	handle->request_type = TYPE_PTR;
+	handle->ttl = 0;
+	handle->err = DNS_ERR_NONE;
+	reply_schedule_handle(base, handle,
+	    event_base_get_npriorities(base->event_base) / 2);
+	return 1;
+}
+
 struct evdns_request *
 evdns_base_resolve_reverse(struct evdns_base *base, const struct in_addr *in, int flags, evdns_callback_type callback, void *ptr) {
+	struct sockaddr_in sin;
 	char buf[32];
 	struct evdns_request *handle;
 	struct request *req;
 	u32 a;
 	EVUTIL_ASSERT(in);
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr = *in;
 	a = ntohl(in->s_addr);
 	evutil_snprintf(buf, sizeof(buf), "%d.%d.%d.%d.in-addr.arpa",
 			(int)(u8)((a	)&0xff),
@@ -3770,12 +5363,20 @@ evdns_base_resolve_reverse(struct evdns_base *base, const struct in_addr *in, in
 	EVDNS_LOCK(base);
 	handle->tcp_flags = base->global_tcp_flags;
 	handle->tcp_flags |= flags & (DNS_QUERY_USEVC | DNS_QUERY_IGNTC);
+	if (evdns_hosts_answer_reverse_(base, handle,
+		(struct sockaddr *)&sin, sizeof(sin)) ||
+	    evdns_lookup_start_(base, handle, TYPE_PTR, buf, flags)) {
+		EVDNS_UNLOCK(base);
+		return handle;
+	}
 	req = request_new(base, handle, TYPE_PTR, buf, flags);
 	if (req)
 		request_submit(req);
 	if (handle->current_req == NULL) {
-		mm_free(handle);
+		evdns_handle_free_(handle);
 		handle = NULL;
+	} else {
+		evdns_lookup_index_(base, handle);
 	}
 	EVDNS_UNLOCK(base);
 	return (handle);
@@ -3793,8 +5394,12 @@ evdns_base_resolve_reverse_ipv6(struct evdns_base *base, const struct in6_addr *
 	char *cp;
 	struct evdns_request *handle;
 	struct request *req;
+	struct sockaddr_in6 sin6;
 	int i;
 	EVUTIL_ASSERT(in);
+	memset(&sin6, 0, sizeof(sin6));
+	sin6.sin6_family = AF_INET6;
+	sin6.sin6_addr = *in;
 	cp = buf;
 	for (i=15; i >= 0; --i) {
 		u8 byte = in->s6_addr[i];
@@ -3814,12 +5419,20 @@ evdns_base_resolve_reverse_ipv6(struct evdns_base *base, const struct in6_addr *
 	EVDNS_LOCK(base);
 	handle->tcp_flags = base->global_tcp_flags;
 	handle->tcp_flags |= flags & (DNS_QUERY_USEVC | DNS_QUERY_IGNTC);
+	if (evdns_hosts_answer_reverse_(base, handle,
+		(struct sockaddr *)&sin6, sizeof(sin6)) ||
+	    evdns_lookup_start_(base, handle, TYPE_PTR, buf, flags)) {
+		EVDNS_UNLOCK(base);
+		return handle;
+	}
 	req = request_new(base, handle, TYPE_PTR, buf, flags);
 	if (req)
 		request_submit(req);
 	if (handle->current_req == NULL) {
-		mm_free(handle);
+		evdns_handle_free_(handle);
 		handle = NULL;
+	} else {
+		evdns_lookup_index_(base, handle);
 	}
 	EVDNS_UNLOCK(base);
 	return (handle);
@@ -3884,6 +5497,7 @@ search_state_new(void) {
 static void
 search_postfix_clear(struct evdns_base *base) {
 	search_state_decref(base->global_search_state);
+	evdns_lookup_config_changed_(base);
 
 	base->global_search_state = search_state_new();
 }
@@ -3913,6 +5527,7 @@ search_postfix_add(struct evdns_base *base, const char *domain) {
 	if (!base->global_search_state) base->global_search_state = search_state_new();
 	if (!base->global_search_state) return;
 	base->global_search_state->num_domains++;
+	evdns_lookup_config_changed_(base);
 
 	sdomain = (struct search_domain *) mm_malloc(sizeof(struct search_domain) + domain_len);
 	if (!sdomain) return;
@@ -3959,6 +5574,7 @@ evdns_base_search_ndots_set(struct evdns_base *base, const int ndots) {
 	if (!base->global_search_state) base->global_search_state = search_state_new();
 	if (base->global_search_state)
 		base->global_search_state->ndots = ndots;
+	evdns_lookup_config_changed_(base);
 	EVDNS_UNLOCK(base);
 }
 void
@@ -4004,114 +5620,744 @@ search_make_new(const struct search_state *const state, int n, const char *const
 		}
 	}
 
-	/* we ran off the end of the list and still didn't find the requested string */
-	EVUTIL_ASSERT(0);
-	return NULL; /* unreachable; stops warnings in some compilers. */
+	/* we ran off the end of the list and still didn't find the requested string */
+	EVUTIL_ASSERT(0);
+	return NULL; /* unreachable; stops warnings in some compilers. */
+}
+
+static struct request *
+search_request_new(struct evdns_base *base, struct evdns_request *handle,
+		   int type, const char *const name, int flags) {
+	ASSERT_LOCKED(base);
+	EVUTIL_ASSERT(type == TYPE_A || type == TYPE_AAAA);
+	EVUTIL_ASSERT(handle->current_req == NULL);
+	if ( ((flags & DNS_QUERY_NO_SEARCH) == 0) &&
+	     base->global_search_state &&
+		 base->global_search_state->num_domains) {
+		/* we have some domains to search */
+		struct request *req;
+		if (string_num_dots(name) >= base->global_search_state->ndots) {
+			req = request_new(base, handle, type, name, flags);
+			if (!req) return NULL;
+			handle->search_index = -1;
+		} else {
+			char *const new_name = search_make_new(base->global_search_state, 0, name);
+			if (!new_name) return NULL;
+			req = request_new(base, handle, type, new_name, flags);
+			mm_free(new_name);
+			if (!req) return NULL;
+			handle->search_index = 0;
+		}
+		EVUTIL_ASSERT(handle->search_origname == NULL);
+		handle->search_origname = mm_strdup(name);
+		if (handle->search_origname == NULL) {
+			/* XXX Should we dealloc req? If yes, how? */
+			if (req)
+				mm_free(req);
+			return NULL;
+		}
+		handle->search_state = base->global_search_state;
+		handle->search_flags = flags;
+		base->global_search_state->refcount++;
+		request_submit(req);
+		return req;
+	} else {
+		struct request *const req = request_new(base, handle, type, name, flags);
+		if (!req) return NULL;
+		request_submit(req);
+		return req;
+	}
+}
+
+/* this is called when a request has failed to find a name. We need to check */
+/* if it is part of a search and, if so, try the next name in the list */
+/* returns: */
+/*   0 another request has been submitted */
+/*   1 no more requests needed */
+static int
+search_try_next(struct evdns_request *const handle) {
+	struct request *req = handle->current_req;
+	struct evdns_base *base = req->base;
+	struct request *newreq;
+	ASSERT_LOCKED(base);
+	if (handle->search_state) {
+		/* it is part of a search */
+		char *new_name;
+		handle->search_index++;
+		if (handle->search_index >= handle->search_state->num_domains) {
+			/* no more postfixes to try, however we may need to try */
+			/* this name without a postfix */
+			if (string_num_dots(handle->search_origname) < handle->search_state->ndots) {
+				/* yep, we need to try it raw */
+				newreq = request_new(base, NULL, req->request_type, handle->search_origname, handle->search_flags);
+				log(EVDNS_LOG_DEBUG, "Search: trying raw query %s", handle->search_origname);
+				if (newreq) {
+					search_request_finished(handle);
+					goto submit_next;
+				}
+			}
+			return 1;
+		}
+
+		new_name = search_make_new(handle->search_state, handle->search_index, handle->search_origname);
+		if (!new_name) return 1;
+		log(EVDNS_LOG_DEBUG, "Search: now trying %s (%d)", new_name, handle->search_index);
+		newreq = request_new(base, NULL, req->request_type, new_name, handle->search_flags);
+		mm_free(new_name);
+		if (!newreq) return 1;
+		goto submit_next;
+	}
+	return 1;
+
+submit_next:
+	request_finished(req, &REQ_HEAD(req->base, req->trans_id), 0);
+	handle->current_req = newreq;
+	newreq->handle = handle;
+	request_submit(newreq);
+	return 0;
+}
+
+static void
+search_request_finished(struct evdns_request *const handle) {
+	ASSERT_LOCKED(handle->current_req->base);
+	if (handle->search_state) {
+		search_state_decref(handle->search_state);
+		handle->search_state = NULL;
+	}
+	if (handle->search_origname) {
+		mm_free(handle->search_origname);
+		handle->search_origname = NULL;
+	}
+}
+
+/* ================================================================= */
+/* Response cache and coalescing of identical lookups */
+/* */
+/* Answers are cached under the name that the caller asked for, so that */
+/* a cached answer for "host" covers the whole walk over the search */
+/* list.  Negative answers (NXDOMAIN and NODATA) are cached for the TTL */
+/* derived from the SOA record in the authority section (RFC 2308); */
+/* negative answers without a SOA are not cached. */
+/* */
+/* A lookup that misses the cache while an identical one is outstanding */
+/* doesn't get a request of its own: it waits on the handle that owns */
+/* the request and is answered from the same reply. */
+
+static inline unsigned
+evdns_cache_entry_hash(const struct evdns_cache_entry *e)
+{
+	unsigned h = ht_string_hash_(e->name);
+	return ht_improve_hash_(h ^ (((unsigned)e->type << 17) |
+	    ((unsigned)e->class << 1) | e->searched));
+}
+
+static inline int
+evdns_cache_entry_eq(const struct evdns_cache_entry *a,
+    const struct evdns_cache_entry *b)
+{
+	return a->type == b->type && a->class == b->class &&
+	    a->searched == b->searched && !strcmp(a->name, b->name);
+}
+
+HT_PROTOTYPE(evdns_cache_map, evdns_cache_entry, node, evdns_cache_entry_hash,
+    evdns_cache_entry_eq)
+HT_GENERATE(evdns_cache_map, evdns_cache_entry, node, evdns_cache_entry_hash,
+    evdns_cache_entry_eq, 0.5, mm_malloc, mm_realloc, mm_free)
+
+static inline unsigned
+evdns_inflight_hash(const struct evdns_request *h)
+{
+	unsigned hash = ht_string_hash_(h->lookup_name);
+	return ht_improve_hash_(hash ^ (((unsigned)h->lookup_type << 17) |
+	    ((unsigned)h->lookup_flags << 1) | h->lookup_searched));
+}
+
+static inline int
+evdns_inflight_eq(const struct evdns_request *a, const struct evdns_request *b)
+{
+	return a->lookup_type == b->lookup_type &&
+	    a->lookup_flags == b->lookup_flags &&
+	    a->lookup_searched == b->lookup_searched &&
+	    !strcmp(a->lookup_name, b->lookup_name);
+}
+
+HT_PROTOTYPE(evdns_inflight_map, evdns_request, inflight_node,
+    evdns_inflight_hash, evdns_inflight_eq)
+HT_GENERATE(evdns_inflight_map, evdns_request, inflight_node,
+    evdns_inflight_hash, evdns_inflight_eq, 0.5, mm_malloc, mm_realloc, mm_free)
+
+static void
+evdns_handle_free_(struct evdns_request *handle)
+{
+	struct evdns_request *waiter;
+
+	if (handle->lookup_indexed) {
+		HT_REMOVE(evdns_inflight_map, &handle->base->inflight, handle);
+		handle->lookup_indexed = 0;
+	}
+	/* The request is going away without an answer; so do its waiters,
+	 * just as it does. */
+	while ((waiter = TAILQ_FIRST(&handle->waiters))) {
+		TAILQ_REMOVE(&handle->waiters, waiter, waiter_next);
+		evdns_handle_free_(waiter);
+	}
+	if (handle->lookup_name)
+		mm_free(handle->lookup_name);
+	mm_free(handle);
+}
+
+/* Size of the answer data in reply for a request of the given type. */
+static size_t
+evdns_reply_datalen_(int type, const struct reply *reply)
+{
+	if (!reply->have_answer)
+		return 0;
+	switch (type) {
+	case TYPE_A:
+		return reply->rr_count * 4;
+	case TYPE_AAAA:
+		return reply->rr_count * 16;
+	case TYPE_PTR:
+		return strlen(reply->data.ptr_name) + 1;
+	default:
+		return 0;
+	}
+}
+
+/* Would a lookup of this type with these flags walk the search list? */
+static int
+evdns_cache_searched_(struct evdns_base *base, int type, int flags)
+{
+	return (type == TYPE_A || type == TYPE_AAAA) &&
+	    !(flags & DNS_QUERY_NO_SEARCH) &&
+	    base->global_search_state &&
+	    base->global_search_state->num_domains;
+}
+
+/* Build a lookup key for name into find, using namebuf as storage for the
+ * lowercased name.  Returns -1 if the name can't be cached. */
+static int
+evdns_cache_key_(struct evdns_base *base, struct evdns_cache_entry *find,
+    char *namebuf, size_t namebuf_len, int type, const char *name, int flags)
+{
+	size_t i, len = strlen(name);
+
+	if (!len || len >= namebuf_len)
+		return -1;
+	for (i = 0; i < len; ++i)
+		namebuf[i] = EVUTIL_TOLOWER_(name[i]);
+	namebuf[len] = '\0';
+
+	memset(find, 0, sizeof(*find));
+	find->name = namebuf;
+	find->type = type;
+	find->class = CLASS_INET;
+	find->searched = evdns_cache_searched_(base, type, flags);
+	return 0;
+}
+
+static void
+evdns_cache_entry_free_(struct evdns_base *base, struct evdns_cache_entry *e)
+{
+	HT_REMOVE(evdns_cache_map, &base->cache, e);
+	TAILQ_REMOVE(&base->cache_lru, e, lru);
+	if (e->data)
+		mm_free(e->data);
+	if (e->cname)
+		mm_free(e->cname);
+	mm_free(e);
+}
+
+static void
+evdns_cache_flush_(struct evdns_base *base)
+{
+	struct evdns_cache_entry *e;
+	ASSERT_LOCKED(base);
+	while ((e = TAILQ_FIRST(&base->cache_lru)))
+		evdns_cache_entry_free_(base, e);
+}
+
+/* Return the live entry matching find, dropping it if it has expired. */
+static struct evdns_cache_entry *
+evdns_cache_find_(struct evdns_base *base, struct evdns_cache_entry *find,
+    struct timeval *now)
+{
+	struct evdns_cache_entry *e;
+
+	ASSERT_LOCKED(base);
+	e = HT_FIND(evdns_cache_map, &base->cache, find);
+	if (!e)
+		return NULL;
+	evutil_gettime_monotonic_(&base->monotonic_timer, now);
+	if (!evutil_timercmp(now, &e->expires, <)) {
+		/* keep it around in case the nameservers fail */
+		if (evutil_timercmp(now, &e->stale_until, <))
+			return NULL;
+		++base->cache_stats.expirations;
+		evdns_cache_entry_free_(base, e);
+		return NULL;
+	}
+	return e;
+}
+
+static void
+evdns_cache_prefetch_callback_(int result, char type, int count, int ttl,
+    void *addresses, void *arg)
+{
+	/* Nothing to do: the answer has already been stored in the cache. */
+}
+
+/* Ask again for the answer in e in the background, so that it is
+ * refreshed before it expires. */
+static void
+evdns_cache_prefetch_(struct evdns_base *base, struct evdns_cache_entry *e,
+    int flags)
+{
+	struct evdns_request *handle;
+	struct request *req;
+
+	handle = mm_calloc(1, sizeof(*handle));
+	if (!handle)
+		return;
+	handle->user_callback = evdns_cache_prefetch_callback_;
+	handle->base = base;
+	handle->tcp_flags = base->global_tcp_flags;
+	handle->tcp_flags |= flags & (DNS_QUERY_USEVC | DNS_QUERY_IGNTC);
+	if (!(handle->lookup_name = mm_strdup(e->name))) {
+		mm_free(handle);
+		return;
+	}
+	handle->lookup_type = e->type;
+	handle->lookup_flags = (flags & DNS_CNAME_CALLBACK) | handle->tcp_flags;
+	handle->lookup_searched = e->searched;
+	TAILQ_INIT(&handle->waiters);
+
+	log(EVDNS_LOG_DEBUG, "Prefetching %s", handle->lookup_name);
+	if (e->searched) {
+		search_request_new(base, handle, e->type, handle->lookup_name,
+		    flags);
+	} else {
+		req = request_new(base, handle, e->type, handle->lookup_name,
+		    flags | DNS_QUERY_NO_SEARCH);
+		if (req)
+			request_submit(req);
+	}
+	if (handle->current_req == NULL) {
+		evdns_handle_free_(handle);
+		return;
+	}
+	evdns_lookup_index_(base, handle);
+	e->prefetching = 1;
+	++base->cache_stats.prefetches;
+}
+
+/* The lookup behind handle is over, whatever its outcome: let the entry
+ * it may have been refreshing be prefetched again. */
+static void
+evdns_cache_prefetch_done_(struct evdns_base *base,
+    struct evdns_request *handle, int type)
+{
+	struct evdns_cache_entry find, *e;
+
+	ASSERT_LOCKED(base);
+	if (!base->cache_max_entries)
+		return;
+	memset(&find, 0, sizeof(find));
+	find.name = handle->lookup_name;
+	find.type = type;
+	find.class = CLASS_INET;
+	find.searched = handle->lookup_searched;
+	if ((e = HT_FIND(evdns_cache_map, &base->cache, &find)))
+		e->prefetching = 0;
+}
+
+/* All nameservers failed for the lookup behind handle.  If the cache still
+ * has an answer for it that is no older than cache-max-stale, copy it into
+ * *reply (for positive answers), set *err and *ttl, and return 1; return 0
+ * otherwise.  See RFC 8767. */
+static int
+evdns_cache_stale_(struct evdns_base *base, struct evdns_request *handle,
+    int type, u32 *ttl, u32 *err, struct reply *reply)
+{
+	struct evdns_cache_entry find, *e;
+	struct timeval now, recheck;
+
+	ASSERT_LOCKED(base);
+	if (!base->cache_max_entries || !base->cache_max_stale)
+		return 0;
+	memset(&find, 0, sizeof(find));
+	find.name = handle->lookup_name;
+	find.type = type;
+	find.class = CLASS_INET;
+	find.searched = handle->lookup_searched;
+	e = HT_FIND(evdns_cache_map, &base->cache, &find);
+	if (!e)
+		return 0;
+	evutil_gettime_monotonic_(&base->monotonic_timer, &now);
+	if (!evutil_timercmp(&now, &e->stale_until, <))
+		return 0;
+
+	memset(reply, 0, sizeof(*reply));
+	if (e->err == DNS_ERR_NONE) {
+		if (!(reply->data.raw = mm_malloc(e->datalen)))
+			return 0;
+		memcpy(reply->data.raw, e->data, e->datalen);
+		reply->type = type;
+		reply->rr_count = e->rr_count;
+		reply->have_answer = 1;
+		if (e->cname)
+			reply->cname = mm_strdup(e->cname);
+	}
+	log(EVDNS_LOG_DEBUG, "Serving stale answer for %s", e->name);
+	*err = e->err;
+	*ttl = EVDNS_STALE_TTL;
+
+	/* Don't send every lookup for this name to the failing nameservers
+	 * again: answer from the cache for a while. */
+	recheck = now;
+	recheck.tv_sec += EVDNS_STALE_TTL;
+	if (evutil_timercmp(&recheck, &e->stale_until, >))
+		recheck = e->stale_until;
+	if (evutil_timercmp(&recheck, &e->expires, >))
+		e->expires = recheck;
+	++base->cache_stats.stale_hits;
+	return 1;
+}
+
+/* Try to answer handle from the cache.  Returns 1 if the callback has been
+ * scheduled, 0 if a request has to be sent. */
+static int
+evdns_cache_answer_(struct evdns_base *base, struct evdns_request *handle,
+    struct evdns_cache_entry *find, int flags)
+{
+	struct evdns_cache_entry *e;
+	struct timeval now, left;
+	int type = find->type;
+
+	e = evdns_cache_find_(base, find, &now);
+	if (!e) {
+		++base->cache_stats.misses;
+		return 0;
+	}
+
+	if (e->err == DNS_ERR_NONE) {
+		void *data = mm_malloc(e->datalen);
+		if (!data)
+			return 0;
+		memcpy(data, e->data, e->datalen);
+		handle->reply.data.raw = data;
+		handle->reply.type = type;
+		handle->reply.rr_count = e->rr_count;
+		handle->reply.have_answer = 1;
+		if ((flags & DNS_CNAME_CALLBACK) && e->cname)
+			handle->reply.cname = mm_strdup(e->cname);
+		handle->have_reply = 1;
+		++base->cache_stats.hits;
+	} else {
+		++base->cache_stats.negative_hits;
+	}
+
+	TAILQ_REMOVE(&base->cache_lru, e, lru);
+	TAILQ_INSERT_HEAD(&base->cache_lru, e, lru);
+
+	evutil_timersub(&e->expires, &now, &left);
+	handle->request_type = type;
+	handle->ttl = (u32)left.tv_sec;
+	handle->err = e->err;
+	reply_schedule_handle(base, handle,
+	    event_base_get_npriorities(base->event_base) / 2);
+
+	if (base->cache_prefetch && e->err == DNS_ERR_NONE &&
+	    !e->prefetching &&
+	    ((ev_uint64_t)left.tv_sec * 1000 + left.tv_usec / 1000) * 100 <
+	    (ev_uint64_t)e->ttl * 1000 * base->cache_prefetch)
+		evdns_cache_prefetch_(base, e, flags);
+	return 1;
+}
+
+/* Attach handle to an outstanding identical lookup, if there is one. */
+static int
+evdns_coalesce_attach_(struct evdns_base *base, struct evdns_request *handle)
+{
+	struct evdns_request *leader;
+
+	leader = HT_FIND(evdns_inflight_map, &base->inflight, handle);
+	if (!leader)
+		return 0;
+	log(EVDNS_LOG_DEBUG, "Coalescing lookup for %s with %p",
+	    handle->lookup_name, (void *)leader);
+	handle->leader = leader;
+	TAILQ_INSERT_TAIL(&leader->waiters, handle, waiter_next);
+	return 1;
+}
+
+/* Called by the resolve functions before creating a request.  Returns 1
+ * if handle has been answered from the cache or attached to an identical
+ * outstanding lookup, and 0 if a request has to be sent. */
+static int
+evdns_lookup_start_(struct evdns_base *base, struct evdns_request *handle,
+    int type, const char *name, int flags)
+{
+	struct evdns_cache_entry find;
+	char namebuf[EVDNS_NAME_MAX + 1];
+
+	ASSERT_LOCKED(base);
+	if (!base->cache_max_entries && !base->coalesce_queries)
+		return 0;
+	if (evdns_cache_key_(base, &find, namebuf, sizeof(namebuf), type, name,
+		flags) < 0)
+		return 0;
+	handle->base = base;
+
+	if (base->cache_max_entries &&
+	    evdns_cache_answer_(base, handle, &find, flags))
+		return 1;
+
+	if (!(handle->lookup_name = mm_strdup(namebuf)))
+		return 0;
+	handle->lookup_type = type;
+	handle->lookup_flags = (flags & DNS_CNAME_CALLBACK) | handle->tcp_flags;
+	handle->lookup_searched = find.searched;
+	TAILQ_INIT(&handle->waiters);
+
+	return base->coalesce_queries && evdns_coalesce_attach_(base, handle);
+}
+
+/* Make handle, which now owns a request, visible to identical lookups. */
+static void
+evdns_lookup_index_(struct evdns_base *base, struct evdns_request *handle)
+{
+	ASSERT_LOCKED(base);
+	if (!handle->lookup_name || !base->coalesce_queries ||
+	    HT_FIND(evdns_inflight_map, &base->inflight, handle))
+		return;
+	HT_INSERT(evdns_inflight_map, &base->inflight, handle);
+	handle->lookup_indexed = 1;
 }
 
-static struct request *
-search_request_new(struct evdns_base *base, struct evdns_request *handle,
-		   int type, const char *const name, int flags) {
+/* The search configuration changed: cached answers and outstanding
+ * lookups no longer answer the same question as new lookups. */
+static void
+evdns_lookup_config_changed_(struct evdns_base *base)
+{
+	struct evdns_request **ent;
+
 	ASSERT_LOCKED(base);
-	EVUTIL_ASSERT(type == TYPE_A || type == TYPE_AAAA);
-	EVUTIL_ASSERT(handle->current_req == NULL);
-	if ( ((flags & DNS_QUERY_NO_SEARCH) == 0) &&
-	     base->global_search_state &&
-		 base->global_search_state->num_domains) {
-		/* we have some domains to search */
-		struct request *req;
-		if (string_num_dots(name) >= base->global_search_state->ndots) {
-			req = request_new(base, handle, type, name, flags);
-			if (!req) return NULL;
-			handle->search_index = -1;
-		} else {
-			char *const new_name = search_make_new(base->global_search_state, 0, name);
-			if (!new_name) return NULL;
-			req = request_new(base, handle, type, new_name, flags);
-			mm_free(new_name);
-			if (!req) return NULL;
-			handle->search_index = 0;
-		}
-		EVUTIL_ASSERT(handle->search_origname == NULL);
-		handle->search_origname = mm_strdup(name);
-		if (handle->search_origname == NULL) {
-			/* XXX Should we dealloc req? If yes, how? */
-			if (req)
-				mm_free(req);
-			return NULL;
-		}
-		handle->search_state = base->global_search_state;
-		handle->search_flags = flags;
-		base->global_search_state->refcount++;
-		request_submit(req);
-		return req;
-	} else {
-		struct request *const req = request_new(base, handle, type, name, flags);
-		if (!req) return NULL;
-		request_submit(req);
-		return req;
+	evdns_cache_flush_(base);
+	for (ent = HT_START(evdns_inflight_map, &base->inflight); ent; ) {
+		(*ent)->lookup_indexed = 0;
+		ent = HT_NEXT_RMV(evdns_inflight_map, &base->inflight, ent);
 	}
 }
 
-/* this is called when a request has failed to find a name. We need to check */
-/* if it is part of a search and, if so, try the next name in the list */
-/* returns: */
-/*   0 another request has been submitted */
-/*   1 no more requests needed */
-static int
-search_try_next(struct evdns_request *const handle) {
-	struct request *req = handle->current_req;
-	struct evdns_base *base = req->base;
-	struct request *newreq;
+/* The request owned by handle is finished: pass its outcome on to every
+ * lookup that was waiting on it. */
+static void
+evdns_coalesce_finish_(struct evdns_base *base, struct evdns_request *handle,
+    int type, u32 ttl, int err, const struct reply *reply, int priority)
+{
+	struct evdns_request *w;
+	size_t datalen = reply ? evdns_reply_datalen_(type, reply) : 0;
+
 	ASSERT_LOCKED(base);
-	if (handle->search_state) {
-		/* it is part of a search */
-		char *new_name;
-		handle->search_index++;
-		if (handle->search_index >= handle->search_state->num_domains) {
-			/* no more postfixes to try, however we may need to try */
-			/* this name without a postfix */
-			if (string_num_dots(handle->search_origname) < handle->search_state->ndots) {
-				/* yep, we need to try it raw */
-				newreq = request_new(base, NULL, req->request_type, handle->search_origname, handle->search_flags);
-				log(EVDNS_LOG_DEBUG, "Search: trying raw query %s", handle->search_origname);
-				if (newreq) {
-					search_request_finished(handle);
-					goto submit_next;
-				}
+	if (handle->lookup_indexed) {
+		HT_REMOVE(evdns_inflight_map, &base->inflight, handle);
+		handle->lookup_indexed = 0;
+	}
+
+	while ((w = TAILQ_FIRST(&handle->waiters))) {
+		TAILQ_REMOVE(&handle->waiters, w, waiter_next);
+		w->leader = NULL;
+		w->request_type = type;
+		w->ttl = ttl;
+		w->err = err;
+		if (reply) {
+			memcpy(&w->reply, reply, sizeof(struct reply));
+			w->reply.data.raw = NULL;
+			w->reply.cname = NULL;
+			if (datalen &&
+			    !(w->reply.data.raw = mm_malloc(datalen))) {
+				w->err = DNS_ERR_UNKNOWN;
+			} else {
+				if (datalen)
+					memcpy(w->reply.data.raw,
+					    reply->data.raw, datalen);
+				if (reply->cname &&
+				    (w->lookup_flags & DNS_CNAME_CALLBACK))
+					w->reply.cname = mm_strdup(reply->cname);
+				if (reply->cname && w->put_cname_in_ptr &&
+				    !*w->put_cname_in_ptr)
+					*w->put_cname_in_ptr =
+					    mm_strdup(reply->cname);
+				w->have_reply = 1;
 			}
-			return 1;
 		}
+		reply_schedule_handle(base, w, priority);
+	}
+}
 
-		new_name = search_make_new(handle->search_state, handle->search_index, handle->search_origname);
-		if (!new_name) return 1;
-		log(EVDNS_LOG_DEBUG, "Search: now trying %s (%d)", new_name, handle->search_index);
-		newreq = request_new(base, NULL, req->request_type, new_name, handle->search_flags);
-		mm_free(new_name);
-		if (!newreq) return 1;
-		goto submit_next;
+/* Cancel a handle that shares its request with other lookups.  A waiter
+ * just drops out; the owner of the request hands it over to its first
+ * waiter, so that the remaining lookups are not affected. */
+static void
+evdns_coalesce_cancel_(struct evdns_base *base, struct evdns_request *handle)
+{
+	struct request *req;
+	struct evdns_request *w, *next;
+
+	ASSERT_LOCKED(base);
+	if (handle->leader) {
+		req = handle->leader->current_req;
+		TAILQ_REMOVE(&handle->leader->waiters, handle, waiter_next);
+		handle->leader = NULL;
+	} else {
+		req = handle->current_req;
+		w = TAILQ_FIRST(&handle->waiters);
+		TAILQ_REMOVE(&handle->waiters, w, waiter_next);
+		w->leader = NULL;
+		while ((next = TAILQ_FIRST(&handle->waiters))) {
+			TAILQ_REMOVE(&handle->waiters, next, waiter_next);
+			TAILQ_INSERT_TAIL(&w->waiters, next, waiter_next);
+			next->leader = w;
+		}
+		if (handle->lookup_indexed) {
+			HT_REMOVE(evdns_inflight_map, &base->inflight, handle);
+			handle->lookup_indexed = 0;
+			HT_INSERT(evdns_inflight_map, &base->inflight, w);
+			w->lookup_indexed = 1;
+		}
+
+		w->current_req = req;
+		w->search_index = handle->search_index;
+		w->search_state = handle->search_state;
+		w->search_origname = handle->search_origname;
+		w->search_flags = handle->search_flags;
+		w->tcp_flags = handle->tcp_flags;
+		handle->search_state = NULL;
+		handle->search_origname = NULL;
+		handle->current_req = NULL;
+		req->handle = w;
+		/* the canceled caller may free its cname storage */
+		req->put_cname_in_ptr = w->put_cname_in_ptr;
+		w->put_cname_in_ptr = NULL;
 	}
-	return 1;
 
-submit_next:
-	request_finished(req, &REQ_HEAD(req->base, req->trans_id), 0);
-	handle->current_req = newreq;
-	newreq->handle = handle;
-	request_submit(newreq);
-	return 0;
+	handle->request_type = handle->lookup_type;
+	handle->ttl = 0;
+	handle->err = DNS_ERR_CANCEL;
+	reply_schedule_handle(base, handle,
+	    event_get_priority(&req->timeout_event));
+}
+
+/* Return a copy of the cached canonical name for a lookup, if any. */
+static char *
+evdns_cache_cname_dup_(struct evdns_base *base, int type, const char *name,
+    int flags)
+{
+	struct evdns_cache_entry find, *e;
+	struct timeval now;
+	char namebuf[EVDNS_NAME_MAX + 1];
+
+	ASSERT_LOCKED(base);
+	if (!base->cache_max_entries)
+		return NULL;
+	if (evdns_cache_key_(base, &find, namebuf, sizeof(namebuf), type, name,
+		flags) < 0)
+		return NULL;
+	e = evdns_cache_find_(base, &find, &now);
+	if (!e || !e->cname)
+		return NULL;
+	return mm_strdup(e->cname);
 }
 
+/* Remember the final outcome of the lookup behind handle. */
 static void
-search_request_finished(struct evdns_request *const handle) {
-	ASSERT_LOCKED(handle->current_req->base);
-	if (handle->search_state) {
-		search_state_decref(handle->search_state);
-		handle->search_state = NULL;
+evdns_cache_store_(struct evdns_base *base, struct evdns_request *handle,
+    int type, u32 ttl, int err, const struct reply *reply)
+{
+	struct evdns_cache_entry find, *e, *old;
+	size_t namelen, datalen = 0;
+
+	ASSERT_LOCKED(base);
+	if (!base->cache_max_entries)
+		return;
+
+	if (err == DNS_ERR_NONE) {
+		if (!reply || !(datalen = evdns_reply_datalen_(type, reply)))
+			return;
+		if (ttl < base->cache_min_ttl)
+			ttl = base->cache_min_ttl;
+		if (ttl > base->cache_max_ttl)
+			ttl = base->cache_max_ttl;
+	} else if (err == DNS_ERR_NOTEXIST || err == DNS_ERR_NODATA) {
+		if (ttl > base->cache_max_negative_ttl)
+			ttl = base->cache_max_negative_ttl;
+	} else {
+		return;
 	}
-	if (handle->search_origname) {
-		mm_free(handle->search_origname);
-		handle->search_origname = NULL;
+	if (!ttl)
+		return;
+
+	namelen = strlen(handle->lookup_name);
+	e = mm_calloc(1, sizeof(*e) + namelen + 1);
+	if (!e)
+		return;
+	e->name = (char *)(e + 1);
+	memcpy(e->name, handle->lookup_name, namelen + 1);
+	e->type = type;
+	e->class = CLASS_INET;
+	e->searched = handle->lookup_searched;
+	e->err = err;
+	if (datalen) {
+		if (!(e->data = mm_malloc(datalen))) {
+			mm_free(e);
+			return;
+		}
+		memcpy(e->data, reply->data.raw, datalen);
+		e->datalen = datalen;
+		e->rr_count = reply->rr_count;
+		if (reply->cname)
+			e->cname = mm_strdup(reply->cname);
+	}
+	evutil_gettime_monotonic_(&base->monotonic_timer, &e->expires);
+	e->expires.tv_sec += ttl;
+	e->stale_until = e->expires;
+	e->stale_until.tv_sec += base->cache_max_stale;
+	e->ttl = ttl;
+
+	find = *e;
+	if ((old = HT_FIND(evdns_cache_map, &base->cache, &find)))
+		evdns_cache_entry_free_(base, old);
+	while (HT_SIZE(&base->cache) >= base->cache_max_entries) {
+		++base->cache_stats.evictions;
+		evdns_cache_entry_free_(base,
+		    TAILQ_LAST(&base->cache_lru, evdns_cache_lru));
 	}
+
+	HT_INSERT(evdns_cache_map, &base->cache, e);
+	TAILQ_INSERT_HEAD(&base->cache_lru, e, lru);
+	++base->cache_stats.insertions;
+}
+
+/* exported function */
+void
+evdns_base_cache_clear(struct evdns_base *base)
+{
+	EVDNS_LOCK(base);
+	evdns_cache_flush_(base);
+	EVDNS_UNLOCK(base);
+}
+
+/* exported function */
+int
+evdns_base_get_cache_stats(struct evdns_base *base,
+    struct evdns_cache_stats *stats)
+{
+	EVDNS_LOCK(base);
+	memcpy(stats, &base->cache_stats, sizeof(*stats));
+	stats->entries = HT_SIZE(&base->cache);
+	EVDNS_UNLOCK(base);
+	return 0;
 }
 
 /* ================================================================= */
@@ -4206,6 +6452,9 @@ evdns_base_set_max_requests_inflight(struct evdns_base *base, int maxinflight)
 		maxinflight = 1;
 	n_heads = (maxinflight+4) / 5;
 	EVUTIL_ASSERT(n_heads > 0);
+	if (trans_map_reserve(base, maxinflight > base->global_requests_inflight ?
+		maxinflight : base->global_requests_inflight) < 0)
+		return (-1);
 	new_heads = mm_calloc(n_heads, sizeof(struct request*));
 	if (!new_heads)
 		return (-1);
@@ -4281,6 +6530,16 @@ evdns_server_port_set_option(struct evdns_server_port *port,
 		log(EVDNS_LOG_DEBUG, "Setting EVDNS_SOPT_TCP_IDLE_TIMEOUT to %u seconds",
 			(unsigned)port->tcp_idle_timeout.tv_sec);
 		break;
+	case EVDNS_SOPT_UDP_BATCH:
+		if (port->listener) {
+			log(EVDNS_LOG_WARN, "EVDNS_SOPT_UDP_BATCH option can be set only on UDP server");
+			res = -1;
+			goto end;
+		}
+		port->batch_replies = value != 0;
+		log(EVDNS_LOG_DEBUG, "Setting EVDNS_SOPT_UDP_BATCH to %d",
+			(int)port->batch_replies);
+		break;
 	default:
 		log(EVDNS_LOG_WARN, "Invalid DNS server option %d", (int)option);
 		res = -1;
@@ -4401,6 +6660,12 @@ evdns_base_set_option_impl(struct evdns_base *base,
 		if (!(flags & DNS_OPTION_MISC)) return 0;
 		log(EVDNS_LOG_DEBUG, "Setting tcp idle timeout to %s", val);
 		memcpy(&base->global_tcp_idle_timeout, &tv, sizeof(tv));
+	} else if (str_matches_option(option, "tcp-reconnect-backoff:")) {
+		struct timeval tv;
+		if (evdns_strtotimeval(val, &tv) == -1) return -1;
+		if (!(flags & DNS_OPTION_MISC)) return 0;
+		log(EVDNS_LOG_DEBUG, "Setting tcp reconnect backoff to %s", val);
+		memcpy(&base->global_tcp_reconnect_backoff, &tv, sizeof(tv));
 	} else if (str_matches_option(option, "use-vc:")) {
 		if (!(flags & DNS_OPTION_MISC)) return 0;
 		if (val && strlen(val)) return -1;
@@ -4417,6 +6682,94 @@ evdns_base_set_option_impl(struct evdns_base *base,
 		if (!(flags & DNS_OPTION_MISC)) return 0;
 		log(EVDNS_LOG_DEBUG, "Setting edns-udp-size to %d", sz);
 		base->global_max_udp_size = sz;
+	} else if (str_matches_option(option, "cache-size:")) {
+		const int sz = strtoint_clipped(val, 0, 1000000);
+		if (sz == -1) return -1;
+		if (!(flags & DNS_OPTION_MISC)) return 0;
+		log(EVDNS_LOG_DEBUG, "Setting cache-size to %d", sz);
+		base->cache_max_entries = sz;
+		while (HT_SIZE(&base->cache) > base->cache_max_entries) {
+			++base->cache_stats.evictions;
+			evdns_cache_entry_free_(base,
+			    TAILQ_LAST(&base->cache_lru, evdns_cache_lru));
+		}
+	} else if (str_matches_option(option, "cache-min-ttl:")) {
+		const int ttl = strtoint(val);
+		if (ttl == -1) return -1;
+		if (!(flags & DNS_OPTION_MISC)) return 0;
+		log(EVDNS_LOG_DEBUG, "Setting cache-min-ttl to %d", ttl);
+		base->cache_min_ttl = ttl;
+	} else if (str_matches_option(option, "cache-max-ttl:")) {
+		const int ttl = strtoint(val);
+		if (ttl == -1) return -1;
+		if (!(flags & DNS_OPTION_MISC)) return 0;
+		log(EVDNS_LOG_DEBUG, "Setting cache-max-ttl to %d", ttl);
+		base->cache_max_ttl = ttl;
+	} else if (str_matches_option(option, "cache-max-negative-ttl:")) {
+		const int ttl = strtoint(val);
+		if (ttl == -1) return -1;
+		if (!(flags & DNS_OPTION_MISC)) return 0;
+		log(EVDNS_LOG_DEBUG, "Setting cache-max-negative-ttl to %d", ttl);
+		base->cache_max_negative_ttl = ttl;
+	} else if (str_matches_option(option, "cache-prefetch:")) {
+		const int pct = strtoint_clipped(val, 0, 99);
+		if (pct == -1) return -1;
+		if (!(flags & DNS_OPTION_MISC)) return 0;
+		log(EVDNS_LOG_DEBUG, "Setting cache-prefetch to %d", pct);
+		base->cache_prefetch = pct;
+	} else if (str_matches_option(option, "cache-max-stale:")) {
+		const int stale = strtoint(val);
+		if (stale == -1) return -1;
+		if (!(flags & DNS_OPTION_MISC)) return 0;
+		log(EVDNS_LOG_DEBUG, "Setting cache-max-stale to %d", stale);
+		base->cache_max_stale = stale;
+	} else if (str_matches_option(option, "coalesce-queries:")) {
+		int coalesce = strtoint(val);
+		if (coalesce == -1) return -1;
+		if (!(flags & DNS_OPTION_MISC)) return 0;
+		log(EVDNS_LOG_DEBUG, "Setting coalesce-queries to %d", coalesce);
+		base->coalesce_queries = coalesce;
+	} else if (str_matches_option(option, "udp-batch:")) {
+		int batch = strtoint(val);
+		if (batch == -1) return -1;
+		if (!(flags & DNS_OPTION_MISC)) return 0;
+		log(EVDNS_LOG_DEBUG, "Setting udp-batch to %d", batch);
+		base->udp_batch = batch;
+	} else if (str_matches_option(option, "rtt-select:")) {
+		int select = strtoint(val);
+		if (select == -1) return -1;
+		if (!(flags & DNS_OPTION_MISC)) return 0;
+		log(EVDNS_LOG_DEBUG, "Setting rtt-select to %d", select);
+		base->rtt_select = select;
+	} else if (str_matches_option(option, "adaptive-timeout:")) {
+		int adaptive = strtoint(val);
+		if (adaptive == -1) return -1;
+		if (!(flags & DNS_OPTION_MISC)) return 0;
+		log(EVDNS_LOG_DEBUG, "Setting adaptive-timeout to %d", adaptive);
+		base->adaptive_timeout = adaptive;
+	} else if (str_matches_option(option, "hedge-percentile:")) {
+		int percentile = strtoint(val);
+		if (percentile < 0 || percentile > 99) return -1;
+		if (!(flags & DNS_OPTION_MISC)) return 0;
+		log(EVDNS_LOG_DEBUG, "Setting hedge-percentile to %d", percentile);
+		base->hedge_percentile = percentile;
+	} else if (str_matches_option(option, "hosts-reverse:")) {
+		int reverse = strtoint(val);
+		if (reverse == -1) return -1;
+		if (!(flags & DNS_OPTION_MISC)) return 0;
+		log(EVDNS_LOG_DEBUG, "Setting hosts-reverse to %d", reverse);
+		base->hosts_reverse = reverse;
+	} else if (str_matches_option(option, "hosts-reload-interval:")) {
+		struct timeval tv;
+		if (evdns_strtotimeval(val, &tv) == -1) return -1;
+		if (!(flags & DNS_OPTION_MISC)) return 0;
+		log(EVDNS_LOG_DEBUG, "Setting hosts-reload-interval to %s", val);
+		if (tv.tv_sec || tv.tv_usec) {
+			if (event_add(&base->hosts_check_ev, &tv) < 0)
+				return -1;
+		} else {
+			(void) event_del(&base->hosts_check_ev);
+		}
 	}
 	return 0;
 }
@@ -4864,7 +7217,37 @@ evdns_base_new(struct event_base *event_base, int flags)
 	base->ns_timeout_backoff_factor = 3;
 	base->global_tcp_idle_timeout.tv_sec = CLIENT_IDLE_CONN_TIMEOUT;
 
-	TAILQ_INIT(&base->hostsdb);
+	HT_INIT(evdns_cache_map, &base->cache);
+	TAILQ_INIT(&base->cache_lru);
+	base->cache_max_entries = 0;
+	base->cache_min_ttl = 0;
+	base->cache_max_ttl = 86400;
+	base->cache_max_negative_ttl = 3600;
+	evutil_configure_monotonic_time_(&base->monotonic_timer, 0);
+
+	HT_INIT(evdns_inflight_map, &base->inflight);
+	base->coalesce_queries = 0;
+
+	base->udp_batch = 0;
+	event_deferred_cb_init_(&base->send_flush_cb,
+	    event_base_get_npriorities(event_base) / 2,
+	    evdns_flush_sends, base);
+
+	base->rtt_select = 0;
+	base->adaptive_timeout = 0;
+	base->hedge_percentile = 0;
+	evutil_weakrand_seed_(&base->weakrand_seed, 0);
+
+	base->hosts_reverse = 0;
+	event_assign(&base->hosts_check_ev, event_base, -1, EV_PERSIST,
+	    evdns_hosts_check_cb, base);
+	evtimer_assign(&base->hosts_parse_ev, event_base,
+	    evdns_hosts_parse_cb, base);
+	base->hostsdb = hosts_db_new();
+	if (!base->hostsdb) {
+		evdns_base_free_and_unlock(base, 0);
+		return NULL;
+	}
 
 #define EVDNS_BASE_ALL_FLAGS ( \
 	EVDNS_BASE_INITIALIZE_NAMESERVERS | \
@@ -4953,7 +7336,11 @@ evdns_nameserver_free(struct nameserver *server)
 		server->probe_request = NULL;
 	}
 	event_debug_unassign(&server->timeout_event);
+	(void) event_del(&server->tcp_reconnect_event);
+	event_debug_unassign(&server->tcp_reconnect_event);
 	disconnect_and_free_connection(server->connection);
+	while (!TAILQ_EMPTY(&server->send_queue))
+		request_unqueue_send(TAILQ_FIRST(&server->send_queue));
 	mm_free(server);
 }
 
@@ -5002,15 +7389,24 @@ evdns_base_free_and_unlock(struct evdns_base *base, int fail_requests)
 		base->global_search_state = NULL;
 	}
 
-	{
-		struct hosts_entry *victim;
-		while ((victim = TAILQ_FIRST(&base->hostsdb))) {
-			TAILQ_REMOVE(&base->hostsdb, victim, next);
-			mm_free(victim);
-		}
+	evdns_hosts_reload_cancel_(base);
+	if (evtimer_initialized(&base->hosts_check_ev)) {
+		(void) event_del(&base->hosts_check_ev);
+		event_debug_unassign(&base->hosts_check_ev);
+		event_debug_unassign(&base->hosts_parse_ev);
 	}
+	hosts_db_free(base->hostsdb);
+	if (base->hosts_fname)
+		mm_free(base->hosts_fname);
+
+	evdns_cache_flush_(base);
+	HT_CLEAR(evdns_cache_map, &base->cache);
+	HT_CLEAR(evdns_inflight_map, &base->inflight);
+	event_deferred_cb_cancel_(base->event_base, &base->send_flush_cb);
 
 	mm_free(base->req_heads);
+	if (base->trans_map)
+		mm_free(base->trans_map);
 
 	EVDNS_UNLOCK(base);
 	EVTHREAD_FREE_LOCK(base->lock, EVTHREAD_LOCKTYPE_RECURSIVE);
@@ -5028,12 +7424,9 @@ evdns_base_free(struct evdns_base *base, int fail_requests)
 void
 evdns_base_clear_host_addresses(struct evdns_base *base)
 {
-	struct hosts_entry *victim;
 	EVDNS_LOCK(base);
-	while ((victim = TAILQ_FIRST(&base->hostsdb))) {
-		TAILQ_REMOVE(&base->hostsdb, victim, next);
-		mm_free(victim);
-	}
+	evdns_hosts_reload_cancel_(base);
+	hosts_db_clear(base->hostsdb);
 	EVDNS_UNLOCK(base);
 }
 
@@ -5049,7 +7442,7 @@ evdns_shutdown(int fail_requests)
 }
 
 static int
-evdns_base_parse_hosts_line(struct evdns_base *base, char *line)
+evdns_base_parse_hosts_line(struct hosts_db *db, char *line)
 {
 	char *strtok_state;
 	static const char *const delims = " \t";
@@ -5057,7 +7450,6 @@ evdns_base_parse_hosts_line(struct evdns_base *base, char *line)
 	char *hostname, *hash;
 	struct sockaddr_storage ss;
 	int socklen = sizeof(ss);
-	ASSERT_LOCKED(base);
 
 #define NEXT_TOKEN strtok_r(NULL, delims, &strtok_state)
 
@@ -5074,25 +7466,14 @@ evdns_base_parse_hosts_line(struct evdns_base *base, char *line)
 		return -1;
 
 	while ((hostname = NEXT_TOKEN)) {
-		struct hosts_entry *he;
-		size_t namelen;
 		if ((hash = strchr(hostname, '#'))) {
 			if (hash == hostname)
 				return 0;
 			*hash = '\0';
 		}
 
-		namelen = strlen(hostname);
-
-		he = mm_calloc(1, sizeof(struct hosts_entry)+namelen);
-		if (!he)
+		if (hosts_db_add(db, (struct sockaddr*)&ss, socklen, hostname) < 0)
 			return -1;
-		EVUTIL_ASSERT(socklen <= (int)sizeof(he->addr));
-		memcpy(&he->addr, &ss, socklen);
-		memcpy(he->hostname, hostname, namelen+1);
-		he->addrlen = socklen;
-
-		TAILQ_INSERT_TAIL(&base->hostsdb, he, next);
 
 		if (hash)
 			return 0;
@@ -5102,25 +7483,66 @@ evdns_base_parse_hosts_line(struct evdns_base *base, char *line)
 #undef NEXT_TOKEN
 }
 
+/* Forget about a reload of the hosts file that is in progress. */
+static void
+evdns_hosts_reload_cancel_(struct evdns_base *base)
+{
+	ASSERT_LOCKED(base);
+	if (!base->hosts_pending)
+		return;
+	(void) event_del(&base->hosts_parse_ev);
+	hosts_db_free(base->hosts_pending);
+	base->hosts_pending = NULL;
+	mm_free(base->hosts_text);
+	base->hosts_text = NULL;
+}
+
+/* Remember the size and modification time of the hosts file, so that */
+/* evdns_hosts_check_cb can tell when it changes. */
+static int
+evdns_hosts_stat_(struct evdns_base *base, int *changed)
+{
+	struct stat st;
+
+	if (stat(base->hosts_fname, &st) < 0)
+		return -1;
+	*changed = st.st_mtime != base->hosts_mtime ||
+	    (ev_int64_t)st.st_size != base->hosts_size;
+	base->hosts_mtime = st.st_mtime;
+	base->hosts_size = (ev_int64_t)st.st_size;
+	return 0;
+}
+
 static int
 evdns_base_load_hosts_impl(struct evdns_base *base, const char *hosts_fname)
 {
 	char *str=NULL, *cp, *eol;
 	size_t len;
-	int err=0;
+	int err=0, changed;
 
 	ASSERT_LOCKED(base);
 
+	/* Entries loaded now would be lost when the reload finishes. */
+	evdns_hosts_reload_cancel_(base);
+
 	if (hosts_fname == NULL ||
 	    (err = evutil_read_file_(hosts_fname, &str, &len, 0)) < 0) {
 		char tmp[64];
 		strlcpy(tmp, "127.0.0.1   localhost", sizeof(tmp));
-		evdns_base_parse_hosts_line(base, tmp);
+		evdns_base_parse_hosts_line(base->hostsdb, tmp);
 		strlcpy(tmp, "::1   localhost", sizeof(tmp));
-		evdns_base_parse_hosts_line(base, tmp);
+		evdns_base_parse_hosts_line(base->hostsdb, tmp);
 		return err ? -1 : 0;
 	}
 
+	if (!base->hosts_fname || strcmp(base->hosts_fname, hosts_fname)) {
+		if (base->hosts_fname)
+			mm_free(base->hosts_fname);
+		base->hosts_fname = mm_strdup(hosts_fname);
+	}
+	if (base->hosts_fname)
+		(void) evdns_hosts_stat_(base, &changed);
+
 	/* This will break early if there is a NUL in the hosts file.
 	 * Probably not a problem.*/
 	cp = str;
@@ -5129,10 +7551,10 @@ evdns_base_load_hosts_impl(struct evdns_base *base, const char *hosts_fname)
 
 		if (eol) {
 			*eol = '\0';
-			evdns_base_parse_hosts_line(base, cp);
+			evdns_base_parse_hosts_line(base->hostsdb, cp);
 			cp = eol+1;
 		} else {
-			evdns_base_parse_hosts_line(base, cp);
+			evdns_base_parse_hosts_line(base->hostsdb, cp);
 			break;
 		}
 	}
@@ -5153,6 +7575,77 @@ evdns_base_load_hosts(struct evdns_base *base, const char *hosts_fname)
 	return res;
 }
 
+/* Parse the next EVDNS_HOSTS_RELOAD_LINES lines of a hosts file that is */
+/* being reloaded, and switch over to it once it is all parsed. */
+static void
+evdns_hosts_parse_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct evdns_base *base = arg;
+	char *cp, *eol;
+	int n;
+
+	(void) fd;
+	(void) what;
+
+	EVDNS_LOCK(base);
+	if (!base->hosts_pending)
+		goto done;
+
+	cp = base->hosts_text + base->hosts_text_pos;
+	for (n = 0; cp && n < EVDNS_HOSTS_RELOAD_LINES; ++n) {
+		if ((eol = strchr(cp, '\n')))
+			*eol = '\0';
+		evdns_base_parse_hosts_line(base->hosts_pending, cp);
+		cp = eol ? eol+1 : NULL;
+	}
+	if (cp) {
+		static const struct timeval tv_zero = { 0, 0 };
+		base->hosts_text_pos = cp - base->hosts_text;
+		evtimer_add(&base->hosts_parse_ev, &tv_zero);
+		goto done;
+	}
+
+	log(EVDNS_LOG_DEBUG, "Reloaded hosts file %s", base->hosts_fname);
+	hosts_db_free(base->hostsdb);
+	base->hostsdb = base->hosts_pending;
+	base->hosts_pending = NULL;
+	mm_free(base->hosts_text);
+	base->hosts_text = NULL;
+done:
+	EVDNS_UNLOCK(base);
+}
+
+/* Start reloading the hosts file if it has changed. */
+static void
+evdns_hosts_check_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct evdns_base *base = arg;
+	char *str = NULL;
+	size_t len;
+	int changed;
+
+	(void) fd;
+	(void) what;
+
+	EVDNS_LOCK(base);
+	if (!base->hosts_fname || base->hosts_pending ||
+	    evdns_hosts_stat_(base, &changed) < 0 || !changed)
+		goto done;
+
+	log(EVDNS_LOG_DEBUG, "Hosts file %s has changed", base->hosts_fname);
+	if (evutil_read_file_(base->hosts_fname, &str, &len, 0) < 0)
+		goto done;
+	if (!(base->hosts_pending = hosts_db_new())) {
+		mm_free(str);
+		goto done;
+	}
+	base->hosts_text = str;
+	base->hosts_text_pos = 0;
+	evdns_hosts_parse_cb(-1, EV_TIMEOUT, base);
+done:
+	EVDNS_UNLOCK(base);
+}
+
 /* A single request for a getaddrinfo, either v4 or v6. */
 struct getaddrinfo_subrequest {
 	struct evdns_request *r;
@@ -5504,24 +7997,6 @@ evdns_getaddrinfo_gotresolve(int result, char type, int count,
 	}
 }
 
-static struct hosts_entry *
-find_hosts_entry(struct evdns_base *base, const char *hostname,
-    struct hosts_entry *find_after)
-{
-	struct hosts_entry *e;
-
-	if (find_after)
-		e = TAILQ_NEXT(find_after, next);
-	else
-		e = TAILQ_FIRST(&base->hostsdb);
-
-	for (; e; e = TAILQ_NEXT(e, next)) {
-		if (!evutil_ascii_strcasecmp(e->hostname, hostname))
-			return e;
-	}
-	return NULL;
-}
-
 static int
 evdns_getaddrinfo_fromhosts(struct evdns_base *base,
     const char *nodename, struct evutil_addrinfo *hints, ev_uint16_t port,
@@ -5533,8 +8008,8 @@ evdns_getaddrinfo_fromhosts(struct evdns_base *base,
 	int f = hints->ai_family;
 
 	EVDNS_LOCK(base);
-	for (e = find_hosts_entry(base, nodename, NULL); e;
-	    e = find_hosts_entry(base, nodename, e)) {
+	for (e = hosts_db_find_name(base->hostsdb, nodename); e;
+	    e = e->next_by_name) {
 		struct evutil_addrinfo *ai_new;
 		++n_found;
 		if ((e->addr.sa.sa_family == AF_INET && f == PF_INET6) ||
@@ -5662,9 +8137,17 @@ evdns_getaddrinfo(struct evdns_base *dns_base,
 		data->ipv4_request.r = evdns_base_resolve_ipv4(dns_base,
 		    nodename, 0, evdns_getaddrinfo_gotresolve,
 		    &data->ipv4_request);
-		if (want_cname && data->ipv4_request.r)
-			data->ipv4_request.r->current_req->put_cname_in_ptr =
-			    &data->cname_result;
+		if (want_cname && data->ipv4_request.r) {
+			if (data->ipv4_request.r->current_req)
+				data->ipv4_request.r->current_req->put_cname_in_ptr =
+				    &data->cname_result;
+			else if (data->ipv4_request.r->leader)
+				data->ipv4_request.r->put_cname_in_ptr =
+				    &data->cname_result;
+			else if (!data->cname_result) /* answered from cache */
+				data->cname_result = evdns_cache_cname_dup_(
+				    dns_base, TYPE_A, nodename, 0);
+		}
 	}
 	if (hints.ai_family != PF_INET) {
 		log(EVDNS_LOG_DEBUG, "Sending request for %s on ipv6 as %p",
@@ -5673,9 +8156,17 @@ evdns_getaddrinfo(struct evdns_base *dns_base,
 		data->ipv6_request.r = evdns_base_resolve_ipv6(dns_base,
 		    nodename, 0, evdns_getaddrinfo_gotresolve,
 		    &data->ipv6_request);
-		if (want_cname && data->ipv6_request.r)
-			data->ipv6_request.r->current_req->put_cname_in_ptr =
-			    &data->cname_result;
+		if (want_cname && data->ipv6_request.r) {
+			if (data->ipv6_request.r->current_req)
+				data->ipv6_request.r->current_req->put_cname_in_ptr =
+				    &data->cname_result;
+			else if (data->ipv6_request.r->leader)
+				data->ipv6_request.r->put_cname_in_ptr =
+				    &data->cname_result;
+			else if (!data->cname_result) /* answered from cache */
+				data->cname_result = evdns_cache_cname_dup_(
+				    dns_base, TYPE_AAAA, nodename, 0);
+		}
 	}
 
 	evtimer_assign(&data->timeout, dns_base->event_base,
@@ -178,6 +178,9 @@
 /* Define if the system has zlib */
 #cmakedefine EVENT__HAVE_LIBZ 1
 
+/* Define to 1 if you have the <linux/errqueue.h> header file. */
+#cmakedefine EVENT__HAVE_LINUX_ERRQUEUE_H 1
+
 /* Define to 1 if you have the `mach_absolute_time' function. */
 #cmakedefine EVENT__HAVE_MACH_ABSOLUTE_TIME 1
 
@@ -190,6 +193,9 @@
 /* Define to 1 if you have the <memory.h> header file. */
 #cmakedefine EVENT__HAVE_MEMORY_H 1
 
+/* Define to 1 if you have the `mincore' function. */
+#cmakedefine EVENT__HAVE_MINCORE 1
+
 /* Define to 1 if you have the `mmap' function. */
 #cmakedefine EVENT__HAVE_MMAP 1
 
@@ -238,6 +244,9 @@
 /* Define to 1 if you have the `port_create' function. */
 #cmakedefine EVENT__HAVE_PORT_CREATE 1
 
+/* Define to 1 if you have the `posix_fadvise' function. */
+#cmakedefine EVENT__HAVE_POSIX_FADVISE 1
+
 /* Define to 1 if you have the <port.h> header file. */
 #cmakedefine EVENT__HAVE_PORT_H 1
 
@@ -268,6 +277,15 @@
 /* Define to 1 if you have the `sendfile' function. */
 #cmakedefine EVENT__HAVE_SENDFILE 1
 
+/* Define to 1 if you have the `sendmmsg' function. */
+#cmakedefine EVENT__HAVE_SENDMMSG 1
+
+/* Define to 1 if you have the `splice' function. */
+#cmakedefine EVENT__HAVE_SPLICE 1
+
+/* Define to 1 if you have the `recvmmsg' function. */
+#cmakedefine EVENT__HAVE_RECVMMSG 1
+
 /* Define to 1 if you have the `sigaction' function. */
 #cmakedefine EVENT__HAVE_SIGACTION 1
 
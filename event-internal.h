@@ -252,6 +252,11 @@ struct evwatch {
 };
 TAILQ_HEAD(evwatch_list, evwatch);
 
+struct bufferevent_mem_accounting;
+struct evbuffer_chain_pool;
+struct bufferevent_zerocopy;
+struct evbuffer_file_fetch;
+
 struct event_base {
 	/** Function pointers and other data to describe this event_base's
 	 * backend. */
@@ -395,6 +400,28 @@ struct event_base {
 
 	/** "Prepare" and "check" watchers. */
 	struct evwatch_list watchers[EVWATCH_MAX];
+
+	/** Memory accounting for the bufferevents on this base, if
+	 * bufferevent_base_set_mem_limits() has been called. */
+	struct bufferevent_mem_accounting *bev_mem;
+
+	/** The pool for large evbuffer chains, if
+	 * evbuffer_base_set_chain_pool() has been called. */
+	struct evbuffer_chain_pool *chain_pool;
+
+	/** The zero-copy state of freed socket bufferevents, kept around
+	 * until the kernel is done sending from their memory. */
+	LIST_HEAD(bufferevent_zerocopy_list, bufferevent_zerocopy)
+	    zerocopy_lingering;
+
+	/** The function that evbuffer_base_set_file_offload() gave us, or
+	 * NULL. */
+	void (*file_offload)(void (*)(void *), void *, void *);
+	/** The argument to pass to file_offload. */
+	void *file_offload_arg;
+	/** Reads that file_offload is doing for us, or that are done but
+	 * haven't been reported yet. */
+	LIST_HEAD(evbuffer_file_fetch_list, evbuffer_file_fetch) file_fetches;
 };
 
 struct event_config_entry {
@@ -530,6 +557,22 @@ int event_base_foreach_event_nolock_(struct event_base *base,
  */
 void event_disable_debug_mode(void);
 
+/* Free the memory accounting that bufferevent_base_set_mem_limits() set up
+ * on a base, when the base is freed. */
+void bufferevent_mem_accounting_free_(struct bufferevent_mem_accounting *m);
+
+/* Drop the reference that a base holds on the chain pool that
+ * evbuffer_base_set_chain_pool() gave it, when the base is freed. */
+void evbuffer_chain_pool_decref_(struct evbuffer_chain_pool *pool);
+
+/* Wait for the reads that base's file offload function is doing, and
+ * report every read we haven't yet, when the base is freed. */
+void evbuffer_file_fetch_cancel_all_(struct event_base *base);
+
+/* Stop waiting for the kernel to finish the zero-copy sends of freed
+ * bufferevents, closing their sockets, when the base is freed. */
+void bufferevent_zerocopy_linger_free_all_(struct event_base *base);
+
 #ifdef __cplusplus
 }
 #endif
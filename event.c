@@ -881,6 +881,9 @@ event_base_free_(struct event_base *base, int run_finalizers)
 		event_debug_unassign(&base->th_notify);
 	}
 
+	/* Before anything else: reporting them may add events. */
+	evbuffer_file_fetch_cancel_all_(base);
+
 	/* Delete all non-internal events. */
 	evmap_delete_all_(base);
 
@@ -934,6 +937,9 @@ event_base_free_(struct event_base *base, int run_finalizers)
 		mm_free(eonce);
 	}
 
+	/* Including what the bufferevents we just finalized left behind. */
+	bufferevent_zerocopy_linger_free_all_(base);
+
 	if (base->evsel != NULL && base->evsel->dealloc != NULL)
 		base->evsel->dealloc(base);
 
@@ -961,6 +967,11 @@ event_base_free_(struct event_base *base, int run_finalizers)
 		}
 	}
 
+	if (base->bev_mem)
+		bufferevent_mem_accounting_free_(base->bev_mem);
+	if (base->chain_pool)
+		evbuffer_chain_pool_decref_(base->chain_pool);
+
 	/* If we're freeing current_base, there won't be a current_base. */
 	if (base == current_base)
 		current_base = NULL;
@@ -3992,6 +4003,7 @@ event_free_globals(void)
 	event_free_debug_globals();
 	event_free_evsig_globals();
 	event_free_evutil_globals();
+	bufferevent_socket_free_globals_();
 }
 
 void
@@ -4014,6 +4026,8 @@ event_global_setup_locks_(const int enable_locks)
 		return -1;
 	if (evutil_secure_rng_global_setup_locks_(enable_locks) < 0)
 		return -1;
+	if (bufferevent_socket_global_setup_locks_(enable_locks) < 0)
+		return -1;
 	return 0;
 }
 #endif
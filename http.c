@@ -687,8 +687,8 @@ evhttp_make_header(struct evhttp_connection *evcon, struct evhttp_request *req)
 	}
 
 	TAILQ_FOREACH(header, req->output_headers, next) {
-		evbuffer_add_printf(output, "%s: %s\r\n",
-		    header->key, header->value);
+		evbuffer_add_strings(output, header->key, ": ", header->value,
+		    "\r\n", NULL);
 	}
 	evbuffer_add(output, "\r\n", 2);
 
@@ -3183,8 +3183,9 @@ evhttp_send_reply_chunk_with_cb(struct evhttp_request *req, struct evbuffer *dat
 	if (!evhttp_response_needs_body(req))
 		return;
 	if (req->chunked) {
-		evbuffer_add_printf(output, "%x\r\n",
-				    (unsigned)evbuffer_get_length(databuf));
+		evbuffer_add_uint_fixed(output, evbuffer_get_length(databuf),
+		    EVBUFFER_INT_HEX, 0);
+		evbuffer_add(output, "\r\n", 2);
 	}
 	evbuffer_add_buffer(output, databuf);
 	if (req->chunked) {
@@ -3445,7 +3446,9 @@ evhttp_uriencode(const char *uri, ev_ssize_t len, int space_as_plus)
 		} else if (*p == ' ' && space_as_plus) {
 			evbuffer_add(buf, "+", 1);
 		} else {
-			evbuffer_add_printf(buf, "%%%02X", (unsigned char)(*p));
+			evbuffer_add(buf, "%", 1);
+			evbuffer_add_uint_fixed(buf, (unsigned char)(*p),
+			    EVBUFFER_INT_HEX|EVBUFFER_INT_UPPER, 2);
 		}
 	}
 
@@ -5397,7 +5400,7 @@ evhttp_uri_join(struct evhttp_uri *uri, char *buf, size_t limit)
 	if (uri->host) {
 		evbuffer_add(tmp, "//", 2);
 		if (uri->userinfo)
-			evbuffer_add_printf(tmp,"%s@", uri->userinfo);
+			evbuffer_add_strings(tmp, uri->userinfo, "@", NULL);
 		if (uri->flags & _EVHTTP_URI_HOST_HAS_BRACKETS) {
 			evbuffer_add(tmp, "[", 1);
 			URI_ADD_(host);
@@ -5405,8 +5408,10 @@ evhttp_uri_join(struct evhttp_uri *uri, char *buf, size_t limit)
 		} else {
 			URI_ADD_(host);
 		}
-		if (uri->port >= 0)
-			evbuffer_add_printf(tmp,":%d", uri->port);
+		if (uri->port >= 0) {
+			evbuffer_add(tmp, ":", 1);
+			evbuffer_add_int(tmp, uri->port);
+		}
 
 		if (uri->path && uri->path[0] != '/' && uri->path[0] != '\0')
 			goto err;
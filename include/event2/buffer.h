@@ -182,6 +182,37 @@ int evbuffer_set_max_read(struct evbuffer *buf, size_t max);
 EVENT2_EXPORT_SYMBOL
 size_t evbuffer_get_max_read(struct evbuffer *buf);
 
+/**
+  Statistics about how evbuffer_read() has been reading into an evbuffer.
+
+  @see evbuffer_get_read_stats()
+ */
+struct evbuffer_read_stats {
+	/** Number of reads that returned any data. */
+	ev_uint64_t n_reads;
+	/** Number of bytes those reads returned. */
+	ev_uint64_t n_bytes;
+	/** Number of those reads that filled all the space they offered. */
+	ev_uint64_t n_full;
+	/** Number of times evbuffer_read() asked the kernel how much data
+	 * was waiting. */
+	ev_uint64_t n_fionread;
+	/** How much the next read will ask for, unless it asks the kernel
+	 * first.  Only changes with EVBUFFER_FLAG_ADAPTIVE_READ. */
+	size_t read_size;
+};
+
+/**
+  Get statistics about reads into an evbuffer.
+
+  @param buf pointer to the evbuffer
+  @param stats structure to fill in
+  @see EVBUFFER_FLAG_ADAPTIVE_READ
+ */
+EVENT2_EXPORT_SYMBOL
+void evbuffer_get_read_stats(struct evbuffer *buf,
+    struct evbuffer_read_stats *stats);
+
 /**
    Enable locking on an evbuffer so that it can safely be used by multiple
    threads at the same time.
@@ -229,6 +260,24 @@ void evbuffer_unlock(struct evbuffer *buf);
  */
 #define EVBUFFER_FLAG_DRAINS_TO_FD 1
 
+/** If this flag is set, evbuffer_read() learns how much to read at once.
+ *
+ * Normally, evbuffer_read() asks the kernel how much data is waiting, and
+ * reads that much, up to evbuffer_get_max_read().  With this flag, it
+ * doubles how much it asks for each time a read fills all the space it
+ * offered, and halves it when reads keep coming back with much less, the
+ * way TCP tunes its windows.  It only asks the kernel how much is waiting
+ * when its guess has been off lately.
+ *
+ * This helps on bulk transfers, which then read in big chunks, and on
+ * request/response traffic, which stops allocating space it won't fill.
+ * Set it on a bufferevent's input buffer to use it there, and raise
+ * bufferevent_set_max_single_read() to let it grow past 16 KiB.
+ *
+ * @see evbuffer_get_read_stats()
+ */
+#define EVBUFFER_FLAG_ADAPTIVE_READ 2
+
 /** Change the flags that are set for an evbuffer by adding more.
  *
  * @param buf the evbuffer that the callback is watching.
@@ -586,6 +635,16 @@ struct evbuffer_file_segment;
    at a time.
  */
 #define EVBUF_FS_DISABLE_LOCKING  0x08
+/**
+   Flag for creating evbuffer_file_segment: Ask the kernel to read the file
+   ahead of where it's being written from, and, on an event_base with
+   evbuffer_base_set_file_offload(), never wait for it to come in from disk
+   on the event loop thread.
+
+   This is for large files that may not be in the page cache; it has no
+   effect on segments that were read into memory.
+ */
+#define EVBUF_FS_READAHEAD        0x10
 
 /**
    A cleanup function for a evbuffer_file_segment added to an evbuffer
@@ -667,6 +726,73 @@ EVENT2_EXPORT_SYMBOL
 int evbuffer_add_file_segment(struct evbuffer *buf,
     struct evbuffer_file_segment *seg, ev_off_t offset, ev_off_t length);
 
+/**
+  An evbuffer_shared holds a block of read-only memory that any number of
+  evbuffers can hold at once, for sending the same data to many places.
+  Adding it to an evbuffer costs one small chain, however large the data,
+  and the data is freed when the last evbuffer that holds it drains it.
+
+  Data from an evbuffer_shared can be read, written with writev, moved to
+  other evbuffers, and passed through filters like any other data.
+ */
+struct evbuffer_shared;
+
+/**
+   Create an evbuffer_shared holding a copy of some data.
+
+   @param data the data to copy
+   @param datlen how much of it there is
+   @return a new evbuffer_shared, or NULL on failure.
+ */
+EVENT2_EXPORT_SYMBOL
+struct evbuffer_shared *evbuffer_shared_new(const void *data, size_t datlen);
+
+/**
+   Create an evbuffer_shared that refers to some data without copying it.
+
+   The data must stay unchanged until cleanupfn is called, which happens
+   when the evbuffer_shared has been freed and no evbuffer holds it any
+   more.  That may happen in whatever thread drains the last of it.
+
+   @param data the memory to refer to
+   @param datlen how much of it there is
+   @param cleanupfn callback to be invoked when the memory is no longer
+	referenced, or NULL
+   @param cleanupfn_arg optional argument to the cleanup callback
+   @return a new evbuffer_shared, or NULL on failure.
+ */
+EVENT2_EXPORT_SYMBOL
+struct evbuffer_shared *evbuffer_shared_new_reference(const void *data,
+    size_t datlen, evbuffer_ref_cleanup_cb cleanupfn, void *cleanupfn_arg);
+
+/**
+   Free an evbuffer_shared.
+
+   It is safe to call this function even if the evbuffer_shared has been
+   added to one or more evbuffers: its data will not be freed until none of
+   them hold it any more.
+ */
+EVENT2_EXPORT_SYMBOL
+void evbuffer_shared_free(struct evbuffer_shared *shared);
+
+/** Return how much data an evbuffer_shared holds. */
+EVENT2_EXPORT_SYMBOL
+size_t evbuffer_shared_get_length(const struct evbuffer_shared *shared);
+
+/**
+   Insert some or all of an evbuffer_shared at the end of an evbuffer,
+   without copying it.
+
+   @param buf the evbuffer to append to
+   @param shared the evbuffer_shared to add
+   @param offset the offset within the evbuffer_shared to start from
+   @param length the amount of data to add, or -1 to add the rest of it.
+   @return 0 on success, -1 on failure.
+ */
+EVENT2_EXPORT_SYMBOL
+int evbuffer_add_shared(struct evbuffer *buf, struct evbuffer_shared *shared,
+    size_t offset, ev_ssize_t length);
+
 /**
   Append a formatted string to the end of an evbuffer.
 
@@ -701,6 +827,73 @@ int evbuffer_add_vprintf(struct evbuffer *buf, const char *fmt, va_list ap)
 #endif
 ;
 
+/**
+  Append a signed integer, in decimal, to the end of an evbuffer.
+
+  This is what evbuffer_add_printf(buf, "%lld", value) does, but it writes
+  the digits straight into the buffer, without parsing a format string.
+
+  @param buf the evbuffer that will be appended to
+  @param value the number to append
+  @return The number of bytes added if successful, or -1 if an error occurred.
+ */
+EVENT2_EXPORT_SYMBOL
+int evbuffer_add_int(struct evbuffer *buf, ev_int64_t value);
+
+/**
+  Append an unsigned integer, in decimal, to the end of an evbuffer.
+
+  @param buf the evbuffer that will be appended to
+  @param value the number to append
+  @return The number of bytes added if successful, or -1 if an error occurred.
+  @see evbuffer_add_int()
+ */
+EVENT2_EXPORT_SYMBOL
+int evbuffer_add_uint(struct evbuffer *buf, ev_uint64_t value);
+
+/** Flag for evbuffer_add_uint_fixed(): write in hexadecimal, not decimal. */
+#define EVBUFFER_INT_HEX	0x01
+/** Flag for evbuffer_add_uint_fixed(): write hexadecimal digits in upper
+ * case. */
+#define EVBUFFER_INT_UPPER	0x02
+
+/**
+  Append an unsigned integer to the end of an evbuffer, padded with zeros
+  to at least some number of digits.
+
+  For example, evbuffer_add_uint_fixed(buf, n, EVBUFFER_INT_HEX, 0) does
+  what "%llx" does, and evbuffer_add_uint_fixed(buf, c, EVBUFFER_INT_HEX|
+  EVBUFFER_INT_UPPER, 2) does what "%02llX" does.
+
+  @param buf the evbuffer that will be appended to
+  @param value the number to append
+  @param flags any of EVBUFFER_INT_HEX and EVBUFFER_INT_UPPER
+  @param width the least number of digits to write, at most 64
+  @return The number of bytes added if successful, or -1 if an error occurred.
+ */
+EVENT2_EXPORT_SYMBOL
+int evbuffer_add_uint_fixed(struct evbuffer *buf, ev_uint64_t value,
+    unsigned flags, int width);
+
+/**
+  Append some NUL-terminated strings, which need no escaping or formatting,
+  to the end of an evbuffer.
+
+  The list of strings ends with a NULL.  This is what evbuffer_add_printf()
+  with a format of nothing but "%s" does, but it copies all the strings in
+  one go, and can't fail halfway.
+
+  @param buf the evbuffer that will be appended to
+  @param ... the strings, then NULL
+  @return The number of bytes added if successful, or -1 if an error occurred.
+ */
+EVENT2_EXPORT_SYMBOL
+int evbuffer_add_strings(struct evbuffer *buf, ...)
+#if defined(__GNUC__) && __GNUC__ >= 4
+	__attribute__((sentinel))
+#endif
+;
+
 
 /**
   Remove a specified number of bytes data from the beginning of an evbuffer.
@@ -1075,6 +1268,303 @@ struct event_base;
 EVENT2_EXPORT_SYMBOL
 int evbuffer_defer_callbacks(struct evbuffer *buffer, struct event_base *base);
 
+/**
+  Return how much memory an evbuffer's chains take up.
+
+  This counts the chain headers, and the space allocated for data in the
+  buffer's own chains, whether or not it is in use.  Memory that chains
+  only refer to, as from evbuffer_add_reference() or evbuffer_add_file(),
+  isn't counted.
+
+  @param buf the evbuffer to inspect
+  @return the number of bytes
+ */
+EVENT2_EXPORT_SYMBOL
+size_t evbuffer_get_mem_usage(struct evbuffer *buf);
+
+/**
+  Release memory that an evbuffer holds but isn't using.
+
+  Buffers that have seen many small writes end up with many small chains,
+  and buffers that have been read into or drained can hold chains that are
+  mostly empty.  This merges runs of small chains into one, moves a little
+  data out of a big chain into a smaller one, and frees empty chains at the
+  end of the buffer.  Chains that are pinned, read-only, or that refer to
+  memory or files outside the buffer are left alone, and so is the chain at
+  a frozen front or back of the buffer.
+
+  The contents of the buffer don't change, but any evbuffer_ptr into it
+  becomes invalid, as with evbuffer_pullup().
+
+  @param buf the evbuffer to compact
+  @param max_copy at most this many bytes of data get copied
+  @return how many bytes of memory were released
+  @see evbuffer_set_compaction()
+ */
+EVENT2_EXPORT_SYMBOL
+size_t evbuffer_compact(struct evbuffer *buf, size_t max_copy);
+
+/**
+  Compact an evbuffer from the event loop whenever it goes idle.
+
+  Once the buffer has gone unchanged for between one and two 'idle'
+  periods, it gets compacted as by evbuffer_compact(), a limited amount
+  at a time; compactions share the event loop's queue of deferred
+  callbacks, so only a few buffers are compacted per loop iteration.
+  This is meant for servers with many long-lived, mostly quiet
+  connections, where what idle buffers hold on to adds up.
+
+  While compaction is pending, the buffer holds a reference to itself,
+  so freeing it can be delayed by up to two idle periods.  Don't keep
+  evbuffer_ptrs into the buffer across trips through the event loop.
+
+  @param buf the evbuffer to compact
+  @param base the event_base to compact it from, or NULL to stop
+  @param idle how long the buffer must go unchanged, or NULL for one
+     second
+  @return 0 on success, -1 if the buffer is already being compacted from
+     another event_base
+  @see evbuffer_get_compact_stats()
+ */
+EVENT2_EXPORT_SYMBOL
+int evbuffer_set_compaction(struct evbuffer *buf, struct event_base *base,
+    const struct timeval *idle);
+
+/** What compaction has done to an evbuffer so far. */
+struct evbuffer_compact_stats {
+	/** How many compactions found something to do */
+	ev_uint64_t n_compactions;
+	/** Bytes of data copied from one chain to another */
+	ev_uint64_t n_bytes_copied;
+	/** Bytes of memory released */
+	ev_uint64_t n_bytes_reclaimed;
+};
+
+/**
+  Find out what compaction has done to an evbuffer.
+
+  @param buf the evbuffer to inspect
+  @param stats filled in with the evbuffer's counters
+  @see evbuffer_compact(), evbuffer_set_compaction()
+ */
+EVENT2_EXPORT_SYMBOL
+void evbuffer_get_compact_stats(struct evbuffer *buf,
+    struct evbuffer_compact_stats *stats);
+
+/** Flag for evbuffer_base_set_chain_pool(): try to back the pool with
+    huge pages: explicit ones (MAP_HUGETLB) if the system has any to spare,
+    otherwise transparent ones, where the kernel allows. */
+#define EVBUFFER_POOL_HUGEPAGES 0x01
+/** Flag for evbuffer_base_set_chain_pool(): keep the pool's memory on the
+    NUMA node of the thread that sets it up, which should be the one
+    running the event_base. */
+#define EVBUFFER_POOL_LOCAL_NODE 0x02
+
+/**
+  Set up a pool of memory that large chains get allocated from, for the
+  evbuffers on an event_base.
+
+  Services that move a lot of data spend much of their time copying it in
+  and out of big chains.  A pool keeps that memory in a few large regions
+  instead of scattering it across the heap, so that it can be backed by huge
+  pages (fewer TLB misses) and kept next to the CPU running the event loop.
+
+  Every bufferevent created on the base afterwards uses the pool for its
+  input and output buffers; other evbuffers can opt in with
+  evbuffer_set_chain_pool().  Chains smaller than min_size still come from
+  the heap, as do the very biggest ones.  The pool grows a region (2 MiB)
+  at a time, and keeps what it has grown, reusing freed chains, until the
+  base and every evbuffer and chain from the pool are gone.  Once it has
+  max_bytes, or when the system won't give it more, chains come from the
+  heap again.
+
+  Call this before creating any bufferevents on the base, from the thread
+  that runs it.  It can only be called once per base.
+
+  @param base the event_base
+  @param min_size the smallest chain to allocate from the pool, or 0 for
+    a reasonable default (16 KiB)
+  @param max_bytes how much memory the pool may hold, or 0 for no limit
+  @param flags any of EVBUFFER_POOL_HUGEPAGES and EVBUFFER_POOL_LOCAL_NODE
+  @return 0 on success, -1 if the base already has a pool, on memory
+    allocation failure, or if pools aren't supported on this platform
+  @see evbuffer_base_get_chain_pool_stats()
+ */
+EVENT2_EXPORT_SYMBOL
+int evbuffer_base_set_chain_pool(struct event_base *base, size_t min_size,
+    size_t max_bytes, unsigned flags);
+
+/**
+  Make an evbuffer allocate its large chains from an event_base's pool.
+
+  @param buf the evbuffer
+  @param base the event_base whose pool to use, or NULL to use the heap
+  @return 0 on success, -1 if base has no pool
+  @see evbuffer_base_set_chain_pool()
+ */
+EVENT2_EXPORT_SYMBOL
+int evbuffer_set_chain_pool(struct evbuffer *buf, struct event_base *base);
+
+/** What an event_base's chain pool holds and has done. */
+struct evbuffer_chain_pool_stats {
+	/** Bytes mapped for the pool so far */
+	size_t bytes_mapped;
+	/** How many of those are explicit huge pages */
+	size_t bytes_hugetlb;
+	/** Bytes in chains that are currently allocated from the pool */
+	size_t bytes_in_use;
+	/** How many chains were allocated from the pool */
+	ev_uint64_t n_allocs;
+	/** How many chains big enough for the pool came from the heap,
+	    because the pool was full or couldn't grow */
+	ev_uint64_t n_fallbacks;
+	/** The NUMA node the pool's memory is kept on, or -1 */
+	int node;
+};
+
+/**
+  Find out what an event_base's chain pool holds.
+
+  @param base the event_base
+  @param stats filled in with the pool's counters
+  @return 0 on success, -1 if base has no pool
+ */
+EVENT2_EXPORT_SYMBOL
+int evbuffer_base_get_chain_pool_stats(struct event_base *base,
+    struct evbuffer_chain_pool_stats *stats);
+
+/**
+   A function to read files in on another thread, for
+   evbuffer_base_set_file_offload().
+
+   It must arrange for work(work_arg) to be called exactly once, from some
+   thread other than the one running the event loop.  work may block on
+   the disk.  event_base_free() waits for every work function that cb was
+   given to return.
+ */
+typedef void (*evbuffer_file_offload_cb)(void (*work)(void *),
+    void *work_arg, void *arg);
+
+/**
+   Keep the bufferevents on an event_base from waiting on the disk.
+
+   Once this is set, a socket bufferevent on base that is about to write
+   from a file segment made with EVBUF_FS_READAHEAD writes only as much of
+   it as is already in the page cache.  If none of it is, the bufferevent
+   has cb read the next part in, and stops writing until that's done.
+
+   Threading must be enabled (see evthread_use_pthreads()), since the
+   reads finish on another thread.
+
+   @param base the event_base to set this up for
+   @param cb the function to read files in with, or NULL to stop
+   @param arg an argument to pass to cb
+   @return 0 on success, or -1 if this platform can't tell what's in the
+      page cache, or threading isn't enabled.
+ */
+EVENT2_EXPORT_SYMBOL
+int evbuffer_base_set_file_offload(struct event_base *base,
+    evbuffer_file_offload_cb cb, void *arg);
+
+/**
+  An evbuffer_spsc carries bytes from exactly one writer thread to an
+  event_base's loop thread, without either side taking a lock.
+
+  The writer appends with evbuffer_spsc_add() and friends.  Whenever it adds
+  to a queue that the loop thread has caught up with, the loop thread is
+  woken, moves everything written so far into an evbuffer that only it
+  uses, and calls the queue's callback.  Full chains move over without
+  being copied.
+
+  Only one thread may write to an evbuffer_spsc at a time.  If several
+  threads need to write, give each its own.
+ */
+struct evbuffer_spsc;
+
+/**
+   Called on the loop thread when an evbuffer_spsc has new data.
+
+   @param spsc the evbuffer_spsc
+   @param input where the data is; take as much of it as you like
+   @param arg the argument passed to evbuffer_spsc_new()
+ */
+typedef void (*evbuffer_spsc_cb)(struct evbuffer_spsc *spsc,
+    struct evbuffer *input, void *arg);
+
+/**
+   Create an evbuffer_spsc that delivers data to the loop thread of base.
+
+   Threading must be enabled (see evthread_use_pthreads()) before base is
+   created, so that the writer can wake the loop.
+
+   @param base the event_base to deliver data on
+   @param cb the function to call when there is new data
+   @param arg an argument to pass to cb
+   @return a new evbuffer_spsc, or NULL on failure.
+ */
+EVENT2_EXPORT_SYMBOL
+struct evbuffer_spsc *evbuffer_spsc_new(struct event_base *base,
+    evbuffer_spsc_cb cb, void *arg);
+
+/**
+   Free an evbuffer_spsc.
+
+   Call this on the loop thread, once the writer has stopped.  Data that
+   the callback hasn't been given yet is thrown away.
+ */
+EVENT2_EXPORT_SYMBOL
+void evbuffer_spsc_free(struct evbuffer_spsc *spsc);
+
+/**
+   Append data to an evbuffer_spsc, from the writer thread.
+
+   @param spsc the evbuffer_spsc
+   @param data the data to append
+   @param datlen how much of it there is
+   @return 0 on success, or -1 on failure.
+ */
+EVENT2_EXPORT_SYMBOL
+int evbuffer_spsc_add(struct evbuffer_spsc *spsc, const void *data,
+    size_t datlen);
+
+/**
+   Append a formatted string to an evbuffer_spsc, from the writer thread.
+
+   @return The number of bytes added if successful, or -1 if an error
+     occurred.
+   @see evbuffer_add_printf()
+ */
+EVENT2_EXPORT_SYMBOL
+int evbuffer_spsc_add_printf(struct evbuffer_spsc *spsc, const char *fmt, ...)
+#ifdef __GNUC__
+  __attribute__((format(printf, 2, 3)))
+#endif
+;
+
+/**
+   Append a va_list formatted string to an evbuffer_spsc, from the writer
+   thread.
+
+   @return The number of bytes added if successful, or -1 if an error
+     occurred.
+   @see evbuffer_add_vprintf()
+ */
+EVENT2_EXPORT_SYMBOL
+int evbuffer_spsc_add_vprintf(struct evbuffer_spsc *spsc, const char *fmt,
+    va_list ap)
+#ifdef __GNUC__
+	__attribute__((format(printf, 2, 0)))
+#endif
+;
+
+/**
+   Return the evbuffer that an evbuffer_spsc delivers data into.
+
+   Only use it on the loop thread.
+ */
+EVENT2_EXPORT_SYMBOL
+struct evbuffer *evbuffer_spsc_get_input(struct evbuffer_spsc *spsc);
+
 /**
   Append data from 1 or more iovec's to an evbuffer
 
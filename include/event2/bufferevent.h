@@ -228,6 +228,14 @@ struct evdns_base;
    @param port The port to connect to on the resolved address.
    @return 0 if successful, -1 on failure.
 
+   If the name resolves to more than one address and the bufferevent has no
+   socket yet, we try them in turn, alternating between IPv6 and IPv4 and
+   starting a new attempt every 250 msec (or as soon as one fails) without
+   abandoning the earlier ones, as RFC 8305 describes.  The first connection
+   to succeed is kept, and the address it used is tried first the next time
+   we connect to the same hostname.  The bufferevent's write timeout, if any,
+   applies to the whole race.
+
    @see bufferevent_socket_connect_hostname_hints()
  */
 EVENT2_EXPORT_SYMBOL
@@ -275,6 +283,58 @@ int bufferevent_socket_connect_hostname_hints(struct bufferevent *bufev,
 EVENT2_EXPORT_SYMBOL
 int bufferevent_socket_get_dns_error(struct bufferevent *bev);
 
+/**
+   Send big writes from a socket bufferevent without copying them.
+
+   Whenever a socket bufferevent has at least min_bytes in its output buffer
+   to write, it sends them with MSG_ZEROCOPY, so that the kernel transmits
+   straight from the evbuffer's memory instead of copying it first.  That
+   memory stays untouched until the kernel says it is done with it: nothing
+   else gets added to the end of it, and it isn't freed until then, even if
+   the data is drained or the bufferevent is freed.  The bufferevent picks
+   up the kernel's notifications as it goes.
+
+   This only pays off for large writes (say, 64 KiB and up), since the
+   kernel has to pin the pages and tell us about every send.  Over loopback,
+   the kernel copies the data anyway.  A bufferevent writes no more than
+   bufferevent_get_max_single_write() bytes at a time, so raise that to at
+   least min_bytes as well.
+
+   Only supported on Linux, with TCP sockets.  If the socket doesn't allow
+   zero-copy sends, the bufferevent quietly copies as usual.
+
+   @param bev a socket bufferevent
+   @param min_bytes the smallest write to send without copying, or 0 to
+      always copy
+   @return 0 on success, or -1 if bev isn't a socket bufferevent or
+      zero-copy sends aren't supported here.
+ */
+EVENT2_EXPORT_SYMBOL
+int bufferevent_socket_set_zerocopy(struct bufferevent *bev, size_t min_bytes);
+
+/**
+   Write from a socket bufferevent once per event loop iteration.
+
+   Ordinarily, adding data to a socket bufferevent's output buffer makes it
+   wait for the socket to become writable, which costs a trip through the
+   backend to watch for writability and another to stop watching.  With
+   batched writes, it instead writes everything that was added during the
+   current loop iteration at the start of the next one, before any newly
+   active events run, with as few writev() calls as the buffer's chains
+   allow.  So a response built from several pieces, in several callbacks,
+   usually goes out in a single system call.  Only if the socket can't take
+   it all does the bufferevent go back to waiting for writability.
+
+   This suits servers that send many small responses.  The write callback
+   and write timeout work as usual.
+
+   @param bev a socket bufferevent
+   @param enable 1 to batch writes, 0 to go back to the default
+   @return 0 on success, or -1 if bev isn't a socket bufferevent.
+ */
+EVENT2_EXPORT_SYMBOL
+int bufferevent_socket_set_batch_writes(struct bufferevent *bev, int enable);
+
 /**
   Assign a bufferevent to a specific event_base.
 
@@ -697,6 +757,38 @@ EVENT2_EXPORT_SYMBOL
 void bufferevent_trigger_event(struct bufferevent *bufev, short what,
     int options);
 
+/**
+   Send everything that one bufferevent reads to another one, as a proxy
+   would.
+
+   When both are socket-based bufferevents on a system with splice(), the
+   data moves from one socket to the other through a pipe, without being
+   copied into or out of user memory.  Otherwise (say, when either one is a
+   filter or does SSL), it is moved from src's input buffer to dst's output
+   buffer as soon as it arrives.
+
+   Whatever is in src's input buffer when this is called gets sent first.
+   While forwarding, src's read callback is not invoked.  Reading from src
+   pauses whenever dst has as much data waiting to be written as its write
+   high-watermark (or 64 KiB, if it has none) allows.  Rate limits on either
+   one still apply.
+
+   When src reaches EOF or an error, any data still waiting in the pipe is
+   moved to dst's output buffer before src's event callback runs, so that
+   the callback can tell whether dst still has data to write.  Forwarding
+   through a pipe stops there.
+
+   Forwarding stops when either bufferevent is freed, or when this function
+   is called again for src.
+
+   @param src the bufferevent to read from
+   @param dst the bufferevent to write to, or NULL to stop forwarding
+   @return 0 on success, -1 on failure (including when something else is
+      already forwarding to dst).
+ */
+EVENT2_EXPORT_SYMBOL
+int bufferevent_forward(struct bufferevent *src, struct bufferevent *dst);
+
 /**
    @name Filtering support
 
@@ -1054,6 +1146,104 @@ void
 bufferevent_rate_limit_group_reset_totals(
 	struct bufferevent_rate_limit_group *grp);
 
+/**
+   @name Memory accounting
+
+   These functions keep track of how many bytes are waiting in the input
+   and output buffers of all the bufferevents on an event_base, so that a
+   flood of data for slow consumers can be noticed and stopped before it
+   runs the process out of memory.
+
+   @{
+ */
+
+/** The bufferevents on a base are within their soft memory limit. */
+#define BEV_MEM_OK 0
+/** The bufferevents on a base are over their soft memory limit. */
+#define BEV_MEM_SOFT 1
+/** The bufferevents on a base have gone over their hard memory limit, and
+    have not yet dropped back within their soft limit. */
+#define BEV_MEM_HARD 2
+
+/**
+   A callback for when the bufferevents on a base move between BEV_MEM_*
+   levels.
+
+   @param base the event_base
+   @param level the new level: BEV_MEM_OK, BEV_MEM_SOFT or BEV_MEM_HARD
+   @param total how many bytes its bufferevents hold now
+   @param ctx the user-specified context
+ */
+typedef void (*bufferevent_mem_cb)(struct event_base *base, int level,
+    size_t total, void *ctx);
+
+/**
+   Start accounting for the memory held by the bufferevents on an
+   event_base, and set limits on it.
+
+   Once the bufferevents' input and output buffers together hold more than
+   soft_limit bytes, cb is called with BEV_MEM_SOFT.  Once they hold more
+   than hard_limit bytes, cb is called with BEV_MEM_HARD, and reading is
+   suspended on the bufferevents with the most input waiting, until the
+   total less their input is no more than soft_limit.  Reading resumes, and
+   cb is called with BEV_MEM_OK, once the total is back within soft_limit.
+   What gets written, and so what's held in output buffers, is up to you.
+
+   The callback runs from the event loop, a little after the limit is
+   crossed, so the total can overshoot the hard limit by about one read
+   per bufferevent.
+
+   Only bufferevents created after the first call are accounted, so call
+   this before creating any, from the thread running the event loop.  Call
+   it again to change the limits.
+
+   @param base the event_base
+   @param soft_limit the soft limit in bytes, or 0 to use hard_limit
+   @param hard_limit the hard limit in bytes, or 0 for none
+   @param cb called when the total crosses a limit; may be NULL
+   @param ctx passed to cb
+   @return 0 on success, -1 if soft_limit is bigger than hard_limit or
+      on memory allocation failure
+ */
+EVENT2_EXPORT_SYMBOL
+int bufferevent_base_set_mem_limits(struct event_base *base,
+    size_t soft_limit, size_t hard_limit, bufferevent_mem_cb cb, void *ctx);
+
+/**
+   Return how many bytes the input and output buffers of the bufferevents
+   on an event_base hold, or 0 if bufferevent_base_set_mem_limits() was
+   never called on it.
+ */
+EVENT2_EXPORT_SYMBOL
+size_t bufferevent_base_get_mem(struct event_base *base);
+
+/**
+   Return how many bytes a bufferevent's input and output buffers hold.
+
+   @see evbuffer_get_mem_usage() for the memory behind them
+ */
+EVENT2_EXPORT_SYMBOL
+size_t bufferevent_get_mem(struct bufferevent *bufev);
+
+/**
+   Find the bufferevents on an event_base that hold the most memory.
+
+   Call this from the thread running the event loop.  The bufferevents
+   returned stay valid only until they are freed.
+
+   @param base the event_base, which bufferevent_base_set_mem_limits()
+      was called on
+   @param bevs set to up to n bufferevents, biggest first
+   @param bytes if not NULL, set to how much each of them holds
+   @param n the size of bevs and bytes
+   @return how many bufferevents were returned
+ */
+EVENT2_EXPORT_SYMBOL
+int bufferevent_base_get_top_mem(struct event_base *base,
+    struct bufferevent **bevs, size_t *bytes, int n);
+
+/*@}*/
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,209 @@
+/*
+ * Copyright (c) 2007-2012 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef EVENT2_DGRAM_H_INCLUDED_
+#define EVENT2_DGRAM_H_INCLUDED_
+
+/** @file event2/dgram.h
+
+  @brief Datagram sockets that read and write in batches.
+
+  An evdgram watches a datagram (UDP) socket, and each time the socket is
+  readable, reads as many datagrams as it can in one system call (with
+  recvmmsg() where we have it), and hands them all to one callback.  The
+  data lives in buffers that the evdgram reuses from one read to the next.
+  evdgram_send() writes batches the same way, with sendmmsg().
+
+  Where the kernel can do it, an evdgram can also have it coalesce runs of
+  datagrams from one sender into a single buffer (EVDGRAM_OPT_GRO), and send
+  runs of datagrams to one peer as a single buffer (segment_size in
+  struct evdgram_msg).
+ */
+
+#include <event2/visibility.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <event2/event.h>
+
+struct sockaddr;
+struct evdgram;
+
+/**
+   A datagram that an evdgram has read, or that it should send.
+ */
+struct evdgram_msg {
+	/** The address of the peer: where the datagram came from, or where
+	 * to send it.  When sending on a connected socket, may be NULL. */
+	struct sockaddr *addr;
+	/** The length of addr. */
+	ev_socklen_t addrlen;
+	/** The data. */
+	void *iov_base;
+	/** The length of the data. */
+	size_t iov_len;
+	/** If nonzero, the data is a run of datagrams of this size, back to
+	 * back, except that the last one may be shorter. */
+	size_t segment_size;
+	/** Any number of EVDGRAM_MSG_* flags. */
+	unsigned flags;
+};
+
+/** Message flag: The datagram was longer than the evdgram's buffers, and
+ * was cut short. */
+#define EVDGRAM_MSG_TRUNCATED		(1u<<0)
+
+/**
+   A callback that we invoke when an evdgram has read some datagrams.
+
+   The messages, their addresses and their data belong to the evdgram, and
+   are only good until the callback returns.  It is safe to free the evdgram
+   from this callback.
+
+   @param dg The evdgram
+   @param msgs The datagrams
+   @param n_msgs How many datagrams there are
+   @param arg the pointer passed to evdgram_setcb()
+ */
+typedef void (*evdgram_read_cb)(struct evdgram *dg, struct evdgram_msg *msgs,
+    int n_msgs, void *arg);
+
+/**
+   A callback that we invoke when reading from an evdgram fails with a
+   non-retriable error.  (On a connected socket, for instance, because the
+   peer isn't listening.)  The evdgram stays enabled.
+
+   @param dg The evdgram
+   @param err The socket error
+   @param arg the pointer passed to evdgram_setcb()
+ */
+typedef void (*evdgram_error_cb)(struct evdgram *dg, int err, void *arg);
+
+/** Flag: Indicates that freeing the evdgram should close the underlying
+ * socket. */
+#define EVDGRAM_OPT_CLOSE_ON_FREE	(1u<<0)
+/** Flag: Indicates that the evdgram should be created in disabled state.
+ * Use evdgram_enable() to enable it later. */
+#define EVDGRAM_OPT_DISABLED		(1u<<1)
+/** Flag: Indicates that we should ask the kernel to coalesce datagrams that
+ * arrive back to back from one sender (UDP_GRO), if it can.  The read
+ * callback then gets them as a single message with segment_size set, in a
+ * buffer of up to 64 KiB. */
+#define EVDGRAM_OPT_GRO			(1u<<2)
+
+/**
+   Allocate a new evdgram to read and write datagrams on a socket.
+
+   @param base The event base to associate the evdgram with.
+   @param fd The socket.  It must be a nonblocking datagram socket, and it
+      should already be bound, and connected if need be.
+   @param flags Any number of EVDGRAM_OPT_* flags
+   @param batch The most datagrams to read at once, or -1 for a reasonable
+      default.
+   @param max_size The longest datagram to read without cutting it short,
+      or 0 for the largest that UDP allows.
+   @return a new evdgram, or NULL on error.
+ */
+EVENT2_EXPORT_SYMBOL
+struct evdgram *evdgram_new(struct event_base *base, evutil_socket_t fd,
+    unsigned flags, int batch, size_t max_size);
+
+/**
+   Disable and deallocate an evdgram.
+ */
+EVENT2_EXPORT_SYMBOL
+void evdgram_free(struct evdgram *dg);
+
+/** Change the callbacks on an evdgram, and their argument. */
+EVENT2_EXPORT_SYMBOL
+void evdgram_setcb(struct evdgram *dg, evdgram_read_cb readcb,
+    evdgram_error_cb errorcb, void *arg);
+
+/**
+   Start reading datagrams on an evdgram.
+ */
+EVENT2_EXPORT_SYMBOL
+int evdgram_enable(struct evdgram *dg);
+
+/**
+   Stop reading datagrams on an evdgram.
+ */
+EVENT2_EXPORT_SYMBOL
+int evdgram_disable(struct evdgram *dg);
+
+/**
+   Send some datagrams on an evdgram, in as few system calls as we can.
+
+   A message with segment_size set goes out as a single buffer if the kernel
+   can split it up (UDP_SEGMENT); it can then hold at most 64 datagrams, and
+   64 KiB.  Otherwise we send its datagrams one at a time, and if only some
+   of them go out, the message counts as unsent.
+
+   @param dg The evdgram
+   @param msgs The datagrams
+   @param n_msgs How many there are
+   @return how many messages were sent, from the start of msgs; or -1 if the
+      first one could not be sent.  Check the socket error to see why.
+ */
+EVENT2_EXPORT_SYMBOL
+int evdgram_send(struct evdgram *dg, const struct evdgram_msg *msgs,
+    int n_msgs);
+
+/** Return an evdgram's associated event_base. */
+EVENT2_EXPORT_SYMBOL
+struct event_base *evdgram_get_base(struct evdgram *dg);
+
+/** Return the socket that an evdgram reads and writes. */
+EVENT2_EXPORT_SYMBOL
+evutil_socket_t evdgram_get_fd(struct evdgram *dg);
+
+/**
+   Counts of what an evdgram has done.
+ */
+struct evdgram_stats {
+	/** How many system calls we've read with, and how many datagrams
+	 * and bytes they got us.  Coalesced datagrams count separately. */
+	ev_uint64_t n_reads;
+	ev_uint64_t n_datagrams_read;
+	ev_uint64_t n_bytes_read;
+	/** How many datagrams were cut short. */
+	ev_uint64_t n_truncated;
+	/** How many system calls we've sent with, and how many datagrams
+	 * they sent. */
+	ev_uint64_t n_sends;
+	ev_uint64_t n_datagrams_sent;
+};
+
+/** Get the counts of what an evdgram has done. */
+EVENT2_EXPORT_SYMBOL
+void evdgram_get_stats(struct evdgram *dg, struct evdgram_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -208,6 +208,7 @@ extern "C" {
  * - max-probe-timeout:
  * - probe-backoff-factor:
  * - tcp-idle-timeout:
+ * - tcp-reconnect-backoff:
  * - edns-udp-size:
  * - use-vc
  * - ignore-tc
@@ -491,8 +492,96 @@ void evdns_cancel_request(struct evdns_base *base, struct evdns_request *req);
 
     ndots, timeout, max-timeouts, max-inflight, attempts, randomize-case,
     bind-to, initial-probe-timeout, max-probe-timeout, probe-backoff-factor,
-    getaddrinfo-allow-skew, so-rcvbuf, so-sndbuf, tcp-idle-timeout, use-vc,
-    ignore-tc, edns-udp-size.
+    getaddrinfo-allow-skew, so-rcvbuf, so-sndbuf, tcp-idle-timeout,
+    tcp-reconnect-backoff, use-vc, ignore-tc, edns-udp-size, cache-size, cache-min-ttl, cache-max-ttl,
+    cache-max-negative-ttl, cache-prefetch, cache-max-stale,
+    coalesce-queries, udp-batch, rtt-select,
+    adaptive-timeout, hedge-percentile, hosts-reverse, hosts-reload-interval.
+
+  - use-vc
+    Send all queries over TCP.  There is one connection per nameserver,
+    and all queries to that nameserver are pipelined on it.  Queries that
+    were waiting on a connection that the nameserver closes are sent again
+    on a new one.
+
+  - tcp-idle-timeout
+    Close a TCP connection to a nameserver after it has carried no data for
+    this long (in seconds) and no query is waiting for an answer on it.
+    Defaults to 5.
+
+  - tcp-reconnect-backoff
+    If nonzero, after a TCP connection to a nameserver fails without
+    answering anything, wait this long (in seconds) before connecting
+    again, twice as long after each further failure, up to 60 seconds.
+    Defaults to 0, which means to reconnect for the next query.
+
+  - edns-udp-size
+    Advertise this UDP payload size (512 to 65535) with EDNS0, so that
+    larger answers come back over UDP instead of being truncated.
+
+  - cache-size
+    Maximum number of answers kept in the response cache; least recently
+    used answers are evicted first.  0 (the default) disables the cache.
+
+  - cache-min-ttl, cache-max-ttl
+    Bounds (in seconds) applied to the TTL of cached answers.  Default to 0
+    and 86400.
+
+  - cache-max-negative-ttl
+    Upper bound (in seconds) for caching NXDOMAIN and NODATA answers, whose
+    TTL is otherwise taken from the SOA record as described in RFC 2308.
+    Defaults to 3600; 0 disables negative caching.
+
+  - cache-prefetch
+    If nonzero (1 to 99), a cached answer that is used when less than this
+    percentage of its TTL is left is also asked for again in the
+    background, so that popular names don't expire from the cache.
+    Defaults to 0.
+
+  - cache-max-stale
+    If nonzero, cached answers are kept for this many seconds after they
+    expire.  When all nameservers time out or fail for a lookup, such an
+    answer is returned instead of the error, with a TTL of 30 seconds, and
+    further lookups are answered from it for that long (RFC 8767).
+    Defaults to 0.
+
+  - coalesce-queries
+    If nonzero, a lookup that is identical to one already in flight (same
+    name, type and flags) shares its request and is answered from the same
+    reply, instead of sending another query.  Defaults to 0.
+
+  - udp-batch
+    If nonzero, queries sent over UDP are queued and written together once
+    per event loop iteration (with sendmmsg() where available), rather than
+    with one system call each.  Defaults to 0.
+
+  - rtt-select
+    If nonzero, pick among the nameservers that are up at random, weighted
+    by the inverse of their smoothed round-trip time, instead of in turn.
+    Defaults to 0.
+
+  - adaptive-timeout
+    If nonzero, wait for a UDP answer from a nameserver for its smoothed
+    round-trip time plus four times its variance (doubled on each
+    retransmission), but at least 200 msec and at most the "timeout"
+    option.  Defaults to 0.
+
+  - hedge-percentile
+    If nonzero (1 to 99), a UDP query that has not been answered after this
+    percentile of its nameserver's recent round-trip times is also sent to
+    the fastest other nameserver, and the first answer wins.  Defaults to 0.
+
+  - hosts-reverse
+    If nonzero, reverse lookups for an address in the hosts file are
+    answered with its first name there, without asking a nameserver.
+    Defaults to 0.
+
+  - hosts-reload-interval
+    If nonzero, check this often (in seconds) whether the hosts file last
+    loaded with evdns_base_load_hosts() has changed, and if so replace all
+    hosts entries with its new contents.  The file is parsed over several
+    event loop iterations; lookups use the old entries until it is done.
+    Defaults to 0.
 
   - probe-backoff-factor
     Backoff factor of probe timeout
@@ -516,6 +605,54 @@ EVENT2_EXPORT_SYMBOL
 int evdns_base_set_option(struct evdns_base *base, const char *option, const char *val);
 
 
+/**
+  Statistics of the response cache of an evdns_base.
+
+  @see evdns_base_get_cache_stats()
+ */
+struct evdns_cache_stats {
+	/** Number of answers currently in the cache */
+	size_t entries;
+	/** Lookups answered with cached addresses */
+	ev_uint64_t hits;
+	/** Lookups answered with a cached NXDOMAIN or NODATA */
+	ev_uint64_t negative_hits;
+	/** Lookups that had to be sent to a nameserver */
+	ev_uint64_t misses;
+	/** Answers added to the cache */
+	ev_uint64_t insertions;
+	/** Answers dropped because the cache was full */
+	ev_uint64_t evictions;
+	/** Answers dropped because their TTL ran out */
+	ev_uint64_t expirations;
+	/** Background refreshes of answers close to expiry */
+	ev_uint64_t prefetches;
+	/** Expired answers returned because all nameservers failed */
+	ev_uint64_t stale_hits;
+};
+
+/**
+  Get statistics of the response cache.
+
+  @param base the evdns_base to examine
+  @param stats a structure to receive the statistics
+  @return 0 if successful, or -1 if an error occurred
+  @see evdns_base_set_option()
+ */
+EVENT2_EXPORT_SYMBOL
+int evdns_base_get_cache_stats(struct evdns_base *base,
+    struct evdns_cache_stats *stats);
+
+/**
+  Remove all answers from the response cache.
+
+  The cache is also cleared whenever the search list changes.
+
+  @param base the evdns_base to which to apply this operation
+ */
+EVENT2_EXPORT_SYMBOL
+void evdns_base_cache_clear(struct evdns_base *base);
+
 /**
   Parse a resolv.conf file.
 
@@ -551,7 +688,8 @@ int evdns_base_resolv_conf_parse(struct evdns_base *base, int flags, const char
    If hosts_fname is NULL, add minimal entries for localhost, and nothing
    else.
 
-   Note that only evdns_getaddrinfo uses the /etc/hosts entries.
+   Note that only evdns_getaddrinfo uses the /etc/hosts entries, and the
+   reverse lookup functions if the "hosts-reverse" option is set.
 
    This function does not replace previously loaded hosts entries; to do that,
    call evdns_base_clear_host_addresses first.
@@ -701,6 +839,73 @@ struct evdns_server_port *evdns_add_server_port_with_listener(
 EVENT2_EXPORT_SYMBOL
 void evdns_close_server_port(struct evdns_server_port *port);
 
+/** Also listen for DNS requests over TCP.
+    @see evdns_add_server_port_group() */
+#define EVDNS_SERVER_GROUP_TCP 0x01
+
+struct evdns_server_port_group;
+
+/** Create DNS server ports for one address on several event bases.
+
+    For each base, a UDP socket (and, with EVDNS_SERVER_GROUP_TCP, a TCP
+    listener) is bound to the same address with SO_REUSEPORT, so that the
+    kernel spreads incoming requests (and connections) among them.  Each
+    base can then be run by its own thread.  Note that the kernel picks a
+    shard by the address of the client, so all requests from one client
+    socket go to the same shard.
+
+    This needs SO_REUSEPORT, which is only used on Linux for now.
+
+    @param bases The event bases to handle events for the server ports;
+      the same base may appear more than once.
+    @param n_bases The number of entries in bases.
+    @param sa The address to listen on.  If its port is 0, all the sockets
+      use the port picked by the kernel for the first one.
+    @param socklen The length of sa.
+    @param flags 0 or EVDNS_SERVER_GROUP_TCP.
+    @param callback A function to invoke whenever we get a DNS request
+      on any of the sockets.
+    @param user_data Data to pass to the callback.
+    @return an evdns_server_port_group structure, or NULL if an error
+      occurred.
+    @see evdns_server_port_group_set_callback()
+ */
+EVENT2_EXPORT_SYMBOL
+struct evdns_server_port_group *evdns_add_server_port_group(
+    struct event_base **bases, int n_bases, const struct sockaddr *sa,
+    int socklen, int flags, evdns_request_callback_fn_type callback,
+    void *user_data);
+
+/** Use another callback for the requests handled on one event base of a
+    server port group.
+
+    This should be done before that event base starts running.
+
+    @param group The group, as returned by evdns_add_server_port_group().
+    @param index The position of the base in the bases argument.
+    @param callback The new callback.
+    @param user_data Data to pass to the callback.
+    @return 0 if successful, or -1 if index is out of range.
+ */
+EVENT2_EXPORT_SYMBOL
+int evdns_server_port_group_set_callback(
+    struct evdns_server_port_group *group, int index,
+    evdns_request_callback_fn_type callback, void *user_data);
+
+/** Return the UDP (if tcp is 0) or TCP server port for one event base of
+    a server port group, for use with evdns_server_port_set_option(), or
+    NULL if there is no such port. */
+EVENT2_EXPORT_SYMBOL
+struct evdns_server_port *evdns_server_port_group_get_port(
+    struct evdns_server_port_group *group, int index, int tcp);
+
+/** Close down all the DNS server ports of a group, and free it.
+
+    The event bases of the group must not be running in other threads
+    while this is called. */
+EVENT2_EXPORT_SYMBOL
+void evdns_close_server_port_group(struct evdns_server_port_group *group);
+
 /**
  * List of configurable evdns_server_port options.
  *
@@ -719,6 +924,12 @@ enum evdns_server_option {
 	 * Can be set only for TCP DNS servers.
 	 */
 	EVDNS_SOPT_TCP_IDLE_TIMEOUT,
+	/**
+	 * If nonzero, replies are not written as soon as they are made, but
+	 * queued and written together once per event loop iteration (with
+	 * sendmmsg() where available).  Can be set only for UDP DNS servers.
+	 */
+	EVDNS_SOPT_UDP_BATCH,
 };
 
 /**
@@ -768,6 +979,61 @@ struct sockaddr;
 EVENT2_EXPORT_SYMBOL
 int evdns_server_request_get_requesting_addr(struct evdns_server_request *req, struct sockaddr *sa, int addr_len);
 
+struct evdns_server_template;
+
+/**
+   Create a precompiled answer for one question.
+
+   A server that gives the same answers to the same questions over and over
+   can build each response once with evdns_server_template_add_reply(),
+   and send it with evdns_server_request_respond_template().  The packet is
+   then made by copying the template and patching in the transaction id and
+   flags, without encoding or compressing any names.
+
+   @param name the name asked for; requests for it match regardless of case
+   @param type the type asked for, e.g. EVDNS_TYPE_A
+   @param dns_class the class asked for, usually EVDNS_CLASS_INET
+   @return a new template, or NULL if an error occurred
+   @see evdns_server_template_free()
+ */
+EVENT2_EXPORT_SYMBOL
+struct evdns_server_template *evdns_server_template_new(const char *name,
+    int type, int dns_class);
+
+/**
+   Add a record to a template.
+
+   The arguments are as for evdns_server_request_add_reply().  Records have
+   to be added in section order: answers, then authority, then additional
+   records.
+
+   @return 0 if successful, or -1 if an error occurred
+ */
+EVENT2_EXPORT_SYMBOL
+int evdns_server_template_add_reply(struct evdns_server_template *tmpl,
+    int section, const char *name, int type, int dns_class, int ttl,
+    int datalen, int is_name, const char *data);
+
+/** Free a template. */
+EVENT2_EXPORT_SYMBOL
+void evdns_server_template_free(struct evdns_server_template *tmpl);
+
+/**
+   Send back the response held in a template to a DNS request, and free the
+   request structure, like evdns_server_request_respond() does.
+
+   The flags set with evdns_server_request_set_flags() are used, and the
+   question is repeated as the client sent it.  Replies added to the
+   request with evdns_server_request_add_*_reply() are ignored.
+
+   @return 0 if successful, or -1 if the request does not have exactly the
+     question of the template, or an error occurred; in that case the
+     request is not freed.
+ */
+EVENT2_EXPORT_SYMBOL
+int evdns_server_request_respond_template(struct evdns_server_request *req,
+    const struct evdns_server_template *tmpl);
+
 /** Callback for evdns_getaddrinfo. */
 typedef void (*evdns_getaddrinfo_cb)(int result, struct evutil_addrinfo *res, void *arg);
 
@@ -52,6 +52,42 @@ void evws_connection_set_closecb(
 EVENT2_EXPORT_SYMBOL
 void evws_connection_free(struct evws_connection *evws);
 
+/**
+ * Enables automatic keepalive on a WebSocket connection.
+
+  A PING frame is sent every ping_interval.  If nothing has been received
+  from the peer for idle_timeout, the connection is freed (the close
+  callback is invoked).  Since the check is done on ping ticks, the
+  effective idle timeout is rounded up to a multiple of ping_interval.
+
+  Timers are placed on a common timeout queue, so connections that use the
+  same ping_interval do not put any load on the timer heap.
+
+  PING frames from the peer are always answered with a PONG, regardless of
+  this setting.
+
+  @param evws the WebSocket connection
+  @param ping_interval how often to send PING frames, or NULL to disable
+    keepalive
+  @param idle_timeout how long the peer may stay silent before the
+    connection is reaped, or NULL to never reap
+  @return 0 on success, -1 on failure
+ */
+EVENT2_EXPORT_SYMBOL
+int evws_connection_set_keepalive(struct evws_connection *evws,
+	const struct timeval *ping_interval, const struct timeval *idle_timeout);
+
+/**
+  Returns the round-trip time measured by the last answered keepalive PING.
+
+  @param evws the WebSocket connection
+  @param rtt pointer to a timeval to receive the round-trip time
+  @return 0 on success, -1 if no PONG has been received yet
+  @see evws_connection_set_keepalive()
+ */
+EVENT2_EXPORT_SYMBOL
+int evws_connection_get_rtt(struct evws_connection *evws, struct timeval *rtt);
+
 /**
  * Return the bufferevent that an evws_connection is using.
  */
@@ -209,6 +209,18 @@ accept_cb(struct evconnlistener *listener, evutil_socket_t fd,
 	bufferevent_setcb(b_in, readcb, NULL, eventcb, b_out);
 	bufferevent_setcb(b_out, readcb, NULL, eventcb, b_in);
 
+	/* Let libevent move the data from each side to the other: without
+	 * copying it, when neither side does SSL.  Each side stops reading
+	 * while the other has MAX_OUTPUT bytes waiting. */
+	bufferevent_setwatermark(b_in, EV_WRITE, 0, MAX_OUTPUT);
+	bufferevent_setwatermark(b_out, EV_WRITE, 0, MAX_OUTPUT);
+	if (bufferevent_forward(b_in, b_out) < 0 ||
+	    bufferevent_forward(b_out, b_in) < 0) {
+		bufferevent_free(b_out);
+		bufferevent_free(b_in);
+		return;
+	}
+
 	bufferevent_enable(b_in, EV_READ|EV_WRITE);
 	bufferevent_enable(b_out, EV_READ|EV_WRITE);
 }
@@ -0,0 +1,262 @@
+/*
+ * Copyright (c) 2007-2012 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "event2/event-config.h"
+
+#include <sys/types.h>
+#ifdef EVENT__HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <winsock2.h>
+#include <windows.h>
+#include <getopt.h>
+#else /* _WIN32 */
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef EVENT__HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/http.h>
+#include <event2/util.h>
+
+/*
+ * This benchmark compares an HTTP server sending small responses over
+ * keep-alive connections with and without bufferevent_socket_set_batch_writes().
+ * The clients run in the same process, on the same event_base, so the
+ * rate and CPU time cover both ends.
+ */
+
+static char *content;
+static size_t content_len = 100;
+static int n_connections = 50;
+static int total_requests = 200000;
+
+static int launched;
+static int handled;
+
+static const char request[] =
+    "GET /x HTTP/1.1\r\nHost: localhost\r\n\r\n";
+
+static void
+http_cb(struct evhttp_request *req, void *arg)
+{
+	struct evbuffer *evb = evhttp_request_get_output_buffer(req);
+
+	evbuffer_add_reference(evb, content, content_len, NULL, NULL);
+	evhttp_send_reply(req, HTTP_OK, "OK", NULL);
+}
+
+static struct bufferevent *
+batch_bevcb(struct event_base *base, void *arg)
+{
+	struct bufferevent *bev;
+
+	bev = bufferevent_socket_new(base, -1, BEV_OPT_CLOSE_ON_FREE);
+	if (bev && bufferevent_socket_set_batch_writes(bev, 1) < 0) {
+		fprintf(stderr, "Couldn't batch writes\n");
+		exit(1);
+	}
+	return bev;
+}
+
+static void
+client_readcb(struct bufferevent *bev, void *arg)
+{
+	struct evbuffer *input = bufferevent_get_input(bev);
+	struct evbuffer_ptr end;
+
+	for (;;) {
+		/* Every response has the same body, so the end of the headers
+		 * tells us where it ends. */
+		end = evbuffer_search(input, "\r\n\r\n", 4, NULL);
+		if (end.pos < 0 ||
+		    evbuffer_get_length(input) < end.pos + 4 + content_len)
+			return;
+		evbuffer_drain(input, end.pos + 4 + content_len);
+		if (++handled == total_requests) {
+			event_base_loopbreak(bufferevent_get_base(bev));
+			return;
+		}
+		if (launched < total_requests) {
+			++launched;
+			bufferevent_write(bev, request, sizeof(request) - 1);
+		}
+	}
+}
+
+static void
+client_eventcb(struct bufferevent *bev, short what, void *arg)
+{
+	if (what & (BEV_EVENT_ERROR|BEV_EVENT_EOF)) {
+		fprintf(stderr, "Connection failed\n");
+		exit(1);
+	}
+}
+
+static double
+cpu_seconds(void)
+{
+#ifdef _WIN32
+	return 0.0;
+#else
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+	    (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1000000.0;
+#endif
+}
+
+static void
+run(struct event_base *base, int batch)
+{
+	struct evhttp *http;
+	struct evhttp_bound_socket *bound;
+	struct bufferevent **clients;
+	struct sockaddr_storage ss;
+	ev_socklen_t sslen = sizeof(ss);
+	struct timeval ts, te;
+	double usec, cpu;
+	int i;
+
+	http = evhttp_new(base);
+	clients = calloc(n_connections, sizeof(*clients));
+	if (!http || !clients) {
+		fprintf(stderr, "Couldn't set up\n");
+		exit(1);
+	}
+	evhttp_set_gencb(http, http_cb, NULL);
+	if (batch)
+		evhttp_set_bevcb(http, batch_bevcb, NULL);
+	bound = evhttp_bind_socket_with_handle(http, "127.0.0.1", 0);
+	if (!bound || getsockname(evhttp_bound_socket_get_fd(bound),
+		(struct sockaddr *)&ss, &sslen) < 0) {
+		fprintf(stderr, "Couldn't listen\n");
+		exit(1);
+	}
+
+	launched = handled = 0;
+	for (i = 0; i < n_connections; ++i) {
+		clients[i] = bufferevent_socket_new(base, -1,
+		    BEV_OPT_CLOSE_ON_FREE);
+		if (!clients[i] || bufferevent_socket_connect(clients[i],
+			(struct sockaddr *)&ss, (int)sslen) < 0) {
+			fprintf(stderr, "Couldn't connect\n");
+			exit(1);
+		}
+		bufferevent_setcb(clients[i], client_readcb, NULL,
+		    client_eventcb, NULL);
+		bufferevent_enable(clients[i], EV_READ);
+		if (launched < total_requests) {
+			++launched;
+			bufferevent_write(clients[i], request,
+			    sizeof(request) - 1);
+		}
+	}
+
+	evutil_gettimeofday(&ts, NULL);
+	cpu = cpu_seconds();
+	event_base_dispatch(base);
+	cpu = cpu_seconds() - cpu;
+	evutil_gettimeofday(&te, NULL);
+	evutil_timersub(&te, &ts, &te);
+	usec = te.tv_sec * 1000000.0 + te.tv_usec;
+
+	fprintf(stdout, "%-8s %12.1f req/s %8.2f usec CPU/req\n",
+	    batch ? "batched" : "default", handled * 1000000.0 / usec,
+	    cpu * 1000000.0 / handled);
+
+	for (i = 0; i < n_connections; ++i)
+		bufferevent_free(clients[i]);
+	free(clients);
+	evhttp_free(http);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct event_base *base;
+	int c;
+#ifdef _WIN32
+	WSADATA WSAData;
+	WSAStartup(0x101, &WSAData);
+#endif
+
+	while ((c = getopt(argc, argv, "c:n:s:")) != -1) {
+		switch (c) {
+		case 'c':
+			n_connections = atoi(optarg);
+			break;
+		case 'n':
+			total_requests = atoi(optarg);
+			break;
+		case 's':
+			content_len = (size_t)atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Illegal argument \"%c\"\n", c);
+			exit(1);
+		}
+	}
+	if (n_connections < 1 || total_requests < 1) {
+		fprintf(stderr, "-c and -n must be positive\n");
+		exit(1);
+	}
+
+	base = event_base_new();
+	content = malloc(content_len + 1);
+	if (!base || !content) {
+		fprintf(stderr, "Couldn't set up\n");
+		exit(1);
+	}
+	memset(content, 'x', content_len + 1);
+
+	run(base, 0);
+	run(base, 1);
+	run(base, 0);
+	run(base, 1);
+
+	free(content);
+	event_base_free(base);
+
+#ifdef _WIN32
+	WSACleanup();
+#endif
+
+	exit(0);
+}
@@ -0,0 +1,282 @@
+/*
+ * Copyright (c) 2007-2012 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "event2/event-config.h"
+
+#include <sys/types.h>
+#ifdef EVENT__HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <winsock2.h>
+#include <windows.h>
+#include <getopt.h>
+#else /* _WIN32 */
+#include <sys/socket.h>
+#include <netinet/in.h>
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef EVENT__HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include <event2/event.h>
+#include <event2/dgram.h>
+#include <event2/util.h>
+
+/*
+ * This benchmark sends small datagrams over loopback from one evdgram to
+ * another, keeping a window of them in flight, and reports packets per
+ * second.  It compares reading and sending one datagram per system call
+ * with batches (recvmmsg/sendmmsg), and with batches of coalesced datagrams
+ * (UDP_SEGMENT and UDP_GRO), where the kernel has them.  Datagrams that
+ * loopback drops are counted, and replaced after a short pause.
+ */
+
+#define MAX_WINDOW 1024
+
+static int total_packets = 1000000;
+static int window = 256;
+static size_t packet_size = 64;
+static char payload[65536];
+
+struct bench_run {
+	struct evdgram *sender;
+	struct sockaddr_in to;
+	int batch;
+	int coalesce;
+	int sent;
+	int received;
+	int lost;
+	int last_received;
+	struct event *timer;
+};
+
+/* Send enough datagrams to fill the window again. */
+static void
+top_up(struct bench_run *run)
+{
+	struct evdgram_msg msgs[MAX_WINDOW];
+	int want, n, i, r;
+
+	want = window - (run->sent - run->received - run->lost);
+	if (want > total_packets - run->sent)
+		want = total_packets - run->sent;
+	while (want > 0) {
+		n = want < run->batch ? want : run->batch;
+		memset(msgs, 0, sizeof(msgs[0]) * n);
+		for (i = 0; i < n; ++i) {
+			msgs[i].addr = (struct sockaddr *)&run->to;
+			msgs[i].addrlen = sizeof(run->to);
+			msgs[i].iov_base = payload;
+			msgs[i].iov_len = packet_size;
+		}
+		if (run->coalesce) {
+			/* One buffer, split up by the kernel. */
+			if (n > 64)
+				n = 64;
+			msgs[0].iov_len = n * packet_size;
+			msgs[0].segment_size = packet_size;
+			r = evdgram_send(run->sender, msgs, 1) == 1 ? n : 0;
+		} else {
+			r = evdgram_send(run->sender, msgs, n);
+		}
+		if (r <= 0)
+			return;		/* The timer will try again. */
+		run->sent += r;
+		want -= r;
+	}
+}
+
+static void
+readcb(struct evdgram *dg, struct evdgram_msg *msgs, int n, void *arg)
+{
+	struct bench_run *run = arg;
+	int i;
+
+	for (i = 0; i < n; ++i) {
+		if (msgs[i].segment_size)
+			run->received += (int)((msgs[i].iov_len +
+				msgs[i].segment_size - 1) /
+			    msgs[i].segment_size);
+		else
+			++run->received;
+	}
+	if (run->received + run->lost >= total_packets)
+		event_base_loopbreak(evdgram_get_base(dg));
+	else
+		top_up(run);
+}
+
+static void
+timercb(evutil_socket_t fd, short what, void *arg)
+{
+	struct bench_run *run = arg;
+
+	/* Nothing arrived for a whole tick: whatever is in flight is gone. */
+	if (run->received == run->last_received) {
+		run->lost = run->sent - run->received;
+		if (run->received + run->lost >= total_packets) {
+			event_base_loopbreak(event_get_base(run->timer));
+			return;
+		}
+	}
+	run->last_received = run->received;
+	top_up(run);
+}
+
+static evutil_socket_t
+udp_socket(struct sockaddr_in *sin)
+{
+	evutil_socket_t fd;
+	ev_socklen_t len = sizeof(*sin);
+	int bufsize = 4 << 20;
+
+	memset(sin, 0, sizeof(*sin));
+	sin->sin_family = AF_INET;
+	sin->sin_addr.s_addr = htonl(0x7f000001);
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd == EVUTIL_INVALID_SOCKET ||
+	    bind(fd, (struct sockaddr *)sin, sizeof(*sin)) < 0 ||
+	    getsockname(fd, (struct sockaddr *)sin, &len) < 0) {
+		perror("socket");
+		exit(1);
+	}
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, (void *)&bufsize,
+	    sizeof(bufsize));
+	setsockopt(fd, SOL_SOCKET, SO_SNDBUF, (void *)&bufsize,
+	    sizeof(bufsize));
+	evutil_make_socket_nonblocking(fd);
+	return fd;
+}
+
+static void
+run(struct event_base *base, const char *what, int batch, int coalesce)
+{
+	struct bench_run run;
+	struct evdgram *receiver;
+	struct evdgram_stats rst, sst;
+	struct sockaddr_in from;
+	struct timeval ts, te, tick = { 0, 50000 };
+	double usec;
+
+	memset(&run, 0, sizeof(run));
+	run.batch = batch;
+	run.coalesce = coalesce;
+	receiver = evdgram_new(base, udp_socket(&run.to),
+	    EVDGRAM_OPT_CLOSE_ON_FREE | (coalesce ? EVDGRAM_OPT_GRO : 0),
+	    batch, 0);
+	run.sender = evdgram_new(base, udp_socket(&from),
+	    EVDGRAM_OPT_CLOSE_ON_FREE|EVDGRAM_OPT_DISABLED, batch, 0);
+	run.timer = event_new(base, -1, EV_PERSIST, timercb, &run);
+	if (!receiver || !run.sender || !run.timer) {
+		fprintf(stderr, "Couldn't set up\n");
+		exit(1);
+	}
+	evdgram_setcb(receiver, readcb, NULL, &run);
+	event_add(run.timer, &tick);
+
+	evutil_gettimeofday(&ts, NULL);
+	top_up(&run);
+	event_base_dispatch(base);
+	evutil_gettimeofday(&te, NULL);
+
+	evutil_timersub(&te, &ts, &te);
+	usec = te.tv_sec * 1000000.0 + te.tv_usec;
+	evdgram_get_stats(receiver, &rst);
+	evdgram_get_stats(run.sender, &sst);
+	fprintf(stdout, "%-9s %12.0f pkt/s %8.1f pkts/read %8.1f pkts/send "
+	    "%8d lost\n", what, run.received * 1000000.0 / usec,
+	    rst.n_reads ? (double)rst.n_datagrams_read / rst.n_reads : 0.0,
+	    sst.n_sends ? (double)sst.n_datagrams_sent / sst.n_sends : 0.0,
+	    run.lost);
+
+	event_free(run.timer);
+	evdgram_free(receiver);
+	evdgram_free(run.sender);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct event_base *base;
+	int batch = 64;
+	int c;
+#ifdef _WIN32
+	WSADATA WSAData;
+	WSAStartup(0x101, &WSAData);
+#endif
+
+	while ((c = getopt(argc, argv, "n:w:b:s:")) != -1) {
+		switch (c) {
+		case 'n':
+			total_packets = atoi(optarg);
+			break;
+		case 'w':
+			window = atoi(optarg);
+			break;
+		case 'b':
+			batch = atoi(optarg);
+			break;
+		case 's':
+			packet_size = (size_t)atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Illegal argument \"%c\"\n", c);
+			exit(1);
+		}
+	}
+	if (total_packets < 1 || window < 1 || window > MAX_WINDOW ||
+	    batch < 1 || batch > MAX_WINDOW || !packet_size ||
+	    packet_size > 1024) {
+		fprintf(stderr, "-n, -w, -b and -s must be positive; -w and -b "
+		    "at most %d, and -s at most 1024\n", MAX_WINDOW);
+		exit(1);
+	}
+
+	base = event_base_new();
+	if (!base) {
+		fprintf(stderr, "Couldn't create event base\n");
+		exit(1);
+	}
+	memset(payload, 'x', sizeof(payload));
+
+	run(base, "single", 1, 0);
+	run(base, "batched", batch, 0);
+	run(base, "coalesced", batch, 1);
+
+	event_base_free(base);
+
+#ifdef _WIN32
+	WSACleanup();
+#endif
+
+	exit(0);
+}
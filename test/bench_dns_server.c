@@ -0,0 +1,283 @@
+/*
+ * Copyright (c) 2007-2012 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "event2/event-config.h"
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <event2/event.h>
+#include <event2/dns.h>
+#include <event2/dns_struct.h>
+#include <event2/thread.h>
+#include <event2/util.h>
+
+/*
+ * This benchmark is a load generator for evdns_add_server_port_group(): it
+ * runs an evdns server with one thread per shard, and client threads that
+ * each keep a window of UDP queries outstanding against it.  Compare the
+ * rate with -s 1 and with more shards to see how the server scales, and
+ * with -T to answer from a precompiled evdns_server_template.
+ */
+
+static const unsigned char query_tail[] =
+	"\x05" "bench" "\x07" "example" "\x03" "com" "\x00"
+	"\x00\x01" /* type A */
+	"\x00\x01"; /* class IN */
+
+static struct sockaddr_in server_addr;
+static int window = 32;
+static volatile int stopping;
+static struct evdns_server_template *answer_template;
+
+struct shard {
+	struct event_base *base;
+	pthread_t thread;
+	long answered;
+};
+
+struct client {
+	pthread_t thread;
+	long answered;
+};
+
+static void
+server_cb(struct evdns_server_request *req, void *arg)
+{
+	struct shard *shard = arg;
+	struct in_addr in;
+
+	++shard->answered;
+	if (answer_template) {
+		evdns_server_request_respond_template(req, answer_template);
+		return;
+	}
+	in.s_addr = htonl(0x0a000001);
+	evdns_server_request_add_a_reply(req, req->questions[0]->name, 1,
+	    &in, 60);
+	evdns_server_request_respond(req, 0);
+}
+
+static void *
+shard_main(void *arg)
+{
+	struct shard *shard = arg;
+	event_base_loop(shard->base, EVLOOP_NO_EXIT_ON_EMPTY);
+	return NULL;
+}
+
+static int
+send_query(int fd, unsigned id)
+{
+	unsigned char packet[12 + sizeof(query_tail) - 1];
+
+	memset(packet, 0, 12);
+	packet[0] = (id >> 8) & 0xff;
+	packet[1] = id & 0xff;
+	packet[2] = 0x01; /* RD */
+	packet[5] = 1; /* one question */
+	memcpy(packet + 12, query_tail, sizeof(query_tail) - 1);
+	return (int)send(fd, packet, sizeof(packet), 0);
+}
+
+static void *
+client_main(void *arg)
+{
+	struct client *client = arg;
+	struct timeval tv = { 0, 100000 };
+	unsigned char buf[512];
+	unsigned id = 0;
+	int fd, i;
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *)&server_addr,
+		sizeof(server_addr)) < 0 ||
+	    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
+		perror("client socket");
+		exit(1);
+	}
+
+	while (!stopping) {
+		for (i = 0; i < window; ++i)
+			send_query(fd, ++id);
+		/* Keep the window full until a query gets lost. */
+		while (!stopping && recv(fd, buf, sizeof(buf), 0) > 0) {
+			++client->answered;
+			send_query(fd, ++id);
+		}
+	}
+	close(fd);
+	return NULL;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct evdns_server_port_group *group;
+	struct event_base **bases;
+	struct shard *shards;
+	struct client *clients;
+	struct timeval ts, te;
+	ev_socklen_t slen = sizeof(server_addr);
+	double usec;
+	long total = 0;
+	int i, c, fd;
+
+	int num_shards = 1;
+	int num_clients = 4;
+	int seconds = 5;
+	int use_template = 0;
+
+	while ((c = getopt(argc, argv, "s:c:t:w:T")) != -1) {
+		switch (c) {
+		case 's':
+			num_shards = atoi(optarg);
+			break;
+		case 'c':
+			num_clients = atoi(optarg);
+			break;
+		case 't':
+			seconds = atoi(optarg);
+			break;
+		case 'w':
+			window = atoi(optarg);
+			break;
+		case 'T':
+			use_template = 1;
+			break;
+		default:
+			fprintf(stderr, "Illegal argument \"%c\"\n", c);
+			exit(1);
+		}
+	}
+	if (num_shards < 1 || num_clients < 1 || seconds < 1 || window < 1) {
+		fprintf(stderr, "-s, -c, -t and -w must be positive\n");
+		exit(1);
+	}
+
+	if (evthread_use_pthreads() < 0) {
+		fprintf(stderr, "Couldn't enable threading support\n");
+		exit(1);
+	}
+
+	if (use_template) {
+		struct in_addr in;
+		in.s_addr = htonl(0x0a000001);
+		answer_template = evdns_server_template_new("bench.example.com",
+		    EVDNS_TYPE_A, EVDNS_CLASS_INET);
+		if (!answer_template || evdns_server_template_add_reply(
+			answer_template, EVDNS_ANSWER_SECTION, "bench.example.com",
+			EVDNS_TYPE_A, EVDNS_CLASS_INET, 60, 4, 0,
+			(const char *)&in) < 0) {
+			fprintf(stderr, "Couldn't create template\n");
+			exit(1);
+		}
+	}
+
+	/* Find a free port on the loopback address. */
+	memset(&server_addr, 0, sizeof(server_addr));
+	server_addr.sin_family = AF_INET;
+	server_addr.sin_addr.s_addr = htonl(0x7f000001);
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0 || bind(fd, (struct sockaddr *)&server_addr,
+		sizeof(server_addr)) < 0 ||
+	    getsockname(fd, (struct sockaddr *)&server_addr, &slen) < 0) {
+		perror("bind");
+		exit(1);
+	}
+	close(fd);
+
+	bases = calloc(num_shards, sizeof(*bases));
+	shards = calloc(num_shards, sizeof(*shards));
+	clients = calloc(num_clients, sizeof(*clients));
+	if (!bases || !shards || !clients) {
+		perror("calloc");
+		exit(1);
+	}
+	for (i = 0; i < num_shards; ++i) {
+		if (!(bases[i] = shards[i].base = event_base_new())) {
+			fprintf(stderr, "Couldn't create event base\n");
+			exit(1);
+		}
+	}
+	group = evdns_add_server_port_group(bases, num_shards,
+	    (struct sockaddr *)&server_addr, sizeof(server_addr), 0,
+	    server_cb, NULL);
+	if (!group) {
+		fprintf(stderr, "Couldn't create server port group\n");
+		exit(1);
+	}
+	for (i = 0; i < num_shards; ++i) {
+		evdns_server_port_group_set_callback(group, i, server_cb,
+		    &shards[i]);
+		pthread_create(&shards[i].thread, NULL, shard_main, &shards[i]);
+	}
+
+	evutil_gettimeofday(&ts, NULL);
+	for (i = 0; i < num_clients; ++i)
+		pthread_create(&clients[i].thread, NULL, client_main, &clients[i]);
+	sleep(seconds);
+	stopping = 1;
+	for (i = 0; i < num_clients; ++i) {
+		pthread_join(clients[i].thread, NULL);
+		total += clients[i].answered;
+	}
+	evutil_gettimeofday(&te, NULL);
+
+	for (i = 0; i < num_shards; ++i) {
+		event_base_loopbreak(shards[i].base);
+		pthread_join(shards[i].thread, NULL);
+	}
+
+	evutil_timersub(&te, &ts, &te);
+	usec = te.tv_sec * 1000000.0 + te.tv_usec;
+	fprintf(stdout, "%d shards, %d clients: %ld answers in %.0f usec: "
+	    "%.0f/sec\n", num_shards, num_clients, total, usec,
+	    total * 1000000.0 / usec);
+	for (i = 0; i < num_shards; ++i)
+		fprintf(stdout, "  shard %d: %ld\n", i, shards[i].answered);
+
+	evdns_close_server_port_group(group);
+	if (answer_template)
+		evdns_server_template_free(answer_template);
+	for (i = 0; i < num_shards; ++i)
+		event_base_free(bases[i]);
+	free(bases);
+	free(shards);
+	free(clients);
+
+	exit(0);
+}
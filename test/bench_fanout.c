@@ -0,0 +1,217 @@
+/*
+ * Copyright (c) 2007-2012 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "event2/event-config.h"
+
+#include <sys/types.h>
+#ifdef EVENT__HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#ifdef _WIN32
+#include <getopt.h>
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef EVENT__HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/util.h>
+
+/*
+ * This benchmark publishes messages to a growing number of subscriber
+ * evbuffers, by copying them, with evbuffer_add_buffer_reference(), and
+ * with an evbuffer_shared, and reports how long that took and how much
+ * memory libevent had allocated once every subscriber held every message.
+ */
+
+static int n_messages = 64;
+static size_t message_size = 16384;
+
+static size_t mem_live;
+static size_t mem_peak;
+
+#ifndef EVENT__DISABLE_MM_REPLACEMENT
+/* Keep track of how much memory libevent has allocated, in a header before
+ * each allocation. */
+#define HDR sizeof(double)
+
+static void *
+count_malloc(size_t sz)
+{
+	size_t *p = malloc(sz + HDR);
+	if (!p)
+		return NULL;
+	*p = sz;
+	mem_live += sz;
+	if (mem_live > mem_peak)
+		mem_peak = mem_live;
+	return (char *)p + HDR;
+}
+
+static void
+count_free(void *ptr)
+{
+	size_t *p;
+	if (!ptr)
+		return;
+	p = (size_t *)((char *)ptr - HDR);
+	mem_live -= *p;
+	free(p);
+}
+
+static void *
+count_realloc(void *ptr, size_t sz)
+{
+	void *n = count_malloc(sz);
+	if (n && ptr) {
+		size_t old = *(size_t *)((char *)ptr - HDR);
+		memcpy(n, ptr, old < sz ? old : sz);
+		count_free(ptr);
+	}
+	return n;
+}
+#endif
+
+enum mode { COPY, BUFFER_REFERENCE, SHARED };
+static const char *mode_names[] = { "copy", "reference", "shared" };
+
+static void
+run(enum mode mode, int n_subscribers, const char *payload)
+{
+	struct evbuffer **subs;
+	struct evbuffer *staging = NULL;
+	struct evbuffer_shared *shared = NULL;
+	struct timeval ts, te;
+	size_t base_mem;
+	double usec;
+	int i, j;
+
+	subs = calloc(n_subscribers, sizeof(*subs));
+	for (i = 0; i < n_subscribers; ++i)
+		subs[i] = evbuffer_new();
+	base_mem = mem_live;
+	mem_peak = mem_live;
+
+	evutil_gettimeofday(&ts, NULL);
+	for (j = 0; j < n_messages; ++j) {
+		switch (mode) {
+		case COPY:
+			for (i = 0; i < n_subscribers; ++i)
+				evbuffer_add(subs[i], payload, message_size);
+			break;
+		case BUFFER_REFERENCE:
+			staging = evbuffer_new();
+			evbuffer_add(staging, payload, message_size);
+			for (i = 0; i < n_subscribers; ++i)
+				evbuffer_add_buffer_reference(subs[i],
+				    staging);
+			evbuffer_free(staging);
+			break;
+		case SHARED:
+			shared = evbuffer_shared_new(payload, message_size);
+			for (i = 0; i < n_subscribers; ++i)
+				evbuffer_add_shared(subs[i], shared, 0, -1);
+			evbuffer_shared_free(shared);
+			break;
+		}
+	}
+	evutil_gettimeofday(&te, NULL);
+
+	for (i = 0; i < n_subscribers; ++i) {
+		if (evbuffer_get_length(subs[i]) !=
+		    (size_t)n_messages * message_size) {
+			fprintf(stderr, "Lost some data\n");
+			exit(1);
+		}
+	}
+	evutil_timersub(&te, &ts, &te);
+	usec = te.tv_sec * 1000000.0 + te.tv_usec;
+	fprintf(stdout, "%-10s %8d %12.1f %14.1f %14.0f\n", mode_names[mode],
+	    n_subscribers, usec / 1000.0,
+	    (mem_peak - base_mem) / 1048576.0,
+	    (double)(mem_peak - base_mem) / n_subscribers / n_messages);
+
+	for (i = 0; i < n_subscribers; ++i)
+		evbuffer_free(subs[i]);
+	free(subs);
+}
+
+int
+main(int argc, char **argv)
+{
+	char *payload;
+	int max_subscribers = 1000;
+	int n, c;
+	enum mode mode;
+
+	while ((c = getopt(argc, argv, "m:s:n:")) != -1) {
+		switch (c) {
+		case 'm':
+			n_messages = atoi(optarg);
+			break;
+		case 's':
+			message_size = (size_t)atoi(optarg);
+			break;
+		case 'n':
+			max_subscribers = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Illegal argument \"%c\"\n", c);
+			exit(1);
+		}
+	}
+	if (n_messages < 1 || !message_size || max_subscribers < 1) {
+		fprintf(stderr, "-m, -s and -n must be positive\n");
+		exit(1);
+	}
+
+#ifdef EVENT__DISABLE_MM_REPLACEMENT
+	fprintf(stderr, "Memory use is not counted without mm replacement\n");
+#else
+	event_set_mem_functions(count_malloc, count_realloc, count_free);
+#endif
+	payload = malloc(message_size);
+	if (!payload) {
+		fprintf(stderr, "Couldn't allocate\n");
+		exit(1);
+	}
+	memset(payload, 'x', message_size);
+
+	fprintf(stdout, "%-10s %8s %12s %14s %14s\n", "mode", "subs", "ms",
+	    "MB allocated", "bytes/sub/msg");
+	for (n = 1; n <= max_subscribers; n *= 10) {
+		for (mode = COPY; mode <= SHARED; ++mode)
+			run(mode, n, payload);
+	}
+
+	free(payload);
+	exit(0);
+}
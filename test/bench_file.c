@@ -0,0 +1,243 @@
+/*
+ * Copyright (c) 2007-2012 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "event2/event-config.h"
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/thread.h>
+#include <event2/util.h>
+
+/*
+ * This benchmark sends a file that isn't in the page cache through a socket
+ * bufferevent, and reports the rate, and the longest that the event loop
+ * went without running a 1 ms timer.  It compares a plain file segment, one
+ * made with EVBUF_FS_READAHEAD, and one that also has its reads offloaded
+ * to other threads with evbuffer_base_set_file_offload().  The file goes in
+ * the current directory by default; it has to be on a filesystem that lets
+ * posix_fadvise() drop it from the cache (tmpfs doesn't).
+ */
+
+static const char *path = "bench_file.tmp";
+static size_t file_size = (size_t)256 << 20;
+static unsigned extra_flags;
+
+struct run_state {
+	size_t received;
+	struct timeval last_tick;
+	double worst_stall;
+};
+
+static void
+offload_cb(void (*work)(void *), void *work_arg, void *arg)
+{
+	pthread_t thread;
+
+	if (pthread_create(&thread, NULL, (void *(*)(void *))(void *)work,
+		work_arg)) {
+		fprintf(stderr, "Couldn't start a thread\n");
+		exit(1);
+	}
+	pthread_detach(thread);
+}
+
+static void
+tick_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct run_state *st = arg;
+	struct timeval now, diff;
+	double ms;
+
+	evutil_gettimeofday(&now, NULL);
+	evutil_timersub(&now, &st->last_tick, &diff);
+	ms = diff.tv_sec * 1000.0 + diff.tv_usec / 1000.0;
+	if (ms > st->worst_stall)
+		st->worst_stall = ms;
+	st->last_tick = now;
+}
+
+static void
+readcb(struct bufferevent *bev, void *arg)
+{
+	struct run_state *st = arg;
+	struct evbuffer *input = bufferevent_get_input(bev);
+
+	st->received += evbuffer_get_length(input);
+	evbuffer_drain(input, evbuffer_get_length(input));
+	if (st->received >= file_size)
+		event_base_loopbreak(bufferevent_get_base(bev));
+}
+
+/* Drop the file from the page cache, if we can. */
+static void
+evict(int fd)
+{
+	fsync(fd);
+	if (posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED)) {
+		fprintf(stderr, "posix_fadvise failed\n");
+		exit(1);
+	}
+}
+
+static void
+run(const char *what, int fd, unsigned flags, int offload)
+{
+	struct event_base *base;
+	struct bufferevent *bevs[2];
+	struct evbuffer_file_segment *seg;
+	struct event *tick;
+	struct run_state st;
+	struct timeval ts, te, ms = { 0, 1000 };
+	evutil_socket_t pair[2];
+	double usec;
+	int i;
+
+	memset(&st, 0, sizeof(st));
+	base = event_base_new();
+	if (!base) {
+		fprintf(stderr, "Couldn't create event base\n");
+		exit(1);
+	}
+	if (offload &&
+	    evbuffer_base_set_file_offload(base, offload_cb, NULL) < 0) {
+		fprintf(stdout, "%-10s unsupported\n", what);
+		event_base_free(base);
+		return;
+	}
+	if (evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0) {
+		perror("socketpair");
+		exit(1);
+	}
+	for (i = 0; i < 2; ++i) {
+		evutil_make_socket_nonblocking(pair[i]);
+		bevs[i] = bufferevent_socket_new(base, pair[i],
+		    BEV_OPT_CLOSE_ON_FREE);
+		if (!bevs[i]) {
+			fprintf(stderr, "Couldn't create bufferevent\n");
+			exit(1);
+		}
+	}
+	bufferevent_setcb(bevs[1], readcb, NULL, NULL, &st);
+	bufferevent_enable(bevs[1], EV_READ);
+	tick = event_new(base, -1, EV_PERSIST, tick_cb, &st);
+	event_add(tick, &ms);
+
+	evict(fd);
+	seg = evbuffer_file_segment_new(fd, 0, file_size, flags | extra_flags);
+	if (!seg) {
+		fprintf(stderr, "Couldn't create file segment\n");
+		exit(1);
+	}
+
+	evutil_gettimeofday(&ts, NULL);
+	st.last_tick = ts;
+	evbuffer_add_file_segment(bufferevent_get_output(bevs[0]), seg, 0, -1);
+	event_base_dispatch(base);
+	evutil_gettimeofday(&te, NULL);
+	evutil_timersub(&te, &ts, &te);
+	usec = te.tv_sec * 1000000.0 + te.tv_usec;
+
+	fprintf(stdout, "%-10s %10.1f MB/s %10.1f ms worst stall\n", what,
+	    st.received / usec, st.worst_stall);
+
+	evbuffer_file_segment_free(seg);
+	event_free(tick);
+	bufferevent_free(bevs[0]);
+	bufferevent_free(bevs[1]);
+	event_base_free(base);
+}
+
+int
+main(int argc, char **argv)
+{
+	static char block[1 << 20];
+	size_t written;
+	int fd, c, keep = 0;
+
+	while ((c = getopt(argc, argv, "f:n:mk")) != -1) {
+		switch (c) {
+		case 'f':
+			path = optarg;
+			break;
+		case 'n':
+			file_size = (size_t)atoi(optarg) << 20;
+			break;
+		case 'm':
+			extra_flags |= EVBUF_FS_DISABLE_SENDFILE;
+			break;
+		case 'k':
+			keep = 1;
+			break;
+		default:
+			fprintf(stderr, "Illegal argument \"%c\"\n", c);
+			exit(1);
+		}
+	}
+	if (!file_size) {
+		fprintf(stderr, "-n must be positive\n");
+		exit(1);
+	}
+	if (evthread_use_pthreads() < 0) {
+		fprintf(stderr, "Couldn't enable threading\n");
+		exit(1);
+	}
+
+	fd = open(path, O_RDWR|O_CREAT|O_TRUNC, 0600);
+	if (fd < 0) {
+		perror(path);
+		exit(1);
+	}
+	for (written = 0; written < file_size; written += sizeof(block)) {
+		memset(block, 'a' + (int)(written >> 20) % 26, sizeof(block));
+		if (write(fd, block, sizeof(block)) != (ev_ssize_t)sizeof(block)) {
+			perror("write");
+			exit(1);
+		}
+	}
+
+	run("default", fd, 0, 0);
+	run("readahead", fd, EVBUF_FS_READAHEAD, 0);
+	run("offload", fd, EVBUF_FS_READAHEAD, 1);
+
+	close(fd);
+	if (!keep)
+		unlink(path);
+
+	exit(0);
+}
@@ -0,0 +1,200 @@
+/*
+ * Copyright (c) 2007-2012 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "event2/event-config.h"
+
+#include <sys/types.h>
+#ifdef EVENT__HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <winsock2.h>
+#include <windows.h>
+#include <ws2tcpip.h>
+#include <getopt.h>
+#else /* _WIN32 */
+#include <sys/socket.h>
+#include <netinet/in.h>
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef EVENT__HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <errno.h>
+
+#include <event2/event.h>
+#include <event2/dns.h>
+#include <event2/util.h>
+
+/*
+ * This benchmark measures how long it takes to load a big hosts file, and
+ * how many lookups per second evdns answers from it, both forward (with
+ * evdns_getaddrinfo) and reverse (with the "hosts-reverse" option).
+ */
+
+static int answered;
+static int reverse_pending;
+
+static void
+gai_cb(int result, struct evutil_addrinfo *res, void *arg)
+{
+	if (result == 0)
+		++answered;
+	if (res)
+		evutil_freeaddrinfo(res);
+}
+
+static void
+reverse_cb(int result, char type, int count, int ttl, void *addresses,
+    void *arg)
+{
+	struct event_base *base = arg;
+	if (result == DNS_ERR_NONE)
+		++answered;
+	if (--reverse_pending == 0)
+		event_base_loopbreak(base);
+}
+
+static void
+print_rate(const char *what, int n, const struct timeval *ts)
+{
+	struct timeval te;
+	double usec;
+
+	evutil_gettimeofday(&te, NULL);
+	evutil_timersub(&te, ts, &te);
+	usec = te.tv_sec * 1000000.0 + te.tv_usec;
+	fprintf(stdout, "%-10s %8d in %10.0f usec: %12.0f/sec\n",
+	    what, n, usec, usec > 0 ? n * 1000000.0 / usec : 0.0);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct event_base *base;
+	struct evdns_base *dns;
+	struct evutil_addrinfo hints;
+	struct timeval ts;
+	const char *filename = "bench_hosts.tmp";
+	char name[64];
+	struct in_addr in;
+	FILE *f;
+	int i, c, k;
+
+	int num_entries = 100000;
+	int num_lookups = 100000;
+#ifdef _WIN32
+	WSADATA WSAData;
+	WSAStartup(0x101, &WSAData);
+#endif
+
+	while ((c = getopt(argc, argv, "n:l:f:")) != -1) {
+		switch (c) {
+		case 'n':
+			num_entries = atoi(optarg);
+			break;
+		case 'l':
+			num_lookups = atoi(optarg);
+			break;
+		case 'f':
+			filename = optarg;
+			break;
+		default:
+			fprintf(stderr, "Illegal argument \"%c\"\n", c);
+			exit(1);
+		}
+	}
+	if (num_entries < 1 || num_entries > 0xffffff) {
+		fprintf(stderr, "-n must be between 1 and %d\n", 0xffffff);
+		exit(1);
+	}
+
+	f = fopen(filename, "w");
+	if (!f) {
+		perror("fopen");
+		exit(1);
+	}
+	for (i = 0; i < num_entries; ++i) {
+		fprintf(f, "10.%d.%d.%d\tservice-%d.cluster.local service-%d\n",
+		    (i >> 16) & 0xff, (i >> 8) & 0xff, i & 0xff, i, i);
+	}
+	fclose(f);
+
+	base = event_base_new();
+	dns = evdns_base_new(base, 0);
+	if (!base || !dns) {
+		fprintf(stderr, "Couldn't set up evdns\n");
+		exit(1);
+	}
+	evdns_base_set_option(dns, "hosts-reverse", "1");
+
+	evutil_gettimeofday(&ts, NULL);
+	if (evdns_base_load_hosts(dns, filename) < 0) {
+		fprintf(stderr, "Couldn't load %s\n", filename);
+		exit(1);
+	}
+	print_rate("load", num_entries, &ts);
+
+	/* Names in the hosts file are answered without a nameserver, and
+	 * before evdns_getaddrinfo returns. */
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = PF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	answered = 0;
+	evutil_gettimeofday(&ts, NULL);
+	for (i = 0; i < num_lookups; ++i) {
+		k = (int)(((unsigned)i * 2654435761u) % (unsigned)num_entries);
+		evutil_snprintf(name, sizeof(name), "SERVICE-%d.cluster.local",
+		    k);
+		evdns_getaddrinfo(dns, name, NULL, &hints, gai_cb, NULL);
+	}
+	print_rate("forward", answered, &ts);
+
+	answered = 0;
+	reverse_pending = num_lookups;
+	evutil_gettimeofday(&ts, NULL);
+	for (i = 0; i < num_lookups; ++i) {
+		k = (int)(((unsigned)i * 2654435761u) % (unsigned)num_entries);
+		in.s_addr = htonl(0x0a000000u | (unsigned)k);
+		evdns_base_resolve_reverse(dns, &in, 0, reverse_cb, base);
+	}
+	event_base_dispatch(base);
+	print_rate("reverse", answered, &ts);
+
+	evdns_base_free(dns, 0);
+	event_base_free(base);
+	unlink(filename);
+
+#ifdef _WIN32
+	WSACleanup();
+#endif
+
+	exit(0);
+}
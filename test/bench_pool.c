@@ -0,0 +1,176 @@
+/*
+ * Copyright (c) 2007-2012 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "event2/event-config.h"
+
+#include <sys/types.h>
+#ifdef EVENT__HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <winsock2.h>
+#include <windows.h>
+#include <getopt.h>
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef EVENT__HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/util.h>
+
+/*
+ * This benchmark moves data through many evbuffers at once, so that their
+ * chains add up to a working set far bigger than the TLB covers, and
+ * compares chains from the heap with chains from a pool set up by
+ * evbuffer_base_set_chain_pool(), backed by transparent or by explicit
+ * huge pages.  Explicit huge pages need some reserved in
+ * /proc/sys/vm/nr_hugepages; without them, that pool falls back on
+ * transparent ones.
+ */
+
+static char block[65536];
+static int n_buffers = 512;
+static int n_rounds = 20;
+static size_t chunk_size = 65536;
+static int chunks_per_buffer = 4;
+
+static void
+run(const char *what, int use_pool, unsigned flags)
+{
+	struct event_base *base;
+	struct evbuffer **bufs;
+	struct evbuffer_chain_pool_stats st;
+	struct timeval ts, te;
+	double usec, bytes = 0;
+	int i, j, r;
+
+	base = event_base_new();
+	bufs = calloc(n_buffers, sizeof(*bufs));
+	if (!base || !bufs) {
+		fprintf(stderr, "Couldn't set up\n");
+		exit(1);
+	}
+	if (use_pool &&
+	    evbuffer_base_set_chain_pool(base, 0, 0, flags) < 0) {
+		fprintf(stdout, "%-14s unsupported\n", what);
+		goto done;
+	}
+	for (i = 0; i < n_buffers; ++i) {
+		if (!(bufs[i] = evbuffer_new())) {
+			fprintf(stderr, "Couldn't create evbuffer\n");
+			exit(1);
+		}
+		if (use_pool)
+			evbuffer_set_chain_pool(bufs[i], base);
+		for (j = 0; j < chunks_per_buffer; ++j)
+			evbuffer_add(bufs[i], block, chunk_size);
+	}
+
+	evutil_gettimeofday(&ts, NULL);
+	for (r = 0; r < n_rounds; ++r) {
+		/* Stride through the buffers, so that each one we touch is
+		 * cold. */
+		for (i = 0; i < n_buffers; ++i) {
+			struct evbuffer *buf = bufs[(i * 97) % n_buffers];
+			evbuffer_remove(buf, block, chunk_size);
+			evbuffer_add(buf, block, chunk_size);
+			bytes += 2.0 * chunk_size;
+		}
+	}
+	evutil_gettimeofday(&te, NULL);
+	evutil_timersub(&te, &ts, &te);
+	usec = te.tv_sec * 1000000.0 + te.tv_usec;
+
+	fprintf(stdout, "%-14s %10.1f MB/s", what, bytes / usec);
+	if (use_pool && evbuffer_base_get_chain_pool_stats(base, &st) == 0)
+		fprintf(stdout, " %6lu MB mapped %6lu MB hugetlb %8lu fallbacks"
+		    " node %d", (unsigned long)(st.bytes_mapped >> 20),
+		    (unsigned long)(st.bytes_hugetlb >> 20),
+		    (unsigned long)st.n_fallbacks, st.node);
+	fputc('\n', stdout);
+
+	for (i = 0; i < n_buffers; ++i)
+		evbuffer_free(bufs[i]);
+done:
+	free(bufs);
+	event_base_free(base);
+}
+
+int
+main(int argc, char **argv)
+{
+	int c;
+#ifdef _WIN32
+	WSADATA WSAData;
+	WSAStartup(0x101, &WSAData);
+#endif
+
+	while ((c = getopt(argc, argv, "b:r:s:c:")) != -1) {
+		switch (c) {
+		case 'b':
+			n_buffers = atoi(optarg);
+			break;
+		case 'r':
+			n_rounds = atoi(optarg);
+			break;
+		case 's':
+			chunk_size = (size_t)atoi(optarg);
+			break;
+		case 'c':
+			chunks_per_buffer = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Illegal argument \"%c\"\n", c);
+			exit(1);
+		}
+	}
+	if (n_buffers < 1 || n_rounds < 1 || chunks_per_buffer < 1 ||
+	    !chunk_size || chunk_size > sizeof(block)) {
+		fprintf(stderr, "-b, -r, -s and -c must be positive, and -s "
+		    "at most %d\n", (int)sizeof(block));
+		exit(1);
+	}
+	memset(block, 'x', sizeof(block));
+
+	run("heap", 0, 0);
+	run("pool", 1, 0);
+	run("pool huge", 1, EVBUFFER_POOL_HUGEPAGES);
+	run("pool huge+node", 1,
+	    EVBUFFER_POOL_HUGEPAGES|EVBUFFER_POOL_LOCAL_NODE);
+
+#ifdef _WIN32
+	WSACleanup();
+#endif
+
+	exit(0);
+}
@@ -0,0 +1,156 @@
+/*
+ * Copyright (c) 2007-2012 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "event2/event-config.h"
+
+#include <sys/types.h>
+#ifdef EVENT__HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#ifdef _WIN32
+#include <getopt.h>
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef EVENT__HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/util.h>
+
+/*
+ * This benchmark appends the kinds of small formatted things that HTTP
+ * and other protocols write -- integers, chunk sizes, escaped bytes,
+ * header lines -- with evbuffer_add_printf(), and with the appenders that
+ * don't parse a format, and reports nanoseconds per append.
+ */
+
+static int n_appends = 2000000;
+
+enum what { DECIMAL, CHUNK, ESCAPE, HEADER };
+static const char *what_names[] = {
+	"decimal", "chunk size", "escape", "header"
+};
+
+static void
+append(struct evbuffer *buf, enum what what, int direct, int i)
+{
+	switch (what) {
+	case DECIMAL:
+		if (direct)
+			evbuffer_add_int(buf, i * 7919);
+		else
+			evbuffer_add_printf(buf, "%d", i * 7919);
+		break;
+	case CHUNK:
+		if (direct) {
+			evbuffer_add_uint_fixed(buf, i, EVBUFFER_INT_HEX, 0);
+			evbuffer_add(buf, "\r\n", 2);
+		} else {
+			evbuffer_add_printf(buf, "%x\r\n", (unsigned)i);
+		}
+		break;
+	case ESCAPE:
+		if (direct) {
+			evbuffer_add(buf, "%", 1);
+			evbuffer_add_uint_fixed(buf, i & 0xff,
+			    EVBUFFER_INT_HEX|EVBUFFER_INT_UPPER, 2);
+		} else {
+			evbuffer_add_printf(buf, "%%%02X", i & 0xff);
+		}
+		break;
+	case HEADER:
+		if (direct)
+			evbuffer_add_strings(buf, "Content-Type", ": ",
+			    "text/html; charset=ISO-8859-1", "\r\n", NULL);
+		else
+			evbuffer_add_printf(buf, "%s: %s\r\n", "Content-Type",
+			    "text/html; charset=ISO-8859-1");
+		break;
+	}
+}
+
+static void
+run(enum what what, int direct)
+{
+	struct evbuffer *buf = evbuffer_new();
+	struct timeval ts, te;
+	size_t total = 0;
+	double usec;
+	int i;
+
+	evutil_gettimeofday(&ts, NULL);
+	for (i = 0; i < n_appends; ++i) {
+		append(buf, what, direct, i);
+		/* Don't let the buffer grow without bound. */
+		if ((i & 1023) == 1023) {
+			total += evbuffer_get_length(buf);
+			evbuffer_drain(buf, evbuffer_get_length(buf));
+		}
+	}
+	total += evbuffer_get_length(buf);
+	evutil_gettimeofday(&te, NULL);
+
+	evutil_timersub(&te, &ts, &te);
+	usec = te.tv_sec * 1000000.0 + te.tv_usec;
+	fprintf(stdout, "%-11s %-7s %8.1f ns/append %10lu bytes\n",
+	    what_names[what], direct ? "direct" : "printf",
+	    usec * 1000.0 / n_appends, (unsigned long)total);
+	evbuffer_free(buf);
+}
+
+int
+main(int argc, char **argv)
+{
+	enum what what;
+	int c;
+
+	while ((c = getopt(argc, argv, "n:")) != -1) {
+		switch (c) {
+		case 'n':
+			n_appends = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Illegal argument \"%c\"\n", c);
+			exit(1);
+		}
+	}
+	if (n_appends < 1) {
+		fprintf(stderr, "-n must be positive\n");
+		exit(1);
+	}
+
+	for (what = DECIMAL; what <= HEADER; ++what) {
+		run(what, 0);
+		run(what, 1);
+	}
+
+	exit(0);
+}
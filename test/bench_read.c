@@ -0,0 +1,259 @@
+/*
+ * Copyright (c) 2007-2012 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "event2/event-config.h"
+
+#include <sys/types.h>
+#ifdef EVENT__HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <winsock2.h>
+#include <windows.h>
+#include <getopt.h>
+#else /* _WIN32 */
+#include <sys/socket.h>
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef EVENT__HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/util.h>
+
+/*
+ * This benchmark compares evbuffer_read() with and without
+ * EVBUFFER_FLAG_ADAPTIVE_READ, on a bulk transfer and on small
+ * request/response messages, both over a socketpair.  For each, it reports
+ * the rate, and how many reads and FIONREAD calls the receiving side made.
+ */
+
+static char block[65536];
+static size_t total_bytes = (size_t)256 << 20;
+static int total_requests = 100000;
+static size_t message_size = 100;
+
+static size_t queued;
+static int requests;
+
+static void
+bulk_writecb(struct bufferevent *bev, void *arg)
+{
+	struct evbuffer *output = bufferevent_get_output(bev);
+
+	while (queued < total_bytes &&
+	    evbuffer_get_length(output) < 4 * sizeof(block)) {
+		evbuffer_add_reference(output, block, sizeof(block),
+		    NULL, NULL);
+		queued += sizeof(block);
+	}
+}
+
+static void
+bulk_readcb(struct bufferevent *bev, void *arg)
+{
+	size_t *received = arg;
+	struct evbuffer *input = bufferevent_get_input(bev);
+
+	*received += evbuffer_get_length(input);
+	evbuffer_drain(input, evbuffer_get_length(input));
+	if (*received >= total_bytes)
+		event_base_loopbreak(bufferevent_get_base(bev));
+}
+
+static void
+server_readcb(struct bufferevent *bev, void *arg)
+{
+	/* Echo everything back. */
+	bufferevent_write_buffer(bev, bufferevent_get_input(bev));
+}
+
+static void
+client_readcb(struct bufferevent *bev, void *arg)
+{
+	struct evbuffer *input = bufferevent_get_input(bev);
+
+	while (evbuffer_get_length(input) >= message_size) {
+		evbuffer_drain(input, message_size);
+		if (++requests == total_requests) {
+			event_base_loopbreak(bufferevent_get_base(bev));
+			return;
+		}
+		bufferevent_write(bev, block, message_size);
+	}
+}
+
+static void
+report(const char *what, int adaptive, const struct timeval *ts,
+    double amount, const char *unit, struct bufferevent *bev)
+{
+	struct evbuffer_read_stats st;
+	struct timeval te;
+	double usec;
+
+	evutil_gettimeofday(&te, NULL);
+	evutil_timersub(&te, ts, &te);
+	usec = te.tv_sec * 1000000.0 + te.tv_usec;
+	evbuffer_get_read_stats(bufferevent_get_input(bev), &st);
+	fprintf(stdout, "%-8s %-9s %12.1f %-6s %10lu reads %10lu fionread "
+	    "%8.0f bytes/read\n", what, adaptive ? "adaptive" : "default",
+	    amount * 1000000.0 / usec, unit, (unsigned long)st.n_reads,
+	    (unsigned long)st.n_fionread,
+	    st.n_reads ? (double)st.n_bytes / st.n_reads : 0.0);
+}
+
+static void
+setup_pair(struct event_base *base, struct bufferevent **bevs,
+    int adaptive, size_t max_read)
+{
+	evutil_socket_t pair[2];
+	int i;
+
+	if (evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0) {
+		perror("socketpair");
+		exit(1);
+	}
+	for (i = 0; i < 2; ++i) {
+		evutil_make_socket_nonblocking(pair[i]);
+		bevs[i] = bufferevent_socket_new(base, pair[i],
+		    BEV_OPT_CLOSE_ON_FREE);
+		if (!bevs[i]) {
+			fprintf(stderr, "Couldn't create bufferevent\n");
+			exit(1);
+		}
+		bufferevent_set_max_single_read(bevs[i], max_read);
+		if (adaptive)
+			evbuffer_set_flags(bufferevent_get_input(bevs[i]),
+			    EVBUFFER_FLAG_ADAPTIVE_READ);
+		bufferevent_enable(bevs[i], EV_READ|EV_WRITE);
+	}
+}
+
+static void
+run_bulk(struct event_base *base, int adaptive, size_t max_read)
+{
+	struct bufferevent *bevs[2];
+	struct timeval ts;
+	size_t received = 0;
+
+	setup_pair(base, bevs, adaptive, max_read);
+	bufferevent_setcb(bevs[0], NULL, bulk_writecb, NULL, NULL);
+	bufferevent_setcb(bevs[1], bulk_readcb, NULL, NULL, &received);
+	queued = 0;
+
+	evutil_gettimeofday(&ts, NULL);
+	bulk_writecb(bevs[0], NULL);
+	event_base_dispatch(base);
+	report("bulk", adaptive, &ts, received / 1048576.0, "MB/s", bevs[1]);
+
+	bufferevent_free(bevs[0]);
+	bufferevent_free(bevs[1]);
+}
+
+static void
+run_requests(struct event_base *base, int adaptive, size_t max_read)
+{
+	struct bufferevent *bevs[2];
+	struct timeval ts;
+
+	setup_pair(base, bevs, adaptive, max_read);
+	bufferevent_setcb(bevs[0], client_readcb, NULL, NULL, NULL);
+	bufferevent_setcb(bevs[1], server_readcb, NULL, NULL, NULL);
+	requests = 0;
+
+	evutil_gettimeofday(&ts, NULL);
+	bufferevent_write(bevs[0], block, message_size);
+	event_base_dispatch(base);
+	report("requests", adaptive, &ts, requests, "req/s", bevs[1]);
+
+	bufferevent_free(bevs[0]);
+	bufferevent_free(bevs[1]);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct event_base *base;
+	size_t max_read = 262144;
+	int c;
+#ifdef _WIN32
+	WSADATA WSAData;
+	WSAStartup(0x101, &WSAData);
+#endif
+
+	while ((c = getopt(argc, argv, "n:r:m:s:")) != -1) {
+		switch (c) {
+		case 'n':
+			total_bytes = (size_t)atoi(optarg) << 20;
+			break;
+		case 'r':
+			total_requests = atoi(optarg);
+			break;
+		case 'm':
+			max_read = (size_t)atoi(optarg);
+			break;
+		case 's':
+			message_size = (size_t)atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Illegal argument \"%c\"\n", c);
+			exit(1);
+		}
+	}
+	if (!total_bytes || total_requests < 1 || !max_read ||
+	    !message_size || message_size > sizeof(block)) {
+		fprintf(stderr, "-n, -r, -m and -s must be positive, and -s "
+		    "at most %d\n", (int)sizeof(block));
+		exit(1);
+	}
+
+	base = event_base_new();
+	if (!base) {
+		fprintf(stderr, "Couldn't create event base\n");
+		exit(1);
+	}
+	memset(block, 'x', sizeof(block));
+
+	run_bulk(base, 0, max_read);
+	run_bulk(base, 1, max_read);
+	run_requests(base, 0, max_read);
+	run_requests(base, 1, max_read);
+
+	event_base_free(base);
+
+#ifdef _WIN32
+	WSACleanup();
+#endif
+
+	exit(0);
+}
@@ -0,0 +1,146 @@
+/*
+ * Copyright (c) 2007-2012 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "event2/event-config.h"
+
+#include <sys/types.h>
+#ifdef EVENT__HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <getopt.h>
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef EVENT__HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include <event2/buffer.h>
+#include <event2/util.h>
+
+/*
+ * This benchmark seeks to random positions in a big evbuffer made of many
+ * small chains, and copies a few bytes out from each, the way a parser
+ * jumping around a large upload would.  For comparison, it also times
+ * walking the chains from the start with evbuffer_peek(), which is what
+ * every evbuffer_ptr_set() used to cost.
+ */
+
+static double
+elapsed_usec(const struct timeval *ts)
+{
+	struct timeval te;
+
+	evutil_gettimeofday(&te, NULL);
+	evutil_timersub(&te, ts, &te);
+	return te.tv_sec * 1000000.0 + te.tv_usec;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct evbuffer *buf;
+	struct evbuffer_ptr ptr;
+	struct timeval ts;
+	size_t total = (size_t)100 << 20, chain_size = 4096, len, i;
+	int n_seeks = 100000, n_walks = 1000, c;
+	unsigned long sum = 0;
+	char *block, out[16];
+	double usec;
+
+	while ((c = getopt(argc, argv, "n:s:r:w:")) != -1) {
+		switch (c) {
+		case 'n':
+			total = (size_t)atoi(optarg) << 20;
+			break;
+		case 's':
+			chain_size = (size_t)atoi(optarg);
+			break;
+		case 'r':
+			n_seeks = atoi(optarg);
+			break;
+		case 'w':
+			n_walks = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Illegal argument \"%c\"\n", c);
+			exit(1);
+		}
+	}
+	if (chain_size < sizeof(out) || total < chain_size ||
+	    n_seeks < 1 || n_walks < 1) {
+		fprintf(stderr, "-n, -r and -w must be positive, and -s at "
+		    "least %d\n", (int)sizeof(out));
+		exit(1);
+	}
+
+	buf = evbuffer_new();
+	block = malloc(chain_size);
+	if (!buf || !block) {
+		fprintf(stderr, "Couldn't set up\n");
+		exit(1);
+	}
+	memset(block, 'x', chain_size);
+
+	/* One chain per block. */
+	for (len = 0; len + chain_size <= total; len += chain_size)
+		evbuffer_add_reference(buf, block, chain_size, NULL, NULL);
+	fprintf(stdout, "%lu bytes in %lu chains\n", (unsigned long)len,
+	    (unsigned long)(len / chain_size));
+	srand(1);
+
+	evutil_gettimeofday(&ts, NULL);
+	for (i = 0; i < (size_t)n_walks; ++i) {
+		size_t pos = ((size_t)rand() * 4096 + rand()) % (len - sizeof(out));
+		sum += evbuffer_peek(buf, pos, NULL, NULL, 0);
+	}
+	usec = elapsed_usec(&ts);
+	fprintf(stdout, "walk:  %12.0f seeks/s\n", n_walks * 1000000.0 / usec);
+
+	evutil_gettimeofday(&ts, NULL);
+	for (i = 0; i < (size_t)n_seeks; ++i) {
+		size_t pos = ((size_t)rand() * 4096 + rand()) % (len - sizeof(out));
+		if (evbuffer_ptr_set(buf, &ptr, pos, EVBUFFER_PTR_SET) < 0 ||
+		    evbuffer_copyout_from(buf, &ptr, out, sizeof(out)) < 0) {
+			fprintf(stderr, "Seek to %lu failed\n",
+			    (unsigned long)pos);
+			exit(1);
+		}
+		sum += out[0];
+	}
+	usec = elapsed_usec(&ts);
+	fprintf(stdout, "index: %12.0f seeks/s\n", n_seeks * 1000000.0 / usec);
+
+	evbuffer_free(buf);
+	free(block);
+
+	return sum ? 0 : 1;
+}
@@ -0,0 +1,211 @@
+/*
+ * Copyright (c) 2007-2012 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "event2/event-config.h"
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/thread.h>
+#include <event2/util.h>
+
+/*
+ * This benchmark has one thread write log lines for the event loop thread
+ * to read, through a locked evbuffer, and through an evbuffer_spsc, and
+ * reports lines per second, and how many times the loop was woken.
+ */
+
+static int n_lines = 5000000;
+static size_t line_size = 100;
+static char line[65536];
+
+struct run_state {
+	struct event_base *base;
+	struct evbuffer *buf;
+	struct evbuffer_spsc *spsc;
+	struct event *wakeup;
+	size_t total;
+	size_t received;
+	int n_wakeups;
+};
+
+/* Locked: the writer adds to a shared evbuffer, and activates an event if
+ * it was empty. */
+static void *
+locked_writer(void *arg)
+{
+	struct run_state *st = arg;
+	int i, was_empty;
+
+	for (i = 0; i < n_lines; ++i) {
+		evbuffer_lock(st->buf);
+		was_empty = evbuffer_get_length(st->buf) == 0;
+		evbuffer_add(st->buf, line, line_size);
+		evbuffer_unlock(st->buf);
+		if (was_empty)
+			event_active(st->wakeup, EV_READ, 1);
+	}
+	return NULL;
+}
+
+static void
+locked_readcb(evutil_socket_t fd, short what, void *arg)
+{
+	struct run_state *st = arg;
+	size_t n;
+
+	++st->n_wakeups;
+	evbuffer_lock(st->buf);
+	n = evbuffer_get_length(st->buf);
+	evbuffer_drain(st->buf, n);
+	evbuffer_unlock(st->buf);
+	st->received += n;
+	if (st->received == st->total)
+		event_base_loopbreak(st->base);
+}
+
+static void *
+spsc_writer(void *arg)
+{
+	struct run_state *st = arg;
+	int i;
+
+	for (i = 0; i < n_lines; ++i)
+		evbuffer_spsc_add(st->spsc, line, line_size);
+	return NULL;
+}
+
+static void
+spsc_readcb(struct evbuffer_spsc *spsc, struct evbuffer *input, void *arg)
+{
+	struct run_state *st = arg;
+	size_t n = evbuffer_get_length(input);
+
+	++st->n_wakeups;
+	evbuffer_drain(input, n);
+	st->received += n;
+	if (st->received == st->total)
+		event_base_loopbreak(st->base);
+}
+
+static void
+run(struct event_base *base, int spsc)
+{
+	struct run_state st;
+	struct timeval ts, te;
+	pthread_t writer;
+	double usec;
+
+	memset(&st, 0, sizeof(st));
+	st.base = base;
+	st.total = (size_t)n_lines * line_size;
+	if (spsc) {
+		st.spsc = evbuffer_spsc_new(base, spsc_readcb, &st);
+	} else {
+		st.buf = evbuffer_new();
+		if (st.buf)
+			evbuffer_enable_locking(st.buf, NULL);
+		st.wakeup = event_new(base, -1, 0, locked_readcb, &st);
+	}
+	if (spsc ? !st.spsc : (!st.buf || !st.wakeup)) {
+		fprintf(stderr, "Couldn't set up\n");
+		exit(1);
+	}
+
+	evutil_gettimeofday(&ts, NULL);
+	if (pthread_create(&writer, NULL, spsc ? spsc_writer : locked_writer,
+		&st)) {
+		perror("pthread_create");
+		exit(1);
+	}
+	event_base_loop(base, EVLOOP_NO_EXIT_ON_EMPTY);
+	evutil_gettimeofday(&te, NULL);
+	pthread_join(writer, NULL);
+
+	evutil_timersub(&te, &ts, &te);
+	usec = te.tv_sec * 1000000.0 + te.tv_usec;
+	fprintf(stdout, "%-7s %12.0f lines/s %10.1f MB/s %10d wakeups\n",
+	    spsc ? "spsc" : "locked", n_lines * 1000000.0 / usec,
+	    st.total / usec, st.n_wakeups);
+
+	if (spsc) {
+		evbuffer_spsc_free(st.spsc);
+	} else {
+		event_free(st.wakeup);
+		evbuffer_free(st.buf);
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	struct event_base *base;
+	int c;
+
+	while ((c = getopt(argc, argv, "n:s:")) != -1) {
+		switch (c) {
+		case 'n':
+			n_lines = atoi(optarg);
+			break;
+		case 's':
+			line_size = (size_t)atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Illegal argument \"%c\"\n", c);
+			exit(1);
+		}
+	}
+	if (n_lines < 1 || !line_size || line_size > sizeof(line)) {
+		fprintf(stderr, "-n and -s must be positive, and -s at most "
+		    "%d\n", (int)sizeof(line));
+		exit(1);
+	}
+
+	if (evthread_use_pthreads() < 0) {
+		fprintf(stderr, "Couldn't enable threads\n");
+		exit(1);
+	}
+	base = event_base_new();
+	if (!base) {
+		fprintf(stderr, "Couldn't create event base\n");
+		exit(1);
+	}
+	memset(line, 'x', sizeof(line));
+
+	run(base, 0);
+	run(base, 1);
+
+	event_base_free(base);
+	exit(0);
+}
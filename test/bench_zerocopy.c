@@ -0,0 +1,267 @@
+/*
+ * Copyright (c) 2007-2012 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 4. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "event2/event-config.h"
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/util.h>
+
+/*
+ * This benchmark measures how much CPU it takes to send a gigabyte through
+ * a socket bufferevent, at different write sizes, with and without
+ * bufferevent_socket_set_zerocopy().  Only the sender's CPU time counts: by
+ * default the data goes to a child process over loopback, but since the
+ * kernel copies loopback traffic anyway, point it at a discard server on
+ * another host with -c to see what zero-copy saves.
+ */
+
+static struct sockaddr_storage sink_addr;
+static int sink_addrlen;
+static int local_sink;
+
+static char *message;
+static size_t message_size;
+static size_t total_bytes;
+static size_t queued;
+
+static void
+writecb(struct bufferevent *bev, void *arg)
+{
+	struct evbuffer *output = bufferevent_get_output(bev);
+
+	if (queued == total_bytes && !evbuffer_get_length(output)) {
+		event_base_loopbreak(bufferevent_get_base(bev));
+		return;
+	}
+	/* Keep a few messages queued, so that we never wait on ourselves. */
+	while (queued < total_bytes &&
+	    evbuffer_get_length(output) < 8 * message_size) {
+		evbuffer_add_reference(output, message, message_size,
+		    NULL, NULL);
+		queued += message_size;
+	}
+}
+
+static void
+eventcb(struct bufferevent *bev, short what, void *arg)
+{
+	if (what & (BEV_EVENT_ERROR|BEV_EVENT_EOF)) {
+		fprintf(stderr, "Connection failed: %s\n",
+		    evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR()));
+		exit(1);
+	}
+}
+
+/* Read and throw away everything from fd until EOF. */
+static void
+sink(evutil_socket_t fd)
+{
+	static char buf[1 << 20];
+
+	while (recv(fd, buf, sizeof(buf), 0) > 0)
+		;
+	_exit(0);
+}
+
+/* Connect to the sink, forking one off first if it's local. */
+static evutil_socket_t
+connect_sink(evutil_socket_t listener, pid_t *pid)
+{
+	evutil_socket_t fd, peer;
+
+	fd = socket(sink_addr.ss_family, SOCK_STREAM, 0);
+	if (fd < 0 ||
+	    connect(fd, (struct sockaddr *)&sink_addr, sink_addrlen) < 0) {
+		perror("connect");
+		exit(1);
+	}
+	*pid = -1;
+	if (local_sink) {
+		peer = accept(listener, NULL, NULL);
+		if (peer < 0) {
+			perror("accept");
+			exit(1);
+		}
+		if ((*pid = fork()) == 0) {
+			close(fd);
+			sink(peer);
+		}
+		close(peer);
+	}
+	evutil_make_socket_nonblocking(fd);
+	return fd;
+}
+
+static double
+cpu_seconds(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+	    (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1000000.0;
+}
+
+static void
+run(struct event_base *base, evutil_socket_t listener, int zerocopy)
+{
+	struct bufferevent *bev;
+	struct timeval ts, te;
+	evutil_socket_t fd;
+	double usec, cpu;
+	pid_t pid;
+
+	fd = connect_sink(listener, &pid);
+	bev = bufferevent_socket_new(base, fd, BEV_OPT_CLOSE_ON_FREE);
+	if (!bev) {
+		fprintf(stderr, "Couldn't create bufferevent\n");
+		exit(1);
+	}
+	bufferevent_set_max_single_write(bev, message_size);
+	if (zerocopy && bufferevent_socket_set_zerocopy(bev, 1) < 0) {
+		fprintf(stderr, "Zero-copy sends aren't supported here\n");
+		exit(1);
+	}
+	bufferevent_setcb(bev, NULL, writecb, eventcb, NULL);
+	queued = 0;
+
+	evutil_gettimeofday(&ts, NULL);
+	cpu = cpu_seconds();
+	writecb(bev, NULL);
+	event_base_dispatch(base);
+	bufferevent_free(bev);
+	/* Wait for the kernel to be done with our last sends, too. */
+	event_base_dispatch(base);
+	cpu = cpu_seconds() - cpu;
+	evutil_gettimeofday(&te, NULL);
+
+	if (pid > 0)
+		waitpid(pid, NULL, 0);
+
+	evutil_timersub(&te, &ts, &te);
+	usec = te.tv_sec * 1000000.0 + te.tv_usec;
+	fprintf(stdout, "%8lu %-9s %10.1f %10.3f\n",
+	    (unsigned long)message_size, zerocopy ? "zerocopy" : "copy",
+	    total_bytes / usec, cpu * (1 << 30) / total_bytes);
+}
+
+int
+main(int argc, char **argv)
+{
+	static const size_t sizes[] = {
+		4096, 16384, 65536, 262144, 1048576, 0
+	};
+	struct event_base *base;
+	struct sockaddr_in sin;
+	ev_socklen_t slen = sizeof(sin);
+	evutil_socket_t listener = -1;
+	int i, c;
+
+	total_bytes = (size_t)1 << 30;
+	sink_addrlen = sizeof(sink_addr);
+	local_sink = 1;
+
+	while ((c = getopt(argc, argv, "n:c:")) != -1) {
+		switch (c) {
+		case 'n':
+			total_bytes = (size_t)atoi(optarg) << 20;
+			break;
+		case 'c':
+			if (evutil_parse_sockaddr_port(optarg,
+				(struct sockaddr *)&sink_addr,
+				&sink_addrlen) < 0) {
+				fprintf(stderr, "Bad address \"%s\"\n",
+				    optarg);
+				exit(1);
+			}
+			local_sink = 0;
+			break;
+		default:
+			fprintf(stderr, "Illegal argument \"%c\"\n", c);
+			exit(1);
+		}
+	}
+	if (!total_bytes) {
+		fprintf(stderr, "-n must be positive\n");
+		exit(1);
+	}
+
+	if (local_sink) {
+		memset(&sin, 0, sizeof(sin));
+		sin.sin_family = AF_INET;
+		sin.sin_addr.s_addr = htonl(0x7f000001);
+		listener = socket(AF_INET, SOCK_STREAM, 0);
+		if (listener < 0 ||
+		    bind(listener, (struct sockaddr *)&sin, sizeof(sin)) < 0 ||
+		    getsockname(listener, (struct sockaddr *)&sin,
+			&slen) < 0 ||
+		    listen(listener, 1) < 0) {
+			perror("listen");
+			exit(1);
+		}
+		memcpy(&sink_addr, &sin, sizeof(sin));
+		sink_addrlen = sizeof(sin);
+	}
+
+	base = event_base_new();
+	message = malloc(sizes[sizeof(sizes) / sizeof(sizes[0]) - 2]);
+	if (!base || !message) {
+		fprintf(stderr, "Couldn't set up\n");
+		exit(1);
+	}
+	memset(message, 'x', sizes[sizeof(sizes) / sizeof(sizes[0]) - 2]);
+
+	fprintf(stdout, "%8s %-9s %10s %10s\n",
+	    "size", "mode", "MB/s", "CPU s/GB");
+	for (i = 0; sizes[i]; ++i) {
+		message_size = sizes[i];
+		run(base, listener, 0);
+		run(base, listener, 1);
+	}
+
+	if (listener >= 0)
+		close(listener);
+	free(message);
+	event_base_free(base);
+
+	exit(0);
+}
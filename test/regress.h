@@ -51,6 +51,7 @@ extern struct testcase_t minheap_testcases[];
 extern struct testcase_t iocp_testcases[];
 extern struct testcase_t openssl_testcases[];
 extern struct testcase_t mbedtls_testcases[];
+extern struct testcase_t dgram_testcases[];
 extern struct testcase_t listener_testcases[];
 extern struct testcase_t listener_iocp_testcases[];
 extern struct testcase_t thread_testcases[];
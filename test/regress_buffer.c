@@ -55,8 +55,10 @@
 #include "event2/event.h"
 #include "event2/buffer.h"
 #include "event2/buffer_compat.h"
+#include "event2/bufferevent.h"
 #include "event2/util.h"
 
+#include "bufferevent-internal.h"
 #include "defer-internal.h"
 #include "evbuffer-internal.h"
 #include "log-internal.h"
@@ -2228,6 +2230,117 @@ end:
 		evbuffer_free(buf2);
 }
 
+static void
+test_evbuffer_shared(void *ptr)
+{
+	struct basic_test_data *data = ptr;
+	const char *text = "this is what we add as read-only memory.";
+	size_t len = strlen(text);
+	struct evbuffer_shared *shared = NULL, *copy = NULL;
+	struct evbuffer *bufs[3] = { NULL, NULL, NULL };
+	struct evbuffer *ref = NULL;
+	struct evbuffer_iovec v[2];
+	char tmp[128];
+	int i;
+
+	reference_cb_called = 0;
+	shared = evbuffer_shared_new_reference(text, len, reference_cb,
+	    (void *)0xdeadaffe);
+	tt_assert(shared);
+	tt_int_op(evbuffer_shared_get_length(shared), ==, len);
+	for (i = 0; i < 3; ++i) {
+		bufs[i] = evbuffer_new();
+		tt_assert(bufs[i]);
+	}
+	ref = evbuffer_new();
+	tt_assert(ref);
+
+	/* Bad ranges. */
+	tt_int_op(evbuffer_add_shared(bufs[0], shared, len + 1, -1), ==, -1);
+	tt_int_op(evbuffer_add_shared(bufs[0], shared, 8, len), ==, -1);
+	tt_int_op(evbuffer_get_length(bufs[0]), ==, 0);
+
+	/* Nothing to add. */
+	tt_int_op(evbuffer_add_shared(bufs[0], shared, len, -1), ==, 0);
+	tt_int_op(evbuffer_add_shared(bufs[0], shared, 0, 0), ==, 0);
+	tt_assert(bufs[0]->first == NULL);
+
+	/* Every buffer points at the same memory. */
+	tt_int_op(evbuffer_add_shared(bufs[0], shared, 0, -1), ==, 0);
+	tt_int_op(evbuffer_add_shared(bufs[1], shared, 0, -1), ==, 0);
+	tt_int_op(evbuffer_add_shared(bufs[2], shared, 8, 4), ==, 0);
+	tt_int_op(evbuffer_peek(bufs[0], -1, NULL, v, 2), ==, 1);
+	tt_assert(v[0].iov_base == (void *)text);
+	tt_int_op(evbuffer_peek(bufs[2], -1, NULL, v, 2), ==, 1);
+	tt_assert(v[0].iov_base == (void *)(text + 8));
+	tt_int_op(v[0].iov_len, ==, 4);
+	/* ... and none of them count it as theirs. */
+	tt_int_op(evbuffer_get_mem_usage(bufs[0]), ==, EVBUFFER_CHAIN_SIZE);
+	evbuffer_validate(bufs[0]);
+	evbuffer_validate(bufs[2]);
+
+	/* We can't write into it. */
+	evbuffer_add(bufs[0], "!", 1);
+	tt_int_op(evbuffer_peek(bufs[0], -1, NULL, v, 2), ==, 2);
+	tt_assert(!memcmp(text, "this is what", 12));
+
+	/* Dropping our reference frees nothing while buffers hold it. */
+	evbuffer_shared_free(shared);
+	shared = NULL;
+	tt_int_op(reference_cb_called, ==, 0);
+
+	/* Read some, move some, reference some. */
+	tt_int_op(evbuffer_remove(bufs[2], tmp, sizeof(tmp)), ==, 4);
+	tt_assert(!memcmp(tmp, "what", 4));
+	evbuffer_free(bufs[2]);
+	bufs[2] = NULL;
+	tt_int_op(evbuffer_add_buffer(bufs[1], bufs[0]), ==, 0);
+	tt_int_op(evbuffer_add_buffer_reference(ref, bufs[1]), ==, 0);
+	tt_int_op(evbuffer_get_length(ref), ==, 2 * len + 1);
+	evbuffer_validate(bufs[1]);
+	evbuffer_validate(ref);
+
+	/* Written out with writev. */
+	while (evbuffer_get_length(bufs[1]))
+		tt_int_op(evbuffer_write(bufs[1], data->pair[0]), >, 0);
+	tt_int_op(recv(data->pair[1], tmp, sizeof(tmp), 0), ==, 2 * len + 1);
+	tt_assert(!memcmp(tmp, text, len));
+	tt_assert(!memcmp(tmp + len, text, len));
+	tt_int_op(tmp[2 * len], ==, '!');
+	tt_int_op(reference_cb_called, ==, 0);
+
+	/* The last one out frees it. */
+	memset(tmp, 0, sizeof(tmp));
+	tt_int_op(evbuffer_copyout(ref, tmp, sizeof(tmp)), ==, 2 * len + 1);
+	tt_assert(!memcmp(tmp, text, len));
+	evbuffer_drain(ref, len);
+	tt_int_op(reference_cb_called, ==, 0);
+	evbuffer_drain(ref, len + 1);
+	tt_int_op(reference_cb_called, ==, 1);
+
+	/* Copied data is freed with the evbuffer_shared. */
+	copy = evbuffer_shared_new(text, len);
+	tt_assert(copy);
+	tt_int_op(evbuffer_add_shared(bufs[0], copy, 0, -1), ==, 0);
+	evbuffer_shared_free(copy);
+	copy = NULL;
+	tt_int_op(evbuffer_peek(bufs[0], -1, NULL, v, 2), ==, 1);
+	tt_assert(v[0].iov_base != (void *)text);
+	tt_int_op(evbuffer_remove(bufs[0], tmp, sizeof(tmp)), ==, len);
+	tt_assert(!memcmp(tmp, text, len));
+
+end:
+	if (shared)
+		evbuffer_shared_free(shared);
+	if (copy)
+		evbuffer_shared_free(copy);
+	for (i = 0; i < 3; ++i)
+		if (bufs[i])
+			evbuffer_free(bufs[i]);
+	if (ref)
+		evbuffer_free(ref);
+}
+
 static void
 check_prepend(struct evbuffer *buffer,
     const struct evbuffer_cb_info *cbinfo,
@@ -2706,6 +2819,87 @@ end:
 	}
 }
 
+static void
+test_evbuffer_add_int(void *ptr)
+{
+	struct evbuffer *buf = evbuffer_new();
+	static const ev_int64_t ints[] = {
+		0, 1, -1, 9, 10, 99, 100, -12345, 1000000007,
+		EV_INT64_MAX, EV_INT64_MIN
+	};
+	char expect[4096], *p;
+	size_t i, len, n = 0;
+	int r;
+
+	tt_assert(buf);
+	for (i = 0; i < sizeof(ints) / sizeof(ints[0]); ++i) {
+		r = evbuffer_add_int(buf, ints[i]);
+		len = evutil_snprintf(expect + n, sizeof(expect) - n, "%lld",
+		    (long long)ints[i]);
+		tt_int_op(r, ==, len);
+		n += len;
+	}
+	r = evbuffer_add_uint(buf, EV_UINT64_MAX);
+	tt_int_op(r, ==, 20);
+	memcpy(expect + n, "18446744073709551615", 20);
+	n += 20;
+	r = evbuffer_add_uint_fixed(buf, 0, EVBUFFER_INT_HEX, 0);
+	tt_int_op(r, ==, 1);
+	expect[n++] = '0';
+	r = evbuffer_add_uint_fixed(buf, 0xbeef, EVBUFFER_INT_HEX, 0);
+	tt_int_op(r, ==, 4);
+	memcpy(expect + n, "beef", 4);
+	n += 4;
+	r = evbuffer_add_uint_fixed(buf, 10,
+	    EVBUFFER_INT_HEX|EVBUFFER_INT_UPPER, 2);
+	tt_int_op(r, ==, 2);
+	memcpy(expect + n, "0A", 2);
+	n += 2;
+	r = evbuffer_add_uint_fixed(buf, 42, 0, 6);
+	tt_int_op(r, ==, 6);
+	memcpy(expect + n, "000042", 6);
+	n += 6;
+	/* Width is a minimum. */
+	r = evbuffer_add_uint_fixed(buf, 123456, 0, 3);
+	tt_int_op(r, ==, 6);
+	memcpy(expect + n, "123456", 6);
+	n += 6;
+	tt_int_op(evbuffer_add_uint_fixed(buf, 1, 0, 65), ==, -1);
+	tt_int_op(evbuffer_add_uint_fixed(buf, 1, 0, -1), ==, -1);
+
+	r = evbuffer_add_strings(buf, "Host", ": ", "", "example.com", "\r\n",
+	    NULL);
+	tt_int_op(r, ==, 19);
+	memcpy(expect + n, "Host: example.com\r\n", 19);
+	n += 19;
+	tt_int_op(evbuffer_add_strings(buf, NULL), ==, 0);
+	evbuffer_validate(buf);
+
+	tt_int_op(evbuffer_get_length(buf), ==, n);
+	tt_assert(!memcmp(evbuffer_pullup(buf, -1), expect, n));
+
+	/* When the last chain is full, numbers go in the next one whole. */
+	evbuffer_drain(buf, n);
+	len = evbuffer_get_length(buf);
+	while ((r = evbuffer_peek(buf, -1, NULL, NULL, 0)) < 2)
+		evbuffer_add(buf, "x", 1);
+	len = evbuffer_get_length(buf);
+	tt_int_op(evbuffer_add_int(buf, -1234567890), ==, 11);
+	p = (char *)evbuffer_pullup(buf, -1);
+	tt_assert(!memcmp(p + len, "-1234567890", 11));
+	evbuffer_validate(buf);
+
+	/* Nothing goes in a frozen buffer. */
+	evbuffer_freeze(buf, 0);
+	tt_int_op(evbuffer_add_int(buf, 1), ==, -1);
+	tt_int_op(evbuffer_add_strings(buf, "x", NULL), ==, -1);
+	tt_int_op(evbuffer_get_length(buf), ==, len + 11);
+
+end:
+	if (buf)
+		evbuffer_free(buf);
+}
+
 static void
 test_evbuffer_copyout(void *dummy)
 {
@@ -2804,6 +2998,468 @@ static const struct testcase_setup_t nil_setup = {
 	cleanup_passthrough
 };
 
+static void
+test_evbuffer_read_adaptive(void *ptr)
+{
+	struct basic_test_data *testdata = ptr;
+	evutil_socket_t *pair = testdata->pair;
+	struct evbuffer *buf = NULL;
+	struct evbuffer_read_stats st;
+	char data[65536];
+	int i, r;
+
+	memset(data, 'x', sizeof(data));
+	buf = evbuffer_new();
+	tt_assert(buf);
+	evbuffer_set_max_read(buf, sizeof(data));
+
+	/* Without the flag, every read asks the kernel first. */
+	tt_int_op(send(pair[0], data, 100, 0), ==, 100);
+	tt_int_op(evbuffer_read(buf, pair[1], -1), ==, 100);
+	evbuffer_get_read_stats(buf, &st);
+	tt_int_op(st.n_reads, ==, 1);
+	tt_int_op(st.n_fionread, ==, 1);
+	tt_int_op(st.read_size, ==, 4096);
+	evbuffer_drain(buf, 100);
+
+	/* Bulk data: each read fills its guess, so the next one asks for
+	 * twice as much, without asking the kernel. */
+	evbuffer_set_flags(buf, EVBUFFER_FLAG_ADAPTIVE_READ);
+	tt_int_op(send(pair[0], data, sizeof(data), 0), ==, sizeof(data));
+	for (i = 0; i < (int)sizeof(data); i += r) {
+		r = evbuffer_read(buf, pair[1], -1);
+		tt_int_op(r, >, 0);
+	}
+	evbuffer_get_read_stats(buf, &st);
+	tt_int_op(st.n_reads, ==, 6);
+	tt_int_op(st.n_full, ==, 5);
+	tt_int_op(st.n_bytes, ==, 100 + sizeof(data));
+	tt_int_op(st.n_fionread, ==, 1);
+	tt_int_op(st.read_size, ==, sizeof(data));
+	evbuffer_drain(buf, sizeof(data));
+
+	/* Small messages: the guess shrinks to the smallest chain, and once
+	 * it's there we stop asking the kernel again. */
+	for (i = 0; i < 20; ++i) {
+		tt_int_op(send(pair[0], data, 100, 0), ==, 100);
+		tt_int_op(evbuffer_read(buf, pair[1], -1), ==, 100);
+		evbuffer_drain(buf, 100);
+	}
+	evbuffer_get_read_stats(buf, &st);
+	tt_int_op(st.read_size, ==, MIN_BUFFER_SIZE);
+	tt_int_op(st.n_fionread, <, 1 + 20);
+	tt_int_op(st.n_reads, ==, 6 + 20);
+
+	/* The guess never goes past the read limit. */
+	evbuffer_set_max_read(buf, 512);
+	evbuffer_get_read_stats(buf, &st);
+	tt_int_op(st.read_size, ==, 512);
+
+end:
+	if (buf)
+		evbuffer_free(buf);
+}
+
+/* Check that the byte at each of a few random positions in buf is the
+ * stream byte 'origin' + position, seeking there from scratch and from
+ * the previous position. */
+static int
+check_seeks(struct evbuffer *buf, size_t origin,
+    struct evutil_weakrand_state *seed)
+{
+	struct evbuffer_ptr ptr, ptr2;
+	size_t len = evbuffer_get_length(buf), p, q;
+	char c;
+	int i;
+
+	if (!len)
+		return 0;
+	memset(&ptr2, 0, sizeof(ptr2));
+	evbuffer_ptr_set(buf, &ptr2, 0, EVBUFFER_PTR_SET);
+	for (i = 0; i < 50; ++i) {
+		p = evutil_weakrand_range_(seed, (ev_int32_t)len);
+		if (evbuffer_ptr_set(buf, &ptr, p, EVBUFFER_PTR_SET) < 0 ||
+		    evbuffer_copyout_from(buf, &ptr, &c, 1) != 1 ||
+		    (unsigned char)c != (origin + p) % 251)
+			return -1;
+		q = (size_t)ptr2.pos;
+		if (p >= q) {
+			if (evbuffer_ptr_set(buf, &ptr2, p - q,
+				EVBUFFER_PTR_ADD) < 0 ||
+			    ptr2.internal_.chain != ptr.internal_.chain ||
+			    ptr2.internal_.pos_in_chain !=
+			    ptr.internal_.pos_in_chain)
+				return -1;
+		}
+	}
+	/* The end of the buffer is still right past the last byte. */
+	if (evbuffer_ptr_set(buf, &ptr, len, EVBUFFER_PTR_SET) < 0 ||
+	    ptr.internal_.chain != NULL ||
+	    evbuffer_ptr_set(buf, &ptr, len + 1, EVBUFFER_PTR_SET) == 0)
+		return -1;
+	return 0;
+}
+
+static void
+test_evbuffer_index(void *ptr)
+{
+	static unsigned char pattern[251 + 8192];
+	struct evutil_weakrand_state seed = { 4242U };
+	struct evbuffer *buf = NULL, *tmp = NULL;
+	/* The buffer holds stream bytes origin .. end-1; stream byte i is
+	 * i % 251.  Start high so that we can prepend. */
+	size_t origin = 1 << 20, end = origin, n;
+	int i, round;
+
+	for (i = 0; i < (int)sizeof(pattern); ++i)
+		pattern[i] = i % 251;
+	buf = evbuffer_new();
+	tmp = evbuffer_new();
+	tt_assert(buf);
+	tt_assert(tmp);
+
+	/* Lots of small chains get the buffer an index. */
+	for (i = 0; i < 1000; ++i) {
+		n = 1 + evutil_weakrand_range_(&seed, 300);
+		evbuffer_add_reference(buf, pattern + end % 251, n, NULL, NULL);
+		end += n;
+	}
+	tt_assert(!check_seeks(buf, origin, &seed));
+	tt_assert(buf->index);
+	tt_assert(buf->index->n > 100);
+
+	for (round = 0; round < 400; ++round) {
+		n = 1 + evutil_weakrand_range_(&seed, 2000);
+		switch (evutil_weakrand_range_(&seed, 8)) {
+		case 0:
+			/* copied data, which may land in an existing chain */
+			evbuffer_add(buf, pattern + end % 251, n);
+			end += n;
+			break;
+		case 1:
+			evbuffer_add_reference(buf, pattern + end % 251,
+			    n % 300 + 1, NULL, NULL);
+			end += n % 300 + 1;
+			break;
+		case 2:
+			if (n > end - origin)
+				n = end - origin;
+			evbuffer_drain(buf, n);
+			origin += n;
+			break;
+		case 3:
+			n = evbuffer_remove_buffer(buf, tmp, n);
+			evbuffer_drain(tmp, n);
+			origin += n;
+			break;
+		case 4:
+			n %= 100;
+			evbuffer_prepend(buf, pattern + (origin - n) % 251, n);
+			origin -= n;
+			break;
+		case 5:
+			evbuffer_pullup(buf, n % 5000);
+			break;
+		case 6:
+			evbuffer_add_reference(tmp, pattern + (origin - n) % 251,
+			    n, NULL, NULL);
+			evbuffer_prepend_buffer(buf, tmp);
+			origin -= n;
+			break;
+		default:
+			break;
+		}
+		tt_int_op(evbuffer_get_length(buf), ==, end - origin);
+		tt_assert(!check_seeks(buf, origin, &seed));
+	}
+
+	/* Emptying the buffer empties the index. */
+	evbuffer_drain(buf, evbuffer_get_length(buf));
+	if (buf->index)
+		tt_int_op(buf->index->n, ==, 0);
+
+end:
+	if (buf)
+		evbuffer_free(buf);
+	if (tmp)
+		evbuffer_free(tmp);
+}
+
+static int
+count_chains(struct evbuffer *buf)
+{
+	struct evbuffer_chain *chain;
+	int n = 0;
+
+	for (chain = buf->first; chain; chain = chain->next)
+		++n;
+	return n;
+}
+
+static void
+test_evbuffer_compact(void *ptr)
+{
+	struct basic_test_data *data = ptr;
+	struct evbuffer *buf = NULL, *tmp = NULL;
+	struct bufferevent *bev;
+	struct evbuffer_compact_stats st;
+	struct timeval tv = { 0, 10000 };
+	struct evbuffer_iovec vec;
+	char expect[1000], got[1000];
+	static char big[EVBUFFER_COMPACT_MAX_MERGE];
+	unsigned char *p;
+	size_t len;
+	int i;
+
+	for (i = 0; i < (int)sizeof(expect); ++i)
+		expect[i] = (char)i;
+	buf = evbuffer_new();
+	tmp = evbuffer_new();
+	tt_assert(buf);
+	tt_assert(tmp);
+
+	/* Nothing to do. */
+	tt_int_op(evbuffer_compact(buf, 65536), ==, 0);
+
+	/* Empty chains at the end go. */
+	evbuffer_expand(buf, 8192);
+	tt_int_op(count_chains(buf), ==, 1);
+	tt_int_op(evbuffer_compact(buf, 0), >=, 8192);
+	tt_int_op(count_chains(buf), ==, 0);
+	tt_assert(buf->last == NULL);
+
+	/* Many small chains become one, even with no budget for the one in
+	 * the middle that we can't move. */
+	for (i = 0; i < 50; ++i) {
+		evbuffer_add(tmp, expect + i * 10, 10);
+		evbuffer_add_buffer(buf, tmp);
+	}
+	evbuffer_add_reference(buf, expect + 500, 100, NULL, NULL);
+	for (i = 60; i < 100; ++i) {
+		evbuffer_add(tmp, expect + i * 10, 10);
+		evbuffer_add_buffer(buf, tmp);
+	}
+	tt_int_op(count_chains(buf), ==, 91);
+	tt_int_op(evbuffer_compact(buf, 499), ==, 0);
+	tt_int_op(evbuffer_compact(buf, 500), >, 0);
+	tt_int_op(count_chains(buf), ==, 42);
+	tt_int_op(evbuffer_compact(buf, 65536), >, 0);
+	tt_int_op(count_chains(buf), ==, 3);
+	tt_int_op(evbuffer_get_length(buf), ==, 1000);
+	tt_int_op(evbuffer_copyout(buf, got, 1000), ==, 1000);
+	tt_assert(!memcmp(got, expect, 1000));
+	evbuffer_get_compact_stats(buf, &st);
+	tt_int_op(st.n_compactions, ==, 3);
+	tt_int_op(st.n_bytes_copied, ==, 900);
+	tt_int_op(st.n_bytes_reclaimed, >, 80 * MIN_BUFFER_SIZE);
+
+	/* Appending still works. */
+	evbuffer_add(buf, "x", 1);
+	tt_int_op(evbuffer_get_length(buf), ==, 1001);
+	tt_assert(*buf->last_with_datap == buf->last);
+	evbuffer_drain(buf, 1001);
+
+	/* A run that ends right before a last chain that can't be merged,
+	 * because it isn't ours or because it's too big: what's added after
+	 * compacting still goes after that chain. */
+	memset(big, 'R', sizeof(big));
+	for (i = 0; i < 2; ++i) {
+		evbuffer_add(tmp, expect, 10);
+		evbuffer_add_buffer(buf, tmp);
+		evbuffer_add(tmp, expect + 10, 10);
+		evbuffer_add_buffer(buf, tmp);
+		if (i)
+			evbuffer_add(tmp, big, sizeof(big));
+		else
+			evbuffer_add_reference(tmp, big, 4, NULL, NULL);
+		evbuffer_add_buffer(buf, tmp);
+		len = evbuffer_get_length(buf);
+		tt_int_op(evbuffer_compact(buf, 65536), >, 0);
+		tt_int_op(count_chains(buf), ==, 2);
+		tt_int_op(evbuffer_reserve_space(buf, 4, &vec, 1), ==, 1);
+		memcpy(vec.iov_base, "CCCC", 4);
+		vec.iov_len = 4;
+		tt_int_op(evbuffer_commit_space(buf, &vec, 1), ==, 0);
+		evbuffer_validate(buf);
+		p = evbuffer_pullup(buf, -1);
+		tt_assert(!memcmp(p, expect, 20));
+		tt_assert(!memcmp(p + len - 4, "RRRRCCCC", 8));
+		evbuffer_drain(buf, len + 4);
+	}
+
+	/* A few bytes in a big chain move to a small one. */
+	evbuffer_expand(buf, 65536);
+	evbuffer_add(buf, "hello", 5);
+	evbuffer_drain(buf, 1);
+	tt_int_op(evbuffer_compact(buf, 65536), >=, 65536 - MIN_BUFFER_SIZE);
+	tt_int_op(count_chains(buf), ==, 1);
+	tt_int_op(buf->first->buffer_len, <, MIN_BUFFER_SIZE);
+	tt_int_op(evbuffer_remove(buf, got, sizeof(got)), ==, 4);
+	tt_assert(!memcmp(got, "ello", 4));
+
+	/* From the event loop, once the buffer goes idle. */
+	tt_int_op(evbuffer_set_compaction(buf, data->base, &tv), ==, 0);
+	evbuffer_expand(buf, 65536);
+	evbuffer_add(buf, "hello", 5);
+	tv.tv_usec = 100000;
+	event_base_loopexit(data->base, &tv);
+	event_base_dispatch(data->base);
+	tt_int_op(count_chains(buf), ==, 1);
+	tt_int_op(buf->first->buffer_len, <, MIN_BUFFER_SIZE);
+	evbuffer_get_compact_stats(buf, &st);
+	tt_int_op(st.n_compactions, ==, 7);
+	tt_assert(!buf->compactor->armed);
+
+	/* Freeing a buffer while it waits to go idle drops it right away. */
+	evbuffer_add(buf, "!", 1);
+	tt_assert(buf->compactor->armed);
+	tt_int_op(buf->refcnt, ==, 2);
+	evbuffer_free(buf);
+	buf = NULL;
+	event_base_loop(data->base, EVLOOP_NONBLOCK);
+
+	/* A socket bufferevent keeps its input's back and its output's front
+	 * frozen, even while idle; everything but the frozen chains still
+	 * gets compacted. */
+	bev = bufferevent_socket_new(data->base, -1, 0);
+	tt_assert(bev);
+	for (i = 0; i < 50; ++i) {
+		evbuffer_add(tmp, expect + i * 10, 10);
+		evbuffer_add_buffer(bufferevent_get_output(bev), tmp);
+	}
+	evbuffer_unfreeze(bufferevent_get_input(bev), 0);
+	for (i = 50; i < 100; ++i) {
+		evbuffer_add(tmp, expect + i * 10, 10);
+		evbuffer_add_buffer(bufferevent_get_input(bev), tmp);
+	}
+	evbuffer_expand(bufferevent_get_input(bev), 8192);
+	evbuffer_freeze(bufferevent_get_input(bev), 0);
+	tt_int_op(evbuffer_compact(bufferevent_get_output(bev), 65536), >, 0);
+	tt_int_op(evbuffer_compact(bufferevent_get_input(bev), 65536), >, 0);
+	tt_int_op(count_chains(bufferevent_get_output(bev)), ==, 2);
+	tt_int_op(count_chains(bufferevent_get_input(bev)), ==, 2);
+	evbuffer_unfreeze(bufferevent_get_output(bev), 1);
+	tt_int_op(evbuffer_copyout(bufferevent_get_output(bev), got, 500), ==,
+	    500);
+	tt_int_op(evbuffer_copyout(bufferevent_get_input(bev), got + 500, 500),
+	    ==, 500);
+	tt_assert(!memcmp(got, expect, 1000));
+	bufferevent_free(bev);
+
+	/* Freeing a bufferevent drops it right away, too. */
+	bev = bufferevent_socket_new(data->base, -1, 0);
+	tt_assert(bev);
+	tt_int_op(evbuffer_set_compaction(bufferevent_get_output(bev),
+		data->base, NULL), ==, 0);
+	tt_int_op(BEV_UPCAST(bev)->refcnt, ==, 2);
+	bufferevent_free(bev);
+	event_base_loop(data->base, EVLOOP_NONBLOCK);
+
+end:
+	if (buf)
+		evbuffer_free(buf);
+	if (tmp)
+		evbuffer_free(tmp);
+}
+
+static void
+test_evbuffer_chain_pool(void *ptr)
+{
+	struct basic_test_data *data = ptr;
+	struct event_base *base = NULL;
+	struct evbuffer *buf = NULL, *other = NULL;
+	struct bufferevent *bev = NULL;
+	struct evbuffer_chain_pool_stats st;
+	static char expect[65536], got[65536];
+	size_t mapped;
+	int i;
+
+	base = event_base_new();
+	tt_assert(base);
+	if (evbuffer_base_set_chain_pool(base, 0, (size_t)4 << 20,
+		EVBUFFER_POOL_HUGEPAGES|EVBUFFER_POOL_LOCAL_NODE) < 0)
+		tt_skip();
+	/* Only one pool per base. */
+	tt_int_op(evbuffer_base_set_chain_pool(base, 0, 0, 0), ==, -1);
+
+	buf = evbuffer_new();
+	other = evbuffer_new();
+	tt_assert(buf);
+	tt_assert(other);
+	/* The test's own base has no pool. */
+	tt_int_op(evbuffer_set_chain_pool(other, data->base), ==, -1);
+	tt_int_op(evbuffer_set_chain_pool(buf, base), ==, 0);
+
+	/* Small chains still come from the heap. */
+	evbuffer_add(buf, "small", 5);
+	tt_assert(!(buf->first->flags & EVBUFFER_POOLED));
+	evbuffer_base_get_chain_pool_stats(base, &st);
+	tt_int_op(st.n_allocs, ==, 0);
+	tt_int_op(st.bytes_mapped, ==, 0);
+	evbuffer_drain(buf, 5);
+
+	/* Big ones come from the pool, until it hits its limit. */
+	for (i = 0; i < 64; ++i) {
+		memset(expect, 'a' + i % 26, sizeof(expect));
+		tt_int_op(evbuffer_add(buf, expect, sizeof(expect)), ==, 0);
+	}
+	tt_assert(buf->first->flags & EVBUFFER_POOLED);
+	evbuffer_base_get_chain_pool_stats(base, &st);
+	tt_int_op(st.n_allocs, >, 0);
+	tt_int_op(st.n_fallbacks, >, 0);
+	tt_int_op(st.bytes_mapped, <=, (size_t)4 << 20);
+	tt_int_op(st.bytes_hugetlb, <=, st.bytes_mapped);
+	tt_int_op(st.bytes_in_use, >, 0);
+	tt_int_op(st.bytes_in_use, <=, st.bytes_mapped);
+	mapped = st.bytes_mapped;
+	for (i = 0; i < 64; ++i) {
+		memset(expect, 'a' + i % 26, sizeof(expect));
+		tt_int_op(evbuffer_remove(buf, got, sizeof(got)), ==,
+		    sizeof(got));
+		tt_assert(!memcmp(got, expect, sizeof(got)));
+	}
+	tt_int_op(evbuffer_get_length(buf), ==, 0);
+
+	/* Freed chains go back to the pool, and get used again. */
+	evbuffer_free(buf);
+	buf = NULL;
+	evbuffer_base_get_chain_pool_stats(base, &st);
+	tt_int_op(st.bytes_in_use, ==, 0);
+	tt_int_op(evbuffer_set_chain_pool(other, base), ==, 0);
+	evbuffer_add(other, expect, sizeof(expect));
+	tt_assert(other->first->flags & EVBUFFER_POOLED);
+	evbuffer_base_get_chain_pool_stats(base, &st);
+	tt_int_op(st.bytes_mapped, ==, mapped);
+	tt_int_op(st.bytes_in_use, >, 0);
+
+	/* Bufferevents on the base use its pool. */
+	bev = bufferevent_socket_new(base, -1, 0);
+	tt_assert(bev);
+	tt_assert(bufferevent_get_input(bev)->pool == other->pool);
+	tt_assert(bufferevent_get_output(bev)->pool == other->pool);
+	bufferevent_free(bev);
+	bev = NULL;
+
+	/* Chains outlive the base they came from. */
+	event_base_free(base);
+	base = NULL;
+	tt_int_op(evbuffer_remove(other, got, sizeof(got)), ==, sizeof(got));
+	tt_assert(!memcmp(got, expect, sizeof(got)));
+	evbuffer_add(other, expect, sizeof(expect));
+	tt_int_op(evbuffer_set_chain_pool(other, NULL), ==, 0);
+	tt_assert(other->pool == NULL);
+
+end:
+	if (bev)
+		bufferevent_free(bev);
+	if (buf)
+		evbuffer_free(buf);
+	if (other)
+		evbuffer_free(other);
+	if (base)
+		event_base_free(base);
+}
+
 struct testcase_t evbuffer_testcases[] = {
 	{ "evbuffer", test_evbuffer, 0, NULL, NULL },
 	{ "remove_buffer_with_empty", test_evbuffer_remove_buffer_with_empty, 0, NULL, NULL },
@@ -2836,6 +3492,7 @@ struct testcase_t evbuffer_testcases[] = {
 	{ "add_reference", test_evbuffer_add_reference, 0, NULL, NULL },
 	{ "multicast", test_evbuffer_multicast, 0, NULL, NULL },
 	{ "multicast_drain", test_evbuffer_multicast_drain, 0, NULL, NULL },
+	{ "shared", test_evbuffer_shared, TT_NEED_SOCKETPAIR, &basic_setup, NULL },
 	{ "prepend", test_evbuffer_prepend, TT_FORK, NULL, NULL },
 	{ "empty_reference_prepend", test_evbuffer_empty_reference_prepend, TT_FORK, NULL, NULL },
 	{ "empty_reference_prepend_buffer", test_evbuffer_empty_reference_prepend_buffer, TT_FORK, NULL, NULL },
@@ -2845,8 +3502,13 @@ struct testcase_t evbuffer_testcases[] = {
 	{ "freeze_end", test_evbuffer_freeze, TT_NEED_SOCKETPAIR, &basic_setup, (void*)"end" },
 	{ "add_iovec", test_evbuffer_add_iovec, 0, NULL, NULL},
 	{ "copyout", test_evbuffer_copyout, 0, NULL, NULL},
+	{ "add_int", test_evbuffer_add_int, 0, NULL, NULL },
 	{ "file_segment_add_cleanup_cb", test_evbuffer_file_segment_add_cleanup_cb, 0, NULL, NULL },
 	{ "pullup_with_empty", test_evbuffer_pullup_with_empty, 0, NULL, NULL },
+	{ "read_adaptive", test_evbuffer_read_adaptive, TT_NEED_SOCKETPAIR, &basic_setup, NULL },
+	{ "index", test_evbuffer_index, 0, NULL, NULL },
+	{ "compact", test_evbuffer_compact, TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "chain_pool", test_evbuffer_chain_pool, TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
 
 #define ADDFILE_TEST(name, parameters)					\
 	{ name, test_evbuffer_add_file, TT_FORK|TT_NEED_BASE,		\
@@ -61,6 +61,9 @@
 #ifdef EVENT__HAVE_ARPA_INET_H
 #include <arpa/inet.h>
 #endif
+#ifdef EVENT__HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
 
 #include "event2/event-config.h"
 #include "event2/event.h"
@@ -68,6 +71,7 @@
 #include "event2/event_compat.h"
 #include "event2/tag.h"
 #include "event2/buffer.h"
+#include "event2/buffer_compat.h"
 #include "event2/bufferevent.h"
 #include "event2/bufferevent_compat.h"
 #include "event2/bufferevent_struct.h"
@@ -75,6 +79,8 @@
 #include "event2/util.h"
 
 #include "bufferevent-internal.h"
+#include "event-internal.h"
+#include "evbuffer-internal.h"
 #include "evthread-internal.h"
 #include "util-internal.h"
 #ifdef _WIN32
@@ -83,6 +89,7 @@
 
 #include "regress.h"
 #include "regress_testutils.h"
+#include "regress_thread.h"
 
 /*
  * simple bufferevent test
@@ -1384,6 +1391,887 @@ end:;
 	bufferevent_free(bev);
 }
 
+#define FORWARD_TOTAL (1024*1024)
+
+struct forward_test {
+	struct event_base *base;
+	evutil_socket_t writer, reader;
+	struct event *write_ev, *read_ev;
+	size_t sent, received;
+	size_t copied;
+	int eof;
+	int corrupt;
+};
+
+static ev_uint8_t
+forward_test_byte(size_t i)
+{
+	return (ev_uint8_t)(i * 7 + i / 251);
+}
+
+static void
+forward_test_writecb(evutil_socket_t fd, short what, void *arg)
+{
+	struct forward_test *t = arg;
+	ev_uint8_t buf[4096];
+	size_t i, len = FORWARD_TOTAL - t->sent;
+	ev_ssize_t n;
+
+	if (len > sizeof(buf))
+		len = sizeof(buf);
+	for (i = 0; i < len; ++i)
+		buf[i] = forward_test_byte(t->sent + i);
+	n = send(fd, (void *)buf, len, 0);
+	if (n > 0)
+		t->sent += n;
+	if (t->sent == FORWARD_TOTAL) {
+		event_del(t->write_ev);
+		shutdown(fd, EVUTIL_SHUT_WR);
+	}
+}
+
+static void
+forward_test_readcb(evutil_socket_t fd, short what, void *arg)
+{
+	struct forward_test *t = arg;
+	ev_uint8_t buf[4096];
+	ev_ssize_t i, n;
+
+	n = recv(fd, (void *)buf, sizeof(buf), 0);
+	for (i = 0; i < n; ++i) {
+		if (buf[i] != forward_test_byte(t->received + i))
+			t->corrupt = 1;
+	}
+	if (n > 0)
+		t->received += n;
+	if (t->received == FORWARD_TOTAL && t->eof)
+		event_base_loopexit(t->base, NULL);
+}
+
+static void
+forward_test_eventcb(struct bufferevent *bev, short what, void *arg)
+{
+	struct forward_test *t = arg;
+
+	if (what & BEV_EVENT_EOF)
+		t->eof = 1;
+	if (t->received == FORWARD_TOTAL && t->eof)
+		event_base_loopexit(t->base, NULL);
+}
+
+static void
+forward_test_outputcb(struct evbuffer *buf,
+    const struct evbuffer_cb_info *info, void *arg)
+{
+	struct forward_test *t = arg;
+	t->copied += info->n_added;
+}
+
+static void
+test_bufferevent_forward(void *arg)
+{
+	struct basic_test_data *data = arg;
+	int filter = data->setup_data && !strcmp(data->setup_data, "filter");
+	struct bufferevent *src = NULL, *dst = NULL, *other = NULL;
+	struct forward_test t;
+	evutil_socket_t pair[2] = { -1, -1 };
+
+	memset(&t, 0, sizeof(t));
+	t.base = data->base;
+	tt_assert(!evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, pair));
+	evutil_make_socket_nonblocking(pair[0]);
+	evutil_make_socket_nonblocking(pair[1]);
+	evutil_make_socket_nonblocking(data->pair[0]);
+
+	/* data->pair[0] -> src ... dst -> pair[1] */
+	src = bufferevent_socket_new(data->base, data->pair[1],
+	    BEV_OPT_CLOSE_ON_FREE);
+	dst = bufferevent_socket_new(data->base, pair[0],
+	    BEV_OPT_CLOSE_ON_FREE);
+	tt_assert(src && dst);
+	data->pair[1] = pair[0] = -1;
+	if (filter) {
+		src = bufferevent_filter_new(src, NULL, NULL,
+		    BEV_OPT_CLOSE_ON_FREE, NULL, NULL);
+		tt_assert(src);
+	}
+	bufferevent_setcb(src, NULL, NULL, forward_test_eventcb, &t);
+	bufferevent_setwatermark(dst, EV_WRITE, 0, 16384);
+	evbuffer_add_cb(bufferevent_get_output(dst), forward_test_outputcb,
+	    &t);
+
+	/* Some data that src has read already goes first. */
+	forward_test_writecb(data->pair[0], EV_WRITE, &t);
+	bufferevent_enable(src, EV_READ);
+	while (evbuffer_get_length(bufferevent_get_input(src)) < 4096)
+		event_base_loop(data->base, EVLOOP_ONCE);
+	tt_int_op(bufferevent_forward(src, dst), ==, 0);
+	/* Only one bufferevent can forward to dst. */
+	other = bufferevent_socket_new(data->base, -1, 0);
+	tt_assert(other);
+	tt_int_op(bufferevent_forward(other, dst), ==, -1);
+	tt_int_op(bufferevent_forward(other, src), ==, 0);
+	bufferevent_free(other);
+	other = NULL;
+	bufferevent_enable(dst, EV_WRITE);
+
+	t.write_ev = event_new(data->base, data->pair[0], EV_WRITE|EV_PERSIST,
+	    forward_test_writecb, &t);
+	t.read_ev = event_new(data->base, pair[1], EV_READ|EV_PERSIST,
+	    forward_test_readcb, &t);
+	event_add(t.write_ev, NULL);
+	event_add(t.read_ev, NULL);
+	event_base_dispatch(data->base);
+
+	tt_int_op(t.received, ==, FORWARD_TOTAL);
+	tt_assert(t.eof);
+	tt_assert(!t.corrupt);
+	tt_int_op(evbuffer_get_length(bufferevent_get_input(src)), ==, 0);
+#ifdef EVENT__HAVE_SPLICE
+	if (!filter) {
+		/* Apart from what was in src's buffer already, and what the
+		 * pipe held at EOF, nothing went through dst's buffer. */
+		tt_int_op(t.copied, <=, 4096 + 16384);
+		/* The forward ended at EOF. */
+		other = bufferevent_socket_new(data->base, -1, 0);
+		tt_assert(other);
+		tt_int_op(bufferevent_forward(other, dst), ==, 0);
+	} else
+#endif
+	{
+		tt_int_op(t.copied, >=, FORWARD_TOTAL);
+	}
+
+end:
+	if (t.write_ev)
+		event_free(t.write_ev);
+	if (t.read_ev)
+		event_free(t.read_ev);
+	if (other)
+		bufferevent_free(other);
+	if (src)
+		bufferevent_free(src);
+	if (dst)
+		bufferevent_free(dst);
+	if (pair[0] >= 0)
+		evutil_closesocket(pair[0]);
+	if (pair[1] >= 0)
+		evutil_closesocket(pair[1]);
+}
+
+static void
+forward_pipe_full_tick_cb(evutil_socket_t fd, short what, void *arg)
+{
+}
+
+static void
+test_bufferevent_forward_pipe_full(void *arg)
+{
+#ifdef EVENT__HAVE_SPLICE
+	struct basic_test_data *data = arg;
+	struct bufferevent *src = NULL, *dst = NULL;
+	struct event *tick = NULL;
+	evutil_socket_t pair[2] = { -1, -1 };
+	struct timeval tv = { 0, 10000 }, start, now;
+	size_t filled = 0, received = 0;
+	int i, iterations = 0;
+	char buf[4096];
+	ev_ssize_t n;
+
+	tt_assert(!evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, pair));
+	evutil_make_socket_nonblocking(pair[0]);
+	evutil_make_socket_nonblocking(pair[1]);
+	evutil_make_socket_nonblocking(data->pair[0]);
+
+	/* data->pair[0] -> src ... dst -> pair[1], which nobody reads
+	 * for now. */
+	memset(buf, 'x', sizeof(buf));
+	while ((n = send(pair[0], buf, sizeof(buf), 0)) > 0)
+		filled += n;
+	src = bufferevent_socket_new(data->base, data->pair[1],
+	    BEV_OPT_CLOSE_ON_FREE);
+	dst = bufferevent_socket_new(data->base, pair[0],
+	    BEV_OPT_CLOSE_ON_FREE);
+	tt_assert(src && dst);
+	data->pair[1] = pair[0] = -1;
+	tt_int_op(bufferevent_forward(src, dst), ==, 0);
+	bufferevent_enable(src, EV_READ);
+	bufferevent_enable(dst, EV_WRITE);
+
+	/* One pipe buffer per write: the pipe fills up long before it
+	 * holds pipe_size bytes. */
+	for (i = 0; i < 64; ++i)
+		tt_int_op(send(data->pair[0], "y", 1, 0), ==, 1);
+
+	/* While dst can't write, src must not keep the loop busy. */
+	tick = event_new(data->base, -1, EV_PERSIST,
+	    forward_pipe_full_tick_cb, NULL);
+	event_add(tick, &tv);
+	evutil_gettimeofday(&start, NULL);
+	do {
+		event_base_loop(data->base, EVLOOP_ONCE);
+		++iterations;
+		evutil_gettimeofday(&now, NULL);
+		evutil_timersub(&now, &start, &now);
+	} while (now.tv_sec == 0 && now.tv_usec < 200000);
+	tt_int_op(iterations, <, 100);
+
+	/* And everything gets through once dst can write again. */
+	while (received < filled + 64 && now.tv_sec < 5) {
+		while ((n = recv(pair[1], buf, sizeof(buf), 0)) > 0)
+			received += n;
+		event_base_loop(data->base, EVLOOP_ONCE);
+		evutil_gettimeofday(&now, NULL);
+		evutil_timersub(&now, &start, &now);
+	}
+	tt_int_op(received, ==, filled + 64);
+
+end:
+	if (tick)
+		event_free(tick);
+	if (src)
+		bufferevent_free(src);
+	if (dst)
+		bufferevent_free(dst);
+	if (pair[0] >= 0)
+		evutil_closesocket(pair[0]);
+	if (pair[1] >= 0)
+		evutil_closesocket(pair[1]);
+#else
+	tt_skip();
+end:
+	;
+#endif
+}
+
+#define ZEROCOPY_TOTAL (4*1024*1024)
+#define ZEROCOPY_CHUNK (256*1024)
+
+struct zerocopy_test {
+	struct event_base *base;
+	size_t sent, received;
+	ev_uint32_t n_sends;
+	int n_pending;
+	int failed;
+	int corrupt;
+};
+
+static void
+zerocopy_test_writecb(struct bufferevent *bev, void *arg)
+{
+	struct zerocopy_test *t = arg;
+	struct bufferevent_zerocopy *zc = BEV_UPCAST(bev)->zerocopy;
+	ev_uint8_t *chunk;
+	size_t i;
+
+	if (t->sent == ZEROCOPY_TOTAL) {
+		/* The kernel is probably not done with the last send; the
+		 * bufferevent has to keep its memory around. */
+		t->n_sends = zc->next_id;
+		t->n_pending = zc->n_pending;
+		t->failed = zc->failed;
+		bufferevent_free(bev);
+		return;
+	}
+
+	chunk = malloc(ZEROCOPY_CHUNK);
+	for (i = 0; i < ZEROCOPY_CHUNK; ++i)
+		chunk[i] = forward_test_byte(t->sent + i);
+	evbuffer_add(bufferevent_get_output(bev), chunk, ZEROCOPY_CHUNK);
+	t->sent += ZEROCOPY_CHUNK;
+	free(chunk);
+}
+
+static void
+zerocopy_test_readcb(struct bufferevent *bev, void *arg)
+{
+	struct zerocopy_test *t = arg;
+	struct evbuffer *input = bufferevent_get_input(bev);
+	ev_uint8_t buf[4096];
+	int i, n;
+
+	while ((n = evbuffer_remove(input, buf, sizeof(buf))) > 0) {
+		for (i = 0; i < n; ++i) {
+			if (buf[i] != forward_test_byte(t->received + i))
+				t->corrupt = 1;
+		}
+		t->received += n;
+	}
+	if (t->received == ZEROCOPY_TOTAL)
+		event_base_loopexit(t->base, NULL);
+}
+
+static void
+test_bufferevent_zerocopy(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct bufferevent *out = NULL, *in = NULL;
+	struct zerocopy_test t;
+	evutil_socket_t pair[2] = { -1, -1 };
+
+	memset(&t, 0, sizeof(t));
+	t.base = data->base;
+	tt_assert(!evutil_ersatz_socketpair_(AF_INET, SOCK_STREAM, 0, pair));
+	evutil_make_socket_nonblocking(pair[0]);
+	evutil_make_socket_nonblocking(pair[1]);
+
+	out = bufferevent_socket_new(data->base, pair[0],
+	    BEV_OPT_CLOSE_ON_FREE);
+	in = bufferevent_socket_new(data->base, pair[1],
+	    BEV_OPT_CLOSE_ON_FREE);
+	tt_assert(out && in);
+	pair[0] = pair[1] = -1;
+	if (bufferevent_socket_set_zerocopy(out, 65536) < 0) {
+		bufferevent_free(out);
+		out = NULL;
+		tt_skip();
+	}
+	bufferevent_set_max_single_write(out, ZEROCOPY_CHUNK);
+	bufferevent_setcb(out, NULL, zerocopy_test_writecb, NULL, &t);
+	bufferevent_setcb(in, zerocopy_test_readcb, NULL, NULL, &t);
+	bufferevent_enable(in, EV_READ);
+	zerocopy_test_writecb(out, &t);
+	out = NULL;
+
+	event_base_dispatch(data->base);
+	tt_int_op(t.received, ==, ZEROCOPY_TOTAL);
+	tt_assert(!t.corrupt);
+	if (t.failed)
+		tt_skip();
+	/* Every send was big enough to go out without copying, and we heard
+	 * back about most of them before we were done. */
+	tt_int_op(t.n_sends, >=, ZEROCOPY_TOTAL / ZEROCOPY_CHUNK);
+	tt_int_op(t.n_pending, <, (int)t.n_sends);
+
+	/* Now only the freed bufferevent's leftovers are waiting, until the
+	 * kernel says it's done with them. */
+	bufferevent_free(in);
+	in = NULL;
+	if (data->setup_data && !strcmp(data->setup_data, "free_base")) {
+		/* ... or until the base goes away, which has to clean up
+		 * after them. */
+		event_base_free(data->base);
+		data->base = NULL;
+	} else {
+		event_base_dispatch(data->base);
+	}
+
+end:
+	if (out)
+		bufferevent_free(out);
+	if (in)
+		bufferevent_free(in);
+	if (pair[0] >= 0)
+		evutil_closesocket(pair[0]);
+	if (pair[1] >= 0)
+		evutil_closesocket(pair[1]);
+}
+
+#define MEM_TEST_N 4
+#define MEM_TEST_BYTES 98304
+#define MEM_TEST_SOFT 131072
+#define MEM_TEST_HARD 196608
+
+struct mem_test {
+	struct event_base *base;
+	int levels_seen;
+	int level;
+	size_t total_at_hard;
+	size_t received;
+	size_t sent;
+};
+
+static void
+mem_test_cb(struct event_base *base, int level, size_t total, void *arg)
+{
+	struct mem_test *t = arg;
+
+	t->levels_seen |= 1 << level;
+	t->level = level;
+	if (level == BEV_MEM_HARD)
+		t->total_at_hard = total;
+}
+
+static void
+mem_test_drain_readcb(struct bufferevent *bev, void *arg)
+{
+	struct mem_test *t = arg;
+	struct evbuffer *input = bufferevent_get_input(bev);
+
+	t->received += evbuffer_get_length(input);
+	evbuffer_drain(input, evbuffer_get_length(input));
+	if (t->received == t->sent)
+		event_base_loopexit(t->base, NULL);
+}
+
+static void
+test_bufferevent_mem_limits(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct bufferevent *readers[MEM_TEST_N], *top[MEM_TEST_N], *biggest;
+	evutil_socket_t writers[MEM_TEST_N];
+	size_t bytes[MEM_TEST_N], sum;
+	struct timeval tv = { 0, 200000 };
+	struct mem_test t;
+	char chunk[4096];
+	int i, n, n_suspended;
+
+	memset(&t, 0, sizeof(t));
+	memset(readers, 0, sizeof(readers));
+	memset(chunk, 'm', sizeof(chunk));
+	for (i = 0; i < MEM_TEST_N; ++i)
+		writers[i] = -1;
+	t.base = data->base;
+
+	tt_int_op(bufferevent_base_get_mem(data->base), ==, 0);
+	tt_int_op(bufferevent_base_set_mem_limits(data->base,
+		    MEM_TEST_HARD, MEM_TEST_SOFT, NULL, NULL), ==, -1);
+	tt_int_op(bufferevent_base_set_mem_limits(data->base,
+		    MEM_TEST_SOFT, MEM_TEST_HARD, mem_test_cb, &t), ==, 0);
+
+	/* Each slow reader has a bunch of data waiting in its socket, and
+	 * never takes anything out of its input buffer. */
+	for (i = 0; i < MEM_TEST_N; ++i) {
+		evutil_socket_t pair[2];
+		size_t queued = 0;
+
+		tt_assert(!evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, pair));
+		evutil_make_socket_nonblocking(pair[0]);
+		evutil_make_socket_nonblocking(pair[1]);
+		writers[i] = pair[0];
+		readers[i] = bufferevent_socket_new(data->base, pair[1],
+		    BEV_OPT_CLOSE_ON_FREE);
+		tt_assert(readers[i]);
+		while (queued < MEM_TEST_BYTES) {
+			n = send(pair[0], chunk, sizeof(chunk), 0);
+			if (n <= 0)
+				break;
+			queued += n;
+		}
+		t.sent += queued;
+		bufferevent_enable(readers[i], EV_READ);
+	}
+	tt_int_op(t.sent, >, MEM_TEST_HARD + MEM_TEST_SOFT);
+
+	event_base_loopexit(data->base, &tv);
+	event_base_dispatch(data->base);
+
+	/* We went over both limits, and stopped the biggest readers before
+	 * they read everything. */
+	tt_int_op(t.levels_seen, ==, (1 << BEV_MEM_SOFT) | (1 << BEV_MEM_HARD));
+	tt_int_op(t.level, ==, BEV_MEM_HARD);
+	tt_int_op(t.total_at_hard, >, MEM_TEST_HARD);
+	tt_int_op(bufferevent_base_get_mem(data->base), <, t.sent);
+
+	sum = 0;
+	n_suspended = 0;
+	for (i = 0; i < MEM_TEST_N; ++i) {
+		sum += bufferevent_get_mem(readers[i]);
+		if (BEV_UPCAST(readers[i])->read_suspended & BEV_SUSPEND_MEM)
+			++n_suspended;
+	}
+	tt_int_op(bufferevent_base_get_mem(data->base), ==, sum);
+	tt_int_op(n_suspended, >, 0);
+	tt_int_op(n_suspended, <, MEM_TEST_N);
+
+	n = bufferevent_base_get_top_mem(data->base, top, bytes, MEM_TEST_N);
+	tt_int_op(n, ==, MEM_TEST_N);
+	for (i = 0; i < n; ++i) {
+		tt_int_op(bytes[i], ==, bufferevent_get_mem(top[i]));
+		if (i)
+			tt_int_op(bytes[i - 1], >=, bytes[i]);
+	}
+	tt_int_op(evbuffer_get_mem_usage(bufferevent_get_input(top[0])), >=,
+	    bytes[0]);
+	biggest = top[0];
+	tt_int_op(bufferevent_base_get_top_mem(data->base, top, NULL, 1), ==, 1);
+	tt_ptr_op(top[0], ==, biggest);
+
+	/* Once the readers catch up, everyone gets to read again, and the
+	 * rest of the data comes through. */
+	for (i = 0; i < MEM_TEST_N; ++i) {
+		bufferevent_setcb(readers[i], mem_test_drain_readcb, NULL, NULL,
+		    &t);
+		mem_test_drain_readcb(readers[i], &t);
+	}
+	tv.tv_sec = 5;
+	event_base_loopexit(data->base, &tv);
+	event_base_dispatch(data->base);
+
+	tt_int_op(t.received, ==, t.sent);
+	tt_int_op(t.level, ==, BEV_MEM_OK);
+	tt_int_op(t.levels_seen, ==, 7);
+	tt_int_op(bufferevent_base_get_mem(data->base), ==, 0);
+	for (i = 0; i < MEM_TEST_N; ++i)
+		tt_assert(!(BEV_UPCAST(readers[i])->read_suspended &
+			BEV_SUSPEND_MEM));
+
+	/* Output that's waiting to be written doesn't get its bufferevent's
+	 * reading suspended; input does. */
+	bufferevent_disable(readers[2], EV_WRITE);
+	for (sum = 0; sum <= MEM_TEST_HARD; sum += sizeof(chunk))
+		evbuffer_add(bufferevent_get_output(readers[2]), chunk,
+		    sizeof(chunk));
+	bufferevent_setcb(readers[1], NULL, NULL, NULL, NULL);
+	tt_int_op(send(writers[1], chunk, sizeof(chunk), 0), ==, sizeof(chunk));
+	tv.tv_sec = 0;
+	event_base_loopexit(data->base, &tv);
+	event_base_dispatch(data->base);
+	tt_int_op(t.level, ==, BEV_MEM_HARD);
+	tt_assert(!(BEV_UPCAST(readers[2])->read_suspended & BEV_SUSPEND_MEM));
+	tt_assert(BEV_UPCAST(readers[1])->read_suspended & BEV_SUSPEND_MEM);
+	bufferevent_free(readers[2]);
+	readers[2] = NULL;
+	evbuffer_drain(bufferevent_get_input(readers[1]), sizeof(chunk));
+	event_base_loop(data->base, EVLOOP_NONBLOCK);
+	tt_int_op(t.level, ==, BEV_MEM_OK);
+	tt_assert(!(BEV_UPCAST(readers[1])->read_suspended & BEV_SUSPEND_MEM));
+
+	/* Freed bufferevents stop being accounted. */
+	evbuffer_add(bufferevent_get_output(readers[0]), chunk, sizeof(chunk));
+	tt_int_op(bufferevent_base_get_mem(data->base), ==, sizeof(chunk));
+	bufferevent_free(readers[0]);
+	readers[0] = NULL;
+	tt_int_op(bufferevent_base_get_mem(data->base), ==, 0);
+
+end:
+	for (i = 0; i < MEM_TEST_N; ++i) {
+		if (readers[i])
+			bufferevent_free(readers[i]);
+		if (writers[i] >= 0)
+			evutil_closesocket(writers[i]);
+	}
+}
+
+struct batch_test {
+	int n_writecbs;
+	size_t received;
+};
+
+static void
+batch_test_writecb(struct bufferevent *bev, void *arg)
+{
+	struct batch_test *t = arg;
+
+	++t->n_writecbs;
+}
+
+static void
+batch_test_readcb(evutil_socket_t fd, short what, void *arg)
+{
+	struct batch_test *t = arg;
+	char buf[65536];
+	ev_ssize_t n;
+
+	while ((n = recv(fd, buf, sizeof(buf), 0)) > 0)
+		t->received += n;
+}
+
+static void
+batch_test_addcb(evutil_socket_t fd, short what, void *arg)
+{
+	bufferevent_write(arg, "def", 3);
+}
+
+static void
+test_bufferevent_batch_writes(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct bufferevent *bev = NULL, *pair[2] = { NULL, NULL };
+	struct event *reader = NULL, *adder = NULL;
+	struct evbuffer *big = NULL;
+	struct batch_test t;
+	char buf[16], chunk[512];
+	size_t i;
+
+	memset(&t, 0, sizeof(t));
+	memset(chunk, 'x', sizeof(chunk));
+	tt_assert(!bufferevent_pair_new(data->base, 0, pair));
+	tt_int_op(bufferevent_socket_set_batch_writes(pair[0], 1), ==, -1);
+
+	bev = bufferevent_socket_new(data->base, data->pair[0], 0);
+	tt_assert(bev);
+	tt_int_op(bufferevent_socket_set_batch_writes(bev, 1), ==, 0);
+	bufferevent_setcb(bev, NULL, batch_test_writecb, NULL, &t);
+	adder = event_new(data->base, -1, 0, batch_test_addcb, bev);
+	tt_assert(adder);
+
+	/* A write from this iteration, and one from a callback that was
+	 * already due to run, go out together without ever watching for
+	 * writability. */
+	bufferevent_write(bev, "abc", 3);
+	tt_assert(bev->ev_write.ev_flags & EVLIST_ACTIVE_LATER);
+	tt_assert(!(bev->ev_write.ev_flags & EVLIST_INSERTED));
+	event_active(adder, EV_TIMEOUT, 1);
+	event_base_loop(data->base, EVLOOP_NONBLOCK);
+	tt_int_op(t.n_writecbs, ==, 1);
+	tt_assert(!(bev->ev_write.ev_flags &
+		(EVLIST_ACTIVE|EVLIST_ACTIVE_LATER|EVLIST_INSERTED)));
+	tt_int_op(evbuffer_get_length(bufferevent_get_output(bev)), ==, 0);
+	tt_int_op(recv(data->pair[1], buf, sizeof(buf), 0), ==, 6);
+	tt_mem_op(buf, ==, "abcdef", 6);
+
+	/* More than the socket can take falls back to waiting for it. */
+	big = evbuffer_new();
+	tt_assert(big);
+	for (i = 0; i < 4096; ++i)
+		evbuffer_add(big, chunk, sizeof(chunk));
+	bufferevent_write_buffer(bev, big);
+	event_base_loop(data->base, EVLOOP_NONBLOCK);
+	tt_assert(evbuffer_get_length(bufferevent_get_output(bev)));
+	tt_assert(bev->ev_write.ev_flags & EVLIST_INSERTED);
+
+	reader = event_new(data->base, data->pair[1], EV_READ|EV_PERSIST,
+	    batch_test_readcb, &t);
+	tt_assert(reader);
+	event_add(reader, NULL);
+	while (t.received < 4096 * sizeof(chunk))
+		event_base_loop(data->base, EVLOOP_ONCE);
+	tt_int_op(t.received, ==, 4096 * sizeof(chunk));
+	tt_int_op(evbuffer_get_length(bufferevent_get_output(bev)), ==, 0);
+	tt_assert(!(bev->ev_write.ev_flags & EVLIST_INSERTED));
+	tt_int_op(t.n_writecbs, >=, 2);
+
+	/* Enabling writes with nothing to write still runs the callback. */
+	t.n_writecbs = 0;
+	bufferevent_disable(bev, EV_WRITE);
+	bufferevent_enable(bev, EV_WRITE);
+	event_base_loop(data->base, EVLOOP_NONBLOCK);
+	event_base_loop(data->base, EVLOOP_NONBLOCK);
+	tt_int_op(t.n_writecbs, ==, 1);
+
+end:
+	if (reader)
+		event_free(reader);
+	if (adder)
+		event_free(adder);
+	if (big)
+		evbuffer_free(big);
+	if (bev)
+		bufferevent_free(bev);
+	if (pair[0])
+		bufferevent_free(pair[0]);
+	if (pair[1])
+		bufferevent_free(pair[1]);
+}
+
+static void
+test_bufferevent_batch_writes_ratelim(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct bufferevent *bev = NULL;
+	struct ev_token_bucket_cfg *cfg = NULL;
+	struct event *reader = NULL;
+	struct timeval tick = { 0, 100*1000 };
+	struct batch_test t;
+	char chunk[4096];
+
+	memset(&t, 0, sizeof(t));
+	memset(chunk, 'x', sizeof(chunk));
+	cfg = ev_token_bucket_cfg_new(EV_RATE_LIMIT_MAX, EV_RATE_LIMIT_MAX,
+	    1024, 1024, &tick);
+	tt_assert(cfg);
+	bev = bufferevent_socket_new(data->base, data->pair[0], 0);
+	tt_assert(bev);
+	tt_int_op(bufferevent_socket_set_batch_writes(bev, 1), ==, 0);
+	tt_int_op(bufferevent_set_rate_limit(bev, cfg), ==, 0);
+	reader = event_new(data->base, data->pair[1], EV_READ|EV_PERSIST,
+	    batch_test_readcb, &t);
+	tt_assert(reader);
+	event_add(reader, NULL);
+
+	/* The batched write empties the bucket; the bufferevent must stay
+	 * suspended instead of going back to waiting for the socket. */
+	bufferevent_write(bev, chunk, sizeof(chunk));
+	event_base_loop(data->base, EVLOOP_NONBLOCK);
+	tt_assert(BEV_UPCAST(bev)->write_suspended & BEV_SUSPEND_BW);
+	tt_assert(!(bev->ev_write.ev_flags & EVLIST_INSERTED));
+	tt_int_op(evbuffer_get_length(bufferevent_get_output(bev)), ==,
+	    sizeof(chunk) - 1024);
+
+	/* The rest goes out a bucket at a time, as it refills. */
+	while (t.received < sizeof(chunk))
+		event_base_loop(data->base, EVLOOP_ONCE);
+	tt_int_op(t.received, ==, sizeof(chunk));
+	tt_int_op(evbuffer_get_length(bufferevent_get_output(bev)), ==, 0);
+
+end:
+	if (reader)
+		event_free(reader);
+	if (bev)
+		bufferevent_free(bev);
+	if (cfg)
+		ev_token_bucket_cfg_free(cfg);
+}
+
+struct file_offload_test {
+	THREAD_T threads[64];
+	int n_offloads;
+	/* If set, the offload threads wait a while before reading. */
+	int slow;
+	size_t received;
+	char *expect;
+	size_t len;
+	int mismatch;
+};
+
+static THREAD_FN
+file_offload_test_thread(void *arg)
+{
+	void **job = arg;
+	void (*work)(void *) = (void (*)(void *))job[0];
+	struct file_offload_test *t = job[2];
+	struct timeval delay = { 0, 200*1000 };
+
+	if (t->slow)
+		evutil_usleep_(&delay);
+	work(job[1]);
+	free(job);
+	THREAD_RETURN();
+}
+
+static void
+file_offload_test_cb(void (*work)(void *), void *work_arg, void *arg)
+{
+	struct file_offload_test *t = arg;
+	void **job = malloc(3 * sizeof(void *));
+
+	EVUTIL_ASSERT(job);
+	EVUTIL_ASSERT(t->n_offloads < 64);
+	job[0] = (void *)work;
+	job[1] = work_arg;
+	job[2] = t;
+	THREAD_START(t->threads[t->n_offloads], file_offload_test_thread,
+	    job);
+	++t->n_offloads;
+}
+
+static void
+file_offload_test_readcb(struct bufferevent *bev, void *arg)
+{
+	struct file_offload_test *t = arg;
+	struct evbuffer *input = bufferevent_get_input(bev);
+	char buf[4096];
+	int n;
+
+	while ((n = evbuffer_remove(input, buf, sizeof(buf))) > 0) {
+		if (t->received + n > t->len ||
+		    memcmp(buf, t->expect + t->received, n))
+			t->mismatch = 1;
+		t->received += n;
+	}
+	if (t->received >= t->len)
+		event_base_loopexit(bufferevent_get_base(bev), NULL);
+}
+
+static void
+test_bufferevent_file_offload(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct bufferevent *bev = NULL, *reader = NULL;
+	struct evbuffer_file_segment *seg = NULL;
+	struct file_offload_test t;
+	char *tmpfilename = NULL;
+	unsigned flags = EVBUF_FS_READAHEAD;
+	int fd = -1, cold = 0, i;
+
+	memset(&t, 0, sizeof(t));
+	t.len = 4 << 20;
+	t.expect = malloc(t.len);
+	tt_assert(t.expect);
+	for (i = 0; i < (int)t.len; ++i)
+		t.expect[i] = (char)(i * 7 + i / 4096);
+
+	if (evbuffer_base_set_file_offload(data->base, file_offload_test_cb,
+		&t) < 0)
+		tt_skip();
+
+	fd = regress_make_tmpfile(t.expect, t.len, &tmpfilename);
+	tt_assert(fd >= 0);
+#if defined(EVENT__HAVE_POSIX_FADVISE) && defined(EVENT__HAVE_MINCORE)
+	/* Try to push the file out of the page cache.  Some filesystems,
+	 * like tmpfs, won't let us. */
+	{
+		unsigned char vec;
+		void *m;
+		fsync(fd);
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		m = mmap(NULL, 4096, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (m != MAP_FAILED) {
+			if (mincore(m, 4096, (void *)&vec) == 0 && !(vec & 1))
+				cold = 1;
+			munmap(m, 4096);
+		}
+	}
+#endif
+
+	if (strstr(data->setup_data, "mmap"))
+		flags |= EVBUF_FS_DISABLE_SENDFILE;
+	seg = evbuffer_file_segment_new(fd, 0, -1, flags);
+	tt_assert(seg);
+
+	bev = bufferevent_socket_new(data->base, data->pair[0], 0);
+	reader = bufferevent_socket_new(data->base, data->pair[1], 0);
+	tt_assert(bev);
+	tt_assert(reader);
+	bufferevent_setcb(reader, file_offload_test_readcb, NULL, NULL, &t);
+	bufferevent_enable(reader, EV_READ);
+	tt_int_op(evbuffer_add_file_segment(bufferevent_get_output(bev), seg,
+		0, -1), ==, 0);
+
+	if (strstr(data->setup_data, "free_base")) {
+		/* Freeing the base has to wait for a read that's still going
+		 * on, and let the bufferevent that asked for it go. */
+		t.slow = 1;
+		while (!t.n_offloads && t.received < t.len)
+			event_base_loop(data->base, EVLOOP_ONCE);
+		if (!t.n_offloads)
+			tt_skip();
+		bufferevent_free(bev);
+		bev = NULL;
+		bufferevent_free(reader);
+		reader = NULL;
+		event_base_free(data->base);
+		data->base = NULL;
+		tt_int_op(t.n_offloads, ==, 1);
+		tt_int_op(seg->refcnt, ==, 1);
+		goto end;
+	}
+
+	event_base_dispatch(data->base);
+	tt_int_op(t.received, ==, t.len);
+	tt_assert(!t.mismatch);
+	tt_int_op(evbuffer_get_length(bufferevent_get_output(bev)), ==, 0);
+	tt_assert(!BEV_UPCAST(bev)->write_suspended);
+	/* With the file written, we stop looking for it. */
+	tt_assert(!bufferevent_get_output(bev)->has_readahead);
+	/* If the file started out cold, its first part can't have been in
+	 * the page cache when we went to write it. */
+	if (cold)
+		tt_int_op(t.n_offloads, >, 0);
+	TT_BLATHER(("cold: %d, offloads: %d", cold, t.n_offloads));
+
+	tt_int_op(evbuffer_base_set_file_offload(data->base, NULL, NULL), ==,
+	    0);
+
+end:
+	for (i = 0; i < t.n_offloads; ++i)
+		THREAD_JOIN(t.threads[i]);
+	if (bev)
+		bufferevent_free(bev);
+	if (reader)
+		bufferevent_free(reader);
+	if (seg)
+		evbuffer_file_segment_free(seg);
+	if (fd >= 0)
+		close(fd);
+	if (tmpfilename) {
+		unlink(tmpfilename);
+		free(tmpfilename);
+	}
+	free(t.expect);
+}
+
 struct testcase_t bufferevent_testcases[] = {
 
 	LEGACY(bufferevent, TT_ISOLATED),
@@ -1462,6 +2350,33 @@ struct testcase_t bufferevent_testcases[] = {
 	{ "bufferevent_read_failed",
 	  test_bufferevent_read_failed,
 	  TT_FORK|TT_NEED_SOCKETPAIR|TT_NEED_BASE, &basic_setup, NULL },
+	{ "bufferevent_forward", test_bufferevent_forward,
+	  TT_FORK|TT_NEED_SOCKETPAIR|TT_NEED_BASE, &basic_setup, NULL },
+	{ "bufferevent_forward_filter", test_bufferevent_forward,
+	  TT_FORK|TT_NEED_SOCKETPAIR|TT_NEED_BASE, &basic_setup,
+	  (void*)"filter" },
+	{ "bufferevent_forward_pipe_full", test_bufferevent_forward_pipe_full,
+	  TT_FORK|TT_NEED_SOCKETPAIR|TT_NEED_BASE, &basic_setup, NULL },
+	{ "bufferevent_zerocopy", test_bufferevent_zerocopy,
+	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "bufferevent_zerocopy_free_base", test_bufferevent_zerocopy,
+	  TT_FORK|TT_NEED_BASE, &basic_setup, (void*)"free_base" },
+	{ "bufferevent_mem_limits", test_bufferevent_mem_limits,
+	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "bufferevent_batch_writes", test_bufferevent_batch_writes,
+	  TT_FORK|TT_NEED_SOCKETPAIR|TT_NEED_BASE, &basic_setup, NULL },
+	{ "bufferevent_batch_writes_ratelim",
+	  test_bufferevent_batch_writes_ratelim,
+	  TT_FORK|TT_NEED_SOCKETPAIR|TT_NEED_BASE, &basic_setup, NULL },
+	{ "bufferevent_file_offload_sendfile", test_bufferevent_file_offload,
+	  TT_FORK|TT_NEED_SOCKETPAIR|TT_NEED_BASE|TT_NEED_THREADS,
+	  &basic_setup, (void *)"sendfile" },
+	{ "bufferevent_file_offload_mmap", test_bufferevent_file_offload,
+	  TT_FORK|TT_NEED_SOCKETPAIR|TT_NEED_BASE|TT_NEED_THREADS,
+	  &basic_setup, (void *)"mmap" },
+	{ "bufferevent_file_offload_free_base", test_bufferevent_file_offload,
+	  TT_FORK|TT_NEED_SOCKETPAIR|TT_NEED_BASE|TT_NEED_THREADS,
+	  &basic_setup, (void *)"mmap free_base" },
 
 	END_OF_TESTCASES,
 };
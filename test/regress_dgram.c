@@ -0,0 +1,422 @@
+/*
+ * Copyright (c) 2007-2012 Niels Provos and Nick Mathewson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "util-internal.h"
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+#endif
+
+#include <sys/types.h>
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "event2/dgram.h"
+#include "event2/event.h"
+#include "event2/util.h"
+
+#include "regress.h"
+#include "tinytest.h"
+#include "tinytest_macros.h"
+
+/* Make a nonblocking UDP socket bound to a free port on localhost, and put
+ * its address in sin. */
+static evutil_socket_t
+dgram_test_socket(struct sockaddr_in *sin)
+{
+	evutil_socket_t fd;
+	ev_socklen_t len = sizeof(*sin);
+
+	memset(sin, 0, sizeof(*sin));
+	sin->sin_family = AF_INET;
+	sin->sin_addr.s_addr = htonl(0x7f000001);
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd == EVUTIL_INVALID_SOCKET)
+		return fd;
+	if (bind(fd, (struct sockaddr *)sin, sizeof(*sin)) < 0 ||
+	    getsockname(fd, (struct sockaddr *)sin, &len) < 0 ||
+	    evutil_make_socket_nonblocking(fd) < 0) {
+		evutil_closesocket(fd);
+		return EVUTIL_INVALID_SOCKET;
+	}
+	return fd;
+}
+
+struct dgram_test {
+	struct sockaddr_in from;
+	int n_cbs;
+	int n_msgs;
+	int n_datagrams;
+	size_t n_bytes;
+	int bad;
+	int expect;
+	int free_in_cb;
+	int err;
+};
+
+static void
+dgram_test_readcb(struct evdgram *dg, struct evdgram_msg *msgs, int n,
+    void *arg)
+{
+	struct dgram_test *t = arg;
+	struct event_base *base = evdgram_get_base(dg);
+	int i;
+
+	++t->n_cbs;
+	for (i = 0; i < n; ++i) {
+		const unsigned char *p = msgs[i].iov_base;
+		size_t j;
+
+		if (msgs[i].addrlen != sizeof(t->from) ||
+		    evutil_sockaddr_cmp(msgs[i].addr,
+			(struct sockaddr *)&t->from, 1))
+			t->bad = 1;
+		/* Every datagram holds its number, over and over. */
+		for (j = 0; j < msgs[i].iov_len; ++j) {
+			size_t seg = msgs[i].segment_size ?
+			    msgs[i].segment_size : msgs[i].iov_len;
+			if (p[j] != (unsigned char)(t->n_datagrams + j / seg))
+				t->bad = 1;
+		}
+		++t->n_msgs;
+		t->n_datagrams += msgs[i].segment_size ?
+		    (int)((msgs[i].iov_len + msgs[i].segment_size - 1) /
+			msgs[i].segment_size) : 1;
+		t->n_bytes += msgs[i].iov_len;
+	}
+	if (t->free_in_cb)
+		evdgram_free(dg);
+	if (t->n_datagrams >= t->expect || t->free_in_cb)
+		event_base_loopexit(base, NULL);
+}
+
+static void
+dgram_test_errorcb(struct evdgram *dg, int err, void *arg)
+{
+	struct dgram_test *t = arg;
+
+	t->err = err;
+	event_base_loopexit(evdgram_get_base(dg), NULL);
+}
+
+static void
+regress_dgram_batch(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evdgram *reader = NULL, *writer = NULL;
+	struct sockaddr_in rsin;
+	struct evdgram_msg msgs[20];
+	struct evdgram_stats st;
+	struct dgram_test t;
+	unsigned char payload[20][32];
+	struct timeval tv = { 5, 0 };
+	evutil_socket_t rfd, wfd;
+	int i;
+
+	memset(&t, 0, sizeof(t));
+	rfd = dgram_test_socket(&rsin);
+	wfd = dgram_test_socket(&t.from);
+	tt_assert(rfd != EVUTIL_INVALID_SOCKET);
+	tt_assert(wfd != EVUTIL_INVALID_SOCKET);
+
+	/* Bad arguments. */
+	tt_assert(!evdgram_new(data->base, rfd, 0, 0, 0));
+	tt_assert(!evdgram_new(data->base, rfd, 0, 8, 70000));
+
+	reader = evdgram_new(data->base, rfd, EVDGRAM_OPT_CLOSE_ON_FREE, 8,
+	    0);
+	writer = evdgram_new(data->base, wfd,
+	    EVDGRAM_OPT_CLOSE_ON_FREE|EVDGRAM_OPT_DISABLED, -1, 0);
+	tt_assert(reader);
+	tt_assert(writer);
+	tt_int_op(evdgram_get_fd(reader), ==, rfd);
+	tt_assert(evdgram_get_base(reader) == data->base);
+	evdgram_setcb(reader, dgram_test_readcb, NULL, &t);
+
+	memset(msgs, 0, sizeof(msgs));
+	for (i = 0; i < 20; ++i) {
+		memset(payload[i], i, sizeof(payload[i]));
+		msgs[i].addr = (struct sockaddr *)&rsin;
+		msgs[i].addrlen = sizeof(rsin);
+		msgs[i].iov_base = payload[i];
+		msgs[i].iov_len = i + 1;
+	}
+	tt_int_op(evdgram_send(writer, msgs, 20), ==, 20);
+	evdgram_get_stats(writer, &st);
+	tt_int_op(st.n_datagrams_sent, ==, 20);
+	tt_int_op(st.n_sends, >=, 1);
+
+	/* They're all waiting, so we read them 8 at a time. */
+	t.expect = 20;
+	event_base_loopexit(data->base, &tv);
+	event_base_dispatch(data->base);
+	tt_assert(!t.bad);
+	tt_int_op(t.n_datagrams, ==, 20);
+	tt_int_op(t.n_bytes, ==, 20 * 21 / 2);
+	tt_int_op(t.n_cbs, ==, 3);
+	evdgram_get_stats(reader, &st);
+	tt_int_op(st.n_reads, ==, 3);
+	tt_int_op(st.n_datagrams_read, ==, 20);
+	tt_int_op(st.n_bytes_read, ==, 20 * 21 / 2);
+
+	/* Freeing the evdgram from its callback is fine. */
+	t.free_in_cb = 1;
+	t.n_datagrams = 0;
+	tt_int_op(evdgram_send(writer, msgs, 2), ==, 2);
+	event_base_loopexit(data->base, &tv);
+	event_base_dispatch(data->base);
+	reader = NULL;
+	tt_int_op(t.n_cbs, ==, 4);
+
+end:
+	if (reader)
+		evdgram_free(reader);
+	if (writer)
+		evdgram_free(writer);
+}
+
+static void
+regress_dgram_segments(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evdgram *reader = NULL, *writer = NULL;
+	struct sockaddr_in rsin;
+	struct evdgram_msg msg;
+	struct evdgram_stats st;
+	struct dgram_test t;
+	unsigned char payload[1000];
+	struct timeval tv = { 5, 0 };
+	evutil_socket_t rfd, wfd;
+	unsigned flags = EVDGRAM_OPT_CLOSE_ON_FREE;
+	int i;
+
+	if (!strcmp(data->setup_data, "gro"))
+		flags |= EVDGRAM_OPT_GRO;
+	memset(&t, 0, sizeof(t));
+	rfd = dgram_test_socket(&rsin);
+	wfd = dgram_test_socket(&t.from);
+	tt_assert(rfd != EVUTIL_INVALID_SOCKET);
+	tt_assert(wfd != EVUTIL_INVALID_SOCKET);
+	reader = evdgram_new(data->base, rfd, flags, 16, 0);
+	writer = evdgram_new(data->base, wfd, EVDGRAM_OPT_CLOSE_ON_FREE, -1,
+	    0);
+	tt_assert(reader);
+	tt_assert(writer);
+	evdgram_setcb(reader, dgram_test_readcb, NULL, &t);
+
+	/* Ten datagrams of 100 bytes, sent as one message.  Whether or not
+	 * the kernel splits them up, or joins them back together, we see all
+	 * ten. */
+	for (i = 0; i < (int)sizeof(payload); ++i)
+		payload[i] = (unsigned char)(i / 100);
+	memset(&msg, 0, sizeof(msg));
+	msg.addr = (struct sockaddr *)&rsin;
+	msg.addrlen = sizeof(rsin);
+	msg.iov_base = payload;
+	msg.iov_len = sizeof(payload);
+	msg.segment_size = 100;
+	tt_int_op(evdgram_send(writer, &msg, 1), ==, 1);
+	evdgram_get_stats(writer, &st);
+	tt_int_op(st.n_datagrams_sent, ==, 10);
+
+	t.expect = 10;
+	event_base_loopexit(data->base, &tv);
+	event_base_dispatch(data->base);
+	tt_assert(!t.bad);
+	tt_int_op(t.n_datagrams, ==, 10);
+	tt_int_op(t.n_bytes, ==, 1000);
+	if (!(flags & EVDGRAM_OPT_GRO))
+		tt_int_op(t.n_msgs, ==, 10);
+	evdgram_get_stats(reader, &st);
+	tt_int_op(st.n_datagrams_read, ==, 10);
+
+end:
+	if (reader)
+		evdgram_free(reader);
+	if (writer)
+		evdgram_free(writer);
+}
+
+#ifdef EVENT__HAVE_RECVMMSG
+static void
+regress_dgram_truncated(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evdgram *reader = NULL, *writer = NULL;
+	struct sockaddr_in rsin;
+	struct evdgram_msg msg;
+	struct evdgram_stats st;
+	struct dgram_test t;
+	unsigned char payload[100];
+	struct timeval tv = { 5, 0 };
+	evutil_socket_t rfd, wfd;
+
+	memset(&t, 0, sizeof(t));
+	rfd = dgram_test_socket(&rsin);
+	wfd = dgram_test_socket(&t.from);
+	tt_assert(rfd != EVUTIL_INVALID_SOCKET);
+	tt_assert(wfd != EVUTIL_INVALID_SOCKET);
+	reader = evdgram_new(data->base, rfd, EVDGRAM_OPT_CLOSE_ON_FREE, 4,
+	    16);
+	writer = evdgram_new(data->base, wfd, EVDGRAM_OPT_CLOSE_ON_FREE, -1,
+	    0);
+	tt_assert(reader);
+	tt_assert(writer);
+	evdgram_setcb(reader, dgram_test_readcb, NULL, &t);
+
+	memset(payload, 0, sizeof(payload));
+	memset(&msg, 0, sizeof(msg));
+	msg.addr = (struct sockaddr *)&rsin;
+	msg.addrlen = sizeof(rsin);
+	msg.iov_base = payload;
+	msg.iov_len = sizeof(payload);
+	tt_int_op(evdgram_send(writer, &msg, 1), ==, 1);
+
+	t.expect = 1;
+	event_base_loopexit(data->base, &tv);
+	event_base_dispatch(data->base);
+	tt_int_op(t.n_datagrams, ==, 1);
+	tt_int_op(t.n_bytes, ==, 16);
+	evdgram_get_stats(reader, &st);
+	tt_int_op(st.n_truncated, ==, 1);
+
+end:
+	if (reader)
+		evdgram_free(reader);
+	if (writer)
+		evdgram_free(writer);
+}
+#endif
+
+#ifndef _WIN32
+static void
+regress_dgram_error(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evdgram *dg = NULL;
+	struct sockaddr_in sin, closed;
+	struct evdgram_msg msg;
+	struct dgram_test t;
+	struct timeval tv = { 5, 0 };
+	evutil_socket_t fd, cfd;
+
+	memset(&t, 0, sizeof(t));
+	/* Find a port that nobody listens on. */
+	cfd = dgram_test_socket(&closed);
+	tt_assert(cfd != EVUTIL_INVALID_SOCKET);
+	evutil_closesocket(cfd);
+
+	fd = dgram_test_socket(&sin);
+	tt_assert(fd != EVUTIL_INVALID_SOCKET);
+	tt_int_op(connect(fd, (struct sockaddr *)&closed, sizeof(closed)), ==,
+	    0);
+	dg = evdgram_new(data->base, fd, EVDGRAM_OPT_CLOSE_ON_FREE, -1, 0);
+	tt_assert(dg);
+	evdgram_setcb(dg, dgram_test_readcb, dgram_test_errorcb, &t);
+
+	memset(&msg, 0, sizeof(msg));
+	msg.iov_base = (char *)"ping";
+	msg.iov_len = 4;
+	tt_int_op(evdgram_send(dg, &msg, 1), ==, 1);
+	event_base_loopexit(data->base, &tv);
+	event_base_dispatch(data->base);
+	tt_int_op(t.err, ==, ECONNREFUSED);
+	tt_int_op(t.n_cbs, ==, 0);
+
+end:
+	if (dg)
+		evdgram_free(dg);
+}
+#endif
+
+#ifndef EVENT__DISABLE_MM_REPLACEMENT
+static int dgram_test_n_mallocs;
+
+/* Fail every allocation after the first. */
+static void *
+dgram_test_failing_malloc(size_t size)
+{
+	if (dgram_test_n_mallocs++)
+		return NULL;
+	return malloc(size);
+}
+
+static void
+regress_dgram_new_fail(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct sockaddr_in sin;
+	ev_socklen_t len = sizeof(sin);
+	struct evdgram *dg;
+	evutil_socket_t fd;
+
+	fd = dgram_test_socket(&sin);
+	tt_assert(fd != EVUTIL_INVALID_SOCKET);
+
+	/* Failing after the evdgram itself is allocated frees it, but
+	 * doesn't touch its event or close the caller's socket. */
+	event_set_mem_functions(dgram_test_failing_malloc, realloc, free);
+	dg = evdgram_new(data->base, fd, EVDGRAM_OPT_CLOSE_ON_FREE, 4, 0);
+	event_set_mem_functions(malloc, realloc, free);
+	tt_assert(!dg);
+	tt_int_op(dgram_test_n_mallocs, >, 1);
+	tt_int_op(getsockname(fd, (struct sockaddr *)&sin, &len), ==, 0);
+
+end:
+	if (fd != EVUTIL_INVALID_SOCKET)
+		evutil_closesocket(fd);
+}
+#endif
+
+struct testcase_t dgram_testcases[] = {
+	{ "batch", regress_dgram_batch, TT_FORK|TT_NEED_BASE,
+	  &basic_setup, NULL },
+	{ "segments", regress_dgram_segments, TT_FORK|TT_NEED_BASE,
+	  &basic_setup, (void *)"plain" },
+	{ "segments_gro", regress_dgram_segments, TT_FORK|TT_NEED_BASE,
+	  &basic_setup, (void *)"gro" },
+#ifdef EVENT__HAVE_RECVMMSG
+	{ "truncated", regress_dgram_truncated, TT_FORK|TT_NEED_BASE,
+	  &basic_setup, NULL },
+#endif
+#ifndef _WIN32
+	{ "error", regress_dgram_error, TT_FORK|TT_NEED_BASE,
+	  &basic_setup, NULL },
+#endif
+#ifndef EVENT__DISABLE_MM_REPLACEMENT
+	{ "new_fail", regress_dgram_new_fail, TT_FORK|TT_NEED_BASE,
+	  &basic_setup, NULL },
+#endif
+	END_OF_TESTCASES,
+};
@@ -679,6 +679,295 @@ end:
 static void dns_search_test(void *arg) { dns_search_test_impl(arg, 0); }
 static void dns_search_lower_test(void *arg) { dns_search_test_impl(arg, 1); }
 
+static struct regress_dns_server_table cache_table[] = {
+	{ "host.c.example.com", "A", "11.22.33.44", 0, 0 },
+	{ "hostn.b.example.com", "errsoa", "3", 0, 0 },
+	{ "host2.b.example.com", "err", "3", 0, 0 },
+	{ "host2.a.example.com", "A", "200.100.0.100", 0, 0 },
+	{ "nosoa.example.com", "err", "3", 0, 0 },
+	{ "other.example.com", "A", "1.2.3.4", 0, 0 },
+	{ NULL, NULL, NULL, 0, 0 }
+};
+
+static void
+dns_cache_test(void *arg)
+{
+	struct regress_dns_server_table table[ARRAY_SIZE(cache_table)];
+	struct basic_test_data *data = arg;
+	struct event_base *base = data->base;
+	struct evdns_base *dns = NULL;
+	struct evdns_cache_stats stats;
+	ev_uint16_t portnum = 0;
+	char buf[64];
+	struct generic_dns_callback_result r[4];
+	int round;
+
+	memcpy(table, cache_table, sizeof(table));
+	tt_assert(regress_dnsserver(base, &portnum, table, NULL));
+	evutil_snprintf(buf, sizeof(buf), "127.0.0.1:%d", (int)portnum);
+
+	dns = evdns_base_new(base, 0);
+	tt_assert(!evdns_base_nameserver_ip_add(dns, buf));
+	tt_assert(!evdns_base_set_option(dns, "cache-size", "16"));
+	evdns_base_search_add(dns, "a.example.com");
+	evdns_base_search_add(dns, "b.example.com");
+
+	exit_base = base;
+	for (round = 0; round < 2; ++round) {
+		memset(r, 0, sizeof(r));
+		n_replies_left = ARRAY_SIZE(r);
+		evdns_base_resolve_ipv4(dns, "HOST.c.example.com", DNS_NO_SEARCH,
+		    generic_dns_callback, &r[0]);
+		evdns_base_resolve_ipv4(dns, "hostn.b.example.com", DNS_NO_SEARCH,
+		    generic_dns_callback, &r[1]);
+		evdns_base_resolve_ipv4(dns, "host2", 0,
+		    generic_dns_callback, &r[2]);
+		evdns_base_resolve_ipv4(dns, "nosoa.example.com", DNS_NO_SEARCH,
+		    generic_dns_callback, &r[3]);
+		event_base_dispatch(base);
+
+		tt_int_op(r[0].result, ==, DNS_ERR_NONE);
+		tt_int_op(r[0].count, ==, 1);
+		tt_int_op(((ev_uint32_t*)r[0].addrs)[0], ==, htonl(0x0b16212c));
+		tt_int_op(r[0].ttl, <=, 100);
+		tt_int_op(r[0].ttl, >=, 99);
+		tt_int_op(r[1].result, ==, DNS_ERR_NOTEXIST);
+		tt_int_op(r[1].ttl, <=, 42);
+		tt_int_op(r[1].ttl, >=, 41);
+		tt_int_op(r[2].result, ==, DNS_ERR_NONE);
+		tt_int_op(((ev_uint32_t*)r[2].addrs)[0], ==, htonl(0xc8640064));
+		tt_int_op(r[3].result, ==, DNS_ERR_NOTEXIST);
+	}
+
+	/* Everything but the negative answer without a SOA came from the
+	 * cache the second time. */
+	tt_int_op(table[0].seen, ==, 1);
+	tt_int_op(table[1].seen, ==, 1);
+	tt_int_op(table[2].seen, ==, 1);
+	tt_int_op(table[3].seen, ==, 1);
+	tt_int_op(table[4].seen, ==, 2);
+
+	tt_assert(!evdns_base_get_cache_stats(dns, &stats));
+	tt_int_op(stats.entries, ==, 3);
+	tt_int_op(stats.hits, ==, 2);
+	tt_int_op(stats.negative_hits, ==, 1);
+	tt_int_op(stats.misses, ==, 5);
+	tt_int_op(stats.insertions, ==, 3);
+	tt_int_op(stats.evictions, ==, 0);
+
+	/* A raw lookup is a different question from a searched one. */
+	n_replies_left = 1;
+	evdns_base_resolve_ipv4(dns, "host2.a.example.com", DNS_NO_SEARCH,
+	    generic_dns_callback, &r[0]);
+	event_base_dispatch(base);
+	tt_int_op(table[3].seen, ==, 2);
+
+	/* Shrinking the cache evicts the least recently used answers. */
+	tt_assert(!evdns_base_set_option(dns, "cache-size", "1"));
+	n_replies_left = 1;
+	evdns_base_resolve_ipv4(dns, "other.example.com", DNS_NO_SEARCH,
+	    generic_dns_callback, &r[0]);
+	event_base_dispatch(base);
+	tt_assert(!evdns_base_get_cache_stats(dns, &stats));
+	tt_int_op(stats.entries, ==, 1);
+	tt_int_op(stats.evictions, ==, 4);
+
+	/* Changing the search list drops cached answers. */
+	evdns_base_search_add(dns, "c.example.com");
+	tt_assert(!evdns_base_get_cache_stats(dns, &stats));
+	tt_int_op(stats.entries, ==, 0);
+
+end:
+	if (dns)
+		evdns_base_free(dns, 0);
+
+	regress_clean_dnsserver();
+}
+
+static void
+dns_cache_wait_(struct event_base *base, long usec)
+{
+	struct timeval tv = { 0, 0 };
+	tv.tv_sec = usec / 1000000;
+	tv.tv_usec = usec % 1000000;
+	event_base_loopexit(base, &tv);
+	event_base_dispatch(base);
+}
+
+static void
+dns_cache_prefetch_test(void *arg)
+{
+	struct regress_dns_server_table table[] = {
+		{ "hot.example.com", "A", "10.0.0.1", 0, 0 },
+		{ NULL, NULL, NULL, 0, 0 }
+	};
+	struct basic_test_data *data = arg;
+	struct event_base *base = data->base;
+	struct evdns_base *dns = NULL;
+	struct evdns_cache_stats stats;
+	ev_uint16_t portnum = 0;
+	char buf[64];
+	struct generic_dns_callback_result r;
+
+	tt_assert(regress_dnsserver(base, &portnum, table, NULL));
+	evutil_snprintf(buf, sizeof(buf), "127.0.0.1:%d", (int)portnum);
+
+	dns = evdns_base_new(base, 0);
+	tt_assert(!evdns_base_nameserver_ip_add(dns, buf));
+	tt_assert(!evdns_base_set_option(dns, "cache-size", "16"));
+	tt_assert(!evdns_base_set_option(dns, "cache-max-ttl", "2"));
+	tt_assert(!evdns_base_set_option(dns, "cache-prefetch", "60"));
+
+	exit_base = base;
+	n_replies_left = 1;
+	evdns_base_resolve_ipv4(dns, "hot.example.com", DNS_NO_SEARCH,
+	    generic_dns_callback, &r);
+	event_base_dispatch(base);
+	tt_int_op(r.result, ==, DNS_ERR_NONE);
+	tt_int_op(table[0].seen, ==, 1);
+
+	/* Early in its TTL, the answer just comes from the cache. */
+	n_replies_left = 1;
+	evdns_base_resolve_ipv4(dns, "hot.example.com", DNS_NO_SEARCH,
+	    generic_dns_callback, &r);
+	event_base_dispatch(base);
+	dns_cache_wait_(base, 100000);
+	tt_int_op(table[0].seen, ==, 1);
+
+	/* Late in its TTL, it is also refreshed in the background. */
+	dns_cache_wait_(base, 1100000);
+	memset(&r, 0, sizeof(r));
+	n_replies_left = 2;
+	evdns_base_resolve_ipv4(dns, "hot.example.com", DNS_NO_SEARCH,
+	    generic_dns_callback, &r);
+	evdns_base_resolve_ipv4(dns, "hot.example.com", DNS_NO_SEARCH,
+	    generic_dns_callback, &r);
+	event_base_dispatch(base);
+	tt_int_op(r.result, ==, DNS_ERR_NONE);
+	tt_int_op(r.ttl, <, 2);
+	dns_cache_wait_(base, 100000);
+	tt_int_op(table[0].seen, ==, 2);
+
+	tt_assert(!evdns_base_get_cache_stats(dns, &stats));
+	tt_int_op(stats.prefetches, ==, 1);
+	tt_int_op(stats.misses, ==, 1);
+	tt_int_op(stats.insertions, ==, 2);
+
+	/* The refreshed answer has a full TTL again. */
+	memset(&r, 0, sizeof(r));
+	n_replies_left = 1;
+	evdns_base_resolve_ipv4(dns, "hot.example.com", DNS_NO_SEARCH,
+	    generic_dns_callback, &r);
+	event_base_dispatch(base);
+	tt_int_op(r.result, ==, DNS_ERR_NONE);
+	tt_int_op(r.ttl, >=, 1);
+	tt_int_op(table[0].seen, ==, 2);
+
+	/* A refresh that fails doesn't keep the next one from going out. */
+	table[0].anstype = "err";
+	table[0].ans = "1";
+	dns_cache_wait_(base, 900000);
+	n_replies_left = 1;
+	evdns_base_resolve_ipv4(dns, "hot.example.com", DNS_NO_SEARCH,
+	    generic_dns_callback, &r);
+	event_base_dispatch(base);
+	dns_cache_wait_(base, 100000);
+	tt_int_op(table[0].seen, ==, 3);
+	n_replies_left = 1;
+	evdns_base_resolve_ipv4(dns, "hot.example.com", DNS_NO_SEARCH,
+	    generic_dns_callback, &r);
+	event_base_dispatch(base);
+	tt_int_op(r.result, ==, DNS_ERR_NONE);
+	dns_cache_wait_(base, 100000);
+	tt_int_op(table[0].seen, ==, 4);
+	tt_assert(!evdns_base_get_cache_stats(dns, &stats));
+	tt_int_op(stats.prefetches, ==, 3);
+
+end:
+	if (dns)
+		evdns_base_free(dns, 0);
+
+	regress_clean_dnsserver();
+}
+
+static void
+dns_cache_stale_test(void *arg)
+{
+	struct regress_dns_server_table table[] = {
+		{ "stale.example.com", "A", "10.0.0.2", 0, 0 },
+		{ "fresh.example.com", "A", "10.0.0.3", 0, 0 },
+		{ NULL, NULL, NULL, 0, 0 }
+	};
+	struct basic_test_data *data = arg;
+	struct event_base *base = data->base;
+	struct evdns_base *dns = NULL;
+	struct evdns_cache_stats stats;
+	ev_uint16_t portnum = 0;
+	char buf[64];
+	struct generic_dns_callback_result r[2];
+
+	tt_assert(regress_dnsserver(base, &portnum, table, NULL));
+	evutil_snprintf(buf, sizeof(buf), "127.0.0.1:%d", (int)portnum);
+
+	dns = evdns_base_new(base, 0);
+	tt_assert(!evdns_base_nameserver_ip_add(dns, buf));
+	tt_assert(!evdns_base_set_option(dns, "cache-size", "16"));
+	tt_assert(!evdns_base_set_option(dns, "cache-max-ttl", "1"));
+	tt_assert(!evdns_base_set_option(dns, "cache-max-stale", "60"));
+	tt_assert(!evdns_base_set_option(dns, "timeout", "0.2"));
+	tt_assert(!evdns_base_set_option(dns, "attempts", "1"));
+	tt_assert(!evdns_base_set_option(dns, "max-timeouts", "10"));
+
+	exit_base = base;
+	n_replies_left = 1;
+	evdns_base_resolve_ipv4(dns, "stale.example.com", DNS_NO_SEARCH,
+	    generic_dns_callback, &r[0]);
+	event_base_dispatch(base);
+	tt_int_op(r[0].result, ==, DNS_ERR_NONE);
+
+	/* Let the answer expire, then make the nameserver go silent. */
+	dns_cache_wait_(base, 1100000);
+	table[0].anstype = "err";
+	table[0].ans = "67";
+	table[1].anstype = "err";
+	table[1].ans = "67";
+
+	memset(r, 0, sizeof(r));
+	n_replies_left = 2;
+	evdns_base_resolve_ipv4(dns, "stale.example.com", DNS_NO_SEARCH,
+	    generic_dns_callback, &r[0]);
+	evdns_base_resolve_ipv4(dns, "fresh.example.com", DNS_NO_SEARCH,
+	    generic_dns_callback, &r[1]);
+	event_base_dispatch(base);
+	tt_int_op(table[0].seen, ==, 2);
+	tt_int_op(r[0].result, ==, DNS_ERR_NONE);
+	tt_int_op(r[0].count, ==, 1);
+	tt_int_op(((ev_uint32_t*)r[0].addrs)[0], ==, htonl(0x0a000002));
+	tt_int_op(r[0].ttl, ==, 30);
+	/* Nothing to fall back to for a name we never saw. */
+	tt_int_op(r[1].result, ==, DNS_ERR_TIMEOUT);
+
+	/* The stale answer is reused for a while without asking again. */
+	memset(r, 0, sizeof(r));
+	n_replies_left = 1;
+	evdns_base_resolve_ipv4(dns, "stale.example.com", DNS_NO_SEARCH,
+	    generic_dns_callback, &r[0]);
+	event_base_dispatch(base);
+	tt_int_op(table[0].seen, ==, 2);
+	tt_int_op(r[0].result, ==, DNS_ERR_NONE);
+	tt_int_op(((ev_uint32_t*)r[0].addrs)[0], ==, htonl(0x0a000002));
+
+	tt_assert(!evdns_base_get_cache_stats(dns, &stats));
+	tt_int_op(stats.stale_hits, ==, 1);
+	tt_int_op(stats.expirations, ==, 0);
+
+end:
+	if (dns)
+		evdns_base_free(dns, 0);
+
+	regress_clean_dnsserver();
+}
+
 static int request_count = 0;
 static struct evdns_request *current_req = NULL;
 
@@ -1694,6 +1983,185 @@ end:
 	}
 }
 
+/* === Test for racing connections in bufferevent_socket_connect_hostname */
+
+static void
+be_race_server_cb(struct evdns_server_request *req, void *data)
+{
+	const char *qname = req->questions[0]->name;
+	ev_uint32_t addrs[2];
+
+	if (req->questions[0]->type != EVDNS_TYPE_A) {
+		evdns_server_request_respond(req, 0);
+		return;
+	}
+	if (!evutil_ascii_strcasecmp(qname, "slow.example.com")) {
+		/* 127.0.0.1 never answers; 127.0.0.2 does. */
+		addrs[0] = htonl(0x7f000001);
+		addrs[1] = htonl(0x7f000002);
+	} else if (!evutil_ascii_strcasecmp(qname, "hang.example.com")) {
+		/* Neither ever answers. */
+		addrs[0] = htonl(0x7f000001);
+		addrs[1] = htonl(0x7f000001);
+	} else if (!evutil_ascii_strcasecmp(qname, "refused.example.com")) {
+		/* Nobody listens on 127.0.0.3. */
+		addrs[0] = htonl(0x7f000003);
+		addrs[1] = htonl(0x7f000002);
+	} else {
+		addrs[0] = htonl(0x7f000003);
+		addrs[1] = htonl(0x7f000004);
+	}
+	evdns_server_request_add_a_reply(req, qname, 2, addrs, 2000);
+	evdns_server_request_respond(req, 0);
+}
+
+static void
+be_race_event_cb(struct bufferevent *bev, short what, void *ctx)
+{
+	short *got = ctx;
+	*got = what;
+	event_base_loopexit(bufferevent_get_base(bev), NULL);
+}
+
+/* Connect to hostname and return how long it took, in msec. */
+static int
+be_race_connect(struct event_base *base, struct evdns_base *dns,
+    const char *hostname, int port, short *what)
+{
+	struct bufferevent *bev;
+	struct timeval start, end;
+
+	*what = 0;
+	bev = bufferevent_socket_new(base, -1, BEV_OPT_CLOSE_ON_FREE);
+	bufferevent_setcb(bev, NULL, NULL, be_race_event_cb, what);
+	evutil_gettimeofday(&start, NULL);
+	if (bufferevent_socket_connect_hostname(bev, dns, AF_UNSPEC,
+		hostname, port) < 0) {
+		bufferevent_free(bev);
+		return -1;
+	}
+	event_base_dispatch(base);
+	evutil_gettimeofday(&end, NULL);
+	bufferevent_free(bev);
+	evutil_timersub(&end, &start, &end);
+	return end.tv_sec * 1000 + end.tv_usec / 1000;
+}
+
+static void
+test_bufferevent_connect_hostname_race(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct evconnlistener *listener = NULL;
+	struct evdns_server_port *dns_port = NULL;
+	struct evdns_base *dns = NULL;
+	struct sockaddr_in sin;
+	struct bufferevent *bev = NULL;
+	struct timeval tv;
+	evutil_socket_t full = -1, filler = -1;
+	ev_socklen_t slen = sizeof(sin);
+	ev_uint16_t portnum = 0;
+	int n_accept = 0, msec;
+	short what;
+	char buf[64];
+
+#ifndef __linux__
+	/* We rely on Linux dropping SYNs to a listener whose backlog is
+	 * full, to get an address that never answers. */
+	tt_skip();
+#endif
+
+	/* A listener on 127.0.0.1 with a full backlog. */
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(0x7f000001);
+	full = socket(AF_INET, SOCK_STREAM, 0);
+	tt_assert(full >= 0);
+	tt_assert(!bind(full, (struct sockaddr *)&sin, sizeof(sin)));
+	tt_assert(!listen(full, 0));
+	tt_assert(!getsockname(full, (struct sockaddr *)&sin, &slen));
+	filler = socket(AF_INET, SOCK_STREAM, 0);
+	tt_assert(filler >= 0);
+	tt_assert(!connect(filler, (struct sockaddr *)&sin, sizeof(sin)));
+
+	/* A working listener on the same port of 127.0.0.2. */
+	sin.sin_addr.s_addr = htonl(0x7f000002);
+	listener = evconnlistener_new_bind(data->base, nil_accept_cb,
+	    &n_accept, LEV_OPT_REUSEABLE|LEV_OPT_CLOSE_ON_EXEC, -1,
+	    (struct sockaddr *)&sin, sizeof(sin));
+	if (!listener)
+		tt_skip();
+
+	dns_port = regress_get_udp_dnsserver(data->base, &portnum, NULL,
+	    be_race_server_cb, NULL);
+	tt_assert(dns_port);
+	dns = evdns_base_new(data->base, 0);
+	tt_assert(dns);
+	evutil_snprintf(buf, sizeof(buf), "127.0.0.1:%d", (int)portnum);
+	tt_assert(!evdns_base_nameserver_ip_add(dns, buf));
+
+	/* The first address hangs, so the second wins after a delay. */
+	msec = be_race_connect(data->base, dns, "slow.example.com",
+	    ntohs(sin.sin_port), &what);
+	tt_int_op(what, ==, BEV_EVENT_CONNECTED);
+	tt_int_op(msec, >=, 200);
+	tt_int_op(msec, <, 900);
+	event_base_loop(data->base, EVLOOP_NONBLOCK);
+	tt_int_op(n_accept, ==, 1);
+
+	/* Next time, the address that won goes first. */
+	msec = be_race_connect(data->base, dns, "SLOW.example.com",
+	    ntohs(sin.sin_port), &what);
+	tt_int_op(what, ==, BEV_EVENT_CONNECTED);
+	tt_int_op(msec, <, 200);
+
+	/* A refused connection moves on to the next address at once. */
+	msec = be_race_connect(data->base, dns, "refused.example.com",
+	    ntohs(sin.sin_port), &what);
+	tt_int_op(what, ==, BEV_EVENT_CONNECTED);
+	tt_int_op(msec, <, 200);
+
+	/* And when every address fails, so does the bufferevent. */
+	msec = be_race_connect(data->base, dns, "nowhere.example.com",
+	    ntohs(sin.sin_port), &what);
+	tt_int_op(what, ==, BEV_EVENT_ERROR);
+	tt_int_op(msec, <, 200);
+
+	/* Freeing the bufferevent in the middle of a race ends it. */
+	bev = bufferevent_socket_new(data->base, -1, BEV_OPT_CLOSE_ON_FREE);
+	tt_assert(bev);
+	what = 0;
+	bufferevent_setcb(bev, NULL, NULL, be_race_event_cb, &what);
+	tv.tv_sec = 0;
+	tv.tv_usec = 400000;
+	bufferevent_set_timeouts(bev, NULL, &tv);
+	tt_assert(!bufferevent_socket_connect_hostname(bev, dns, AF_UNSPEC,
+		"hang.example.com", ntohs(sin.sin_port)));
+	tv.tv_usec = 100000;
+	event_base_loopexit(data->base, &tv);
+	event_base_dispatch(data->base);
+	bufferevent_free(bev);
+	bev = NULL;
+	/* Neither the next attempt nor the timeout may fire now. */
+	tv.tv_usec = 600000;
+	event_base_loopexit(data->base, &tv);
+	event_base_dispatch(data->base);
+	tt_int_op(what, ==, 0);
+
+end:
+	if (bev)
+		bufferevent_free(bev);
+	if (listener)
+		evconnlistener_free(listener);
+	if (dns)
+		evdns_base_free(dns, 0);
+	if (dns_port)
+		evdns_close_server_port(dns_port);
+	if (filler >= 0)
+		evutil_closesocket(filler);
+	if (full >= 0)
+		evutil_closesocket(full);
+}
+
 struct gai_outcome {
 	int err;
 	struct evutil_addrinfo *ai;
@@ -2113,72 +2581,758 @@ end:
 		evdns_base_free(dns_base, 0);
 }
 
-struct gaic_request_status {
-	int magic;
-	struct event_base *base;
-	struct evdns_base *dns_base;
-	struct evdns_getaddrinfo_request *request;
-	struct event cancel_event;
-	int canceled;
+static struct regress_dns_server_table coalesce_table[] = {
+	{ "coal.example.com", "A", "1.2.3.4", 0, 0 },
+	{ "gai.example.com", "A", "5.6.7.8", 0, 0 },
+	{ NULL, NULL, NULL, 0, 0 }
 };
 
-#define GAIC_MAGIC 0x1234abcd
-
-static int gaic_pending = 0;
-static int gaic_freed = 0;
-
 static void
-gaic_cancel_request_cb(evutil_socket_t fd, short what, void *arg)
+test_coalesce(void *arg)
 {
-	struct gaic_request_status *status = arg;
+	struct regress_dns_server_table table[ARRAY_SIZE(coalesce_table)];
+	struct basic_test_data *data = arg;
+	struct event_base *base = data->base;
+	struct evdns_base *dns = NULL;
+	struct evdns_request *reqs[4];
+	struct generic_dns_callback_result r[4];
+	struct gai_outcome go[3];
+	struct evutil_addrinfo hints;
+	struct sockaddr_in *sin;
+	ev_uint16_t portnum = 0;
+	char buf[64];
+	int i;
 
-	tt_assert(status->magic == GAIC_MAGIC);
-	status->canceled = 1;
-	evdns_getaddrinfo_cancel(status->request);
-	return;
-end:
-	event_base_loopexit(status->base, NULL);
-}
+	memcpy(table, coalesce_table, sizeof(table));
+	memset(go, 0, sizeof(go));
+	tt_assert(regress_dnsserver(base, &portnum, table, NULL));
+	evutil_snprintf(buf, sizeof(buf), "127.0.0.1:%d", (int)portnum);
 
-static void
-gaic_server_cb(struct evdns_server_request *req, void *arg)
-{
-	ev_uint32_t answer = 0x7f000001;
-	tt_assert(req->nquestions);
-	evdns_server_request_add_a_reply(req, req->questions[0]->name, 1,
-	    &answer, 100);
-	evdns_server_request_respond(req, 0);
-	return;
-end:
-	evdns_server_request_respond(req, DNS_ERR_REFUSED);
-}
+	dns = evdns_base_new(base, 0);
+	tt_assert(!evdns_base_nameserver_ip_add(dns, buf));
+	tt_assert(!evdns_base_set_option(dns, "coalesce-queries", "1"));
+
+	for (i = 0; i < 4; ++i) {
+		reqs[i] = evdns_base_resolve_ipv4(dns,
+		    (i & 1) ? "COAL.example.com" : "coal.example.com",
+		    DNS_QUERY_NO_SEARCH, generic_dns_callback, &r[i]);
+		tt_assert(reqs[i]);
+	}
+	/* Canceling the owner of the request hands it over to a waiter;
+	 * canceling a waiter leaves the others alone. */
+	evdns_cancel_request(dns, reqs[0]);
+	evdns_cancel_request(dns, reqs[2]);
 
+	/* Each getaddrinfo issues an A and an AAAA lookup. */
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = PF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	for (i = 0; i < 3; ++i) {
+		tt_assert(evdns_getaddrinfo(dns, "gai.example.com", "80",
+			&hints, gai_cb, &go[i]));
+	}
 
-static void
-gaic_getaddrinfo_cb(int result, struct evutil_addrinfo *res, void *arg)
-{
-	struct gaic_request_status *status = arg;
-	struct event_base *base = status->base;
-	tt_assert(status->magic == GAIC_MAGIC);
+	exit_base = base;
+	n_replies_left = 4;
+	n_gai_results_pending = 3;
+	event_base_dispatch(base);
+	if (n_gai_results_pending > 0) {
+		exit_base_on_no_pending_results = base;
+		event_base_dispatch(base);
+		exit_base_on_no_pending_results = NULL;
+	}
 
-	if (result == EVUTIL_EAI_CANCEL) {
-		tt_assert(status->canceled);
+	tt_int_op(r[0].result, ==, DNS_ERR_CANCEL);
+	tt_int_op(r[2].result, ==, DNS_ERR_CANCEL);
+	for (i = 1; i < 4; i += 2) {
+		tt_int_op(r[i].result, ==, DNS_ERR_NONE);
+		tt_int_op(r[i].count, ==, 1);
+		tt_int_op(((ev_uint32_t*)r[i].addrs)[0], ==, htonl(0x01020304));
+	}
+	for (i = 0; i < 3; ++i) {
+		tt_int_op(go[i].err, ==, 0);
+		tt_assert(go[i].ai);
+		tt_int_op(go[i].ai->ai_family, ==, AF_INET);
+		sin = (struct sockaddr_in *)go[i].ai->ai_addr;
+		tt_int_op(sin->sin_addr.s_addr, ==, htonl(0x05060708));
 	}
-	event_del(&status->cancel_event);
 
-	memset(status, 0xf0, sizeof(*status));
-	free(status);
+	tt_int_op(table[0].seen, ==, 1);
+	tt_int_op(table[1].seen, ==, 2);
 
 end:
-	if (res)
-	{
-		TT_BLATHER(("evutil_freeaddrinfo(%p)", res));
-		evutil_freeaddrinfo(res);
-		++gaic_freed;
+	for (i = 0; i < (int)ARRAY_SIZE(go); ++i) {
+		if (go[i].ai)
+			evutil_freeaddrinfo(go[i].ai);
 	}
-	if (--gaic_pending <= 0)
-		event_base_loopexit(base, NULL);
-}
+	if (dns)
+		evdns_base_free(dns, 0);
+
+	regress_clean_dnsserver();
+}
+
+static struct regress_dns_server_table udp_batch_table[] = {
+	{ "*", "A", "10.0.0.1", 0, 0 },
+	{ NULL, NULL, NULL, 0, 0 }
+};
+
+static void
+test_udp_batch(void *arg)
+{
+	struct regress_dns_server_table table[ARRAY_SIZE(udp_batch_table)];
+	struct basic_test_data *data = arg;
+	struct event_base *base = data->base;
+	struct evdns_base *dns = NULL;
+	struct evdns_server_port *port = NULL;
+	struct evdns_request *req;
+	struct generic_dns_callback_result r[40];
+	ev_uint16_t portnum = 0;
+	char buf[64];
+	int i;
+
+	memcpy(table, udp_batch_table, sizeof(table));
+	port = regress_get_udp_dnsserver(base, &portnum, NULL,
+	    regress_dns_server_cb, table);
+	tt_assert(port);
+	tt_assert(!evdns_server_port_set_option(port, EVDNS_SOPT_UDP_BATCH, 1));
+	evutil_snprintf(buf, sizeof(buf), "127.0.0.1:%d", (int)portnum);
+
+	dns = evdns_base_new(base, 0);
+	tt_assert(!evdns_base_nameserver_ip_add(dns, buf));
+	tt_assert(!evdns_base_set_option(dns, "udp-batch", "1"));
+	tt_assert(!evdns_base_set_option(dns, "max-inflight", "64"));
+
+	/* More queries than fit into one batch; the first one is canceled
+	 * while it is still queued. */
+	for (i = 0; i < (int)ARRAY_SIZE(r); ++i) {
+		evutil_snprintf(buf, sizeof(buf), "host%d.example.com", i);
+		req = evdns_base_resolve_ipv4(dns, buf, DNS_QUERY_NO_SEARCH,
+		    generic_dns_callback, &r[i]);
+		tt_assert(req);
+		if (!i)
+			evdns_cancel_request(dns, req);
+	}
+
+	exit_base = base;
+	n_replies_left = ARRAY_SIZE(r);
+	event_base_dispatch(base);
+
+	tt_int_op(r[0].result, ==, DNS_ERR_CANCEL);
+	for (i = 1; i < (int)ARRAY_SIZE(r); ++i) {
+		tt_int_op(r[i].result, ==, DNS_ERR_NONE);
+		tt_int_op(r[i].count, ==, 1);
+		tt_int_op(((ev_uint32_t*)r[i].addrs)[0], ==, htonl(0x0a000001));
+	}
+	tt_int_op(table[0].seen, ==, ARRAY_SIZE(r) - 1);
+
+end:
+	if (dns)
+		evdns_base_free(dns, 0);
+	if (port)
+		evdns_close_server_port(port);
+}
+
+/* Answers every question, but first has a stranger send the asker a
+ * packet. */
+static void
+udp_batch_stray_cb(struct evdns_server_request *req, void *arg)
+{
+	evutil_socket_t *stray = arg;
+	struct sockaddr_storage ss;
+	ev_uint32_t answer = htonl(0x0a000003);
+	char junk[12];
+	int len;
+
+	memset(junk, 0, sizeof(junk));
+	len = evdns_server_request_get_requesting_addr(req,
+	    (struct sockaddr *)&ss, sizeof(ss));
+	if (len > 0)
+		sendto(*stray, junk, sizeof(junk), 0, (struct sockaddr *)&ss,
+		    (ev_socklen_t)len);
+	evdns_server_request_add_a_reply(req, req->questions[0]->name, 1,
+	    &answer, 10);
+	evdns_server_request_respond(req, 0);
+}
+
+static void
+test_udp_batch_stray(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct event_base *base = data->base;
+	struct evdns_base *dns = NULL;
+	struct evdns_server_port *port = NULL;
+	struct generic_dns_callback_result r;
+	struct sockaddr_in sin;
+	evutil_socket_t stray;
+	ev_uint16_t portnum = 0;
+	char buf[64];
+
+	/* The stranger has to have another address; a port doesn't count. */
+	stray = socket(AF_INET, SOCK_DGRAM, 0);
+	tt_assert(stray != EVUTIL_INVALID_SOCKET);
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(0x7f000002);
+	if (bind(stray, (struct sockaddr *)&sin, sizeof(sin)) < 0)
+		tt_skip();
+
+	port = regress_get_udp_dnsserver(base, &portnum, NULL,
+	    udp_batch_stray_cb, &stray);
+	tt_assert(port);
+	evutil_snprintf(buf, sizeof(buf), "127.0.0.1:%d", (int)portnum);
+
+	dns = evdns_base_new(base, 0);
+	tt_assert(!evdns_base_nameserver_ip_add(dns, buf));
+	tt_assert(!evdns_base_set_option(dns, "udp-batch", "1"));
+	tt_assert(!evdns_base_set_option(dns, "timeout", "1"));
+	tt_assert(!evdns_base_set_option(dns, "attempts", "1"));
+
+	/* The stray packet comes in right before the answer; we skip it, and
+	 * still see the answer behind it. */
+	exit_base = base;
+	n_replies_left = 1;
+	tt_assert(evdns_base_resolve_ipv4(dns, "stray.example.com",
+		DNS_QUERY_NO_SEARCH, generic_dns_callback, &r));
+	event_base_dispatch(base);
+	tt_int_op(r.result, ==, DNS_ERR_NONE);
+	tt_int_op(r.count, ==, 1);
+	tt_int_op(((ev_uint32_t*)r.addrs)[0], ==, htonl(0x0a000003));
+
+end:
+	if (dns)
+		evdns_base_free(dns, 0);
+	if (port)
+		evdns_close_server_port(port);
+	if (stray != EVUTIL_INVALID_SOCKET)
+		evutil_closesocket(stray);
+}
+
+/* Answers every question after 50 msec. */
+static void
+rtt_slow_reply_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct evdns_server_request *req = arg;
+	ev_uint32_t answer = htonl(0x0a000002);
+	evdns_server_request_add_a_reply(req, req->questions[0]->name, 1,
+	    &answer, 100);
+	evdns_server_request_respond(req, 0);
+}
+
+static void
+rtt_slow_server_cb(struct evdns_server_request *req, void *arg)
+{
+	struct timeval tv = { 0, 50000 };
+	int *seen = arg;
+	++*seen;
+	event_base_once(exit_base, -1, EV_TIMEOUT, rtt_slow_reply_cb, req, &tv);
+}
+
+/* Resolve name through dns and wait for the answer. */
+static void
+rtt_resolve_one(struct event_base *base, struct evdns_base *dns,
+    const char *name, struct generic_dns_callback_result *r)
+{
+	exit_base = base;
+	n_replies_left = 1;
+	tt_assert(evdns_base_resolve_ipv4(dns, name, DNS_QUERY_NO_SEARCH,
+		generic_dns_callback, r));
+	event_base_dispatch(base);
+end:
+	;
+}
+
+static void
+test_rtt_select(void *arg)
+{
+	struct regress_dns_server_table table[ARRAY_SIZE(udp_batch_table)];
+	struct basic_test_data *data = arg;
+	struct event_base *base = data->base;
+	struct evdns_base *dns = NULL;
+	struct evdns_server_port *fast = NULL, *slow = NULL;
+	struct generic_dns_callback_result r[40];
+	ev_uint16_t fast_port = 0, slow_port = 0;
+	int slow_seen = 0;
+	char buf[64];
+	int i;
+
+	exit_base = base;
+	memcpy(table, udp_batch_table, sizeof(table));
+	fast = regress_get_udp_dnsserver(base, &fast_port, NULL,
+	    regress_dns_server_cb, table);
+	tt_assert(fast);
+	slow = regress_get_udp_dnsserver(base, &slow_port, NULL,
+	    rtt_slow_server_cb, &slow_seen);
+	tt_assert(slow);
+
+	dns = evdns_base_new(base, 0);
+	evutil_snprintf(buf, sizeof(buf), "127.0.0.1:%d", (int)slow_port);
+	tt_assert(!evdns_base_nameserver_ip_add(dns, buf));
+	evutil_snprintf(buf, sizeof(buf), "127.0.0.1:%d", (int)fast_port);
+	tt_assert(!evdns_base_nameserver_ip_add(dns, buf));
+	tt_assert(!evdns_base_set_option(dns, "rtt-select", "1"));
+	tt_assert(!evdns_base_set_option(dns, "max-inflight", "64"));
+
+	/* Let both servers be measured. */
+	for (i = 0; i < 10; ++i) {
+		evutil_snprintf(buf, sizeof(buf), "warm%d.example.com", i);
+		rtt_resolve_one(base, dns, buf, &r[0]);
+		tt_int_op(r[0].result, ==, DNS_ERR_NONE);
+	}
+
+	slow_seen = 0;
+	table[0].seen = 0;
+	for (i = 0; i < (int)ARRAY_SIZE(r); ++i) {
+		evutil_snprintf(buf, sizeof(buf), "host%d.example.com", i);
+		tt_assert(evdns_base_resolve_ipv4(dns, buf, DNS_QUERY_NO_SEARCH,
+			generic_dns_callback, &r[i]));
+	}
+	n_replies_left = ARRAY_SIZE(r);
+	event_base_dispatch(base);
+
+	for (i = 0; i < (int)ARRAY_SIZE(r); ++i)
+		tt_int_op(r[i].result, ==, DNS_ERR_NONE);
+	/* Round robin would send half of them to the slow server. */
+	tt_int_op(slow_seen + table[0].seen, ==, ARRAY_SIZE(r));
+	tt_int_op(slow_seen, <, 8);
+
+end:
+	if (dns)
+		evdns_base_free(dns, 0);
+	if (fast)
+		evdns_close_server_port(fast);
+	if (slow)
+		evdns_close_server_port(slow);
+}
+
+/* Server a drops "lost.example.com"; server b answers everything. */
+static struct regress_dns_server_table rtt_lossy_table[] = {
+	{ "lost.example.com", "err", "67", 0, 0 },
+	{ "*", "A", "10.0.0.1", 0, 0 },
+	{ NULL, NULL, NULL, 0, 0 }
+};
+
+/* With two servers used in turn, resolve lost.example.com twice (so
+ * that the lossy server gets one of them) and check that neither waits
+ * for the 5 second timeout. */
+static void
+rtt_lossy_test(struct event_base *base, const char *option)
+{
+	struct regress_dns_server_table table_a[ARRAY_SIZE(rtt_lossy_table)];
+	struct regress_dns_server_table table_b[ARRAY_SIZE(udp_batch_table)];
+	struct evdns_base *dns = NULL;
+	struct evdns_server_port *a = NULL, *b = NULL;
+	struct generic_dns_callback_result r[2];
+	struct timeval before, after, elapsed;
+	ev_uint16_t port_a = 0, port_b = 0;
+	char buf[64];
+	int i;
+
+	memcpy(table_a, rtt_lossy_table, sizeof(table_a));
+	memcpy(table_b, udp_batch_table, sizeof(table_b));
+	a = regress_get_udp_dnsserver(base, &port_a, NULL,
+	    regress_dns_server_cb, table_a);
+	tt_assert(a);
+	b = regress_get_udp_dnsserver(base, &port_b, NULL,
+	    regress_dns_server_cb, table_b);
+	tt_assert(b);
+
+	dns = evdns_base_new(base, 0);
+	evutil_snprintf(buf, sizeof(buf), "127.0.0.1:%d", (int)port_a);
+	tt_assert(!evdns_base_nameserver_ip_add(dns, buf));
+	evutil_snprintf(buf, sizeof(buf), "127.0.0.1:%d", (int)port_b);
+	tt_assert(!evdns_base_nameserver_ip_add(dns, buf));
+	tt_assert(!evdns_base_set_option(dns, "timeout", "5"));
+	tt_assert(!evdns_base_set_option(dns, option, "1"));
+
+	for (i = 0; i < 16; ++i) {
+		evutil_snprintf(buf, sizeof(buf), "warm%d.example.com", i);
+		rtt_resolve_one(base, dns, buf, &r[0]);
+		tt_int_op(r[0].result, ==, DNS_ERR_NONE);
+	}
+	tt_int_op(table_a[1].seen, >, 0);
+	tt_int_op(table_b[0].seen, >, 0);
+
+	evutil_gettimeofday(&before, NULL);
+	for (i = 0; i < 2; ++i) {
+		tt_assert(evdns_base_resolve_ipv4(dns, "lost.example.com",
+			DNS_QUERY_NO_SEARCH, generic_dns_callback, &r[i]));
+	}
+	exit_base = base;
+	n_replies_left = 2;
+	event_base_dispatch(base);
+	evutil_gettimeofday(&after, NULL);
+	evutil_timersub(&after, &before, &elapsed);
+
+	tt_int_op(r[0].result, ==, DNS_ERR_NONE);
+	tt_int_op(r[1].result, ==, DNS_ERR_NONE);
+	tt_int_op(table_a[0].seen, >=, 1);
+	tt_int_op(elapsed.tv_sec, <, 2);
+
+end:
+	if (dns)
+		evdns_base_free(dns, 0);
+	if (a)
+		evdns_close_server_port(a);
+	if (b)
+		evdns_close_server_port(b);
+}
+
+static void
+test_hedge(void *arg)
+{
+	struct basic_test_data *data = arg;
+	rtt_lossy_test(data->base, "hedge-percentile");
+}
+
+static void
+test_adaptive_timeout(void *arg)
+{
+	struct basic_test_data *data = arg;
+	rtt_lossy_test(data->base, "adaptive-timeout");
+}
+
+static const char hosts_index_file[] =
+	"# comment\n"
+	"10.0.0.1   alpha Alpha-Alias   # trailing comment\n"
+	"10.0.0.2   beta\n"
+	"10.0.0.3   alpha\n"
+	"::1        ip6host\n"
+	"10.0.0.4   ALPHA\n";
+
+/* Resolve nodename into go.  Returns the request if the answer has to
+ * come from a nameserver rather than from the hosts file. */
+static struct evdns_getaddrinfo_request *
+hosts_index_lookup(struct evdns_base *dns, const char *nodename,
+    struct gai_outcome *go)
+{
+	struct evutil_addrinfo hints;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = PF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (go->ai)
+		evutil_freeaddrinfo(go->ai);
+	memset(go, 0, sizeof(*go));
+	return evdns_getaddrinfo(dns, nodename, "80", &hints, gai_cb, go);
+}
+
+static void
+hosts_index_ptr_cb(int result, char type, int count, int ttl,
+    void *addresses, void *arg)
+{
+	char *name = arg;
+	if (result == DNS_ERR_NONE && type == DNS_PTR)
+		evutil_snprintf(name, 64, "%s", ((char **)addresses)[0]);
+	else
+		evutil_snprintf(name, 64, "(error)");
+	if (--n_replies_left == 0)
+		event_base_loopexit(exit_base, NULL);
+}
+
+static void
+test_hosts_index(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct event_base *base = data->base;
+	struct evdns_base *dns = NULL;
+	struct gai_outcome go;
+	struct evdns_getaddrinfo_request *req;
+	struct evutil_addrinfo *ai;
+	struct in_addr in;
+	struct in6_addr in6;
+	struct timeval tv = { 0, 300000 };
+	char names[3][64];
+	char *filename = NULL;
+	char *big = NULL;
+	size_t big_len = 0, big_size = 64 * 5000;
+	FILE *f;
+	int fd, i;
+
+	memset(&go, 0, sizeof(go));
+	fd = regress_make_tmpfile(hosts_index_file, strlen(hosts_index_file),
+	    &filename);
+	tt_int_op(fd, !=, -1);
+	close(fd);
+
+	dns = evdns_base_new(base, 0);
+	tt_assert(dns);
+	tt_int_op(evdns_base_load_hosts(dns, filename), ==, 0);
+
+	/* Every address for a name, case-insensitively, in file order. */
+	tt_assert(!hosts_index_lookup(dns, "aLpHa", &go));
+	tt_int_op(go.err, ==, 0);
+	ai = go.ai;
+	test_ai_eq(ai, "10.0.0.1:80", SOCK_STREAM, IPPROTO_TCP);
+	ai = ai->ai_next;
+	test_ai_eq(ai, "10.0.0.3:80", SOCK_STREAM, IPPROTO_TCP);
+	ai = ai->ai_next;
+	test_ai_eq(ai, "10.0.0.4:80", SOCK_STREAM, IPPROTO_TCP);
+	tt_ptr_op(ai->ai_next, ==, NULL);
+
+	tt_assert(!hosts_index_lookup(dns, "alpha-alias", &go));
+	tt_int_op(go.err, ==, 0);
+	test_ai_eq(go.ai, "10.0.0.1:80", SOCK_STREAM, IPPROTO_TCP);
+	tt_ptr_op(go.ai->ai_next, ==, NULL);
+
+	/* Reverse lookups give the first name for the address. */
+	tt_assert(!evdns_base_set_option(dns, "hosts-reverse", "1"));
+	evutil_inet_pton(AF_INET, "10.0.0.1", &in);
+	tt_assert(evdns_base_resolve_reverse(dns, &in, 0,
+		hosts_index_ptr_cb, names[0]));
+	evutil_inet_pton(AF_INET, "10.0.0.2", &in);
+	tt_assert(evdns_base_resolve_reverse(dns, &in, 0,
+		hosts_index_ptr_cb, names[1]));
+	evutil_inet_pton(AF_INET6, "::1", &in6);
+	tt_assert(evdns_base_resolve_reverse_ipv6(dns, &in6, 0,
+		hosts_index_ptr_cb, names[2]));
+	exit_base = base;
+	n_replies_left = 3;
+	event_base_dispatch(base);
+	tt_str_op(names[0], ==, "alpha");
+	tt_str_op(names[1], ==, "beta");
+	tt_str_op(names[2], ==, "ip6host");
+
+	/* Replace the file with one that takes several loop iterations to
+	 * parse, and wait for the reload. */
+	tt_assert(!evdns_base_set_option(dns, "hosts-reload-interval", "0.05"));
+	big = malloc(big_size);
+	tt_assert(big);
+	for (i = 0; i < 5000; ++i) {
+		big_len += evutil_snprintf(big + big_len, big_size - big_len,
+		    "10.1.%d.%d host%d.example.com\n", i / 256, i % 256, i);
+	}
+	f = fopen(filename, "w");
+	tt_assert(f);
+	tt_int_op(fwrite(big, 1, big_len, f), ==, big_len);
+	fclose(f);
+
+	event_base_loopexit(base, &tv);
+	event_base_dispatch(base);
+
+	tt_assert(!hosts_index_lookup(dns, "host4999.example.com", &go));
+	tt_int_op(go.err, ==, 0);
+	test_ai_eq(go.ai, "10.1.19.135:80", SOCK_STREAM, IPPROTO_TCP);
+	/* beta is gone, so it has to be looked up for real. */
+	req = hosts_index_lookup(dns, "beta", &go);
+	tt_assert(req);
+	evdns_getaddrinfo_cancel(req);
+	event_base_loop(base, EVLOOP_NONBLOCK);
+
+end:
+	if (go.ai)
+		evutil_freeaddrinfo(go.ai);
+	if (dns)
+		evdns_base_free(dns, 0);
+	if (filename) {
+		unlink(filename);
+		free(filename);
+	}
+	free(big);
+}
+
+#define TRANS_STRESS_N 20000
+#define TRANS_STRESS_BURST 100
+
+/* The server holds every query until it has all TRANS_STRESS_N of them,
+ * so that they are all in flight at once, and then answers them
+ * TRANS_STRESS_BURST per loop iteration.  The client sends them at the
+ * same pace, so that no datagram is dropped. */
+struct trans_stress {
+	struct evdns_base *dns;
+	struct evdns_server_request **held;
+	struct event *issue_ev;
+	struct event *answer_ev;
+	int n_issued;
+	int n_held;
+	int n_answered;
+	int n_ok;
+	int n_done;
+};
+
+static const struct timeval trans_stress_tick = { 0, 0 };
+
+static void
+trans_stress_server_cb(struct evdns_server_request *req, void *arg)
+{
+	struct trans_stress *ts = arg;
+	ts->held[ts->n_held++] = req;
+	if (ts->n_held == TRANS_STRESS_N)
+		evtimer_add(ts->answer_ev, &trans_stress_tick);
+}
+
+static void
+trans_stress_answer_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct trans_stress *ts = arg;
+	int i, idx;
+
+	for (i = 0; i < TRANS_STRESS_BURST && ts->n_answered < ts->n_held; ++i) {
+		struct evdns_server_request *req = ts->held[ts->n_answered++];
+		ev_uint32_t answer;
+		/* skip "host", whatever its case */
+		if (sscanf(req->questions[0]->name + 4, "%d", &idx) != 1)
+			idx = -1;
+		answer = htonl(0x0a000000 | (ev_uint32_t)idx);
+		evdns_server_request_add_a_reply(req, req->questions[0]->name,
+		    1, &answer, 100);
+		evdns_server_request_respond(req, 0);
+	}
+	if (ts->n_answered < ts->n_held)
+		evtimer_add(ts->answer_ev, &trans_stress_tick);
+}
+
+static struct trans_stress *trans_stress_state;
+
+static void
+trans_stress_dns_cb(int result, char type, int count, int ttl,
+    void *addresses, void *arg)
+{
+	struct trans_stress *ts = trans_stress_state;
+	int idx = (int)(ev_intptr_t)arg;
+
+	if (result == DNS_ERR_NONE && type == DNS_IPv4_A && count == 1 &&
+	    ((ev_uint32_t *)addresses)[0] == htonl(0x0a000000 | idx))
+		++ts->n_ok;
+	if (++ts->n_done == TRANS_STRESS_N)
+		event_base_loopexit(exit_base, NULL);
+}
+
+static void
+trans_stress_issue_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct trans_stress *ts = arg;
+	char name[64];
+	int i;
+
+	for (i = 0; i < TRANS_STRESS_BURST && ts->n_issued < TRANS_STRESS_N; ++i) {
+		evutil_snprintf(name, sizeof(name), "host%d.example.com",
+		    ts->n_issued);
+		if (!evdns_base_resolve_ipv4(ts->dns, name, DNS_QUERY_NO_SEARCH,
+			trans_stress_dns_cb, (void *)(ev_intptr_t)ts->n_issued))
+			break;
+		++ts->n_issued;
+	}
+	if (ts->n_issued < TRANS_STRESS_N)
+		evtimer_add(ts->issue_ev, &trans_stress_tick);
+}
+
+static void
+test_trans_id_stress(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct event_base *base = data->base;
+	struct evdns_server_port *port = NULL;
+	struct trans_stress ts;
+	struct timeval limit = { 60, 0 };
+	ev_uint16_t portnum = 0;
+	char buf[64];
+
+	memset(&ts, 0, sizeof(ts));
+	trans_stress_state = &ts;
+	ts.held = calloc(TRANS_STRESS_N, sizeof(*ts.held));
+	tt_assert(ts.held);
+	ts.issue_ev = evtimer_new(base, trans_stress_issue_cb, &ts);
+	ts.answer_ev = evtimer_new(base, trans_stress_answer_cb, &ts);
+
+	port = regress_get_udp_dnsserver(base, &portnum, NULL,
+	    trans_stress_server_cb, &ts);
+	tt_assert(port);
+	evutil_snprintf(buf, sizeof(buf), "127.0.0.1:%d", (int)portnum);
+
+	ts.dns = evdns_base_new(base, 0);
+	tt_assert(!evdns_base_nameserver_ip_add(ts.dns, buf));
+	evutil_snprintf(buf, sizeof(buf), "%d", TRANS_STRESS_N);
+	tt_assert(!evdns_base_set_option(ts.dns, "max-inflight", buf));
+	tt_assert(!evdns_base_set_option(ts.dns, "timeout", "60"));
+
+	exit_base = base;
+	evtimer_add(ts.issue_ev, &trans_stress_tick);
+	event_base_loopexit(base, &limit);
+	event_base_dispatch(base);
+
+	tt_int_op(ts.n_issued, ==, TRANS_STRESS_N);
+	tt_int_op(ts.n_held, ==, TRANS_STRESS_N);
+	tt_int_op(ts.n_done, ==, TRANS_STRESS_N);
+	tt_int_op(ts.n_ok, ==, TRANS_STRESS_N);
+
+end:
+	if (ts.dns)
+		evdns_base_free(ts.dns, 0);
+	if (port)
+		evdns_close_server_port(port);
+	if (ts.issue_ev)
+		event_free(ts.issue_ev);
+	if (ts.answer_ev)
+		event_free(ts.answer_ev);
+	free(ts.held);
+}
+
+struct gaic_request_status {
+	int magic;
+	struct event_base *base;
+	struct evdns_base *dns_base;
+	struct evdns_getaddrinfo_request *request;
+	struct event cancel_event;
+	int canceled;
+};
+
+#define GAIC_MAGIC 0x1234abcd
+
+static int gaic_pending = 0;
+static int gaic_freed = 0;
+
+static void
+gaic_cancel_request_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct gaic_request_status *status = arg;
+
+	tt_assert(status->magic == GAIC_MAGIC);
+	status->canceled = 1;
+	evdns_getaddrinfo_cancel(status->request);
+	return;
+end:
+	event_base_loopexit(status->base, NULL);
+}
+
+static void
+gaic_server_cb(struct evdns_server_request *req, void *arg)
+{
+	ev_uint32_t answer = 0x7f000001;
+	tt_assert(req->nquestions);
+	evdns_server_request_add_a_reply(req, req->questions[0]->name, 1,
+	    &answer, 100);
+	evdns_server_request_respond(req, 0);
+	return;
+end:
+	evdns_server_request_respond(req, DNS_ERR_REFUSED);
+}
+
+
+static void
+gaic_getaddrinfo_cb(int result, struct evutil_addrinfo *res, void *arg)
+{
+	struct gaic_request_status *status = arg;
+	struct event_base *base = status->base;
+	tt_assert(status->magic == GAIC_MAGIC);
+
+	if (result == EVUTIL_EAI_CANCEL) {
+		tt_assert(status->canceled);
+	}
+	event_del(&status->cancel_event);
+
+	memset(status, 0xf0, sizeof(*status));
+	free(status);
+
+end:
+	if (res)
+	{
+		TT_BLATHER(("evutil_freeaddrinfo(%p)", res));
+		evutil_freeaddrinfo(res);
+		++gaic_freed;
+	}
+	if (--gaic_pending <= 0)
+		event_base_loopexit(base, NULL);
+}
 
 static void
 gaic_launch(struct event_base *base, struct evdns_base *dns_base, unsigned i)
@@ -2879,6 +4033,319 @@ end:
 	regress_clean_dnsserver();
 }
 
+static void
+close_accept_cb(struct evconnlistener *l, evutil_socket_t fd,
+    struct sockaddr *s, int socklen, void *arg)
+{
+	int *p = arg;
+	(*p)++;
+	evutil_closesocket(fd);
+}
+
+static void
+test_tcp_reconnect_backoff(void *arg)
+{
+	struct generic_dns_callback_result r;
+	struct basic_test_data *data = arg;
+	struct event_base *base = data->base;
+	struct evdns_base *dns = NULL;
+	struct evconnlistener *listener = NULL;
+	struct sockaddr_in sin;
+	struct timeval start, end;
+	int n_accept = 0;
+	char buf[64];
+
+	exit_base = base;
+
+	/* A nameserver that hangs up on us without answering. */
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(0x7f000001);
+	listener = evconnlistener_new_bind(base, close_accept_cb, &n_accept,
+	    LEV_OPT_REUSEABLE|LEV_OPT_CLOSE_ON_EXEC, -1,
+	    (struct sockaddr *)&sin, sizeof(sin));
+	tt_assert(listener);
+	evutil_snprintf(buf, sizeof(buf), "127.0.0.1:%d",
+	    regress_get_socket_port(evconnlistener_get_fd(listener)));
+
+	dns = evdns_base_new(base, 0);
+	tt_assert(!evdns_base_nameserver_ip_add(dns, buf));
+	tt_assert(!evdns_base_set_option(dns, "use-vc", NULL));
+	tt_assert(!evdns_base_set_option(dns, "timeout", "5"));
+	tt_assert(!evdns_base_set_option(dns, "attempts", "4"));
+	tt_assert(!evdns_base_set_option(dns, "tcp-reconnect-backoff", "0.05"));
+
+	/* We try again after 50, 100 and 200 msec rather than waiting for
+	 * the request timeout each time, then give up. */
+	evutil_gettimeofday(&start, NULL);
+	n_replies_left = 1;
+	tt_assert(evdns_base_resolve_ipv4(dns, "example.com", 0,
+		generic_dns_callback, &r));
+	event_base_dispatch(base);
+	evutil_gettimeofday(&end, NULL);
+	evutil_timersub(&end, &start, &end);
+
+	tt_int_op(r.result, ==, DNS_ERR_TIMEOUT);
+	tt_int_op(n_accept, ==, 4);
+	tt_int_op(end.tv_sec, <, 2);
+	tt_int_op(end.tv_sec * 1000000 + end.tv_usec, >=, 300000);
+
+end:
+	if (dns)
+		evdns_base_free(dns, 0);
+	if (listener)
+		evconnlistener_free(listener);
+}
+
+static void
+test_tcp_reconnect_backoff_timeout(void *arg)
+{
+	struct generic_dns_callback_result r[2];
+	struct basic_test_data *data = arg;
+	struct event_base *base = data->base;
+	struct evdns_base *dns = NULL;
+	struct evconnlistener *listener = NULL;
+	struct sockaddr_in sin;
+	struct timeval start, end;
+	int n_accept = 0;
+	char buf[64];
+
+	exit_base = base;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(0x7f000001);
+	listener = evconnlistener_new_bind(base, close_accept_cb, &n_accept,
+	    LEV_OPT_REUSEABLE|LEV_OPT_CLOSE_ON_EXEC, -1,
+	    (struct sockaddr *)&sin, sizeof(sin));
+	tt_assert(listener);
+	evutil_snprintf(buf, sizeof(buf), "127.0.0.1:%d",
+	    regress_get_socket_port(evconnlistener_get_fd(listener)));
+
+	dns = evdns_base_new(base, 0);
+	tt_assert(!evdns_base_nameserver_ip_add(dns, buf));
+	tt_assert(!evdns_base_set_option(dns, "use-vc", NULL));
+	tt_assert(!evdns_base_set_option(dns, "timeout", "0.2"));
+	tt_assert(!evdns_base_set_option(dns, "attempts", "2"));
+	tt_assert(!evdns_base_set_option(dns, "tcp-reconnect-backoff", "10"));
+
+	/* The first connection fails, so the next one is 10 seconds away.
+	 * Requests sent meanwhile, or still waiting, time out as usual. */
+	memset(r, 0, sizeof(r));
+	evutil_gettimeofday(&start, NULL);
+	n_replies_left = 2;
+	tt_assert(evdns_base_resolve_ipv4(dns, "example.com", 0,
+		generic_dns_callback, &r[0]));
+	dns_cache_wait_(base, 100000);
+	tt_int_op(n_accept, ==, 1);
+	tt_assert(evdns_base_resolve_ipv4(dns, "example.org", 0,
+		generic_dns_callback, &r[1]));
+	event_base_dispatch(base);
+	evutil_gettimeofday(&end, NULL);
+	evutil_timersub(&end, &start, &end);
+
+	tt_int_op(r[0].result, ==, DNS_ERR_TIMEOUT);
+	tt_int_op(r[1].result, ==, DNS_ERR_TIMEOUT);
+	tt_int_op(n_accept, ==, 1);
+	tt_int_op(end.tv_sec, <, 2);
+
+	/* Dropping the nameserver drops its pending reconnection too. */
+	tt_assert(!evdns_base_clear_nameservers_and_suspend(dns));
+	/* Only the listener is left. */
+	tt_int_op(event_base_get_num_events(base, EVENT_BASE_COUNT_ADDED), ==,
+	    1);
+
+end:
+	if (dns)
+		evdns_base_free(dns, 0);
+	if (listener)
+		evconnlistener_free(listener);
+}
+
+static void
+server_group_cb(struct evdns_server_request *req, void *data)
+{
+	int *count = data;
+	struct in_addr in;
+
+	++*count;
+	in.s_addr = htonl(0x0a000001);
+	evdns_server_request_add_a_reply(req, req->questions[0]->name, 1,
+	    &in, 10);
+	evdns_server_request_respond(req, 0);
+}
+
+static void
+test_server_port_group(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct event_base *base = data->base;
+	struct event_base *bases[2];
+	struct evdns_server_port_group *group = NULL;
+	struct evdns_base *dns[8];
+	struct generic_dns_callback_result r[9];
+	struct sockaddr_in sin;
+	ev_socklen_t slen = sizeof(sin);
+	evutil_socket_t fd;
+	int counts[2] = { 0, 0 };
+	char buf[64];
+	int i;
+
+	memset(dns, 0, sizeof(dns));
+#ifndef __linux__
+	tt_skip();
+#endif
+	exit_base = base;
+
+	/* Find a port that is free for both UDP and TCP. */
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(0x7f000001);
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	tt_assert(fd >= 0);
+	tt_assert(!bind(fd, (struct sockaddr *)&sin, sizeof(sin)));
+	tt_assert(!getsockname(fd, (struct sockaddr *)&sin, &slen));
+	evutil_closesocket(fd);
+
+	/* Two shards on the same base: what matters here is that both
+	 * sockets share the address and answer. */
+	bases[0] = bases[1] = base;
+	group = evdns_add_server_port_group(bases, 2,
+	    (struct sockaddr *)&sin, sizeof(sin), EVDNS_SERVER_GROUP_TCP,
+	    server_group_cb, &counts[0]);
+	tt_assert(group);
+	tt_assert(evdns_server_port_group_get_port(group, 1, 0));
+	tt_assert(evdns_server_port_group_get_port(group, 1, 1));
+	tt_assert(!evdns_server_port_group_get_port(group, 2, 0));
+	tt_int_op(evdns_server_port_group_set_callback(group, 1,
+		server_group_cb, &counts[1]), ==, 0);
+	tt_int_op(evdns_server_port_group_set_callback(group, 2,
+		server_group_cb, &counts[1]), ==, -1);
+
+	evutil_snprintf(buf, sizeof(buf), "127.0.0.1:%d",
+	    (int)ntohs(sin.sin_port));
+	memset(r, 0, sizeof(r));
+	n_replies_left = ARRAY_SIZE(r);
+	for (i = 0; i < (int)ARRAY_SIZE(dns); ++i) {
+		dns[i] = evdns_base_new(base, 0);
+		tt_assert(dns[i]);
+		tt_assert(!evdns_base_nameserver_ip_add(dns[i], buf));
+		tt_assert(evdns_base_resolve_ipv4(dns[i], "group.example.com",
+			DNS_NO_SEARCH, generic_dns_callback, &r[i]));
+	}
+	tt_assert(evdns_base_resolve_ipv4(dns[0], "tcp.example.com",
+		DNS_NO_SEARCH|DNS_QUERY_USEVC, generic_dns_callback, &r[8]));
+	event_base_dispatch(base);
+
+	for (i = 0; i < (int)ARRAY_SIZE(r); ++i) {
+		tt_int_op(r[i].result, ==, DNS_ERR_NONE);
+		tt_int_op(((ev_uint32_t *)r[i].addrs)[0], ==, htonl(0x0a000001));
+	}
+	tt_int_op(counts[0] + counts[1], ==, ARRAY_SIZE(r));
+
+end:
+	for (i = 0; i < (int)ARRAY_SIZE(dns); ++i) {
+		if (dns[i])
+			evdns_base_free(dns[i], 0);
+	}
+	if (group)
+		evdns_close_server_port_group(group);
+}
+
+static void
+server_template_cb(struct evdns_server_request *req, void *data)
+{
+	struct evdns_server_template *tmpl = data;
+	struct in_addr in;
+
+	if (!evdns_server_request_respond_template(req, tmpl))
+		return;
+	/* Not the question of the template: answer the slow way. */
+	in.s_addr = htonl(0x0a000009);
+	evdns_server_request_add_a_reply(req, req->questions[0]->name, 1,
+	    &in, 10);
+	evdns_server_request_respond(req, 0);
+}
+
+static void
+test_server_template(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct event_base *base = data->base;
+	struct evdns_server_template *tmpl = NULL;
+	struct evdns_server_port *port = NULL;
+	struct evdns_base *dns = NULL;
+	struct generic_dns_callback_result r[3];
+	ev_uint32_t addrs[40];
+	ev_uint16_t portnum = 0;
+	evutil_socket_t sock;
+	char buf[64];
+	int i;
+
+	exit_base = base;
+
+	tmpl = evdns_server_template_new("www.example.com", EVDNS_TYPE_A,
+	    EVDNS_CLASS_INET);
+	tt_assert(tmpl);
+	for (i = 0; i < (int)ARRAY_SIZE(addrs); ++i)
+		addrs[i] = htonl(0x0a010000 + i);
+	tt_assert(!evdns_server_template_add_reply(tmpl,
+		EVDNS_ANSWER_SECTION, "www.example.com", EVDNS_TYPE_CNAME,
+		EVDNS_CLASS_INET, 60, -1, 1, "web.example.com"));
+	for (i = 0; i < (int)ARRAY_SIZE(addrs); ++i) {
+		tt_assert(!evdns_server_template_add_reply(tmpl,
+			EVDNS_ANSWER_SECTION, "web.example.com", EVDNS_TYPE_A,
+			EVDNS_CLASS_INET, 60, 4, 0, (const char *)&addrs[i]));
+	}
+	tt_assert(!evdns_server_template_add_reply(tmpl,
+		EVDNS_AUTHORITY_SECTION, "example.com", EVDNS_TYPE_NS,
+		EVDNS_CLASS_INET, 60, -1, 1, "ns.example.com"));
+	/* Sections have to come in order. */
+	tt_assert(evdns_server_template_add_reply(tmpl,
+		EVDNS_ANSWER_SECTION, "www.example.com", EVDNS_TYPE_A,
+		EVDNS_CLASS_INET, 60, 4, 0, (const char *)&addrs[0]));
+
+	port = regress_get_udp_dnsserver(base, &portnum, &sock,
+	    server_template_cb, tmpl);
+	tt_assert(port);
+	evutil_snprintf(buf, sizeof(buf), "127.0.0.1:%d", (int)portnum);
+	dns = evdns_base_new(base, 0);
+	tt_assert(!evdns_base_nameserver_ip_add(dns, buf));
+	tt_assert(!evdns_base_set_option(dns, "randomize-case", "1"));
+	tt_assert(!evdns_base_set_option(dns, "edns-udp-size", "4096"));
+
+	/* Forty addresses need more than 512 bytes, so this only works if
+	 * the template honours EDNS0. */
+	memset(r, 0, sizeof(r));
+	n_replies_left = ARRAY_SIZE(r);
+	evdns_base_resolve_ipv4(dns, "WWW.example.com", DNS_NO_SEARCH,
+	    generic_dns_callback, &r[0]);
+	evdns_base_resolve_ipv4(dns, "www.example.com", DNS_NO_SEARCH,
+	    generic_dns_callback, &r[1]);
+	evdns_base_resolve_ipv4(dns, "other.example.com", DNS_NO_SEARCH,
+	    generic_dns_callback, &r[2]);
+	event_base_dispatch(base);
+
+	for (i = 0; i < 2; ++i) {
+		tt_int_op(r[i].result, ==, DNS_ERR_NONE);
+		tt_int_op(r[i].count, ==, ARRAY_SIZE(addrs));
+		tt_int_op(r[i].ttl, ==, 60);
+		tt_int_op(((ev_uint32_t *)r[i].addrs)[0], ==, addrs[0]);
+		tt_int_op(((ev_uint32_t *)r[i].addrs)[39], ==, addrs[39]);
+	}
+	tt_int_op(r[2].result, ==, DNS_ERR_NONE);
+	tt_int_op(r[2].count, ==, 1);
+	tt_int_op(((ev_uint32_t *)r[2].addrs)[0], ==, htonl(0x0a000009));
+
+end:
+	if (dns)
+		evdns_base_free(dns, 0);
+	if (port)
+		evdns_close_server_port(port);
+	if (tmpl)
+		evdns_server_template_free(tmpl);
+}
+
 static void
 test_edns(void *arg)
 {
@@ -3057,6 +4524,9 @@ test_set_server_option(void *arg)
 		tt_assert(FAIL == evdns_server_port_set_option(udp_port, tcp_options[i], 0));
 		tt_assert(FAIL == evdns_server_port_set_option(udp_port, tcp_options[i], 100));
 	}
+	tt_assert(SUCCESS == evdns_server_port_set_option(udp_port, EVDNS_SOPT_UDP_BATCH, 1));
+	tt_assert(SUCCESS == evdns_server_port_set_option(udp_port, EVDNS_SOPT_UDP_BATCH, 0));
+	tt_assert(FAIL == evdns_server_port_set_option(tcp_port, EVDNS_SOPT_UDP_BATCH, 1));
 
 #undef SUCCESS
 #undef FAIL
@@ -3084,6 +4554,11 @@ struct testcase_t dns_testcases[] = {
 	{ "search_empty", dns_search_empty_test, TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
 	{ "search", dns_search_test, TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
 	{ "search_lower", dns_search_lower_test, TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "cache", dns_cache_test, TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "cache_prefetch", dns_cache_prefetch_test, TT_FORK|TT_NEED_BASE,
+	  &basic_setup, NULL },
+	{ "cache_stale", dns_cache_stale_test, TT_FORK|TT_NEED_BASE,
+	  &basic_setup, NULL },
 	{ "search_cancel", dns_search_cancel_test,
 	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
 	{ "retry", dns_retry_test, TT_FORK|TT_NEED_BASE|TT_NO_LOGS, &basic_setup, NULL },
@@ -3102,6 +4577,9 @@ struct testcase_t dns_testcases[] = {
 #endif
 	{ "bufferevent_connect_hostname_hints", test_bufferevent_connect_hostname,
 	  TT_FORK|TT_NEED_BASE, &basic_setup, (char*)"hints" },
+	{ "bufferevent_connect_hostname_race",
+	  test_bufferevent_connect_hostname_race, TT_FORK|TT_NEED_BASE,
+	  &basic_setup, NULL },
 	{ "disable_when_inactive", dns_disable_when_inactive_test,
 	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
 	{ "disable_when_inactive_no_ns", dns_disable_when_inactive_no_ns_test,
@@ -3124,6 +4602,17 @@ struct testcase_t dns_testcases[] = {
 	  TT_FORK|TT_NEED_BASE, &basic_setup, (char*)"" },
 	{ "getaddrinfo_cancel_stress", test_getaddrinfo_async_cancel_stress,
 	  TT_FORK, NULL, NULL },
+	{ "coalesce", test_coalesce, TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "udp_batch", test_udp_batch, TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "udp_batch_stray", test_udp_batch_stray,
+	  TT_FORK|TT_NEED_BASE|TT_NO_LOGS, &basic_setup, NULL },
+	{ "rtt_select", test_rtt_select, TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "hedge", test_hedge, TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "adaptive_timeout", test_adaptive_timeout, TT_FORK|TT_NEED_BASE,
+	  &basic_setup, NULL },
+	{ "hosts_index", test_hosts_index, TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
+	{ "trans_id_stress", test_trans_id_stress, TT_FORK|TT_NEED_BASE,
+	  &basic_setup, NULL },
 
 #ifdef EVENT_SET_MEM_FUNCTIONS_IMPLEMENTED
 	{ "leak_shutdown", test_dbg_leak_shutdown, TT_FORK, &testleak_funcs, NULL },
@@ -3158,6 +4647,14 @@ struct testcase_t dns_testcases[] = {
 	  TT_FORK | TT_NEED_BASE | TT_RETRIABLE, &basic_setup, NULL },
 	{ "tcp_timeout", test_tcp_timeout,
 	  TT_FORK | TT_NEED_BASE | TT_RETRIABLE | TT_NO_LOGS, &basic_setup, NULL },
+	{ "tcp_reconnect_backoff", test_tcp_reconnect_backoff,
+	  TT_FORK | TT_NEED_BASE | TT_NO_LOGS, &basic_setup, NULL },
+	{ "tcp_reconnect_backoff_timeout", test_tcp_reconnect_backoff_timeout,
+	  TT_FORK | TT_NEED_BASE | TT_NO_LOGS, &basic_setup, NULL },
+	{ "server_port_group", test_server_port_group,
+	  TT_FORK | TT_NEED_BASE, &basic_setup, NULL },
+	{ "server_template", test_server_template,
+	  TT_FORK | TT_NEED_BASE, &basic_setup, NULL },
 
 	{ "set_SO_RCVBUF_SO_SNDBUF", test_set_so_rcvbuf_so_sndbuf,
 	  TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
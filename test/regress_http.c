@@ -5952,6 +5952,7 @@ struct testcase_t http_testcases[] = {
 	HTTP(terminate_chunked_oneshot),
 	HTTP(on_complete),
 	HTTP(ws),
+	HTTP(ws_keepalive),
 
 	HTTP(highport),
 	HTTP(dispatcher),
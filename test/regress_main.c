@@ -452,6 +452,7 @@ struct testgroup_t testgroups[] = {
 	{ "evtag/", evtag_testcases },
 	{ "rpc/", rpc_testcases },
 	{ "thread/", thread_testcases },
+	{ "dgram/", dgram_testcases },
 	{ "listener/", listener_testcases },
 	{ "watch/", watch_testcases },
 	{ "event_timer/", event_timer_testcases },
@@ -54,6 +54,8 @@
 
 #include "sys/queue.h"
 
+#include "event2/buffer.h"
+#include "event2/buffer_compat.h"
 #include "event2/event.h"
 #include "event2/event_struct.h"
 #include "event2/thread.h"
@@ -61,6 +63,7 @@
 #include "evthread-internal.h"
 #include "event-internal.h"
 #include "defer-internal.h"
+#include "evbuffer-internal.h"
 #include "regress.h"
 #include "tinytest_macros.h"
 #include "time-internal.h"
@@ -564,6 +567,120 @@ end:
 	;
 }
 
+#define SPSC_RECORDS 5000
+
+struct spsc_test {
+	struct evbuffer_spsc *spsc;
+	struct event_base *base;
+	char *expect;
+	size_t len;
+	size_t got;
+	int n_cbs;
+	int bad;
+};
+
+static THREAD_FN
+spsc_writer(void *arg)
+{
+	struct spsc_test *t = arg;
+	size_t pos = 0, n;
+	int i;
+
+	/* Records of all sizes, some much bigger than a chain, sent
+	 * alternately as data and as printf output. */
+	for (i = 0; i < SPSC_RECORDS; ++i) {
+		n = (i * 37) % 3000 + (i % 500 == 0 ? 20000 : 0) + 1;
+		if (i & 1) {
+			if (evbuffer_spsc_add(t->spsc, t->expect + pos, n) < 0)
+				t->bad = 1;
+		} else {
+			if (evbuffer_spsc_add_printf(t->spsc, "%.*s", (int)n,
+				t->expect + pos) != (int)n)
+				t->bad = 1;
+		}
+		pos += n;
+		if (i % 1000 == 0)
+			SLEEP_MS(1);
+	}
+	THREAD_RETURN();
+}
+
+static void
+spsc_readcb(struct evbuffer_spsc *spsc, struct evbuffer *input, void *arg)
+{
+	struct spsc_test *t = arg;
+	size_t n = evbuffer_get_length(input);
+
+	++t->n_cbs;
+	if (t->got + n > t->len ||
+	    memcmp(evbuffer_pullup(input, n), t->expect + t->got, n))
+		t->bad = 1;
+	t->got += n;
+	evbuffer_drain(input, n);
+	if (t->got >= t->len || t->bad)
+		event_base_loopbreak(t->base);
+}
+
+static void
+thread_spsc(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct spsc_test t;
+	struct timeval tv = { 10, 0 };
+	THREAD_T thread;
+	size_t i;
+
+	memset(&t, 0, sizeof(t));
+	t.base = data->base;
+	for (i = 0; i < SPSC_RECORDS; ++i)
+		t.len += (i * 37) % 3000 + (i % 500 == 0 ? 20000 : 0) + 1;
+	t.expect = malloc(t.len);
+	tt_assert(t.expect);
+	for (i = 0; i < t.len; ++i)
+		t.expect[i] = 'a' + (i * 7) % 26;
+	t.spsc = evbuffer_spsc_new(data->base, spsc_readcb, &t);
+	tt_assert(t.spsc);
+
+	/* Nothing written yet, so nothing to read. */
+	tt_int_op(evbuffer_get_length(evbuffer_spsc_get_input(t.spsc)), ==, 0);
+
+	THREAD_START(thread, spsc_writer, &t);
+	event_base_loopexit(data->base, &tv);
+	event_base_loop(data->base, EVLOOP_NO_EXIT_ON_EMPTY);
+	THREAD_JOIN(thread);
+
+	tt_assert(!t.bad);
+	tt_int_op(t.got, ==, t.len);
+	/* The writer only wakes us when we've caught up. */
+	tt_int_op(t.n_cbs, >=, 1);
+	tt_int_op(t.n_cbs, <=, SPSC_RECORDS);
+	TT_BLATHER(("%d callbacks for %d records", t.n_cbs, SPSC_RECORDS));
+
+	/* Data that arrives after we stop looking is waiting for us. */
+	tt_int_op(evbuffer_spsc_add(t.spsc, "hello", 5), ==, 0);
+	tt_int_op(evbuffer_spsc_add_printf(t.spsc, " %d", 42), ==, 3);
+	tt_int_op(evbuffer_get_length(evbuffer_spsc_get_input(t.spsc)), ==, 8);
+	tt_assert(!memcmp(evbuffer_pullup(evbuffer_spsc_get_input(t.spsc), 8),
+		"hello 42", 8));
+	evbuffer_drain(evbuffer_spsc_get_input(t.spsc), 8);
+
+	/* printf output still gets through when the chain it would go in
+	 * is exactly full. */
+	i = t.spsc->tail->buffer_len - t.spsc->tail->off;
+	tt_int_op(evbuffer_spsc_add(t.spsc, t.expect, i), ==, 0);
+	tt_int_op(t.spsc->tail->off, ==, t.spsc->tail->buffer_len);
+	tt_int_op(evbuffer_spsc_add_printf(t.spsc, "%s", "hello"), ==, 5);
+	tt_int_op(evbuffer_get_length(evbuffer_spsc_get_input(t.spsc)), ==,
+	    i + 5);
+	tt_assert(!memcmp(evbuffer_pullup(evbuffer_spsc_get_input(t.spsc), -1)
+		+ i, "hello", 5));
+
+end:
+	if (t.spsc)
+		evbuffer_spsc_free(t.spsc);
+	free(t.expect);
+}
+
 #define TEST(name, f)							\
 	{ #name, thread_##name, TT_FORK|TT_NEED_THREADS|TT_NEED_BASE|(f),	\
 	  &basic_setup, NULL }
@@ -579,6 +696,8 @@ struct testcase_t thread_testcases[] = {
 	  &basic_setup, (char*)"priority_inheritance" },
 #endif
 	TEST(conditions_simple, TT_RETRIABLE),
+	{ "spsc", thread_spsc, TT_FORK|TT_NEED_THREADS|TT_NEED_BASE,
+	  &basic_setup, NULL },
 	{ "deferred_cb_skew", thread_deferred_cb_skew,
 	  TT_FORK|TT_NEED_THREADS|TT_OFF_BY_DEFAULT,
 	  &basic_setup, NULL },
@@ -376,3 +376,152 @@ end:
 	if (bev)
 		bufferevent_free(bev);
 }
+
+static struct evws_connection *keepalive_evws;
+static int keepalive_had_rtt;
+
+static void
+on_ws_keepalive_close_cb(struct evws_connection *evws, void *arg)
+{
+	struct timeval rtt;
+
+	if (!evws_connection_get_rtt(evws, &rtt))
+		keepalive_had_rtt = 1;
+	keepalive_evws = NULL;
+	test_ok++;
+}
+
+static void
+http_on_ws_keepalive_cb(struct evhttp_request *req, void *arg)
+{
+	struct timeval interval = {0, 50000};
+	struct timeval idle = {0, 300000};
+
+	keepalive_evws = evws_new_session(req, on_ws_msg_cb, (void *)0xDEADBEEF, 0);
+	if (!keepalive_evws)
+		return;
+	evws_connection_set_closecb(
+		keepalive_evws, on_ws_keepalive_close_cb, (void *)0xDEADBEEF);
+	if (evws_connection_set_keepalive(keepalive_evws, &interval, &idle) == 0)
+		test_ok++;
+}
+
+/* sends a masked control frame with a payload shorter than 126 bytes */
+static void
+send_ws_control(struct evbuffer *buf, int opcode, const void *payload,
+	size_t len)
+{
+	uint8_t hdr[2];
+	uint8_t mask_key[4] = {1, 2, 3, 4};
+	const uint8_t *p = payload;
+	uint8_t m;
+	size_t i;
+
+	hdr[0] = 0x80 | opcode;
+	hdr[1] = 0x80 | (uint8_t)len;
+	evbuffer_add(buf, hdr, 2);
+	evbuffer_add(buf, mask_key, 4);
+	for (i = 0; i < len; i++) {
+		m = p[i] ^ mask_key[i % 4];
+		evbuffer_add(buf, &m, 1);
+	}
+}
+
+static int keepalive_pongs_to_send;
+
+static void
+http_ws_keepalive_readcb_phase2(struct bufferevent *bev, void *arg)
+{
+	struct evbuffer *input = bufferevent_get_input(bev);
+	struct evbuffer *output = bufferevent_get_output(bev);
+
+	/* server frames are unmasked, and we expect only short ones */
+	while (evbuffer_get_length(input) >= 2) {
+		unsigned char *data = evbuffer_pullup(input, 2);
+		int opcode = data[0] & 0x0F;
+		size_t len = data[1] & 0x7F;
+
+		if (evbuffer_get_length(input) < 2 + len)
+			return;
+		data = evbuffer_pullup(input, 2 + len);
+
+		if (opcode == 0x9) {
+			/* PING from server: answer the first few, then go silent */
+			if (keepalive_pongs_to_send > 0) {
+				send_ws_control(output, 0xA, data + 2, len);
+				if (--keepalive_pongs_to_send == 0)
+					test_ok++;
+			}
+		} else if (opcode == 0xA) {
+			/* PONG to our own PING */
+			if (len == 4 && !memcmp(data + 2, "abcd", 4))
+				test_ok++;
+		}
+		evbuffer_drain(input, 2 + len);
+	}
+}
+
+static void
+http_ws_keepalive_readcb_hdr(struct bufferevent *bev, void *arg)
+{
+	struct evbuffer *input = bufferevent_get_input(bev);
+	struct evbuffer *output = bufferevent_get_output(bev);
+	size_t nread = 0;
+	char *line;
+
+	while ((line = evbuffer_readln(input, &nread, EVBUFFER_EOL_CRLF))) {
+		if (strlen(line) == 0) {
+			free(line);
+			bufferevent_setcb(bev, http_ws_keepalive_readcb_phase2, NULL,
+				http_ws_errorcb, arg);
+			send_ws_control(output, 0x9, "abcd", 4);
+			http_ws_keepalive_readcb_phase2(bev, arg);
+			return;
+		}
+		free(line);
+	}
+}
+
+void
+http_ws_keepalive_test(void *arg)
+{
+	struct basic_test_data *data = arg;
+	struct bufferevent *bev = NULL;
+	evutil_socket_t fd;
+	ev_uint16_t port = 0;
+	struct evhttp *http = http_setup(&port, data->base, 0);
+	struct evbuffer *out;
+
+	tt_assert(http);
+	evhttp_set_cb(http, "/ws_keepalive", http_on_ws_keepalive_cb, NULL);
+
+	fd = http_connect("127.0.0.1", port);
+	bev = create_bev(data->base, fd, 0, BEV_OPT_CLOSE_ON_FREE);
+	bufferevent_setcb(
+		bev, http_ws_keepalive_readcb_hdr, NULL, http_ws_errorcb, data->base);
+	bufferevent_enable(bev, EV_READ);
+	out = bufferevent_get_output(bev);
+
+	evbuffer_add_printf(out, "GET /ws_keepalive HTTP/1.1\r\n"
+							 "Host: somehost\r\n"
+							 "Connection: Upgrade\r\n"
+							 "Upgrade: websocket\r\n"
+							 "Sec-WebSocket-Key: x3JJHMbDL1EzLkh9GBhXDw==\r\n"
+							 "\r\n");
+
+	/* keepalive set (1), pongs answered (1), our ping answered (1),
+	 * idle connection reaped (1), EOF seen by the client (1) */
+	test_ok = 0;
+	keepalive_had_rtt = 0;
+	keepalive_pongs_to_send = 3;
+	event_base_dispatch(data->base);
+	tt_int_op(test_ok, ==, 5);
+	tt_int_op(keepalive_had_rtt, ==, 1);
+	tt_ptr_op(keepalive_evws, ==, NULL);
+
+end:
+	if (bev)
+		bufferevent_free(bev);
+	if (http)
+		evhttp_free(http);
+}
@@ -3,5 +3,6 @@
 
 void http_on_ws_cb(struct evhttp_request *req, void *arg);
 void http_ws_test(void *arg);
+void http_ws_keepalive_test(void *arg);
 
 #endif /* REGRESS_WS_H */
@@ -361,6 +361,18 @@ ev_int32_t evutil_weakrand_range_(struct evutil_weakrand_state *seed, ev_int32_t
 #define EVUTIL_FALLTHROUGH /* fallthrough */
 #endif
 
+/* Loads that acquire, stores that release, and exchanges, on an int or a
+ * pointer that another thread uses without a lock.  Code that uses these
+ * needs a locked fallback for when EVUTIL_HAVE_ATOMICS isn't defined. */
+#if defined(__clang__) || \
+    (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 7)))
+#define EVUTIL_HAVE_ATOMICS
+#define EVUTIL_ATOMIC_LOAD(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define EVUTIL_ATOMIC_STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define EVUTIL_ATOMIC_EXCHANGE(p, v) \
+	__atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+#endif
+
 /* Replacement for assert() that calls event_errx on failure. */
 #ifdef NDEBUG
 #define EVUTIL_ASSERT(cond) EVUTIL_NIL_CONDITION_(cond)
@@ -461,6 +473,7 @@ int evutil_hex_char_to_int_(char c);
 
 void evutil_free_secure_rng_globals_(void);
 void evutil_free_globals_(void);
+void bufferevent_socket_free_globals_(void);
 
 #ifdef _WIN32
 EVENT2_EXPORT_SYMBOL
@@ -54,6 +54,19 @@ struct evws_connection {
 
 	struct evbuffer *incomplete_frames;
 	bool closed;
+
+	/* keepalive: a persistent timer on a common timeout queue shared by
+	 * all connections with the same ping interval */
+	struct event *keepalive_ev;
+	struct timeval idle_timeout;
+	/* time when we last received any frame from the peer */
+	struct timeval last_activity;
+	/* time when the outstanding ping was sent */
+	struct timeval ping_sent;
+	struct timeval rtt;
+	ev_uint32_t ping_seq;
+	bool ping_outstanding;
+	bool has_rtt;
 };
 
 enum WebSocketFrameType {
@@ -88,6 +101,9 @@ evws_connection_free(struct evws_connection *evws)
 		http->connection_cnt--;
 	}
 
+	if (evws->keepalive_ev != NULL) {
+		event_free(evws->keepalive_ev);
+	}
 	if (evws->bufev != NULL) {
 		bufferevent_free(evws->bufev);
 	}
@@ -170,6 +186,8 @@ evws_close(struct evws_connection *evws, uint16_t reason)
 	if (evws->closed)
 		return;
 	evws->closed = true;
+	if (evws->keepalive_ev != NULL)
+		event_del(evws->keepalive_ev);
 
 	u16 = (uint16_t *)&fr[2];
 	*u16 = htons((int16_t)reason);
@@ -187,6 +205,9 @@ evws_force_disconnect_(struct evws_connection *evws)
 	evws_close(evws, WS_CR_NONE);
 }
 
+static void make_ws_frame(struct evbuffer *output,
+	enum WebSocketFrameType frame_type, unsigned char *msg, int len);
+
 /* parse base frame according to
  * https://www.rfc-editor.org/rfc/rfc6455#section-5.2
  */
@@ -272,6 +293,9 @@ ws_evhttp_read_cb(struct bufferevent *bufev, void *arg)
 	struct evbuffer *input = bufferevent_get_input(evws->bufev);
 
 	bufferevent_incref_and_lock_(evws->bufev);
+	if (evws->keepalive_ev != NULL)
+		event_base_gettimeofday_cached(
+			bufferevent_get_base(evws->bufev), &evws->last_activity);
 	while ((in_len = evbuffer_get_length(input))) {
 		unsigned char *data = evbuffer_pullup(input, in_len);
 		if (data == NULL) {
@@ -318,8 +342,20 @@ ws_evhttp_read_cb(struct bufferevent *bufev, void *arg)
 			evws_force_disconnect_(evws);
 			break;
 		case PING_FRAME:
+			/* reply with the same application data, see RFC 6455 5.5.3 */
+			if (!evws->closed)
+				make_ws_frame(bufferevent_get_output(evws->bufev), PONG_FRAME,
+					data, msg_len);
+			break;
 		case PONG_FRAME:
-			/* ping or pong frame */
+			/* unsolicited pongs are allowed and serve as heartbeats only */
+			if (evws->ping_outstanding && msg_len == 4 &&
+				ntohl(*(ev_uint32_t *)data) == evws->ping_seq) {
+				evutil_timersub(&evws->last_activity, &evws->ping_sent,
+					&evws->rtt);
+				evws->has_rtt = true;
+				evws->ping_outstanding = false;
+			}
 			break;
 		default:
 			event_warn("%s: unexpected frame type %d\n", __func__, type);
@@ -451,6 +487,98 @@ evws_connection_set_closecb(
 	evws->cbclose_arg = cbarg;
 }
 
+static void
+ws_keepalive_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct evws_connection *evws = arg;
+	struct bufferevent *bev = evws->bufev;
+	struct timeval now, idle;
+	ev_uint32_t seq;
+
+	bufferevent_incref_and_lock_(bev);
+	event_base_gettimeofday_cached(bufferevent_get_base(bev), &now);
+	evutil_timersub(&now, &evws->last_activity, &idle);
+
+	if (evutil_timerisset(&evws->idle_timeout) &&
+		evutil_timercmp(&idle, &evws->idle_timeout, >=)) {
+		/* the peer is gone or stuck, there is no point in waiting for
+		 * a close frame to be written */
+		evws_connection_free(evws);
+		goto done;
+	}
+
+	seq = htonl(++evws->ping_seq);
+	make_ws_frame(bufferevent_get_output(bev), PING_FRAME,
+		(unsigned char *)&seq, sizeof(seq));
+	evws->ping_sent = now;
+	evws->ping_outstanding = true;
+
+done:
+	bufferevent_decref_and_unlock_(bev);
+}
+
+int
+evws_connection_set_keepalive(struct evws_connection *evws,
+	const struct timeval *ping_interval, const struct timeval *idle_timeout)
+{
+	struct event_base *base;
+	const struct timeval *tv;
+	int res = -1;
+
+	bufferevent_lock(evws->bufev);
+	base = bufferevent_get_base(evws->bufev);
+
+	if (ping_interval == NULL || !evutil_timerisset(ping_interval)) {
+		if (evws->keepalive_ev != NULL) {
+			event_free(evws->keepalive_ev);
+			evws->keepalive_ev = NULL;
+		}
+		evws->ping_outstanding = false;
+		res = 0;
+		goto done;
+	}
+	if (evws->closed)
+		goto done;
+
+	/* all connections with the same interval share one common timeout
+	 * queue, so arming 100k of them stays O(1) each */
+	if ((tv = event_base_init_common_timeout(base, ping_interval)) == NULL)
+		goto done;
+
+	if (evws->keepalive_ev == NULL) {
+		evws->keepalive_ev =
+			event_new(base, -1, EV_PERSIST, ws_keepalive_cb, evws);
+		if (evws->keepalive_ev == NULL)
+			goto done;
+	}
+
+	if (idle_timeout != NULL)
+		evws->idle_timeout = *idle_timeout;
+	else
+		evutil_timerclear(&evws->idle_timeout);
+	event_base_gettimeofday_cached(base, &evws->last_activity);
+
+	res = event_add(evws->keepalive_ev, tv);
+
+done:
+	bufferevent_unlock(evws->bufev);
+	return res;
+}
+
+int
+evws_connection_get_rtt(struct evws_connection *evws, struct timeval *rtt)
+{
+	int res = -1;
+
+	bufferevent_lock(evws->bufev);
+	if (evws->has_rtt) {
+		*rtt = evws->rtt;
+		res = 0;
+	}
+	bufferevent_unlock(evws->bufev);
+	return res;
+}
+
 struct bufferevent *
 evws_connection_get_bufferevent(struct evws_connection *evws)
 {